@@ -28,7 +28,8 @@ int mem_image_open(void *store, const char *path, const void **image_data)
 	int fd = -1;
 	struct stat file_stat;
 	char *buf = NULL;
-	int ret = -1;
+	size_t size = 0;
+	ssize_t ret;
 
 	fd = open(path, O_RDONLY);
 	if (fd < 0)
@@ -36,30 +37,42 @@ int mem_image_open(void *store, const char *path, const void **image_data)
 
 	memset(&file_stat, 0, sizeof(file_stat));
 	if (fstat(fd, &file_stat))
-		return -1;
+		goto err;
 
-	LPRINTF("file size %d\n", file_stat.st_size);
+	LPRINTF("file size %ld\n", (long)file_stat.st_size);
 	buf = malloc(file_stat.st_size);
 	if (!buf)
-		return -1;
-
-	ret = read(fd, buf, file_stat.st_size);
-	if (ret > 0) {
-		LPRINTF("%d read\n", ret);
-	} else if (ret < 0) {
-		LPRINTF("%s\n", strerror(errno));
-		return ret;
+		goto err;
+
+	/* read() may return less than asked */
+	while (size < (size_t)file_stat.st_size) {
+		ret = read(fd, buf + size, file_stat.st_size - size);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			LPRINTF("%s\n", ret ? strerror(errno) : "short read");
+			goto err;
+		}
+		size += ret;
 	}
+	LPRINTF("%lu read\n", (unsigned long)size);
+	close(fd);
 	*image_data = buf;
 	image->base = buf;
-	return file_stat.st_size;
+	return (int)size;
+
+err:
+	free(buf);
+	close(fd);
+	return -1;
 }
 
 void mem_image_close(void *store)
 {
-	//TODO
-	/* The image is in memory, does nothing */
-	(void)store;
+	struct mem_file *image = store;
+
+	free((void *)image->base);
+	image->base = NULL;
 }
 
 int mem_image_load(void *store, size_t offset, size_t size,
@@ -105,6 +118,6 @@ struct image_store_ops mem_image_store_ops = {
 	.open = mem_image_open,
 	.close = mem_image_close,
 	.load = mem_image_load,
-	.features = SUPPORT_SEEK,
+	.features = SUPPORT_SEEK | SUPPORT_CONCURRENT_LOAD,
 };
 
@@ -18,7 +18,8 @@
 #define __section_t(S)          __attribute__((__section__(#S)))
 #define __resource              __section_t(.resource_table)
 
-#define RPMSG_IPU_C0_FEATURES        1
+#define RPMSG_IPU_C0_FEATURES        ((1 << VIRTIO_RPMSG_F_NS) | \
+				      VIRTIO_RING_F_EVENT_IDX)
 
 /* VirtIO rpmsg device id */
 #define VIRTIO_ID_RPMSG_             7
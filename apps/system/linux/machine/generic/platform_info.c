@@ -57,6 +57,9 @@ struct remoteproc_priv rproc_priv = {
 
 static struct remoteproc rproc_inst;
 
+/* Empty polls before going back to IPI mode, 0 to disable the hybrid mode */
+static unsigned int rx_poll_budget;
+
 /* External functions */
 extern int init_system(void);
 extern void cleanup_system(void);
@@ -307,6 +310,10 @@ int platform_init(int argc, char *argv[], void **platform)
 		rsc_id = strtoul(argv[2], NULL, 0);
 	}
 
+	if (argc >= 4) {
+		rx_poll_budget = strtoul(argv[3], NULL, 0);
+	}
+
 	rproc = platform_create_proc(proc_id, rsc_id);
 	if (!rproc) {
 		fprintf(stderr, "Failed to create remoteproc device.\r\n");
@@ -323,6 +330,7 @@ platform_create_rpmsg_vdev(void *platform, unsigned int vdev_index,
 			   rpmsg_ns_bind_cb ns_bind_cb)
 {
 	struct remoteproc *rproc = platform;
+	struct remoteproc_priv *prproc = rproc->priv;
 	struct rpmsg_virtio_device *rpmsg_vdev;
 	struct virtio_device *vdev;
 	void *shbuf;
@@ -359,6 +367,8 @@ platform_create_rpmsg_vdev(void *platform, unsigned int vdev_index,
 		printf("failed rpmsg_init_vdev\r\n");
 		goto err2;
 	}
+	rpmsg_virtio_set_rx_poll_budget(rpmsg_vdev, rx_poll_budget);
+	prproc->rpmsg_vdev = rpmsg_vdev;
 	return rpmsg_virtio_get_rpmsg_device(rpmsg_vdev);
 err2:
 	remoteproc_remove_virtio(rproc, vdev);
@@ -385,6 +395,18 @@ int platform_poll(void *priv)
 			break;
 		}
 #else
+		if (prproc->rpmsg_vdev &&
+		    rpmsg_virtio_rx_polling(prproc->rpmsg_vdev)) {
+			/* Hybrid mode: no RX IPI until the RX vring is idle */
+			if (!(atomic_flag_test_and_set(&prproc->ipi_nokick))) {
+				ret = remoteproc_get_notification(rproc,
+							RSC_NOTIFY_ID_ANY);
+				if (ret)
+					return ret;
+			}
+			rpmsg_virtio_rx_poll(prproc->rpmsg_vdev);
+			break;
+		}
 		flags = metal_irq_save_disable();
 		if (!(atomic_flag_test_and_set(&prproc->ipi_nokick))) {
 			metal_irq_restore_enable(flags);
@@ -403,7 +425,33 @@ int platform_poll(void *priv)
 
 void platform_release_rpmsg_vdev(struct rpmsg_device *rpdev)
 {
-	(void)rpdev;
+	struct rpmsg_virtio_device *rpmsg_vdev;
+	struct rpmsg_virtio_rx_poll_stats stats;
+#ifdef RPMSG_STATS
+	struct rpmsg_stats rpmsg_stats;
+
+	if (!rpmsg_get_stats(rpdev, &rpmsg_stats))
+		printf("rpmsg: %lu messages (%llu bytes) sent, %lu (%llu bytes) "
+		       "received, %lu kicks, %lu notifications, %lu TX buffer "
+		       "waits (%llu ns), %lu without buffer, rings high-water "
+		       "TX %u RX %u\r\n",
+		       rpmsg_stats.tx_msgs, rpmsg_stats.tx_bytes,
+		       rpmsg_stats.rx_msgs, rpmsg_stats.rx_bytes,
+		       rpmsg_stats.kicks, rpmsg_stats.notifications,
+		       rpmsg_stats.tx_waits, rpmsg_stats.tx_wait_time,
+		       rpmsg_stats.tx_no_buff, rpmsg_stats.tx_ring_max,
+		       rpmsg_stats.rx_ring_max);
+#endif
+
+	if (!rx_poll_budget)
+		return;
+	rpmsg_vdev = metal_container_of(rpdev, struct rpmsg_virtio_device,
+					rdev);
+	rpmsg_virtio_get_rx_poll_stats(rpmsg_vdev, &stats);
+	printf("hybrid RX: %lu switches to poll mode, %lu to IPI mode, "
+	       "%lu polls (%lu empty), %lu messages polled\r\n",
+	       stats.to_poll, stats.to_irq, stats.polls, stats.empty_polls,
+	       stats.msgs);
 }
 
 void platform_cleanup(void *platform)
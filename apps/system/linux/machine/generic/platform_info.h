@@ -33,6 +33,7 @@ struct remoteproc_priv {
 	struct remoteproc_mem shm_mem; /**< shared memory */
 	unsigned int ipi_chn_mask; /**< IPI channel mask */
 	atomic_int ipi_nokick;
+	struct rpmsg_virtio_device *rpmsg_vdev; /**< rpmsg virtio device */
 #ifdef RPMSG_NO_IPI
 	const char *shm_poll_name; /**< shared memory device name */
 	const char *shm_poll_bus_name; /**< shared memory bus name */
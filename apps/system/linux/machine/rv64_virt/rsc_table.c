@@ -11,7 +11,8 @@
 #include "platform_info.h"
 #include "rsc_table.h"
 
-#define RPMSG_IPU_C0_FEATURES        1
+#define RPMSG_IPU_C0_FEATURES        ((1 << VIRTIO_RPMSG_F_NS) | \
+				      VIRTIO_RING_F_EVENT_IDX)
 
 /* VirtIO rpmsg device id */
 #define VIRTIO_ID_RPMSG_             7
@@ -0,0 +1,922 @@
+/*
+ * This is a benchmark of the RPMsg virtio transport. It runs the master and
+ * the remote sides as threads of the same process, sharing a memfd region
+ * and notifying each other through eventfds, so that the rpmsg and virtqueue
+ * code can be measured without a board.
+ *
+ * For each combination of payload size, buffer count, thread count and
+ * virtqueue layout (split or packed ring, split ring with event index or
+ * with cache aligned payloads), it reports:
+ *  - the one-way throughput, each sender thread flooding the remote, and the
+ *    number of notifications per message,
+ *  - the round-trip latency percentiles, each sender thread pinging the
+ *    remote which echoes the message back.
+ * With -f, the endpoints fragment their messages, so that payloads larger
+ * than the buffers can be measured.
+ * With -w, the endpoints have credit based flow control, with the given
+ * window. The payload sizes are then clamped to the room left by the
+ * credit header in the buffers.
+ * With -T, the transport events of both sides are recorded in a trace ring
+ * of the given number of entries, and counted per event type.
+ * With -c, each side works on a private copy of the shared memory, written
+ * back and refreshed only by the virtio cache operations, as with non
+ * coherent caches. The messages are checked, and the cache operations are
+ * counted per message. The packed ring cannot be cache maintained, the
+ * split ring is then measured instead.
+ */
+
+/* For memfd_create() */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <metal/atomic.h>
+#include <metal/io.h>
+#include <metal/sys.h>
+#include <openamp/remoteproc.h>
+#include <openamp/remoteproc_virtio.h>
+#include <openamp/rpmsg_credit.h>
+#include <openamp/rpmsg_frag.h>
+#include <openamp/rpmsg_trace.h>
+#include <openamp/rpmsg_virtio.h>
+
+#define LPRINTF(format, ...) printf(format, ##__VA_ARGS__)
+#define LPERROR(format, ...) LPRINTF("ERROR: " format, ##__VA_ARGS__)
+
+#define BENCH_MAX_LIST		16
+#define BENCH_MAX_THREADS	64
+#define BENCH_VRING_ALIGN	4096
+#define BENCH_MASTER_EPT_ADDR	0x100
+#define BENCH_REMOTE_EPT_ADDR	0x200
+
+/* Notify IDs of the vrings */
+#define BENCH_VRING0_ID		1
+#define BENCH_VRING1_ID		2
+
+enum bench_mode {
+	BENCH_THROUGHPUT,
+	BENCH_LATENCY,
+};
+
+/* Resource table of the loopback vdev, at the start of the shared memory */
+METAL_PACKED_BEGIN
+struct bench_rsc {
+	struct fw_rsc_vdev vdev;
+	struct fw_rsc_vdev_vring vring[2];
+} METAL_PACKED_END;
+
+/*
+ * One side of the loopback. Its view of the shared memory is the shared
+ * memory itself, or its private copy with -c.
+ */
+struct bench_side {
+	struct virtio_device *vdev;
+	struct rpmsg_virtio_device rvdev;
+	int efd;
+	pthread_t thread;
+	char *mem;
+	struct metal_io_region *io;
+	struct metal_io_region cache_io;
+	struct virtio_cache_ops cache_ops;
+	atomic_ulong flushes;
+	atomic_ulong invalidates;
+};
+
+/* One sender thread, with its endpoints on both sides */
+struct bench_sender {
+	struct rpmsg_endpoint mept;
+	struct rpmsg_endpoint rept;
+	struct rpmsg_frag mfrag;
+	struct rpmsg_frag rfrag;
+	struct rpmsg_credit mcredit;
+	struct rpmsg_credit rcredit;
+	pthread_t thread;
+	atomic_int replies;
+	uint32_t rx_seq;
+	uint64_t *samples;
+};
+
+struct bench_list {
+	unsigned int values[BENCH_MAX_LIST];
+	unsigned int num;
+};
+
+/* Virtqueue layouts and notification modes, selected through the features */
+struct bench_ring {
+	const char *name;
+	uint32_t features;
+};
+
+static const struct bench_ring bench_rings[] = {
+	{ "split", 0 },
+	{ "packed", VIRTIO_F_RING_PACKED },
+	{ "event", VIRTIO_RING_F_EVENT_IDX },
+	{ "cache", 1 << VIRTIO_RPMSG_F_CACHE_ALIGNED },
+};
+
+#define BENCH_NUM_RINGS (sizeof(bench_rings) / sizeof(bench_rings[0]))
+
+/* Globals */
+static struct bench_list sizes = { { 16, 64, 256, 496 }, 4 };
+static struct bench_list buf_nums = { { 16, 64, 256 }, 3 };
+static struct bench_list thread_nums = { { 1, 2, 4 }, 3 };
+static struct bench_list rings = { { 0, 1, 2 }, 3 };
+static unsigned int num_msgs = 100000;
+static unsigned int num_pings = 10000;
+static int fragment;
+static unsigned int credit_window;
+static unsigned int trace_entries;
+static int cache_sim;
+
+static void *shm;
+static int shm_fd;
+static size_t shm_size;
+static metal_phys_addr_t shm_phys;
+static struct metal_io_region shm_io;
+static struct rpmsg_virtio_shm_pool shpool;
+static struct bench_side master, remote;
+static struct bench_sender senders[BENCH_MAX_THREADS];
+static enum bench_mode mode;
+static unsigned int payload_size;
+static atomic_ulong received;
+static atomic_ulong notifications;
+static atomic_ulong corrupted;
+static atomic_int stop;
+/* First send error of the run, which stops the senders */
+static atomic_int send_error;
+
+/*-----------------------------------------------------------------------------*
+ *  Helpers
+ *-----------------------------------------------------------------------------*/
+static uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double bench_percentile(uint64_t *samples, size_t num, double pct)
+{
+	size_t i = (size_t)(pct / 100.0 * (num - 1) + 0.5);
+
+	return samples[i] / 1000.0;
+}
+
+static int bench_parse_rings(const char *arg, struct bench_list *list)
+{
+	unsigned int i;
+	size_t len;
+
+	list->num = 0;
+	while (*arg && list->num < BENCH_MAX_LIST) {
+		len = strcspn(arg, ",");
+		for (i = 0; i < BENCH_NUM_RINGS; i++) {
+			if (strlen(bench_rings[i].name) == len &&
+			    !strncmp(arg, bench_rings[i].name, len))
+				break;
+		}
+		if (i == BENCH_NUM_RINGS)
+			return -EINVAL;
+		list->values[list->num++] = i;
+		arg += arg[len] ? len + 1 : len;
+	}
+	return list->num ? 0 : -EINVAL;
+}
+
+static int bench_parse_list(const char *arg, struct bench_list *list)
+{
+	char *end;
+
+	list->num = 0;
+	while (*arg && list->num < BENCH_MAX_LIST) {
+		list->values[list->num] = strtoul(arg, &end, 0);
+		if (end == arg || !list->values[list->num])
+			return -EINVAL;
+		list->num++;
+		arg = *end == ',' ? end + 1 : end;
+	}
+	return list->num ? 0 : -EINVAL;
+}
+
+/*
+ * Fills a payload for the message seq of a sender: the sequence number,
+ * then bytes depending on it. Only done with -c, to check the messages.
+ */
+static void bench_fill(unsigned char *data, size_t len, uint32_t seq)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		data[i] = (unsigned char)(seq + i);
+	if (len >= sizeof(seq))
+		memcpy(data, &seq, sizeof(seq));
+}
+
+/* Checks a payload filled by bench_fill() */
+static void bench_check(const unsigned char *data, size_t len, uint32_t seq)
+{
+	size_t i = 0;
+
+	if (!cache_sim)
+		return;
+	if (len != payload_size)
+		goto out;
+	if (len >= sizeof(seq)) {
+		if (memcmp(data, &seq, sizeof(seq)))
+			goto out;
+		i = sizeof(seq);
+	}
+	for (; i < len; i++) {
+		if (data[i] != (unsigned char)(seq + i))
+			goto out;
+	}
+	return;
+out:
+	atomic_fetch_add(&corrupted, 1);
+}
+
+/* Records a send error, the first one being reported for the run */
+static void bench_fail(int err)
+{
+	int none = 0;
+
+	atomic_compare_exchange_strong(&send_error, &none, err);
+}
+
+/*
+ * Sends a message, yielding to the other threads while no buffer is free,
+ * the errors being recorded
+ */
+static int bench_send(struct rpmsg_endpoint *ept, const void *data, int len)
+{
+	int ret;
+
+	while ((ret = rpmsg_trysend(ept, data, len)) == RPMSG_ERR_NO_BUFF &&
+	       !atomic_load(&stop) && !atomic_load(&send_error))
+		sched_yield();
+	if (ret < 0)
+		bench_fail(ret);
+	return ret;
+}
+
+/*-----------------------------------------------------------------------------*
+ *  Simulated non coherent caches
+ *-----------------------------------------------------------------------------*/
+/* Copies cache lines, a word at a time as a cache would not tear them */
+static void bench_cache_copy(void *dst, const void *src, size_t len)
+{
+	volatile uint64_t *d = dst;
+	const volatile uint64_t *s = src;
+	size_t i;
+
+	for (i = 0; i < len / sizeof(*d); i++)
+		d[i] = s[i];
+}
+
+/* Writes back the private copy of a side to the shared memory */
+static void bench_cache_flush(void *priv, void *addr, size_t len)
+{
+	struct bench_side *side = priv;
+
+	bench_cache_copy((char *)shm + ((char *)addr - side->mem), addr, len);
+	atomic_fetch_add(&side->flushes, 1);
+}
+
+/* Reloads the private copy of a side from the shared memory */
+static void bench_cache_invalidate(void *priv, void *addr, size_t len)
+{
+	struct bench_side *side = priv;
+
+	bench_cache_copy(addr, (char *)shm + ((char *)addr - side->mem), len);
+	atomic_fetch_add(&side->invalidates, 1);
+}
+
+/*
+ * Maps the private copy of the shared memory of a side. The resource
+ * table is mapped from the shared memory as it would be uncached.
+ */
+static int bench_cache_map(struct bench_side *side)
+{
+	int prot = PROT_READ | PROT_WRITE;
+	char *mem;
+
+	if (side->mem && side->mem != shm)
+		munmap(side->mem, shm_size);
+	side->mem = NULL;
+	mem = mmap(NULL, shm_size, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return -ENOMEM;
+	side->mem = mem;
+	if (mmap(mem, BENCH_VRING_ALIGN, prot, MAP_SHARED | MAP_FIXED, shm_fd,
+		 0) == MAP_FAILED)
+		return -ENOMEM;
+
+	metal_io_init(&side->cache_io, mem, &shm_phys, shm_size, -1, 0, NULL);
+	side->io = &side->cache_io;
+	side->cache_ops.flush = bench_cache_flush;
+	side->cache_ops.invalidate = bench_cache_invalidate;
+	side->cache_ops.priv = side;
+	atomic_store(&side->flushes, 0);
+	atomic_store(&side->invalidates, 0);
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------*
+ *  Loopback transport
+ *-----------------------------------------------------------------------------*/
+static int bench_notify(void *priv, uint32_t id)
+{
+	struct bench_side *peer = priv;
+	uint64_t val = 1;
+
+	(void)id;
+	atomic_fetch_add(&notifications, 1);
+	if (write(peer->efd, &val, sizeof(val)) != sizeof(val))
+		return -errno;
+	return 0;
+}
+
+/* Processes the notifications of one side, as an interrupt handler would */
+static void *bench_notify_thread(void *arg)
+{
+	struct bench_side *side = arg;
+	uint64_t val;
+
+	while (!atomic_load(&stop)) {
+		if (read(side->efd, &val, sizeof(val)) != sizeof(val))
+			continue;
+		rproc_virtio_notified(side->vdev, RSC_NOTIFY_ID_ANY);
+	}
+	return NULL;
+}
+
+static int bench_setup(unsigned int buf_num, uint32_t features)
+{
+	struct rpmsg_virtio_config config;
+	struct bench_rsc *rsc;
+	size_t vring_bytes, vring0, vring1, bufs;
+	unsigned int i;
+	int ret;
+
+	vring_bytes = vring_size(buf_num, BENCH_VRING_ALIGN);
+	vring_bytes = (vring_bytes + BENCH_VRING_ALIGN - 1) &
+		      ~(size_t)(BENCH_VRING_ALIGN - 1);
+	/* Offsets in the shared memory */
+	vring0 = BENCH_VRING_ALIGN;
+	vring1 = vring0 + vring_bytes;
+	bufs = vring1 + vring_bytes;
+	if (bufs + 2 * buf_num * RPMSG_BUFFER_SIZE > shm_size) {
+		LPERROR("shared memory too small for %u buffers\r\n", buf_num);
+		return -ENOMEM;
+	}
+
+	memset(shm, 0, shm_size);
+	if (cache_sim) {
+		ret = bench_cache_map(&master);
+		if (!ret)
+			ret = bench_cache_map(&remote);
+		if (ret) {
+			LPERROR("failed to map the private copies\r\n");
+			return ret;
+		}
+	}
+	rsc = shm;
+	rsc->vdev.type = RSC_VDEV;
+	rsc->vdev.id = VIRTIO_ID_RPMSG;
+	rsc->vdev.dfeatures = features;
+	rsc->vdev.num_of_vrings = 2;
+	for (i = 0; i < 2; i++) {
+		rsc->vring[i].align = BENCH_VRING_ALIGN;
+		rsc->vring[i].num = buf_num;
+		rsc->vring[i].notifyid = i ? BENCH_VRING1_ID : BENCH_VRING0_ID;
+	}
+
+	/* Each side accesses the shared memory through its view */
+	master.vdev = rproc_virtio_create_vdev(VIRTIO_DEV_MASTER, 0,
+					       master.mem, master.io, &remote,
+					       bench_notify, NULL);
+	remote.vdev = rproc_virtio_create_vdev(VIRTIO_DEV_SLAVE, 0,
+					       remote.mem, remote.io, &master,
+					       bench_notify, NULL);
+	if (!master.vdev || !remote.vdev) {
+		LPERROR("failed to create the virtio devices\r\n");
+		return -ENOMEM;
+	}
+	if (cache_sim) {
+		virtio_set_cache_ops(master.vdev, &master.cache_ops);
+		virtio_set_cache_ops(remote.vdev, &remote.cache_ops);
+	}
+	rproc_virtio_init_vring(master.vdev, 0, BENCH_VRING0_ID,
+				master.mem + vring0, master.io, buf_num,
+				BENCH_VRING_ALIGN);
+	rproc_virtio_init_vring(master.vdev, 1, BENCH_VRING1_ID,
+				master.mem + vring1, master.io, buf_num,
+				BENCH_VRING_ALIGN);
+	rproc_virtio_init_vring(remote.vdev, 0, BENCH_VRING0_ID,
+				remote.mem + vring0, remote.io, buf_num,
+				BENCH_VRING_ALIGN);
+	rproc_virtio_init_vring(remote.vdev, 1, BENCH_VRING1_ID,
+				remote.mem + vring1, remote.io, buf_num,
+				BENCH_VRING_ALIGN);
+
+	config.h2r_buf_size = RPMSG_BUFFER_SIZE;
+	config.r2h_buf_size = RPMSG_BUFFER_SIZE;
+	config.h2r_buf_num = buf_num;
+	config.r2h_buf_num = buf_num;
+	rpmsg_virtio_init_shm_pool(&shpool, master.mem + bufs,
+				   shm_size - bufs);
+	ret = rpmsg_init_vdev_with_config(&master.rvdev, master.vdev, NULL,
+					  master.io, &shpool, &config);
+	if (ret) {
+		LPERROR("failed to init master rpmsg device: %d\r\n", ret);
+		return ret;
+	}
+	/* The master has set the device status, the remote can start */
+	ret = rpmsg_init_vdev_with_config(&remote.rvdev, remote.vdev, NULL,
+					  remote.io, NULL, &config);
+	if (ret) {
+		LPERROR("failed to init remote rpmsg device: %d\r\n", ret);
+		return ret;
+	}
+	return 0;
+}
+
+static void bench_cleanup(void)
+{
+	rpmsg_deinit_vdev(&remote.rvdev);
+	rpmsg_deinit_vdev(&master.rvdev);
+	rproc_virtio_remove_vdev(remote.vdev);
+	rproc_virtio_remove_vdev(master.vdev);
+}
+
+/*-----------------------------------------------------------------------------*
+ *  RPMSG endpoint callbacks
+ *-----------------------------------------------------------------------------*/
+static int bench_remote_cb(struct rpmsg_endpoint *ept, void *data, size_t len,
+			   uint32_t src, void *priv)
+{
+	struct bench_sender *sender = priv;
+
+	(void)src;
+
+	bench_check(data, len, sender->rx_seq++);
+	if (mode == BENCH_LATENCY)
+		(void)bench_send(ept, data, len);
+	else
+		atomic_fetch_add(&received, 1);
+	return RPMSG_SUCCESS;
+}
+
+static int bench_master_cb(struct rpmsg_endpoint *ept, void *data, size_t len,
+			   uint32_t src, void *priv)
+{
+	struct bench_sender *sender = priv;
+
+	(void)ept;
+	(void)src;
+
+	/* The pings follow the messages of the throughput */
+	bench_check(data, len, num_msgs + atomic_load(&sender->replies));
+	atomic_fetch_add(&sender->replies, 1);
+	return RPMSG_SUCCESS;
+}
+
+/*-----------------------------------------------------------------------------*
+ *  Sender threads
+ *-----------------------------------------------------------------------------*/
+static void *bench_sender_thread(void *arg)
+{
+	struct bench_sender *sender = arg;
+	unsigned char *payload;
+	uint64_t start;
+	unsigned int i;
+
+	payload = malloc(payload_size ? payload_size : 1);
+	if (!payload) {
+		LPERROR("failed to allocate the payload\r\n");
+		bench_fail(-ENOMEM);
+		return NULL;
+	}
+	memset(payload, 0xA5, payload_size);
+	if (mode == BENCH_THROUGHPUT) {
+		for (i = 0; i < num_msgs; i++) {
+			if (cache_sim)
+				bench_fill(payload, payload_size, i);
+			if (bench_send(&sender->mept, payload,
+				       payload_size) < 0)
+				break;
+		}
+		free(payload);
+		return NULL;
+	}
+
+	for (i = 0; i < num_pings; i++) {
+		if (cache_sim)
+			bench_fill(payload, payload_size, num_msgs + i);
+		start = bench_now_ns();
+		if (bench_send(&sender->mept, payload, payload_size) < 0)
+			break;
+		while (atomic_load(&sender->replies) <= (int)i &&
+		       !atomic_load(&stop) && !atomic_load(&send_error))
+			sched_yield();
+		if (atomic_load(&send_error))
+			break;
+		sender->samples[i] = bench_now_ns() - start;
+	}
+	free(payload);
+	return NULL;
+}
+
+static int bench_start_threads(struct bench_side *side)
+{
+	return pthread_create(&side->thread, NULL, bench_notify_thread, side);
+}
+
+static void bench_stop_threads(void)
+{
+	uint64_t val = 1;
+
+	atomic_store(&stop, 1);
+	if (write(master.efd, &val, sizeof(val)) < 0 ||
+	    write(remote.efd, &val, sizeof(val)) < 0)
+		LPERROR("failed to wake up the notification threads\r\n");
+	pthread_join(master.thread, NULL);
+	pthread_join(remote.thread, NULL);
+}
+
+/*
+ * Runs the senders in the current mode, and sets elapsed to the elapsed
+ * time in ns. Returns the first send error, the run being aborted by it.
+ */
+static int bench_run_senders(unsigned int nthreads, uint64_t *elapsed)
+{
+	uint64_t start;
+	unsigned int i, started;
+	int ret;
+
+	start = bench_now_ns();
+	for (started = 0; started < nthreads; started++) {
+		ret = pthread_create(&senders[started].thread, NULL,
+				     bench_sender_thread, &senders[started]);
+		if (ret) {
+			LPERROR("failed to create the sender threads\r\n");
+			bench_fail(-ret);
+			break;
+		}
+	}
+	for (i = 0; i < started; i++)
+		pthread_join(senders[i].thread, NULL);
+	if (mode == BENCH_THROUGHPUT) {
+		while (atomic_load(&received) <
+		       (unsigned long)nthreads * num_msgs &&
+		       !atomic_load(&send_error))
+			sched_yield();
+	}
+	*elapsed = bench_now_ns() - start;
+	return atomic_load(&send_error);
+}
+
+/* Reads the whole trace ring, and reports the events per type */
+static void bench_trace_report(struct rpmsg_trace *trace)
+{
+	struct rpmsg_trace_entry entry;
+	unsigned long counts[RPMSG_TRACE_NO_BUFF + 1] = { 0 };
+	unsigned long lost = 0, total = 0;
+	uint32_t seq = 0, expected = 0;
+	unsigned int i;
+
+	while (rpmsg_trace_read(trace, &seq, &entry)) {
+		/* The entries skipped have been overwritten */
+		lost += entry.seq - expected;
+		expected = seq;
+		total++;
+		if (entry.event <= RPMSG_TRACE_NO_BUFF)
+			counts[entry.event]++;
+	}
+	LPRINTF("%35s %lu events read, %lu overwritten:", "trace:", total,
+		lost);
+	for (i = RPMSG_TRACE_SEND; i <= RPMSG_TRACE_NO_BUFF; i++)
+		LPRINTF(" %s %lu", rpmsg_trace_event_name(i), counts[i]);
+	LPRINTF("\r\n");
+}
+
+static int bench_run(unsigned int size, unsigned int buf_num,
+		     unsigned int nthreads, const struct bench_ring *ring)
+{
+	struct rpmsg_trace *trace = NULL;
+	void *trace_mem = NULL;
+	uint64_t *samples;
+	uint64_t elapsed;
+	int max_size;
+	double msgs_per_sec, kicks_per_msg, msgs;
+	unsigned long flushes[2], invalidates[2];
+	unsigned int i;
+	int ret;
+
+	samples = calloc((size_t)nthreads * num_pings, sizeof(*samples));
+	if (!samples)
+		return -ENOMEM;
+
+	atomic_store(&stop, 0);
+	atomic_store(&send_error, 0);
+	atomic_store(&received, 0);
+	atomic_store(&corrupted, 0);
+	ret = bench_setup(buf_num, ring->features);
+	if (ret)
+		goto out;
+	if (!fragment && size > (unsigned int)rpmsg_virtio_get_buffer_size(
+					&master.rvdev.rdev)) {
+		LPRINTF("%8u %8u %8u %8s   payload larger than buffers, "
+			"skipped\r\n", size, buf_num, nthreads, ring->name);
+		bench_cleanup();
+		goto out;
+	}
+	if (trace_entries) {
+		/* Both sides record in the same ring */
+		size_t trace_size = sizeof(*trace) + (size_t)trace_entries *
+				    sizeof(struct rpmsg_trace_entry);
+
+		trace_mem = malloc(trace_size);
+		trace = trace_mem ? rpmsg_trace_init(trace_mem, trace_size) :
+			NULL;
+		if (!trace) {
+			LPERROR("failed to create the trace ring\r\n");
+			exit(1);
+		}
+		rpmsg_trace_attach(&master.rvdev.rdev, trace);
+		rpmsg_trace_attach(&remote.rvdev.rdev, trace);
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		atomic_init(&senders[i].replies, 0);
+		senders[i].rx_seq = 0;
+		senders[i].samples = samples + (size_t)i * num_pings;
+		rpmsg_create_ept(&senders[i].rept, &remote.rvdev.rdev, "bench",
+				 BENCH_REMOTE_EPT_ADDR + i,
+				 BENCH_MASTER_EPT_ADDR + i, bench_remote_cb,
+				 NULL);
+		senders[i].rept.priv = &senders[i];
+		rpmsg_create_ept(&senders[i].mept, &master.rvdev.rdev, "bench",
+				 BENCH_MASTER_EPT_ADDR + i,
+				 BENCH_REMOTE_EPT_ADDR + i, bench_master_cb,
+				 NULL);
+		senders[i].mept.priv = &senders[i];
+		if (fragment) {
+			/* Reassemble into buffers allocated per message */
+			rpmsg_frag_enable(&senders[i].rept, &senders[i].rfrag,
+					  NULL, size);
+			rpmsg_frag_enable(&senders[i].mept, &senders[i].mfrag,
+					  NULL, size);
+		}
+		if (credit_window) {
+			rpmsg_credit_enable(&senders[i].rept,
+					    &senders[i].rcredit, credit_window);
+			rpmsg_credit_enable(&senders[i].mept,
+					    &senders[i].mcredit, credit_window);
+		}
+	}
+
+	/* The credit header takes room from the payload of the buffers */
+	max_size = rpmsg_get_tx_buffer_size(&senders[0].mept);
+	if (!fragment && max_size >= 0 && size > (unsigned int)max_size)
+		size = max_size;
+
+	if (bench_start_threads(&master) || bench_start_threads(&remote)) {
+		LPERROR("failed to create the notification threads\r\n");
+		exit(1);
+	}
+
+	payload_size = size;
+	mode = BENCH_THROUGHPUT;
+	atomic_store(&notifications, 0);
+	atomic_store(&master.flushes, 0);
+	atomic_store(&master.invalidates, 0);
+	atomic_store(&remote.flushes, 0);
+	atomic_store(&remote.invalidates, 0);
+	ret = bench_run_senders(nthreads, &elapsed);
+	if (ret)
+		goto abort;
+	msgs = (double)nthreads * num_msgs;
+	msgs_per_sec = msgs * 1e9 / elapsed;
+	kicks_per_msg = (double)atomic_load(&notifications) / msgs;
+	flushes[0] = atomic_load(&master.flushes);
+	flushes[1] = atomic_load(&remote.flushes);
+	invalidates[0] = atomic_load(&master.invalidates);
+	invalidates[1] = atomic_load(&remote.invalidates);
+
+	mode = BENCH_LATENCY;
+	ret = bench_run_senders(nthreads, &elapsed);
+	if (ret)
+		goto abort;
+	qsort(samples, (size_t)nthreads * num_pings, sizeof(*samples),
+	      bench_cmp_u64);
+
+	LPRINTF("%8u %8u %8u %8s %12.0f %10.2f %10.3f %10.2f %10.2f %10.2f\r\n",
+		size, buf_num, nthreads, ring->name, msgs_per_sec,
+		msgs_per_sec * size / (1024 * 1024), kicks_per_msg,
+		bench_percentile(samples, (size_t)nthreads * num_pings, 50),
+		bench_percentile(samples, (size_t)nthreads * num_pings, 99),
+		bench_percentile(samples, (size_t)nthreads * num_pings, 99.9));
+	if (cache_sim)
+		LPRINTF("%35s flushes/msg %.2f+%.2f, invalidates/msg "
+			"%.2f+%.2f, %lu corrupted messages\r\n",
+			"master+remote:", flushes[0] / msgs, flushes[1] / msgs,
+			invalidates[0] / msgs, invalidates[1] / msgs,
+			atomic_load(&corrupted));
+	if (trace)
+		bench_trace_report(trace);
+	if (atomic_load(&corrupted))
+		ret = -EIO;
+
+abort:
+	if (ret && ret != -EIO)
+		LPRINTF("%8u %8u %8u %8s   send failed: %d, run aborted\r\n",
+			size, buf_num, nthreads, ring->name, ret);
+	bench_stop_threads();
+	for (i = 0; i < nthreads; i++) {
+		rpmsg_destroy_ept(&senders[i].mept);
+		rpmsg_destroy_ept(&senders[i].rept);
+	}
+	if (trace) {
+		rpmsg_trace_attach(&master.rvdev.rdev, NULL);
+		rpmsg_trace_attach(&remote.rvdev.rdev, NULL);
+	}
+	bench_cleanup();
+out:
+	free(trace_mem);
+	free(samples);
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	LPRINTF("Usage: %s [-s sizes] [-b buffers] [-t threads] [-r rings]"
+		" [-n msgs] [-l pings] [-f] [-c] [-w window] [-T entries]\r\n",
+		prog);
+	LPRINTF("  -s: comma-separated payload sizes in bytes\r\n");
+	LPRINTF("  -b: comma-separated buffer counts (powers of 2)\r\n");
+	LPRINTF("  -t: comma-separated sender thread counts\r\n");
+	LPRINTF("  -r: comma-separated virtqueue layouts, split, packed, "
+		"event (split with event index) or cache (split with cache "
+		"aligned payloads)\r\n");
+	LPRINTF("  -n: messages sent per thread for the throughput\r\n");
+	LPRINTF("  -l: round trips per thread for the latency\r\n");
+	LPRINTF("  -f: fragment the messages, sizes may exceed the "
+		"buffers\r\n");
+	LPRINTF("  -c: simulate non coherent caches, checking the messages "
+		"and counting the cache operations\r\n");
+	LPRINTF("  -w: credit based flow control of the endpoints, with this "
+		"window\r\n");
+	LPRINTF("  -T: record the transport events in a trace ring of this "
+		"number of entries (power of 2)\r\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct metal_init_params metal_param = METAL_INIT_DEFAULTS;
+	unsigned int s, b, t, r, max_bufs = 0;
+	int opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "s:b:t:r:n:l:fcw:T:h")) != -1) {
+		switch (opt) {
+		case 's':
+			ret = bench_parse_list(optarg, &sizes);
+			break;
+		case 'b':
+			ret = bench_parse_list(optarg, &buf_nums);
+			break;
+		case 't':
+			ret = bench_parse_list(optarg, &thread_nums);
+			break;
+		case 'r':
+			ret = bench_parse_rings(optarg, &rings);
+			break;
+		case 'n':
+			num_msgs = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			num_pings = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			fragment = 1;
+			break;
+		case 'c':
+			cache_sim = 1;
+			break;
+		case 'w':
+			credit_window = strtoul(optarg, NULL, 0);
+			if (!credit_window ||
+			    credit_window > RPMSG_CREDIT_MAX_WINDOW)
+				ret = -EINVAL;
+			break;
+		case 'T':
+			trace_entries = strtoul(optarg, NULL, 0);
+			if (trace_entries < 2 ||
+			    (trace_entries & (trace_entries - 1)))
+				ret = -EINVAL;
+			break;
+		default:
+			ret = -EINVAL;
+			break;
+		}
+		if (ret || !num_msgs || !num_pings) {
+			usage(argv[0]);
+			return -1;
+		}
+	}
+	if (fragment && credit_window) {
+		LPERROR("fragmenting endpoints have no flow control\r\n");
+		return -1;
+	}
+	for (b = 0; b < buf_nums.num; b++) {
+		if (buf_nums.values[b] & (buf_nums.values[b] - 1)) {
+			LPERROR("buffer count %u is not a power of 2\r\n",
+				buf_nums.values[b]);
+			return -1;
+		}
+		if (buf_nums.values[b] > max_bufs)
+			max_bufs = buf_nums.values[b];
+	}
+	for (t = 0; t < thread_nums.num; t++) {
+		if (thread_nums.values[t] > BENCH_MAX_THREADS) {
+			LPERROR("at most %d threads\r\n", BENCH_MAX_THREADS);
+			return -1;
+		}
+	}
+
+	metal_init(&metal_param);
+
+	/* Resource table, two vrings and the buffers of both directions */
+	shm_size = BENCH_VRING_ALIGN +
+		   2 * (vring_size(max_bufs, BENCH_VRING_ALIGN) +
+			BENCH_VRING_ALIGN) +
+		   2 * max_bufs * RPMSG_BUFFER_SIZE;
+	shm_fd = memfd_create("rpmsg-bench", 0);
+	if (shm_fd < 0 || ftruncate(shm_fd, shm_size)) {
+		LPERROR("failed to create the shared memory\r\n");
+		return -1;
+	}
+	shm = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd,
+		   0);
+	if (shm == MAP_FAILED) {
+		LPERROR("failed to map the shared memory\r\n");
+		return -1;
+	}
+	/* Use the virtual addresses as physical addresses */
+	shm_phys = (metal_phys_addr_t)(uintptr_t)shm;
+	metal_io_init(&shm_io, shm, &shm_phys, shm_size, -1, 0, NULL);
+	master.mem = shm;
+	master.io = &shm_io;
+	remote.mem = shm;
+	remote.io = &shm_io;
+
+	master.efd = eventfd(0, 0);
+	remote.efd = eventfd(0, 0);
+	if (master.efd < 0 || remote.efd < 0) {
+		LPERROR("failed to create the eventfds\r\n");
+		return -1;
+	}
+
+	LPRINTF("%8s %8s %8s %8s %12s %10s %10s %10s %10s %10s\r\n", "size",
+		"buffers", "threads", "ring", "msgs/s", "MB/s", "kicks/msg",
+		"p50(us)", "p99(us)", "p999(us)");
+	/* The rings vary last, to compare them side by side */
+	for (s = 0; s < sizes.num && !ret; s++)
+		for (b = 0; b < buf_nums.num && !ret; b++)
+			for (t = 0; t < thread_nums.num && !ret; t++)
+				for (r = 0; r < rings.num && !ret; r++)
+					ret = bench_run(sizes.values[s],
+						buf_nums.values[b],
+						thread_nums.values[t],
+						&bench_rings[rings.values[r]]);
+
+	close(master.efd);
+	close(remote.efd);
+	if (master.mem != shm)
+		munmap(master.mem, shm_size);
+	if (remote.mem != shm)
+		munmap(remote.mem, shm_size);
+	munmap(shm, shm_size);
+	close(shm_fd);
+	metal_finish();
+
+	return ret ? -1 : 0;
+}
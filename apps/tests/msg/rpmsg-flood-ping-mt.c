@@ -0,0 +1,243 @@
+/* This is a test application to send rpmsgs in flood mode from several
+ * threads. The sender threads keep sending messages while the main thread
+ * processes the echoes, so that transmission and reception run
+ * concurrently on the two virtqueues.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <openamp/open_amp.h>
+#include <metal/alloc.h>
+#include <metal/atomic.h>
+#include "platform_info.h"
+#include "rpmsg-ping.h"
+
+#define APP_EPT_ADDR    1024
+#define LPRINTF(format, ...) printf(format, ##__VA_ARGS__)
+#define LPERROR(format, ...) LPRINTF("ERROR: " format, ##__VA_ARGS__)
+
+struct _payload {
+	unsigned long num;
+	unsigned long size;
+	unsigned char data[];
+};
+
+#define PAYLOAD_SIZE 256
+#define NUMS_THREADS 4
+#define NUMS_PACKAGES 0x10000
+
+/* Globals */
+static struct rpmsg_endpoint lept;
+static atomic_int rnum;
+static atomic_int err_cnt;
+static int ept_deleted = 0;
+
+/* External functions */
+extern int init_system();
+extern void cleanup_system();
+
+/*-----------------------------------------------------------------------------*
+ *  RPMSG endpoint callbacks
+ *-----------------------------------------------------------------------------*/
+static int rpmsg_endpoint_cb(struct rpmsg_endpoint *ept, void *data, size_t len,
+			     uint32_t src, void *priv)
+{
+	struct _payload *r_payload = (struct _payload *)data;
+	unsigned int i;
+
+	(void)ept;
+	(void)src;
+	(void)priv;
+
+	if (len != sizeof(struct _payload) + PAYLOAD_SIZE ||
+	    r_payload->size != PAYLOAD_SIZE) {
+		LPERROR(" Invalid size of package is received 0x%x.\r\n",
+			(unsigned int)len);
+		atomic_fetch_add(&err_cnt, 1);
+		return RPMSG_SUCCESS;
+	}
+	/* Validate data buffer integrity. */
+	for (i = 0; i < PAYLOAD_SIZE; i++) {
+		if (r_payload->data[i] != (unsigned char)r_payload->num) {
+			LPERROR("Data corruption %lu\r\n", r_payload->num);
+			atomic_fetch_add(&err_cnt, 1);
+			break;
+		}
+	}
+	atomic_fetch_add(&rnum, 1);
+	return RPMSG_SUCCESS;
+}
+
+static void rpmsg_service_unbind(struct rpmsg_endpoint *ept)
+{
+	(void)ept;
+	rpmsg_destroy_ept(&lept);
+	LPRINTF("echo test: service is destroyed\r\n");
+	ept_deleted = 1;
+}
+
+static void rpmsg_name_service_bind_cb(struct rpmsg_device *rdev,
+				       const char *name, uint32_t dest)
+{
+	LPRINTF("new endpoint notification is received.\r\n");
+	if (strcmp(name, RPMSG_SERVICE_NAME))
+		LPERROR("Unexpected name service %s.\r\n", name);
+	else
+		(void)rpmsg_create_ept(&lept, rdev, RPMSG_SERVICE_NAME,
+				       APP_EPT_ADDR, dest,
+				       rpmsg_endpoint_cb,
+				       rpmsg_service_unbind);
+
+}
+
+/*-----------------------------------------------------------------------------*
+ *  Sender thread
+ *-----------------------------------------------------------------------------*/
+static void *sender(void *arg)
+{
+	struct _payload *i_payload;
+	unsigned long id = (unsigned long)arg;
+	int i, ret = 0;
+
+	i_payload = metal_allocate_memory(sizeof(*i_payload) + PAYLOAD_SIZE);
+	if (!i_payload) {
+		LPERROR("memory allocation failed.\r\n");
+		atomic_fetch_add(&err_cnt, 1);
+		return NULL;
+	}
+	i_payload->size = PAYLOAD_SIZE;
+
+	for (i = 0; i < NUMS_PACKAGES; i++) {
+		i_payload->num = id * NUMS_PACKAGES + i;
+		memset(i_payload->data, (unsigned char)i_payload->num,
+		       PAYLOAD_SIZE);
+		while (!atomic_load(&err_cnt) && !ept_deleted) {
+			ret = rpmsg_trysend(&lept, i_payload,
+					    sizeof(*i_payload) + PAYLOAD_SIZE);
+			if (ret != RPMSG_ERR_NO_BUFF)
+				break;
+			/* The main thread returns the buffers */
+			sched_yield();
+		}
+		if (ret < 0) {
+			LPERROR("Failed to send data...\r\n");
+			atomic_fetch_add(&err_cnt, 1);
+		}
+		if (ret < 0 || atomic_load(&err_cnt) || ept_deleted)
+			break;
+	}
+
+	metal_free_memory(i_payload);
+	return NULL;
+}
+
+/*-----------------------------------------------------------------------------*
+ *  Application
+ *-----------------------------------------------------------------------------*/
+int app (struct rpmsg_device *rdev, void *priv)
+{
+	pthread_t threads[NUMS_THREADS];
+	struct timespec start, end;
+	double elapsed;
+	int ret;
+	int i, nthreads;
+
+	LPRINTF(" 1 - Send data to remote core from %d threads,",
+		NUMS_THREADS);
+	LPRINTF(" retrieve the echo and validate its integrity ..\r\n");
+
+	if (rpmsg_virtio_get_buffer_size(rdev) <
+	    (int)(sizeof(struct _payload) + PAYLOAD_SIZE)) {
+		LPERROR("No avaiable buffer size.\r\n");
+		return -1;
+	}
+
+	/* Create RPMsg endpoint */
+	ret = rpmsg_create_ept(&lept, rdev, RPMSG_SERVICE_NAME, APP_EPT_ADDR,
+			       RPMSG_ADDR_ANY,
+			       rpmsg_endpoint_cb, rpmsg_service_unbind);
+	if (ret) {
+		LPERROR("Failed to create RPMsg endpoint.\r\n");
+		return ret;
+	}
+
+	while (!is_rpmsg_ept_ready(&lept))
+		platform_poll(priv);
+	LPRINTF("RPMSG endpoint is binded with remote.\r\n");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (nthreads = 0; nthreads < NUMS_THREADS; nthreads++) {
+		if (pthread_create(&threads[nthreads], NULL, sender,
+				   (void *)(unsigned long)nthreads)) {
+			LPERROR("Failed to create sender thread.\r\n");
+			atomic_fetch_add(&err_cnt, 1);
+			break;
+		}
+	}
+
+	/* Receive the echoes while the senders are running */
+	while (atomic_load(&rnum) < nthreads * NUMS_PACKAGES &&
+	       !atomic_load(&err_cnt) && !ept_deleted)
+		platform_poll(priv);
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	elapsed = (end.tv_sec - start.tv_sec) +
+		  (end.tv_nsec - start.tv_nsec) / 1e9;
+	if (elapsed > 0)
+		LPRINTF("echo test: %d packages in %f s, %.0f packages/s\r\n",
+			atomic_load(&rnum), elapsed,
+			atomic_load(&rnum) / elapsed);
+
+	if (ept_deleted)
+		LPRINTF("Remote RPMsg endpoint is destroyed unexpected.\r\n");
+
+	LPRINTF("**********************************\r\n");
+	LPRINTF(" Test Results: Error count = %d \r\n",
+		atomic_load(&err_cnt));
+	LPRINTF("**********************************\r\n");
+	/* Destroy the RPMsg endpoint */
+	rpmsg_destroy_ept(&lept);
+	LPRINTF("Quitting application .. Echo test end\r\n");
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	void *platform;
+	struct rpmsg_device *rpdev;
+	int ret;
+
+	/* Initialize platform */
+	ret = platform_init(argc, argv, &platform);
+	if (ret) {
+		LPERROR("Failed to initialize platform.\r\n");
+		ret = -1;
+	} else {
+		rpdev = platform_create_rpmsg_vdev(platform, 0,
+						  VIRTIO_DEV_MASTER,
+						  NULL,
+						  rpmsg_name_service_bind_cb);
+		if (!rpdev) {
+			LPERROR("Failed to create rpmsg virtio device.\r\n");
+			ret = -1;
+		} else {
+			app(rpdev, platform);
+			platform_release_rpmsg_vdev(rpdev);
+			ret = 0;
+		}
+	}
+
+	LPRINTF("Stopping application...\r\n");
+	platform_cleanup(platform);
+
+	return ret;
+}
@@ -0,0 +1,143 @@
+/*
+ * This is the host side decoder of the rpmsg trace rings (see
+ * rpmsg_trace_init()). It maps the memory of a ring, such as the buffer of
+ * the trace resource of a remote processor through /dev/mem, or a file
+ * holding a dump of that memory, and prints its entries, oldest first.
+ *
+ * The entries lost, overwritten before being read or dropped by a delayed
+ * writer, are reported as gaps in the sequence numbers. With -f, the ring
+ * is followed as the remote keeps writing into it.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <openamp/rpmsg_trace.h>
+
+#define LPRINTF(format, ...) printf(format, ##__VA_ARGS__)
+#define LPERROR(format, ...) LPRINTF("ERROR: " format, ##__VA_ARGS__)
+
+/* Polling period of the ring with -f, in microseconds */
+#define TRACE_FOLLOW_PERIOD_US	10000
+
+static void usage(const char *prog)
+{
+	LPRINTF("Usage: %s [-o offset] [-l length] [-f] file\r\n", prog);
+	LPRINTF("  -o: offset of the ring in the file, such as the physical "
+		"address of the trace resource buffer in /dev/mem\r\n");
+	LPRINTF("  -l: length of the ring memory, the rest of the file by "
+		"default\r\n");
+	LPRINTF("  -f: follow the ring, printing the entries as they are "
+		"written\r\n");
+}
+
+static void trace_print(const struct rpmsg_trace_entry *entry)
+{
+	LPRINTF("%10u %20llu q%-3u %-10s 0x%08x 0x%08x 0x%08x 0x%08x\r\n",
+		(unsigned int)entry->seq,
+		(unsigned long long)entry->timestamp, entry->queue,
+		rpmsg_trace_event_name(entry->event), entry->args[0],
+		entry->args[1], entry->args[2], entry->args[3]);
+}
+
+int main(int argc, char *argv[])
+{
+	struct rpmsg_trace_entry entry;
+	struct rpmsg_trace *trace;
+	unsigned long long offset = 0;
+	unsigned long lost = 0;
+	size_t len = 0, page;
+	struct stat st;
+	uint32_t seq = 0, expected = 0;
+	int follow = 0;
+	void *mem;
+	int opt, fd;
+
+	while ((opt = getopt(argc, argv, "o:l:fh")) != -1) {
+		switch (opt) {
+		case 'o':
+			offset = strtoull(optarg, NULL, 0);
+			break;
+		case 'l':
+			len = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			follow = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0) {
+		LPERROR("failed to open %s: %d\r\n", argv[optind], errno);
+		return -1;
+	}
+	if (!len) {
+		if (fstat(fd, &st) || (unsigned long long)st.st_size <= offset) {
+			LPERROR("no ring length, give it with -l\r\n");
+			return -1;
+		}
+		len = st.st_size - offset;
+	}
+
+	/* The mapping starts on a page boundary */
+	page = sysconf(_SC_PAGESIZE);
+	mem = mmap(NULL, len + offset % page, PROT_READ, MAP_SHARED, fd,
+		   offset - offset % page);
+	if (mem == MAP_FAILED) {
+		LPERROR("failed to map %s: %d\r\n", argv[optind], errno);
+		return -1;
+	}
+	trace = rpmsg_trace_open((char *)mem + offset % page, len);
+	if (!trace) {
+		LPERROR("no trace ring at 0x%llx\r\n", offset);
+		return -1;
+	}
+
+	LPRINTF("%u entries, %u written\r\n", trace->num_entries,
+		(unsigned int)atomic_load(&trace->head));
+	LPRINTF("%10s %20s %4s %-10s %s\r\n", "seq", "timestamp", "queue",
+		"event", "args");
+	while (1) {
+		while (rpmsg_trace_read(trace, &seq, &entry)) {
+			if (entry.seq != expected) {
+				lost += entry.seq - expected;
+				LPRINTF("%10s %lu entries lost\r\n", "...",
+					(unsigned long)(entry.seq - expected));
+			}
+			expected = seq;
+			trace_print(&entry);
+		}
+		if (!follow) {
+			/*
+			 * The writers are stopped: an entry not written has
+			 * been dropped
+			 */
+			if ((int32_t)(atomic_load(&trace->head) - seq) > 0) {
+				seq++;
+				continue;
+			}
+			break;
+		}
+		usleep(TRACE_FOLLOW_PERIOD_US);
+	}
+	LPRINTF("%lu entries lost\r\n", lost);
+
+	munmap(mem, len + offset % page);
+	close(fd);
+
+	return 0;
+}
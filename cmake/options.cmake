@@ -74,9 +74,47 @@ endif (WITH_ZEPHYR)
 
 option (WITH_LIBMETAL_FIND "Check Libmetal library can be found" ON)
 
+option (WITH_RPMSG_TX_WAIT_EVENT "Also wake TX buffer waiters on remote notification" OFF)
+
+if (WITH_RPMSG_TX_WAIT_EVENT)
+  add_definitions(-DRPMSG_TX_WAIT_EVENT)
+endif (WITH_RPMSG_TX_WAIT_EVENT)
+
+option (WITH_RPMSG_VIRTIO_SPSC "Access each virtqueue from a single context, without lock nor held RX buffers" OFF)
+
+if (WITH_RPMSG_VIRTIO_SPSC)
+  add_definitions(-DRPMSG_VIRTIO_SPSC)
+endif (WITH_RPMSG_VIRTIO_SPSC)
+
+option (WITH_RPMSG_VIRTIO_TX_STAGING "Let concurrent senders copy and stage their messages out of the TX virtqueue lock" OFF)
+
+if (WITH_RPMSG_VIRTIO_TX_STAGING)
+  add_definitions(-DRPMSG_VIRTIO_TX_STAGING)
+endif (WITH_RPMSG_VIRTIO_TX_STAGING)
+
+option (WITH_RPMSG_STATS "Collect rpmsg and virtqueue statistics" OFF)
+
+if (WITH_RPMSG_STATS)
+  add_definitions(-DRPMSG_STATS -DVQUEUE_STATS)
+endif (WITH_RPMSG_STATS)
+
+option (WITH_RPROC_LZ4 "Decompress the LZ4 compressed segments of the executables" OFF)
+
+if (WITH_RPROC_LZ4)
+  add_definitions(-DRPROC_LZ4)
+endif (WITH_RPROC_LZ4)
+
 if (DEFINED RPMSG_BUFFER_SIZE)
   add_definitions( -DRPMSG_BUFFER_SIZE=${RPMSG_BUFFER_SIZE} )
 endif (DEFINED RPMSG_BUFFER_SIZE)
 
+if (DEFINED RPMSG_RX_BATCH_SIZE)
+  add_definitions( -DRPMSG_RX_BATCH_SIZE=${RPMSG_RX_BATCH_SIZE} )
+endif (DEFINED RPMSG_RX_BATCH_SIZE)
+
+if (DEFINED RPMSG_EPT_HASH_SIZE)
+  add_definitions( -DRPMSG_EPT_HASH_SIZE=${RPMSG_EPT_HASH_SIZE} )
+endif (DEFINED RPMSG_EPT_HASH_SIZE)
+
 message ("-- C_FLAGS : ${CMAKE_C_FLAGS}")
 # vim: expandtab:ts=2:sw=2:smartindent
@@ -169,6 +169,13 @@ typedef struct elf64_phdr {
 #define PT_LOPROC  0x70000000
 #define PT_HIPROC  0x7fffffff
 
+/* segment flags */
+#define PF_X       0x1
+#define PF_W       0x2
+#define PF_R       0x4
+/* OS-specific: the segment data is LZ4 frames, p_filesz being their size */
+#define PF_OPENAMP_LZ4 0x00100000
+
 /* ELF32 section header. */
 typedef struct {
 	Elf32_Word sh_name;
@@ -417,6 +424,19 @@ metal_phys_addr_t elf_get_entry(void *img_info);
 int elf_locate_rsc_table(void *img_info, metal_phys_addr_t *da,
 			 size_t *offset, size_t *size);
 
+/**
+ * elf_get_data_flags - get the flags of the last loaded segment
+ *
+ * It will return RPROC_LOAD_DATA_WRITABLE if the segment returned by the
+ * last elf_load() call is writable, and RPROC_LOAD_DATA_LZ4 if its data is
+ * compressed (see PF_OPENAMP_LZ4).
+ *
+ * @img_info: pointer to ELF image information
+ *
+ * return RPROC_LOAD_DATA_* flags of the segment
+ */
+unsigned int elf_get_data_flags(void *img_info);
+
 #if defined __cplusplus
 }
 #endif
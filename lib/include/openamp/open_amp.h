@@ -9,6 +9,9 @@
 #define OPEN_AMP_H_
 
 #include <openamp/rpmsg.h>
+#include <openamp/rpmsg_frag.h>
+#include <openamp/rpmsg_credit.h>
+#include <openamp/rpmsg_trace.h>
 #include <openamp/rpmsg_virtio.h>
 #include <openamp/remoteproc.h>
 #include <openamp/remoteproc_virtio.h>
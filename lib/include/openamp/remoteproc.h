@@ -12,6 +12,7 @@
 #ifndef REMOTEPROC_H
 #define REMOTEPROC_H
 
+#include <metal/atomic.h>
 #include <metal/io.h>
 #include <metal/mutex.h>
 #include <metal/compiler.h>
@@ -323,6 +324,29 @@ struct loader_ops;
 struct image_store_ops;
 struct remoteproc_ops;
 
+/**
+ * struct remoteproc_load_cache
+ *
+ * Hashes of the read-only data loaded to a remoteproc memory, so that
+ * reloading an executable skips the data already in the memory (see
+ * remoteproc_init_load_cache()).
+ *
+ * @pa: physical address of the first chunk
+ * @chunk_size: size of the chunks the memory is split into
+ * @num_chunks: number of chunks
+ * @hashes: hash of the data loaded to each chunk, 0 if not known
+ * @copied: number of bytes copied to the memory by the loads
+ * @skipped: number of bytes not copied as already in the memory
+ */
+struct remoteproc_load_cache {
+	metal_phys_addr_t pa;
+	size_t chunk_size;
+	size_t num_chunks;
+	uint64_t *hashes;
+	atomic_ulong copied;
+	atomic_ulong skipped;
+};
+
 /**
  * struct remoteproc_mem
  *
@@ -332,6 +356,7 @@ struct remoteproc_ops;
  * @pa: physical memory
  * @size: size of the memory
  * @io: pointer to the I/O region
+ * @cache: load cache, NULL if the memory is always fully loaded
  * @node: list node
  */
 struct remoteproc_mem {
@@ -340,9 +365,26 @@ struct remoteproc_mem {
 	size_t size;
 	char name[RPROC_MAX_NAME_LEN];
 	struct metal_io_region *io;
+	struct remoteproc_load_cache *cache;
 	struct metal_list node;
 };
 
+/**
+ * struct remoteproc_load_stats
+ *
+ * Statistics of the compressed data of the last load, the decompression
+ * throughput being @decompressed / @time
+ *
+ * @compressed: number of bytes of compressed data read from the image
+ * @decompressed: number of bytes decompressed to the target memory
+ * @time: time spent decompressing, in metal_get_timestamp() units
+ */
+struct remoteproc_load_stats {
+	size_t compressed;
+	size_t decompressed;
+	unsigned long long time;
+};
+
 /**
  * struct remoteproc
  *
@@ -361,6 +403,7 @@ struct remoteproc_mem {
  * @vdevs: remoteproc virtio devices
  * @bitmap: bitmap for notify IDs for remoteproc subdevices
  * @state: remote processor state
+ * @load_stats: statistics of the last load
  * @priv: private data
  */
 struct remoteproc {
@@ -375,6 +418,7 @@ struct remoteproc {
 	metal_phys_addr_t bootaddr;
 	struct loader_ops *loader;
 	unsigned int state;
+	struct remoteproc_load_stats load_stats;
 	void *priv;
 };
 
@@ -412,6 +456,34 @@ struct remoteproc_ops {
 	int (*notify)(struct remoteproc *rproc, uint32_t id);
 };
 
+/*
+ * Size of the pieces the segments are split into by a parallel load, each
+ * piece being copied or zero-filled by one worker. It is a power of two.
+ */
+#ifndef RPROC_LOAD_CHUNK_SIZE
+#define RPROC_LOAD_CHUNK_SIZE (1024 * 1024)
+#endif
+
+/**
+ * struct remoteproc_load_pool
+ *
+ * Worker pool of a parallel load, provided by the application which knows
+ * how to run works concurrently (threads, other cores...).
+ *
+ * @num_workers: number of workers, the calling thread works too
+ * @run: start work(arg) on a worker, returns 0 on success. The works
+ *       started may run at once, on any of the workers
+ * @wait: wait for all the started works to return
+ * @priv: private data of the pool
+ */
+struct remoteproc_load_pool {
+	unsigned int num_workers;
+	int (*run)(struct remoteproc_load_pool *pool,
+		   void (*work)(void *arg), void *arg);
+	void (*wait)(struct remoteproc_load_pool *pool);
+	void *priv;
+};
+
 /* Remoteproc error codes */
 #define RPROC_EBASE	0
 #define RPROC_ENOMEM	(RPROC_EBASE + 1)
@@ -521,8 +593,52 @@ remoteproc_init_mem(struct remoteproc_mem *mem, const char *name,
 	mem->da = da;
 	mem->io = io;
 	mem->size = size;
+	mem->cache = NULL;
 }
 
+/**
+ * remoteproc_init_load_cache
+ *
+ * Initialize the load cache of a remoteproc memory.
+ *
+ * With a load cache, remoteproc_load() and remoteproc_load_parallel() hash
+ * the read-only data they load to the memory, chunk by chunk, and skip the
+ * chunks holding the data loaded last time: reloading the executable after
+ * a crash of the remote only copies its writable data, and zero-fills its
+ * bss. Which data is read-only is told by the loader (see
+ * RPROC_LOAD_DATA_WRITABLE), the chunks partly holding other data are
+ * always copied.
+ *
+ * The cache only knows about the data written by the loads. It is
+ * invalidated by remoteproc_shutdown(), which may power the memory off, so
+ * only a reload after remoteproc_stop() skips data. If anything else may
+ * have changed the read-only data in the memory, such as a remote
+ * overwriting its code before crashing, or remoteproc_load_noblock(), call
+ * remoteproc_invalidate_load_cache() before loading again.
+ *
+ * @mem - pointer to remoteproc memory, its physical address aligned on
+ *        @chunk_size
+ * @cache - pointer to the load cache
+ * @hashes - hash table, of mem->size / @chunk_size entries rounded up
+ * @chunk_size - size of the chunks, a power of two not larger than
+ *               RPROC_LOAD_CHUNK_SIZE, such as the page size
+ *
+ * returns 0 for success and negative value for errors
+ */
+int remoteproc_init_load_cache(struct remoteproc_mem *mem,
+			       struct remoteproc_load_cache *cache,
+			       uint64_t *hashes, size_t chunk_size);
+
+/**
+ * remoteproc_invalidate_load_cache
+ *
+ * Forget the data loaded to a memory, so that the next load copies all of
+ * it.
+ *
+ * @cache - pointer to the load cache
+ */
+void remoteproc_invalidate_load_cache(struct remoteproc_load_cache *cache);
+
 /**
  * remoteproc_add_mem
  *
@@ -617,6 +733,22 @@ void *remoteproc_mmap(struct remoteproc *rproc,
 		      size_t size, unsigned int attribute,
 		      struct metal_io_region **io);
 
+/**
+ * remoteproc_get_trace
+ *
+ * get the buffer of a trace resource, such as a rpmsg trace ring written by
+ * the remote (see rpmsg_trace_open())
+ *
+ * @rproc - pointer to the remote processor
+ * @index - index of the trace resource in the resource table
+ * @len - pointer to the length of the buffer, filled on success
+ *
+ * returns pointer to the buffer, NULL if there is no such trace resource
+ * or its memory cannot be mapped
+ */
+void *remoteproc_get_trace(struct remoteproc *rproc, unsigned int index,
+			   size_t *len);
+
 /**
  * remoteproc_set_rsc_table
  *
@@ -673,7 +805,8 @@ int remoteproc_stop(struct remoteproc *rproc);
  * remoteproc_shutdown
  *
  * This function shutdown the remote processor and
- * release its resources.
+ * release its resources. The load caches of its memories
+ * are invalidated.
  *
  * @rproc - pointer to remoteproc instance
  *
@@ -688,6 +821,12 @@ int remoteproc_shutdown(struct remoteproc *rproc);
  * open the executable file and how to get data from the executable file
  * and how to load data to the target memory.
  *
+ * With RPROC_LZ4, the segments the loader tells are compressed (see
+ * RPROC_LOAD_DATA_LZ4) are decompressed straight to the target memory,
+ * mapped with remoteproc_mmap(), while they are read from the image store
+ * block by block. The compressed and decompressed sizes, and the time
+ * spent, are reported in rproc->load_stats.
+ *
  * @rproc: pointer to the remoteproc instance
  * @path: optional path to the image file
  * @store: pointer to user defined image store argument
@@ -701,6 +840,39 @@ int remoteproc_load(struct remoteproc *rproc, const char *path,
 		    void *store, struct image_store_ops *store_ops,
 		    void **img_info);
 
+/**
+ * remoteproc_load_parallel
+ *
+ * load executable as remoteproc_load(), copying and zero-filling the
+ * segments concurrently.
+ *
+ * The segment list is first collected from the loader. The segments are
+ * then split into pieces of RPROC_LOAD_CHUNK_SIZE bytes, aligned in the
+ * target memory, copied and zero-filled by the calling thread and the
+ * workers of @pool. The segments are copied concurrently only if the
+ * image store supports it (see SUPPORT_CONCURRENT_LOAD), otherwise they
+ * are copied in order while the list is collected, and only the zero-fill
+ * is parallel. Overlapping segments are loaded in order by the calling
+ * thread.
+ *
+ * The resource table is updated once all the works have returned, so that
+ * it is never overwritten by the copy of the segment holding it.
+ *
+ * @rproc: pointer to the remoteproc instance
+ * @path: optional path to the image file
+ * @store: pointer to user defined image store argument
+ * @store_ops: pointer to image store operations
+ * @pool: workers, NULL to load with the calling thread only
+ * @image_info: pointer to memory which stores image information used
+ *              by remoteproc loader
+ *
+ * return 0 for success and negative value for failure
+ */
+int remoteproc_load_parallel(struct remoteproc *rproc, const char *path,
+			     void *store, struct image_store_ops *store_ops,
+			     struct remoteproc_load_pool *pool,
+			     void **img_info);
+
 /**
  * remoteproc_load_noblock
  *
@@ -34,6 +34,19 @@ extern "C" {
 
 /* Loader feature macros */
 #define SUPPORT_SEEK 1UL
+/*
+ * The load callback can be called concurrently to load distinct ranges
+ * to the target memory (see remoteproc_load_parallel()), or to local
+ * memory for the memories with a load cache, the data returned to each
+ * caller staying valid until its next call
+ */
+#define SUPPORT_CONCURRENT_LOAD 2UL
+
+/* Target data flags, see loader_ops get_data_flags */
+/* The remote may write to the data once running */
+#define RPROC_LOAD_DATA_WRITABLE 1UL
+/* The data is LZ4 frames, decompressed to the size in memory at most */
+#define RPROC_LOAD_DATA_LZ4 2UL
 
 /* Remoteproc loader any address */
 #define RPROC_LOAD_ANYADDR ((metal_phys_addr_t)-1)
@@ -83,6 +96,9 @@ struct image_store_ops {
  * @release: define how to release the loader
  * @get_entry: get entry address
  * @get_load_state: get load state from the image information
+ * @get_data_flags: optional, get the RPROC_LOAD_DATA_* flags of the target
+ *                  data returned by the last load_data call. Without it,
+ *                  the data is taken as writable
  */
 struct loader_ops {
 	int (*load_header)(const void *img_data, size_t offset, size_t len,
@@ -99,6 +115,7 @@ struct loader_ops {
 	void (*release)(void *img_info);
 	metal_phys_addr_t (*get_entry)(void *img_info);
 	int (*get_load_state)(void *img_info);
+	unsigned int (*get_data_flags)(void *img_info);
 };
 
 #if defined __cplusplus
@@ -0,0 +1,49 @@
+/*
+ * Memory mapped image store, for Linux hosts
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef REMOTEPROC_MMAP_STORE_H_
+#define REMOTEPROC_MMAP_STORE_H_
+
+#include <stddef.h>
+#include <openamp/remoteproc_loader.h>
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+/**
+ * struct remoteproc_mmap_store - image store of a memory mapped file
+ * @base: read-only mapping of the file, NULL while it is closed
+ * @size: size of the file
+ *
+ * The store is given to remoteproc_load() or remoteproc_load_parallel(),
+ * with remoteproc_mmap_store_ops, to load an executable file:
+ *
+ *	struct remoteproc_mmap_store store = { 0 };
+ *
+ *	remoteproc_load(rproc, path, &store, &remoteproc_mmap_store_ops,
+ *			NULL);
+ *
+ * The file is mapped read-only when the load opens it, and unmapped when
+ * it closes it: the headers are parsed in place, and the segments are
+ * copied straight from the page cache to the target memory, without any
+ * copy of the file in memory. Loading the same file again only reads it
+ * again from the storage if its pages have been evicted. The store
+ * supports seeking, and concurrent loads (see remoteproc_load_parallel()).
+ * It is only available on Linux.
+ */
+struct remoteproc_mmap_store {
+	const void *base;
+	size_t size;
+};
+
+extern struct image_store_ops remoteproc_mmap_store_ops;
+
+#if defined __cplusplus
+}
+#endif
+
+#endif /* REMOTEPROC_MMAP_STORE_H_ */
@@ -27,6 +27,20 @@ extern "C" {
 /* Configurable parameters */
 #define RPMSG_NAME_SIZE			(32)
 #define RPMSG_ADDR_BMP_SIZE		(128)
+/*
+ * Number of buckets of the endpoint lookup tables, a power of two. Each
+ * rpmsg device holds two tables of this many list heads, that is 16 *
+ * RPMSG_EPT_HASH_SIZE bytes on a 32-bit target and twice that on a 64-bit
+ * one. The default suits devices with a few tens of endpoints, the devices
+ * with hundreds of them raise it (cmake -DRPMSG_EPT_HASH_SIZE=256).
+ */
+#ifndef RPMSG_EPT_HASH_SIZE
+#define RPMSG_EPT_HASH_SIZE		(16)
+#endif
+#if RPMSG_EPT_HASH_SIZE <= 0 || \
+	(RPMSG_EPT_HASH_SIZE & (RPMSG_EPT_HASH_SIZE - 1)) != 0
+#error "RPMSG_EPT_HASH_SIZE must be a power of two"
+#endif
 
 #define RPMSG_NS_EPT_ADDR		(0x35)
 #define RPMSG_RESERVED_ADDRESSES	(1024)
@@ -45,6 +59,9 @@ extern "C" {
 
 struct rpmsg_endpoint;
 struct rpmsg_device;
+struct rpmsg_frag;
+struct rpmsg_credit;
+struct rpmsg_trace;
 
 /* Returns positive value on success or negative error value on failure */
 typedef int (*rpmsg_ept_cb)(struct rpmsg_endpoint *ept, void *data,
@@ -64,7 +81,15 @@ typedef void (*rpmsg_ns_bind_cb)(struct rpmsg_device *rdev,
  * @ns_unbind_cb: end point service unbind callback, called when remote
  *                ept is destroyed.
  * @node: end point node.
+ * @addr_node: node in the device endpoints table indexed by address
+ * @name_node: node in the device endpoints table indexed by name
  * @priv: private data for the driver's use
+ * @frag: fragmentation context, NULL if the endpoint sends and receives
+ *        its messages unfragmented (see rpmsg_frag_enable())
+ * @priority: priority of the messages sent by the endpoint, 0 being the
+ *            highest (see rpmsg_set_ept_priority())
+ * @credit: flow control context, NULL if the endpoint sends and receives
+ *          its messages without credits (see rpmsg_credit_enable())
  *
  * In essence, an rpmsg endpoint represents a listener on the rpmsg bus, as
  * it binds an rpmsg address with an rx callback handler.
@@ -77,38 +102,138 @@ struct rpmsg_endpoint {
 	rpmsg_ept_cb cb;
 	rpmsg_ns_unbind_cb ns_unbind_cb;
 	struct metal_list node;
+	struct metal_list addr_node;
+	struct metal_list name_node;
 	void *priv;
+	struct rpmsg_frag *frag;
+	unsigned int priority;
+	struct rpmsg_credit *credit;
+};
+
+/**
+ * struct rpmsg_msg - message descriptor for batched send
+ * @dst: destination address
+ * @data: payload of the message
+ * @len: length of the payload
+ */
+struct rpmsg_msg {
+	uint32_t dst;
+	const void *data;
+	int len;
+};
+
+/**
+ * struct rpmsg_stats - RPMsg device counters
+ * @tx_msgs: number of messages sent
+ * @tx_bytes: number of payload bytes sent
+ * @rx_msgs: number of messages received
+ * @rx_bytes: number of payload bytes received
+ * @tx_no_buff: number of TX buffer requests which found no buffer in time,
+ *              failing with RPMSG_ERR_NO_BUFF
+ * @tx_waits: number of TX buffer requests which waited for a buffer
+ * @tx_wait_time: time spent waiting for TX buffers, in metal_get_timestamp()
+ *                units
+ * @tx_lock_contended: number of times the TX lock was found taken
+ * @rx_lock_contended: number of times the RX lock was found taken
+ * @kicks: number of notifications sent to the remote
+ * @notifications: number of notifications received from the remote
+ * @tx_ring_max: high-water mark of the messages sent and not given back by
+ *               the remote yet, only known on the master side
+ * @rx_ring_max: high-water mark of the messages waiting in the RX ring,
+ *               with split rings only
+ *
+ * The counters are only collected with RPMSG_STATS, and the ring ones with
+ * VQUEUE_STATS. Each direction counts under its own lock, without any
+ * added synchronization.
+ */
+struct rpmsg_stats {
+	unsigned long tx_msgs;
+	unsigned long long tx_bytes;
+	unsigned long rx_msgs;
+	unsigned long long rx_bytes;
+	unsigned long tx_no_buff;
+	unsigned long tx_waits;
+	unsigned long long tx_wait_time;
+	unsigned long tx_lock_contended;
+	unsigned long rx_lock_contended;
+	unsigned long kicks;
+	unsigned long notifications;
+	unsigned int tx_ring_max;
+	unsigned int rx_ring_max;
 };
 
 /**
  * struct rpmsg_device_ops - RPMsg device operations
  * @send_offchannel_raw: send RPMsg data
+ * @get_tx_payload_buffer: get a TX payload buffer to fill in place
+ * @send_offchannel_nocopy: send a TX payload buffer filled in place
+ * @release_tx_buffer: give back a TX payload buffer which is not sent
+ * @hold_rx_buffer: keep a RX buffer beyond the endpoint callback
+ * @release_rx_buffer: give back a held RX buffer
+ * @send_offchannel_batch: send several RPMsg messages with a single kick
+ * @send_offchannel_nocopy_batch: send several TX payload buffers filled in
+ *                                place with a single kick
+ * @get_stats: get the device counters
+ * @get_tx_buffer_size: get the payload size of the TX buffers of an
+ *                      endpoint
+ * @peek_rx: call a function with the messages received for an endpoint and
+ *           not delivered yet, dropping the leading ones it returns 1 for
  */
 struct rpmsg_device_ops {
 	int (*send_offchannel_raw)(struct rpmsg_device *rdev,
 				   uint32_t src, uint32_t dst,
 				   const void *data, int size, int wait);
+	void *(*get_tx_payload_buffer)(struct rpmsg_device *rdev,
+				       uint32_t src, uint32_t *len, int wait);
+	int (*send_offchannel_nocopy)(struct rpmsg_device *rdev,
+				      uint32_t src, uint32_t dst,
+				      const void *data, int len);
+	int (*release_tx_buffer)(struct rpmsg_device *rdev, void *txbuf);
+	void (*hold_rx_buffer)(struct rpmsg_device *rdev, void *rxbuf);
+	void (*release_rx_buffer)(struct rpmsg_device *rdev, void *rxbuf);
+	int (*send_offchannel_batch)(struct rpmsg_device *rdev, uint32_t src,
+				     const struct rpmsg_msg *msgs, int num,
+				     int wait);
+	int (*send_offchannel_nocopy_batch)(struct rpmsg_device *rdev,
+					    uint32_t src,
+					    const struct rpmsg_msg *msgs,
+					    int num);
+	void (*get_stats)(struct rpmsg_device *rdev,
+			  struct rpmsg_stats *stats);
+	int (*get_tx_buffer_size)(struct rpmsg_device *rdev, uint32_t src);
+	void (*peek_rx)(struct rpmsg_device *rdev, struct rpmsg_endpoint *ept,
+			rpmsg_ept_cb cb);
 };
 
 /**
  * struct rpmsg_device - representation of a RPMsg device
  * @endpoints: list of endpoints
+ * @ept_addr_table: endpoints hashed by local address
+ * @ept_name_table: endpoints hashed by name
  * @ns_ept: name service endpoint
  * @bitmap: table endpoint address allocation.
  * @lock: mutex lock for rpmsg management
+ * @ept_gen: number of endpoints unregistered, to check the endpoints looked
+ *           up beforehand
  * @ns_bind_cb: callback handler for name service announcement without local
  *              endpoints waiting to bind.
  * @ops: RPMsg device operations
  * @support_ns: create/destroy namespace message
+ * @trace: trace ring recording the transport events, NULL if none (see
+ *         rpmsg_trace_attach())
  */
 struct rpmsg_device {
 	struct metal_list endpoints;
+	struct metal_list ept_addr_table[RPMSG_EPT_HASH_SIZE];
+	struct metal_list ept_name_table[RPMSG_EPT_HASH_SIZE];
 	struct rpmsg_endpoint ns_ept;
 	unsigned long bitmap[metal_bitmap_longs(RPMSG_ADDR_BMP_SIZE)];
 	metal_mutex_t lock;
+	unsigned int ept_gen;
 	rpmsg_ns_bind_cb ns_bind_cb;
 	struct rpmsg_device_ops ops;
 	bool support_ns;
+	struct rpmsg_trace *trace;
 };
 
 /**
@@ -265,6 +390,202 @@ static inline int rpmsg_trysend_offchannel(struct rpmsg_endpoint *ept,
 	return rpmsg_send_offchannel_raw(ept, src, dst, data, len, false);
 }
 
+/**
+ * rpmsg_send_batch() - send several messages with a single notification
+ * @ept: the rpmsg endpoint
+ * @msgs: array of messages to send
+ * @num: number of messages in @msgs
+ * @wait: boolean, wait or not for buffers to become available
+ *
+ * This function sends the messages of @msgs, in order, from @ept's source
+ * address to the destination address of each message. The messages are
+ * queued together and the remote processor is notified once, rather than
+ * once per message as with rpmsg_send().
+ * If the TX buffers run out and @wait is set, the messages queued so far
+ * are sent and the function blocks until a buffer becomes available, or
+ * a timeout of 15 seconds elapses. Otherwise, it stops at the first
+ * message which cannot be sent.
+ *
+ * Returns the number of messages sent, or negative error value if none
+ * of them could be sent.
+ */
+int rpmsg_send_batch(struct rpmsg_endpoint *ept, const struct rpmsg_msg *msgs,
+		     int num, int wait);
+
+/**
+ * rpmsg_sendv() - send several messages with a single notification
+ * @ept: the rpmsg endpoint
+ * @msgs: array of messages to send
+ * @num: number of messages in @msgs
+ *
+ * Blocking version of rpmsg_send_batch().
+ *
+ * Returns the number of messages sent, or negative error value if none
+ * of them could be sent.
+ */
+static inline int rpmsg_sendv(struct rpmsg_endpoint *ept,
+			      const struct rpmsg_msg *msgs, int num)
+{
+	return rpmsg_send_batch(ept, msgs, num, true);
+}
+
+/**
+ * rpmsg_trysendv() - send several messages with a single notification
+ * @ept: the rpmsg endpoint
+ * @msgs: array of messages to send
+ * @num: number of messages in @msgs
+ *
+ * Non-blocking version of rpmsg_send_batch().
+ *
+ * Returns the number of messages sent, or negative error value if none
+ * of them could be sent.
+ */
+static inline int rpmsg_trysendv(struct rpmsg_endpoint *ept,
+				 const struct rpmsg_msg *msgs, int num)
+{
+	return rpmsg_send_batch(ept, msgs, num, false);
+}
+
+/**
+ * rpmsg_hold_rx_buffer() - hold a RX buffer beyond the endpoint callback
+ * @ept: the rpmsg endpoint
+ * @rxbuf: RX payload buffer passed to the endpoint callback
+ *
+ * This function has to be called from the endpoint callback. The buffer
+ * is not given back to the virtqueue when the callback returns, so that
+ * the application can keep on using it without copying the message out
+ * of the shared memory, e.g. from another thread. The buffer has to be
+ * given back later with rpmsg_release_rx_buffer(). Held buffers can be
+ * released in any order. If the device cannot hold buffers, e.g. a rpmsg
+ * virtio device in RPMSG_VIRTIO_SPSC mode, the call has no effect and the
+ * buffer is given back when the callback returns.
+ */
+void rpmsg_hold_rx_buffer(struct rpmsg_endpoint *ept, void *rxbuf);
+
+/**
+ * rpmsg_release_rx_buffer() - give back a held RX buffer
+ * @ept: the rpmsg endpoint
+ * @rxbuf: RX payload buffer held with rpmsg_hold_rx_buffer()
+ *
+ * The buffer is returned to the virtqueue, so that the remote processor
+ * can use it again. It must not be used by the application anymore.
+ */
+void rpmsg_release_rx_buffer(struct rpmsg_endpoint *ept, void *rxbuf);
+
+/**
+ * rpmsg_get_tx_payload_buffer() - get a TX buffer to fill in place
+ * @ept: the rpmsg endpoint
+ * @len: pointer to store the size of the returned payload buffer
+ * @wait: boolean, wait or not for a buffer to become available
+ *
+ * This function returns a pointer to the payload area of a shared memory
+ * TX buffer. The caller writes the message directly into it and then
+ * sends it with one of the rpmsg_send*_nocopy() functions, which saves
+ * the copy done by rpmsg_send(). If the message is finally not sent, the
+ * buffer has to be given back with rpmsg_release_tx_buffer().
+ * In case there are no TX buffers available and @wait is set, the function
+ * will block until one becomes available, or a timeout of 15 seconds
+ * elapses.
+ * On devices with several queues, the buffer is taken from the queue of
+ * @ept's priority, and the message is sent on that queue.
+ *
+ * Returns pointer to the payload buffer or NULL on failure.
+ */
+void *rpmsg_get_tx_payload_buffer(struct rpmsg_endpoint *ept,
+				  uint32_t *len, int wait);
+
+/**
+ * rpmsg_release_tx_buffer() - give back an unsent TX payload buffer
+ * @ept: the rpmsg endpoint
+ * @txbuf: payload buffer returned by rpmsg_get_tx_payload_buffer()
+ *
+ * The buffer is put back in the device TX buffers and can be returned
+ * again by rpmsg_get_tx_payload_buffer(). It must not be used by the
+ * caller anymore.
+ *
+ * Returns RPMSG_SUCCESS on success or negative error value on failure.
+ */
+int rpmsg_release_tx_buffer(struct rpmsg_endpoint *ept, void *txbuf);
+
+/**
+ * rpmsg_send_offchannel_nocopy() - send a TX payload buffer filled in place,
+ * specifying source and destination address.
+ * @ept: the rpmsg endpoint
+ * @src: source address
+ * @dst: destination address
+ * @data: payload buffer returned by rpmsg_get_tx_payload_buffer()
+ * @len: length of the payload, at most the length returned by
+ *       rpmsg_get_tx_payload_buffer()
+ *
+ * This function sends @data of length @len to the remote @dst address from
+ * the source @src address. @data is not copied: it is queued as it is on
+ * the virtqueue, and it must not be accessed by the caller anymore.
+ *
+ * Returns number of bytes it has sent or negative error value on failure,
+ * RPMSG_ERR_PARAM if @len does not fit in the buffer, which is then still
+ * owned by the caller.
+ */
+int rpmsg_send_offchannel_nocopy(struct rpmsg_endpoint *ept, uint32_t src,
+				 uint32_t dst, const void *data, int len);
+
+/**
+ * rpmsg_sendto_nocopy() - send a TX payload buffer filled in place,
+ * specify dst
+ * @ept: the rpmsg endpoint
+ * @data: payload buffer returned by rpmsg_get_tx_payload_buffer()
+ * @len: length of the payload
+ * @dst: destination address
+ *
+ * This function sends @data of length @len to the remote @dst address,
+ * using @ept's source address. See rpmsg_send_offchannel_nocopy().
+ *
+ * Returns number of bytes it has sent or negative error value on failure.
+ */
+static inline int rpmsg_sendto_nocopy(struct rpmsg_endpoint *ept,
+				      const void *data, int len, uint32_t dst)
+{
+	return rpmsg_send_offchannel_nocopy(ept, ept->addr, dst, data, len);
+}
+
+/**
+ * rpmsg_send_nocopy() - send a TX payload buffer filled in place
+ * @ept: the rpmsg endpoint
+ * @data: payload buffer returned by rpmsg_get_tx_payload_buffer()
+ * @len: length of the payload
+ *
+ * This function sends @data of length @len based on the @ept, using
+ * @ept's source and destination addresses.
+ * See rpmsg_send_offchannel_nocopy().
+ *
+ * Returns number of bytes it has sent or negative error value on failure.
+ */
+static inline int rpmsg_send_nocopy(struct rpmsg_endpoint *ept,
+				    const void *data, int len)
+{
+	return rpmsg_send_offchannel_nocopy(ept, ept->addr, ept->dest_addr,
+					    data, len);
+}
+
+/**
+ * rpmsg_send_nocopy_batch() - send several TX payload buffers filled in
+ * place with a single notification
+ * @ept: the rpmsg endpoint
+ * @msgs: array of messages to send, the data of each one being a payload
+ *        buffer returned by rpmsg_get_tx_payload_buffer()
+ * @num: number of messages in @msgs
+ *
+ * This function sends the messages of @msgs, in order, from @ept's source
+ * address to the destination address of each message. As with
+ * rpmsg_send_nocopy(), the payload buffers are not copied and must not be
+ * accessed by the caller anymore, but the remote processor is notified
+ * once for the whole batch. If the length of a message does not fit in its
+ * buffer, no message is sent and RPMSG_ERR_PARAM is returned.
+ *
+ * Returns the number of messages sent or negative error value on failure.
+ */
+int rpmsg_send_nocopy_batch(struct rpmsg_endpoint *ept,
+			    const struct rpmsg_msg *msgs, int num);
+
 /**
  * rpmsg_init_ept - initialize rpmsg endpoint
  *
@@ -335,6 +656,58 @@ int rpmsg_create_ept(struct rpmsg_endpoint *ept, struct rpmsg_device *rdev,
  */
 void rpmsg_destroy_ept(struct rpmsg_endpoint *ept);
 
+/**
+ * rpmsg_set_ept_priority - set the priority of the messages of an endpoint
+ *
+ * @ept: pointer to the rpmsg endpoint
+ * @priority: priority, 0 being the highest
+ *
+ * Devices with several queues send the messages of each priority on their
+ * own queue, so that they do not wait behind the messages of the lower
+ * priorities. A rpmsg virtio device sends them on the queue whose index is
+ * @priority, the priorities beyond the last queue sharing the last queue:
+ * the priority can therefore also assign an endpoint to a queue. When the
+ * TX buffers of a queue run out, the senders waiting for one are served by
+ * priority, then in their order of arrival. Endpoints are created with
+ * priority 0, which also covers the name service.
+ *
+ * Returns RPMSG_SUCCESS on success or negative error value on failure.
+ */
+int rpmsg_set_ept_priority(struct rpmsg_endpoint *ept, unsigned int priority);
+
+/**
+ * rpmsg_get_stats - get the counters of a rpmsg device
+ *
+ * @rdev: pointer to the rpmsg device
+ * @stats: pointer to the structure to fill
+ *
+ * The counters help sizing the rings and finding backpressure: the
+ * messages and bytes exchanged, the notifications, how often and how long
+ * the senders waited for TX buffers, the lock contention and the ring
+ * occupancy high-water marks. They are only collected when the library is
+ * built with RPMSG_STATS and VQUEUE_STATS (WITH_RPMSG_STATS option), and
+ * are all zero otherwise.
+ *
+ * Returns RPMSG_SUCCESS on success or negative error value on failure.
+ */
+int rpmsg_get_stats(struct rpmsg_device *rdev, struct rpmsg_stats *stats);
+
+/**
+ * rpmsg_get_tx_buffer_size - get the largest message an endpoint can send
+ *
+ * @ept: pointer to the rpmsg endpoint
+ *
+ * The payload of the TX buffers of the endpoint, less the header of the
+ * endpoints with flow control (see rpmsg_credit_enable()): this is the
+ * largest message rpmsg_send() accepts, and the size of the buffers of
+ * rpmsg_get_tx_payload_buffer(). It may differ from
+ * rpmsg_virtio_get_buffer_size(), which gives the size of the buffers of
+ * the device.
+ *
+ * Returns the size in bytes or negative error value on failure.
+ */
+int rpmsg_get_tx_buffer_size(struct rpmsg_endpoint *ept);
+
 /**
  * is_rpmsg_ept_ready - check if the rpmsg endpoint ready to send
  *
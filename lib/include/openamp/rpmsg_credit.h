@@ -0,0 +1,138 @@
+/*
+ * RPMsg credit based flow control
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _RPMSG_CREDIT_H_
+#define _RPMSG_CREDIT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <metal/atomic.h>
+#include <metal/mutex.h>
+#include <openamp/rpmsg.h>
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+/* Configurable parameters */
+/*
+ * Maximum number of messages of a batch queued before the remote
+ * processor is notified, for the endpoints with flow control.
+ */
+#ifndef RPMSG_CREDIT_BATCH_SIZE
+#define RPMSG_CREDIT_BATCH_SIZE	(16)
+#endif
+
+/* Largest window of an endpoint, the counters wrapping at 16 bits */
+#define RPMSG_CREDIT_MAX_WINDOW	(0x7FFF)
+
+/* The message carries data for the endpoint callback */
+#define RPMSG_CREDIT_F_DATA	(1 << 0)
+/* The sender has no credit limit from the receiver yet and asks for it */
+#define RPMSG_CREDIT_F_SYNC	(1 << 1)
+
+/**
+ * struct rpmsg_credit_hdr - header of the messages of a credited endpoint
+ * @limit: number of messages the sender of this header accepts from the
+ *         receiver since the flow control was enabled, modulo 2^16
+ * @flags: RPMSG_CREDIT_F_* flags
+ *
+ * Every message sent(/received) on an endpoint with flow control begins
+ * with this header. The credit limit is carried by the data messages, and
+ * by messages without data when there is no data to send it with.
+ */
+struct rpmsg_credit_hdr {
+	uint16_t limit;
+	uint16_t flags;
+};
+
+/**
+ * struct rpmsg_credit - flow control context of an rpmsg endpoint
+ * @cb: endpoint callback, called with the data messages
+ * @window: number of messages the endpoint accepts in flight
+ * @tx_count: number of messages sent, modulo 2^16
+ * @tx_limit: number of messages the remote accepts, modulo 2^16
+ * @rx_count: number of messages consumed, modulo 2^16
+ * @rx_limit: last limit sent to the remote, modulo 2^16
+ * @synced: a limit has been received from the remote
+ * @held: the message given to the endpoint callback has been held
+ * @stalls: number of sends which found no credit
+ * @lock: protects the counters
+ * @event: counter of the limit raises of the remote, which wake up the
+ *         senders waiting for credits
+ */
+struct rpmsg_credit {
+	rpmsg_ept_cb cb;
+	uint16_t window;
+	uint16_t tx_count;
+	uint16_t tx_limit;
+	uint16_t rx_count;
+	uint16_t rx_limit;
+	bool synced;
+	bool held;
+	unsigned long stalls;
+	metal_mutex_t lock;
+	atomic_uint event;
+};
+
+/**
+ * rpmsg_credit_enable() - enable the flow control of an endpoint
+ * @ept: the rpmsg endpoint, created with rpmsg_create_ept()
+ * @credit: flow control context, owned by the caller until the endpoint
+ *          is destroyed
+ * @window: number of messages the endpoint accepts in flight, from 1 to
+ *          RPMSG_CREDIT_MAX_WINDOW
+ *
+ * Once enabled, the endpoint may only have as many messages in flight as
+ * the remote endpoint grants it credits: a message consumes a credit, which
+ * the remote gives back once its callback returns, or once the message is
+ * released if it was held. Out of credits, rpmsg_send() and the other
+ * blocking functions wait for the remote to give some back, with their
+ * usual timeout, and the non-blocking ones fail with RPMSG_ERR_NO_BUFF.
+ * A flooding endpoint can thus not use up the shared buffers: with windows
+ * summing up to less than the number of buffers, every endpoint of the
+ * device keeps getting buffers.
+ *
+ * The endpoints exchange their limits with the first message sent, which
+ * asks the remote for its limit: a non-blocking send fails until the limit
+ * is received. The credits are returned by the RX path: a sender waiting
+ * for credits in the context receiving the messages, e.g. an endpoint
+ * callback, takes them from the messages it cannot receive meanwhile, if
+ * the device can look at them (not with RPMSG_VIRTIO_SPSC).
+ * The remote endpoint must enable the flow control too, before messages
+ * are sent to it. The credits of the endpoint are shared by all of its
+ * destinations, so the flow control is meant for endpoints bound to a
+ * single remote endpoint. The endpoint cannot fragment its messages (see
+ * rpmsg_frag_enable()).
+ *
+ * Returns RPMSG_SUCCESS on success or negative error value on failure.
+ */
+int rpmsg_credit_enable(struct rpmsg_endpoint *ept,
+			struct rpmsg_credit *credit, uint32_t window);
+
+/**
+ * rpmsg_credit_disable() - disable the flow control of an endpoint
+ * @ept: the rpmsg endpoint
+ *
+ * The endpoint callback given at creation is restored. This is done by
+ * rpmsg_destroy_ept().
+ */
+void rpmsg_credit_disable(struct rpmsg_endpoint *ept);
+
+/**
+ * rpmsg_credit_get_tx_credits() - get the credits left to an endpoint
+ * @ept: the rpmsg endpoint, with flow control enabled
+ *
+ * Returns the number of messages the endpoint can send before running out
+ * of credits, or negative error value on failure.
+ */
+int rpmsg_credit_get_tx_credits(struct rpmsg_endpoint *ept);
+
+#if defined __cplusplus
+}
+#endif
+
+#endif				/* _RPMSG_CREDIT_H_ */
@@ -0,0 +1,125 @@
+/*
+ * RPMsg large message fragmentation
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _RPMSG_FRAG_H_
+#define _RPMSG_FRAG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <metal/mutex.h>
+#include <openamp/rpmsg.h>
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+/* Configurable parameters */
+/*
+ * Maximum number of fragments queued before the remote processor is
+ * notified. A message longer than that is sent in several batches.
+ */
+#ifndef RPMSG_FRAG_BATCH_SIZE
+#define RPMSG_FRAG_BATCH_SIZE	(16)
+#endif
+
+/**
+ * struct rpmsg_frag_hdr - header of the fragments of a message
+ * @msg_len: length of the whole message
+ * @offset: offset of the fragment data in the message
+ *
+ * Every message sent(/received) on a fragmenting endpoint is split in one
+ * or more fragments, each beginning with this header followed by the
+ * fragment data. The fragments of a message are sent in order.
+ */
+struct rpmsg_frag_hdr {
+	uint32_t msg_len;
+	uint32_t offset;
+};
+
+/**
+ * struct rpmsg_frag - fragmentation context of an rpmsg endpoint
+ * @cb: endpoint callback, called with the reassembled messages
+ * @buf: reassembly buffer, NULL to allocate one per message
+ * @size: size of @buf, or maximum size of the allocated buffers
+ * @msg: buffer of the message being reassembled
+ * @msg_len: length of the message being reassembled, 0 if none
+ * @offset: length of the message received so far
+ * @src: source address of the message being reassembled
+ * @dropped: number of incomplete or oversized messages dropped
+ * @tx_lock: keeps the fragments of concurrent messages from interleaving
+ */
+struct rpmsg_frag {
+	rpmsg_ept_cb cb;
+	void *buf;
+	size_t size;
+	unsigned char *msg;
+	uint32_t msg_len;
+	uint32_t offset;
+	uint32_t src;
+	unsigned long dropped;
+	metal_mutex_t tx_lock;
+};
+
+/**
+ * rpmsg_frag_enable() - make an endpoint fragment its messages
+ * @ept: the rpmsg endpoint, created with rpmsg_create_ept()
+ * @frag: fragmentation context, owned by the caller until the endpoint is
+ *        destroyed
+ * @buf: reassembly buffer, or NULL to allocate one per received message
+ * @size: size of @buf, or maximum size of a received message when @buf
+ *        is NULL
+ *
+ * Once enabled, the messages sent with the rpmsg_send*() functions are
+ * split in as many TX buffers as needed, which are queued in batches with
+ * a single notification of the remote processor, so a message is no more
+ * limited to the size of one buffer. Received fragments are copied into
+ * the reassembly buffer, and the endpoint callback is called with the
+ * whole message. A message which fits in one fragment is given to the
+ * callback in place, without being copied.
+ * The remote endpoint must use the same fragmentation scheme, and the RX
+ * buffers of the endpoint can no more be held with rpmsg_hold_rx_buffer().
+ * The fragments of a device have to be received by one thread at a time,
+ * and the endpoint callback must be called in order. The endpoint cannot
+ * have flow control (see rpmsg_credit_enable()).
+ *
+ * Returns RPMSG_SUCCESS on success or negative error value on failure.
+ */
+int rpmsg_frag_enable(struct rpmsg_endpoint *ept, struct rpmsg_frag *frag,
+		      void *buf, size_t size);
+
+/**
+ * rpmsg_frag_disable() - stop fragmenting the messages of an endpoint
+ * @ept: the rpmsg endpoint
+ *
+ * The endpoint callback given at creation is restored, and a message
+ * being reassembled is dropped. This is done by rpmsg_destroy_ept().
+ */
+void rpmsg_frag_disable(struct rpmsg_endpoint *ept);
+
+/**
+ * rpmsg_frag_send() - send a message in fragments
+ * @ept: the rpmsg endpoint, with fragmentation enabled
+ * @src: source address
+ * @dst: destination address
+ * @data: payload of the message
+ * @len: length of the payload
+ * @wait: boolean, wait or not for the first buffer to become available
+ *
+ * This function is called by rpmsg_send_offchannel_raw() for fragmenting
+ * endpoints. When @wait is not set, it fails only if no buffer is
+ * available for the first fragment: once started, a message is completed
+ * waiting for buffers, with the timeout of rpmsg_send().
+ *
+ * Returns number of bytes it has sent or negative error value on failure.
+ */
+int rpmsg_frag_send(struct rpmsg_endpoint *ept, uint32_t src, uint32_t dst,
+		    const void *data, int len, int wait);
+
+#if defined __cplusplus
+}
+#endif
+
+#endif				/* _RPMSG_FRAG_H_ */
@@ -0,0 +1,178 @@
+/*
+ * RPMsg binary trace ring
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _RPMSG_TRACE_H_
+#define _RPMSG_TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <metal/atomic.h>
+#include <openamp/rpmsg.h>
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+/* "RPTR" in memory, identifies a trace ring */
+#define RPMSG_TRACE_MAGIC	0x52545052U
+#define RPMSG_TRACE_VERSION	1
+
+/**
+ * enum rpmsg_trace_event - transport events recorded in a trace ring
+ * @RPMSG_TRACE_SEND: a message is being copied out, before waiting for a
+ *                    TX buffer; args: source, destination, length
+ * @RPMSG_TRACE_ENQUEUE: a message is placed on the TX virtqueue; args:
+ *                       source, destination, length, buffer index (0 on
+ *                       the master)
+ * @RPMSG_TRACE_KICK: a virtqueue is kicked, the remote being notified if
+ *                    it asked to be; args: 0 for the TX virtqueue, 1 for
+ *                    the RX virtqueue, number of buffers queued
+ * @RPMSG_TRACE_NOTIFY: a notification is received; args: 0 for the TX
+ *                      virtqueue, 1 for the RX virtqueue
+ * @RPMSG_TRACE_CB_ENTER: an endpoint callback is called; args: source,
+ *                        destination, length, buffer index
+ * @RPMSG_TRACE_CB_EXIT: an endpoint callback returned; args: source,
+ *                       destination, length, buffer index
+ * @RPMSG_TRACE_BUF_RETURN: RX buffers are given back to the remote; args:
+ *                          number of buffers, 1 if released after being
+ *                          held
+ * @RPMSG_TRACE_NO_BUFF: no TX buffer is available in time; args: source
+ */
+enum rpmsg_trace_event {
+	RPMSG_TRACE_SEND = 1,
+	RPMSG_TRACE_ENQUEUE,
+	RPMSG_TRACE_KICK,
+	RPMSG_TRACE_NOTIFY,
+	RPMSG_TRACE_CB_ENTER,
+	RPMSG_TRACE_CB_EXIT,
+	RPMSG_TRACE_BUF_RETURN,
+	RPMSG_TRACE_NO_BUFF,
+};
+
+/**
+ * struct rpmsg_trace_entry - event recorded in a trace ring
+ * @timestamp: time of the event, in metal_get_timestamp() units
+ * @seq: sequence number of the entry, written last
+ * @event: RPMSG_TRACE_* event
+ * @queue: index of the rpmsg virtio queue
+ * @args: arguments of the event, see enum rpmsg_trace_event
+ */
+struct rpmsg_trace_entry {
+	uint64_t timestamp;
+	atomic_uint seq;
+	uint16_t event;
+	uint16_t queue;
+	uint32_t args[4];
+};
+
+/**
+ * struct rpmsg_trace - trace ring, placed at the beginning of its memory
+ * @magic: RPMSG_TRACE_MAGIC
+ * @version: RPMSG_TRACE_VERSION
+ * @entry_size: size of an entry, in bytes
+ * @num_entries: number of entries, a power of two
+ * @reserved: reserved, zero
+ * @head: sequence number of the next entry to write
+ * @entries: entries, the entry of sequence number n at n % @num_entries
+ *
+ * The ring is written without lock, by any number of writers: a writer
+ * reserves an entry by incrementing @head, and writes its sequence number
+ * once the entry is complete. The oldest entries are overwritten. An event
+ * whose writer is delayed for a whole lap of the ring is dropped. The
+ * ring is meant to be placed in the memory of a trace resource (see
+ * struct fw_rsc_trace), or in any memory the decoding side can read, not
+ * cached or kept coherent.
+ */
+struct rpmsg_trace {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t entry_size;
+	uint32_t num_entries;
+	uint32_t reserved[4];
+	atomic_uint head;
+	struct rpmsg_trace_entry entries[0];
+};
+
+/**
+ * rpmsg_trace_init() - create a trace ring
+ * @mem: memory of the ring, 8 bytes aligned
+ * @size: size of the memory, in bytes
+ *
+ * The ring takes as many entries as fit in @size, rounded down to a power
+ * of two, and at least two.
+ *
+ * Returns the empty trace ring, or NULL if @size is too small.
+ */
+struct rpmsg_trace *rpmsg_trace_init(void *mem, size_t size);
+
+/**
+ * rpmsg_trace_open() - open a trace ring created by the other side
+ * @mem: memory of the ring, such as the trace resource buffer
+ * @size: size of the memory, in bytes
+ *
+ * Returns the trace ring, or NULL if @mem holds no valid trace ring.
+ */
+struct rpmsg_trace *rpmsg_trace_open(void *mem, size_t size);
+
+/**
+ * rpmsg_trace_record() - record an event
+ * @trace: the trace ring
+ * @event: RPMSG_TRACE_* event
+ * @queue: index of the rpmsg virtio queue
+ * @arg0: first argument of the event
+ * @arg1: second argument of the event
+ * @arg2: third argument of the event
+ * @arg3: fourth argument of the event
+ *
+ * The events of the rpmsg devices attached to the ring with
+ * rpmsg_trace_attach() are recorded by the library.
+ */
+void rpmsg_trace_record(struct rpmsg_trace *trace, uint16_t event,
+			uint16_t queue, uint32_t arg0, uint32_t arg1,
+			uint32_t arg2, uint32_t arg3);
+
+/**
+ * rpmsg_trace_read() - read the next entry of a trace ring
+ * @trace: the trace ring
+ * @seq: sequence number of the entry to read, updated to the next one
+ * @entry: entry to fill
+ *
+ * The oldest entry still in the ring is read if the entry of sequence
+ * number @seq has been overwritten: a sequence number of @entry beyond
+ * @seq tells the number of entries lost. Starting from 0, the reader gets
+ * the whole ring history.
+ *
+ * Once the writers are stopped, an entry before @head which is not written
+ * has been dropped, and the reader can go on with *@seq + 1.
+ *
+ * Returns 1 if @entry is filled, 0 if the entry is not written yet.
+ */
+int rpmsg_trace_read(struct rpmsg_trace *trace, uint32_t *seq,
+		     struct rpmsg_trace_entry *entry);
+
+/**
+ * rpmsg_trace_attach() - record the events of a rpmsg device
+ * @rdev: the rpmsg device
+ * @trace: the trace ring, NULL to stop recording
+ *
+ * Recording costs a few stores per event, and a test per event without a
+ * ring attached. Several devices may share a ring.
+ */
+void rpmsg_trace_attach(struct rpmsg_device *rdev, struct rpmsg_trace *trace);
+
+/**
+ * rpmsg_trace_event_name() - get the name of an event
+ * @event: RPMSG_TRACE_* event
+ *
+ * Returns the name of the event, "unknown" if it is not an event.
+ */
+const char *rpmsg_trace_event_name(uint16_t event);
+
+#if defined __cplusplus
+}
+#endif
+
+#endif				/* _RPMSG_TRACE_H_ */
@@ -12,6 +12,7 @@
 #ifndef _RPMSG_VIRTIO_H_
 #define _RPMSG_VIRTIO_H_
 
+#include <metal/atomic.h>
 #include <metal/io.h>
 #include <metal/mutex.h>
 #include <openamp/rpmsg.h>
@@ -26,37 +27,284 @@ extern "C" {
 #define RPMSG_BUFFER_SIZE	(512)
 #endif
 
+/*
+ * RPMSG_VIRTIO_SPSC removes the virtqueue locks: each vring must then have
+ * a single producer and a single consumer. All the messages of a queue
+ * must be sent from a single context, the endpoint callbacks included if
+ * they send, and the RX buffers must be processed from a single context.
+ * The RX buffers cannot be held: rpmsg_hold_rx_buffer() has no effect and
+ * the buffers are given back when the endpoint callback returns. With
+ * RPMSG_DEBUG, a concurrent access to a virtqueue is fatal.
+ *
+ * RPMSG_VIRTIO_TX_STAGING is for the queues with concurrent senders: the
+ * messages are copied out of the TX lock, and a sender never waits for the
+ * lock to place its buffers on the TX vring (see struct
+ * rpmsg_virtio_queue). It costs some atomic operations per message to a
+ * single sender.
+ */
+#if defined(RPMSG_VIRTIO_SPSC) && defined(RPMSG_VIRTIO_TX_STAGING)
+#error "RPMSG_VIRTIO_TX_STAGING is for several senders, not RPMSG_VIRTIO_SPSC"
+#endif
+
+/*
+ * Maximum number of RX buffers drained from the virtqueue at once. The
+ * buffers of a batch are returned with a single ring update. Set it to 1
+ * to process the buffers one by one.
+ */
+#ifndef RPMSG_RX_BATCH_SIZE
+#define RPMSG_RX_BATCH_SIZE	(8)
+#endif
+
+/*
+ * Maximum number of TX buffers taken at once when sending several messages.
+ * The buffers of a batch are taken under a single hold of the TX lock, and
+ * the remote is kicked once per batch.
+ */
+#ifndef RPMSG_TX_BATCH_SIZE
+#define RPMSG_TX_BATCH_SIZE	(16)
+#endif
+
+/*
+ * Number of buffer size classes of the shared memory pool. The classes are
+ * the multiples of RPMSG_SHM_POOL_MIN_BUF_SIZE up to 4 times it, then four
+ * classes per power of two, so that a buffer wastes less than a quarter of
+ * its size. The default covers buffers up to 128 KB, above the largest
+ * rpmsg buffer since the message length is 16-bit.
+ */
+#ifndef RPMSG_SHM_POOL_NUM_CLASSES
+#define RPMSG_SHM_POOL_NUM_CLASSES	(40)
+#endif
+
+/*
+ * Number of bits of the buffer index in the free list heads of the shared
+ * memory pool, the remaining bits of the 32-bit heads holding the
+ * modification tag. The index counts RPMSG_SHM_POOL_MIN_BUF_SIZE units, so
+ * the default allows pools up to 64 MB: the memory beyond is not used.
+ */
+#ifndef RPMSG_SHM_POOL_INDEX_BITS
+#define RPMSG_SHM_POOL_INDEX_BITS	(20)
+#endif
+
+/*
+ * Smallest buffer of the shared memory pool, and alignment of the buffers:
+ * a cache line, for the devices with cache aligned buffers.
+ */
+#ifndef RPMSG_SHM_POOL_MIN_BUF_SIZE
+#define RPMSG_SHM_POOL_MIN_BUF_SIZE	VRING_CACHE_LINE_SIZE
+#endif
+
+/*
+ * Maximum number of queues, i.e. pairs of vrings, of a rpmsg virtio device.
+ * The queues beyond the vrings declared by the vdev are not used.
+ */
+#ifndef RPMSG_VIRTIO_MAX_QUEUES
+#define RPMSG_VIRTIO_MAX_QUEUES	(4)
+#endif
+
 /* The feature bitmap for virtio rpmsg */
 #define VIRTIO_RPMSG_F_NS	0 /* RP supports name service notifications */
+#define VIRTIO_RPMSG_F_MQ	1 /* RP uses all the vring pairs of the vdev */
+#define VIRTIO_RPMSG_F_CACHE_ALIGNED	2 /* RP lays out on cache lines */
+
+/* The virtio features supported by the rpmsg virtio driver */
+#define RPMSG_VIRTIO_FEATURES	((1 << VIRTIO_RPMSG_F_NS) | \
+				 (1 << VIRTIO_RPMSG_F_MQ) | \
+				 (1 << VIRTIO_RPMSG_F_CACHE_ALIGNED) | \
+				 VIRTIO_RING_F_INDIRECT_DESC | \
+				 VIRTIO_RING_F_EVENT_IDX | \
+				 VIRTIO_F_RING_PACKED)
+
+/**
+ * struct rpmsg_virtio_shm_pool_hdr - state of a shared memory pool
+ * @free_list: free buffers of each size class, the list links are stored
+ *             in the free buffers. The head holds the index + 1 of the
+ *             first buffer in its RPMSG_SHM_POOL_INDEX_BITS low bits and a
+ *             modification tag in the high bits.
+ * @avail: memory size not carved into buffers yet
+ * @used: memory size of the allocated buffers
+ * @peak: maximum of @used
+ * @allocs: number of successful allocations
+ * @frees: number of freed buffers
+ * @failures: number of failed allocations
+ *
+ * The header is placed at the beginning of the pool memory. The fields are
+ * 32-bit, to be lock-free on the 32-bit processors.
+ */
+struct rpmsg_virtio_shm_pool_hdr {
+	atomic_uint free_list[RPMSG_SHM_POOL_NUM_CLASSES];
+	atomic_uint avail;
+	atomic_uint used;
+	atomic_uint peak;
+	atomic_uint allocs;
+	atomic_uint frees;
+	atomic_uint failures;
+};
 
 /**
  * struct rpmsg_virtio_shm_pool - shared memory pool used for rpmsg buffers
- * @base: base address of the memory pool
- * @avail: available memory size
- * @size: total pool size
+ * @hdr: pool state, at the beginning of the pool memory
+ * @base: base address of the buffers, following the header
+ * @size: total size of the buffers
+ *
+ * The pool can be shared by several rpmsg virtio devices. Buffers are
+ * rounded up to a size class and freed buffers are recycled for the same
+ * class. The pool is lock-free, and its state lives in the shared memory
+ * with the buffers.
  */
 struct rpmsg_virtio_shm_pool {
+	struct rpmsg_virtio_shm_pool_hdr *hdr;
 	void *base;
-	size_t avail;
 	size_t size;
 };
 
+/**
+ * struct rpmsg_virtio_shm_pool_stats - shared memory pool occupancy
+ * @size: total size of the buffers
+ * @avail: memory size not carved into buffers yet
+ * @used: memory size of the allocated buffers
+ * @peak: maximum of @used
+ * @allocs: number of successful allocations
+ * @frees: number of freed buffers
+ * @failures: number of failed allocations
+ */
+struct rpmsg_virtio_shm_pool_stats {
+	size_t size;
+	size_t avail;
+	size_t used;
+	size_t peak;
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long failures;
+};
+
+/**
+ * struct rpmsg_virtio_rx_poll_stats - hybrid RX mode counters
+ * @to_poll: number of switches from interrupt mode to poll mode
+ * @to_irq: number of switches from poll mode back to interrupt mode
+ * @polls: number of polls of the RX virtqueue in poll mode
+ * @empty_polls: number of polls which found no message
+ * @msgs: number of messages received by the polls
+ */
+struct rpmsg_virtio_rx_poll_stats {
+	unsigned long to_poll;
+	unsigned long to_irq;
+	unsigned long polls;
+	unsigned long empty_polls;
+	unsigned long msgs;
+};
+
+/**
+ * struct rpmsg_virtio_config - configuration of the rpmsg virtio buffers
+ * @h2r_buf_size: size of the buffers sent from the master to the remote
+ * @r2h_buf_size: size of the buffers sent from the remote to the master
+ * @h2r_buf_num: number of master to remote buffers, 0 to use one buffer
+ *               per vring descriptor
+ * @r2h_buf_num: number of remote to master buffers, 0 to use one buffer
+ *               per vring descriptor
+ *
+ * The buffers are allocated by the master, so the configuration is only
+ * used on the master side. The remote gets the buffer sizes from the
+ * vring descriptors.
+ * With VIRTIO_RPMSG_F_CACHE_ALIGNED, each buffer is placed in its allocation so
+ * that the payload starts on a cache line: the sizes include this offset,
+ * which is VRING_CACHE_LINE_SIZE - sizeof(struct rpmsg_hdr), and the
+ * shared memory pool must be cache line aligned.
+ */
+struct rpmsg_virtio_config {
+	uint32_t h2r_buf_size;
+	uint32_t r2h_buf_size;
+	uint32_t h2r_buf_num;
+	uint32_t r2h_buf_num;
+};
+
+struct rpmsg_virtio_device;
+struct rpmsg_virtio_tx_slot;
+
+/**
+ * struct rpmsg_virtio_queue - pair of vrings of a rpmsg virtio device
+ * @rvdev: pointer to the rpmsg virtio device
+ * @rvq: pointer to receive virtqueue
+ * @svq: pointer to send virtqueue
+ * @tx_buf_alloc: number of TX buffers allocated from the pool
+ * @tx_lock: lock of the TX virtqueue and buffers
+ * @rx_lock: lock of the RX virtqueue
+ * @reclaimer: list of TX buffers released without being sent
+ * @tx_waiters: senders waiting for a TX buffer, by priority then in their
+ *              order of arrival
+ * @tx_event: counter of the wake-ups of the senders waiting for TX buffers,
+ *            bumped when a waiter is served, and with RPMSG_TX_WAIT_EVENT
+ *            when the remote notifies that it gave back TX buffers
+ * @tx_slots: TX buffers staged by the senders, indexed by their claim
+ *            number modulo the slot count, with RPMSG_VIRTIO_TX_STAGING
+ * @tx_slot_mask: slot count minus one, the slot count being the TX vring
+ *                size rounded up to a power of two
+ * @tx_claimed: number of slots claimed by the senders
+ * @tx_published: number of staged buffers placed on the TX vring, updated
+ *                with @tx_lock held
+ * @tx_pending: set when staged buffers are to be placed on the TX vring by
+ *              the holder of @tx_lock
+ * @rx_poll_budget: number of consecutive empty polls after which the RX
+ *                  notifications are enabled again, 0 if the hybrid RX mode
+ *                  is disabled
+ * @rx_poll_idle: number of consecutive empty polls so far
+ * @rx_polling: non-zero while the RX virtqueue is in poll mode
+ * @rx_poll_stats: hybrid RX mode counters
+ * @stats: message counters, the TX ones updated with @tx_lock held and the
+ *         RX ones with @rx_lock held
+ *
+ * The queue i uses the vrings 2 * i and 2 * i + 1 of the vdev, whose
+ * notify IDs are its own: each queue can be serviced on its own core.
+ *
+ * With RPMSG_VIRTIO_TX_STAGING, the senders of a queue take their TX
+ * buffers with @tx_lock held, fill them without it, then claim a slot with
+ * an atomic increment of @tx_claimed to stage them. The holder of @tx_lock
+ * places the staged buffers on the TX vring in claim order: a sender
+ * finding the lock taken leaves its buffers to the holder instead of
+ * waiting for the lock.
+ */
+struct rpmsg_virtio_queue {
+	struct rpmsg_virtio_device *rvdev;
+	struct virtqueue *rvq;
+	struct virtqueue *svq;
+	uint32_t tx_buf_alloc;
+	metal_mutex_t tx_lock;
+	metal_mutex_t rx_lock;
+	struct metal_list reclaimer;
+	struct metal_list tx_waiters;
+	atomic_uint tx_event;
+	struct rpmsg_virtio_tx_slot *tx_slots;
+	unsigned int tx_slot_mask;
+	atomic_uint tx_claimed;
+	unsigned int tx_published;
+	atomic_int tx_pending;
+	unsigned int rx_poll_budget;
+	unsigned int rx_poll_idle;
+	atomic_int rx_polling;
+	struct rpmsg_virtio_rx_poll_stats rx_poll_stats;
+	struct rpmsg_stats stats;
+};
+
 /**
  * struct rpmsg_virtio_device - representation of a rpmsg device based on virtio
  * @rdev: rpmsg device, first property in the struct
  * @vdev: pointer to the virtio device
- * @rvq: pointer to receive virtqueue
- * @svq: pointer to send virtqueue
  * @shbuf_io: pointer to the shared buffer I/O region
  * @shpool: pointer to the shared buffers pool
+ * @config: buffers configuration, applying to each queue
+ * @buf_offset: offset of the buffers in their pool allocations
+ * @num_queues: number of queues, more than one with VIRTIO_RPMSG_F_MQ
+ * @queues: queues of the device, the messages of the endpoints of priority
+ *          i being sent on the queue i (see rpmsg_set_ept_priority())
  */
 struct rpmsg_virtio_device {
 	struct rpmsg_device rdev;
 	struct virtio_device *vdev;
-	struct virtqueue *rvq;
-	struct virtqueue *svq;
 	struct metal_io_region *shbuf_io;
 	struct rpmsg_virtio_shm_pool *shpool;
+	struct rpmsg_virtio_config config;
+	uint32_t buf_offset;
+	unsigned int num_queues;
+	struct rpmsg_virtio_queue queues[RPMSG_VIRTIO_MAX_QUEUES];
 };
 
 #define RPMSG_REMOTE	VIRTIO_DEV_SLAVE
@@ -82,7 +330,32 @@ static inline uint8_t rpmsg_virtio_get_status(struct rpmsg_virtio_device *rvdev)
 static inline uint32_t
 rpmsg_virtio_get_features(struct rpmsg_virtio_device *rvdev)
 {
-	return rvdev->vdev->func->get_features(rvdev->vdev);
+	return rvdev->vdev->func->get_features(rvdev->vdev) &
+	       RPMSG_VIRTIO_FEATURES;
+}
+
+/**
+ * rpmsg_virtio_get_vring_align - get the alignment of the rpmsg vrings
+ * @features: features of the rpmsg virtio device
+ * @align: vring alignment from the vring description
+ *
+ * With VIRTIO_RPMSG_F_CACHE_ALIGNED, the vrings and the buffers are laid
+ * out on cache lines of VRING_CACHE_LINE_SIZE bytes: the alignment is
+ * raised to the cache line size, so that the used ring (or the device
+ * event suppression structure of a packed ring) does not share a cache
+ * line with the parts written by the driver. The vring itself must be
+ * cache line aligned, and the memory reserved for it must be vring_size()
+ * with the returned alignment.
+ *
+ * Returns the vring alignment.
+ */
+static inline unsigned long rpmsg_virtio_get_vring_align(uint32_t features,
+							 unsigned long align)
+{
+	if ((features & (1 << VIRTIO_RPMSG_F_CACHE_ALIGNED)) &&
+	    align < VRING_CACHE_LINE_SIZE)
+		return VRING_CACHE_LINE_SIZE;
+	return align;
 }
 
 static inline void
@@ -99,6 +372,19 @@ rpmsg_virtio_write_config(struct rpmsg_virtio_device *rvdev,
 	rvdev->vdev->func->write_config(rvdev->vdev, offset, dst, length);
 }
 
+/**
+ * rpmsg_virtio_get_num_queues - get the number of queues of the device
+ *
+ * @param rvdev - pointer to the rpmsg virtio device
+ *
+ * @return - number of queues
+ */
+static inline unsigned int
+rpmsg_virtio_get_num_queues(struct rpmsg_virtio_device *rvdev)
+{
+	return rvdev->num_queues;
+}
+
 static inline int
 rpmsg_virtio_create_virtqueues(struct rpmsg_virtio_device *rvdev,
 			       int flags, unsigned int nvqs,
@@ -112,12 +398,99 @@ rpmsg_virtio_create_virtqueues(struct rpmsg_virtio_device *rvdev,
 /**
  * rpmsg_virtio_get_buffer_size - get rpmsg virtio buffer size
  *
+ * The endpoints with flow control have less room for their messages, see
+ * rpmsg_get_tx_buffer_size().
+ *
  * @rdev - pointer to the rpmsg device
  *
  * @return - next available buffer size for text, negative value for failure
  */
 int rpmsg_virtio_get_buffer_size(struct rpmsg_device *rdev);
 
+/**
+ * rpmsg_virtio_get_rx_buffer_size - get rpmsg virtio RX buffer size
+ *
+ * @rdev - pointer to the rpmsg device
+ *
+ * @return - next RX buffer payload size, negative value for failure
+ */
+int rpmsg_virtio_get_rx_buffer_size(struct rpmsg_device *rdev);
+
+/**
+ * rpmsg_virtio_set_rx_poll_budget - set the hybrid RX mode
+ *
+ * In the hybrid RX mode, the RX notification switches the RX virtqueue to
+ * poll mode: the notifications are disabled, and the messages are received
+ * by rpmsg_virtio_rx_poll() calls. Once @budget consecutive polls found no
+ * message, the notifications are enabled again.
+ *
+ * A zero @budget disables the hybrid RX mode. If the RX virtqueue is in
+ * poll mode, it goes back to interrupt mode at the next empty poll.
+ *
+ * @param rvdev  - pointer to the rpmsg virtio device
+ * @param budget - number of empty polls before going back to interrupt mode
+ */
+void rpmsg_virtio_set_rx_poll_budget(struct rpmsg_virtio_device *rvdev,
+				     unsigned int budget);
+
+/**
+ * rpmsg_virtio_rx_polling - check if a RX virtqueue is in poll mode
+ *
+ * While in poll mode, no RX notification comes, rpmsg_virtio_rx_poll() has
+ * to be called to receive the messages.
+ *
+ * @param rvdev - pointer to the rpmsg virtio device
+ *
+ * @return - true if the RX virtqueue of a queue is in poll mode
+ */
+static inline bool rpmsg_virtio_rx_polling(struct rpmsg_virtio_device *rvdev)
+{
+	unsigned int i;
+
+	for (i = 0; i < rvdev->num_queues; i++) {
+		if (atomic_load(&rvdev->queues[i].rx_polling))
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * rpmsg_virtio_rx_poll_queue - poll the RX virtqueue of a queue
+ *
+ * Receives the pending messages when the RX virtqueue of the queue is in
+ * poll mode, and switches it back to interrupt mode once idle.
+ *
+ * @param rvdev - pointer to the rpmsg virtio device
+ * @param qid   - index of the queue
+ *
+ * @return - number of messages received
+ */
+int rpmsg_virtio_rx_poll_queue(struct rpmsg_virtio_device *rvdev,
+			       unsigned int qid);
+
+/**
+ * rpmsg_virtio_rx_poll - poll the RX virtqueues
+ *
+ * Calls rpmsg_virtio_rx_poll_queue() for each queue.
+ *
+ * @param rvdev - pointer to the rpmsg virtio device
+ *
+ * @return - number of messages received
+ */
+int rpmsg_virtio_rx_poll(struct rpmsg_virtio_device *rvdev);
+
+/**
+ * rpmsg_virtio_get_rx_poll_stats - get the hybrid RX mode counters
+ *
+ * The counters are summed over the queues.
+ *
+ * @param rvdev - pointer to the rpmsg virtio device
+ * @param stats - pointer to the structure to fill
+ */
+void rpmsg_virtio_get_rx_poll_stats(struct rpmsg_virtio_device *rvdev,
+				    struct rpmsg_virtio_rx_poll_stats *stats);
+
 /**
  * rpmsg_init_vdev - initialize rpmsg virtio device
  * Master side:
@@ -129,6 +502,10 @@ int rpmsg_virtio_get_buffer_size(struct rpmsg_device *rdev);
  * Slave side:
  * This API will not return until the driver ready is set by the master side.
  *
+ * With VIRTIO_RPMSG_F_MQ, a queue is created for each pair of vrings of the
+ * vdev, up to RPMSG_VIRTIO_MAX_QUEUES. Otherwise, only the first two vrings
+ * are used.
+ *
  * @param rvdev  - pointer to the rpmsg virtio device
  * @param vdev   - pointer to the virtio device
  * @param ns_bind_cb  - callback handler for name service announcement without
@@ -145,6 +522,34 @@ int rpmsg_init_vdev(struct rpmsg_virtio_device *rvdev,
 		    struct metal_io_region *shm_io,
 		    struct rpmsg_virtio_shm_pool *shpool);
 
+/**
+ * rpmsg_init_vdev_with_config - initialize rpmsg virtio device with a
+ * buffers configuration
+ *
+ * Same as rpmsg_init_vdev, except that the size and the number of the
+ * shared buffers are taken from @config instead of RPMSG_BUFFER_SIZE and
+ * the vrings size. The number of buffers is capped to the vring size.
+ * With VIRTIO_RPMSG_F_MQ, each queue gets this configuration.
+ *
+ * @param rvdev  - pointer to the rpmsg virtio device
+ * @param vdev   - pointer to the virtio device
+ * @param ns_bind_cb  - callback handler for name service announcement without
+ *                      local endpoints waiting to bind.
+ * @param shm_io - pointer to the share memory I/O region.
+ * @param shpool - pointer to shared memory pool. rpmsg_virtio_init_shm_pool has
+ *                 to be called first to fill this structure.
+ * @param config - pointer to the buffers configuration, only used on the
+ *                 master side.
+ *
+ * @return - status of function execution
+ */
+int rpmsg_init_vdev_with_config(struct rpmsg_virtio_device *rvdev,
+				struct virtio_device *vdev,
+				rpmsg_ns_bind_cb ns_bind_cb,
+				struct metal_io_region *shm_io,
+				struct rpmsg_virtio_shm_pool *shpool,
+				const struct rpmsg_virtio_config *config);
+
 /**
  * rpmsg_deinit_vdev - deinitialize rpmsg virtio device
  *
@@ -158,7 +563,9 @@ void rpmsg_deinit_vdev(struct rpmsg_virtio_device *rvdev);
  * RPMsg virtio has default shared buffers pool implementation.
  * The memory assigned to this pool will be dedicated to the RPMsg
  * virtio. This function has to be called before calling rpmsg_init_vdev,
- * to initialize the rpmsg_virtio_shm_pool structure.
+ * to initialize the rpmsg_virtio_shm_pool structure. The pool state is
+ * placed at the beginning of the shared buffers, so @size must exceed
+ * the size of struct rpmsg_virtio_shm_pool_hdr.
  *
  * @param shpool - pointer to the shared buffers pool structure
  * @param shbuf - pointer to the beginning of shared buffers
@@ -195,6 +602,30 @@ metal_weak void *
 rpmsg_virtio_shm_pool_get_buffer(struct rpmsg_virtio_shm_pool *shpool,
 				 size_t size);
 
+/**
+ * rpmsg_virtio_shm_pool_put_buffer - give back a buffer to the shared
+ * memory pool
+ *
+ * If you implement your own rpmsg_virtio_shm_pool_get_buffer function,
+ * you have to implement this function too.
+ *
+ * @param shpool - pointer to the shared buffers pool
+ * @param buffer - buffer got with rpmsg_virtio_shm_pool_get_buffer
+ * @param size - size passed to rpmsg_virtio_shm_pool_get_buffer
+ */
+metal_weak void
+rpmsg_virtio_shm_pool_put_buffer(struct rpmsg_virtio_shm_pool *shpool,
+				 void *buffer, size_t size);
+
+/**
+ * rpmsg_virtio_shm_pool_get_stats - get the shared memory pool occupancy
+ *
+ * @param shpool - pointer to the shared buffers pool
+ * @param stats - pointer to the structure to fill
+ */
+void rpmsg_virtio_shm_pool_get_stats(struct rpmsg_virtio_shm_pool *shpool,
+				     struct rpmsg_virtio_shm_pool_stats *stats);
+
 #if defined __cplusplus
 }
 #endif
@@ -48,6 +48,16 @@ struct virtio_device_id {
  */
 #define VIRTIO_F_NOTIFY_ON_EMPTY (1 << 24)
 
+/*
+ * Use the packed virtqueue layout instead of the split one.
+ *
+ * VIRTIO 1.1 defines this feature as bit 34, which does not fit in the
+ * 32-bit feature fields of the resource table: the last transport
+ * feature bit is used instead. Peers that do not know it ignore it and
+ * keep the split layout.
+ */
+#define VIRTIO_F_RING_PACKED (1U << 31)
+
 /*
  * The guest should never negotiate this feature; it
  * is used to detect faulty drivers.
@@ -102,6 +112,9 @@ struct virtio_device {
 	void *priv; /**< TODO: remove pointer to virtio_device private data */
 	unsigned int vrings_num; /**< number of vrings */
 	struct virtio_vring_info *vrings_info;
+	const struct virtio_cache_ops *cache_ops; /**< cache maintenance,
+						     *  NULL if coherent
+						     */
 };
 
 /*
@@ -143,6 +156,30 @@ int virtio_create_virtqueues(struct virtio_device *vdev, unsigned int flags,
 			     unsigned int nvqs, const char *names[],
 			     vq_callback callbacks[]);
 
+/**
+ * virtio_set_cache_ops - set the cache maintenance of the shared memory
+ * @vdev: the virtio device
+ * @ops: cache operations, NULL if the shared memory is coherent
+ *
+ * Must be called before the virtqueues are created. The virtqueues then
+ * flush what they write to the shared memory, coalesced in cache line
+ * ranges and batched until the other side is kicked, and invalidate what
+ * the other side writes before reading it.
+ *
+ * The cache lines written by one side must never be written by the other,
+ * which the split ring ensures when laid out on cache lines, e.g. by rpmsg
+ * virtio devices with VIRTIO_RPMSG_F_CACHE_ALIGNED. The
+ * descriptors of the packed ring are written in place by both sides, so
+ * VIRTIO_F_RING_PACKED cannot be used with cache operations: the
+ * virtqueues are not created, and rpmsg_init_vdev() negotiates the split
+ * ring instead. The resource table is not maintained.
+ */
+static inline void virtio_set_cache_ops(struct virtio_device *vdev,
+					const struct virtio_cache_ops *ops)
+{
+	vdev->cache_ops = ops;
+}
+
 #if defined __cplusplus
 }
 #endif
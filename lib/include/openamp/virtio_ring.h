@@ -108,6 +108,15 @@ struct vring {
  * NOTE: for VirtIO PCI, align is 4096.
  */
 
+/*
+ * Cache line size of the cache aligned layout (VIRTIO_RPMSG_F_CACHE_ALIGNED).
+ * Both sides must use the same value, the largest cache line size of the
+ * two processors.
+ */
+#ifndef VRING_CACHE_LINE_SIZE
+#define VRING_CACHE_LINE_SIZE	64
+#endif
+
 /*
  * We publish the used event index at the end of the available ring, and vice
  * versa. They are at the end for backwards compatibility.
@@ -140,6 +149,97 @@ vring_init(struct vring *vr, unsigned int num, uint8_t *p, unsigned long align)
 	      align - 1) & ~(align - 1));
 }
 
+/*
+ * Packed ring (VIRTIO_F_RING_PACKED).
+ *
+ * A single ring of descriptors is shared by the driver and the device.
+ * The driver makes a descriptor available by writing it with the AVAIL flag
+ * equal to its wrap counter and the USED flag opposite to it. The device
+ * hands a buffer back by writing a descriptor, in order, with both flags
+ * equal to its wrap counter. The wrap counters start at 1 and flip each
+ * time the ring index wraps around.
+ */
+#define VRING_PACKED_DESC_F_AVAIL	(1 << 7)
+#define VRING_PACKED_DESC_F_USED	(1 << 15)
+
+/* Event suppression flags of the packed ring */
+#define VRING_PACKED_EVENT_FLAG_ENABLE	0x0
+#define VRING_PACKED_EVENT_FLAG_DISABLE	0x1
+#define VRING_PACKED_EVENT_FLAG_DESC	0x2
+
+/* Packed ring descriptors: 16 bytes. */
+METAL_PACKED_BEGIN
+struct vring_packed_desc {
+	/* Address (guest-physical). */
+	uint64_t addr;
+	/* Length. */
+	uint32_t len;
+	/* Buffer ID. */
+	uint16_t id;
+	/* The flags as indicated above. */
+	uint16_t flags;
+} METAL_PACKED_END;
+
+/* Event suppression structure, one written by each side. */
+METAL_PACKED_BEGIN
+struct vring_packed_desc_event {
+	/* Descriptor ring offset and wrap counter, for the DESC flag. */
+	uint16_t off_wrap;
+	/* The event flags as indicated above. */
+	uint16_t flags;
+} METAL_PACKED_END;
+
+struct vring_packed {
+	unsigned int num;
+
+	struct vring_packed_desc *desc;
+	/* Written by the driver, to suppress used buffer notifications. */
+	struct vring_packed_desc_event *driver;
+	/* Written by the device, to suppress available buffer notifications. */
+	struct vring_packed_desc_event *device;
+};
+
+/* The packed layout for the ring is a continuous chunk of memory which
+ * looks like this. It always fits in vring_size() bytes.
+ *
+ * struct vring_packed {
+ *      // The descriptors (16 bytes each)
+ *      struct vring_packed_desc desc[num];
+ *
+ *      // The driver event suppression structure.
+ *      struct vring_packed_desc_event driver;
+ *
+ *      // Padding to the next align boundary.
+ *      char pad[];
+ *
+ *      // The device event suppression structure.
+ *      struct vring_packed_desc_event device;
+ * };
+ */
+static inline int vring_packed_size(unsigned int num, unsigned long align)
+{
+	int size;
+
+	size = num * sizeof(struct vring_packed_desc);
+	size += sizeof(struct vring_packed_desc_event);
+	size = (size + align - 1) & ~(align - 1);
+	size += sizeof(struct vring_packed_desc_event);
+
+	return size;
+}
+
+static inline void
+vring_packed_init(struct vring_packed *vr, unsigned int num, uint8_t *p,
+		  unsigned long align)
+{
+	vr->num = num;
+	vr->desc = (struct vring_packed_desc *)p;
+	vr->driver = (struct vring_packed_desc_event *)
+	    (p + num * sizeof(struct vring_packed_desc));
+	vr->device = (struct vring_packed_desc_event *)
+	    (((unsigned long)(vr->driver + 1) + align - 1) & ~(align - 1));
+}
+
 /*
  * The following is used with VIRTIO_RING_F_EVENT_IDX.
  *
@@ -11,6 +11,7 @@
  */
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #if defined __cplusplus
@@ -47,14 +48,78 @@ extern "C" {
 /* Support to suppress interrupt until specific index is reached. */
 #define VIRTIO_RING_F_EVENT_IDX        (1 << 29)
 
+/*
+ * Maximum number of coalesced memory ranges a virtqueue keeps to flush at
+ * the next kick. Once they are all used, the pending ranges are flushed.
+ */
+#ifndef VQ_CACHE_MAX_RANGES
+#define VQ_CACHE_MAX_RANGES                            8
+#endif
+
 struct virtqueue_buf {
 	void *buf;
 	int len;
 };
 
+/**
+ * struct virtio_cache_ops - cache maintenance of the shared memory
+ * @flush: writes back the cache lines of a memory range
+ * @invalidate: discards the cache lines of a memory range, so that the
+ *              next reads get the memory content
+ * @priv: private data given to the operations
+ *
+ * Used when the shared memory is cached and the caches are not coherent
+ * with the other side. The ranges are given cache line aligned, as
+ * VRING_CACHE_LINE_SIZE bytes lines.
+ */
+struct virtio_cache_ops {
+	void (*flush)(void *priv, void *addr, size_t len);
+	void (*invalidate)(void *priv, void *addr, size_t len);
+	void *priv;
+};
+
+/* Memory range waiting to be flushed, in cache line aligned addresses */
+struct vq_cache_range {
+	uintptr_t start;
+	uintptr_t end;
+};
+
+/**
+ * struct virtqueue_stats - virtqueue counters
+ * @kicks: number of notifications sent to the other side
+ * @kicks_suppressed: number of kicks not notified, the other side having
+ *                    asked not to be
+ * @notifications: number of notifications received from the other side
+ * @added: number of buffers given to the other side: made available on the
+ *         driver side, used on the device side
+ * @got: number of buffers got from the other side
+ * @max_pending: high-water mark of the buffers waiting to be got from the
+ *               ring, sampled when getting one, split rings only
+ * @max_outstanding: high-water mark of the buffers not given back: on the
+ *                   driver side, the buffers made available and not used
+ *                   yet, which is the ring occupancy; on the device side,
+ *                   the buffers got and not used yet
+ *
+ * The counters are only collected with VQUEUE_STATS, by the side owning
+ * the virtqueue, without lock: they are updated under the lock of the
+ * virtqueue, if any.
+ */
+struct virtqueue_stats {
+	unsigned long kicks;
+	unsigned long kicks_suppressed;
+	unsigned long notifications;
+	unsigned long added;
+	unsigned long got;
+	uint16_t max_pending;
+	uint16_t max_outstanding;
+};
+
 struct vq_desc_extra {
 	void *cookie;
 	uint16_t ndescs;
+	/* Packed ring only: next free buffer ID, and buffer length */
+	uint16_t next;
+	uint32_t len;
 };
 
 struct virtqueue {
@@ -88,6 +153,52 @@ struct virtqueue {
 	 */
 	uint16_t vq_available_idx;
 
+	/*
+	 * Packed ring, used instead of vq_ring when VIRTIO_F_RING_PACKED
+	 * is negotiated. The buffer IDs are used as descriptor indexes by
+	 * the virtqueue API, the free IDs are chained in vq_descx.
+	 */
+	struct vring_packed vq_packed_ring;
+
+	/*
+	 * Next descriptor to make available (driver side) or to consume
+	 * (device side) in the packed ring, and its wrap counter.
+	 */
+	uint16_t vq_packed_avail_idx;
+	bool vq_packed_avail_wrap;
+
+	/*
+	 * Next used descriptor to consume (driver side) or to write
+	 * (device side) in the packed ring, and its wrap counter.
+	 */
+	uint16_t vq_packed_used_idx;
+	bool vq_packed_used_wrap;
+
+	/*
+	 * Indirect descriptor tables, in shared memory, used by the driver
+	 * side of a split ring when VIRTIO_RING_F_INDIRECT_DESC is
+	 * negotiated. The table of the chain whose head is the descriptor i
+	 * starts at vq_indirect + i * vq_indirect_max.
+	 */
+	struct vring_desc *vq_indirect;
+	uint16_t vq_indirect_max;
+
+	/*
+	 * Cache maintenance, when the device has cache operations: the
+	 * ranges written since the last kick, flushed before the ring
+	 * entries. The index of the ring written by this side is kept in
+	 * vq_cache_ring_idx until then. The ring index of the other side is
+	 * only read again from memory once the entries up to
+	 * vq_cache_peer_idx are consumed.
+	 */
+	struct vq_cache_range vq_cache_ranges[VQ_CACHE_MAX_RANGES];
+	uint16_t vq_cache_nranges;
+	uint16_t vq_cache_ring_idx;
+	uint16_t vq_cache_peer_idx;
+
+	/* Counters, collected with VQUEUE_STATS */
+	struct virtqueue_stats vq_stats;
+
 #ifdef VQUEUE_DEBUG
 	bool vq_inuse;
 #endif
@@ -95,7 +206,8 @@ struct virtqueue {
 	/*
 	 * Used by the host side during callback. Cookie
 	 * holds the address of buffer received from other side.
-	 * Other fields in this structure are not used currently.
+	 * With the packed ring, the device side also keeps there the
+	 * length and the number of descriptors of the buffers it got.
 	 */
 
 	struct vq_desc_extra vq_descx[0];
@@ -182,9 +294,51 @@ static inline void virtqueue_set_shmem_io(struct virtqueue *vq,
 	vq->shm_io = io;
 }
 
+/*
+ * virtqueue_indirect_tables_size
+ *
+ * get the size of the memory needed for the indirect descriptor tables
+ *
+ * @num_descs - number of descriptors of the virt queue
+ * @max_segs - maximum number of buffers of a chain
+ *
+ * return size in bytes
+ */
+static inline size_t virtqueue_indirect_tables_size(unsigned int num_descs,
+						    unsigned int max_segs)
+{
+	return (size_t)num_descs * max_segs * sizeof(struct vring_desc);
+}
+
+/*
+ * virtqueue_set_indirect_tables
+ *
+ * set the memory of the indirect descriptor tables of the virtqueue
+ *
+ * Once set, and if VIRTIO_RING_F_INDIRECT_DESC is negotiated, the chains
+ * of up to @max_segs buffers added by the driver side take a single ring
+ * descriptor. The memory must be part of the shared memory I/O region and
+ * of at least virtqueue_indirect_tables_size() bytes.
+ *
+ * @vq - virt queue
+ * @tables - pointer to the indirect descriptor tables, NULL to disable
+ * @max_segs - maximum number of buffers of a chain
+ */
+static inline void virtqueue_set_indirect_tables(struct virtqueue *vq,
+						 void *tables,
+						 uint16_t max_segs)
+{
+	vq->vq_indirect = (struct vring_desc *)tables;
+	vq->vq_indirect_max = tables ? max_segs : 0;
+}
+
 int virtqueue_add_buffer(struct virtqueue *vq, struct virtqueue_buf *buf_list,
 			 int readable, int writable, void *cookie);
 
+int virtqueue_add_buffer_batch(struct virtqueue *vq,
+			       struct virtqueue_buf *buf_list,
+			       int num, int writable);
+
 void *virtqueue_get_buffer(struct virtqueue *vq, uint32_t *len, uint16_t *idx);
 
 void *virtqueue_get_available_buffer(struct virtqueue *vq, uint16_t *avail_idx,
@@ -193,12 +347,26 @@ void *virtqueue_get_available_buffer(struct virtqueue *vq, uint16_t *avail_idx,
 int virtqueue_add_consumed_buffer(struct virtqueue *vq, uint16_t head_idx,
 				  uint32_t len);
 
+int virtqueue_add_consumed_buffer_batch(struct virtqueue *vq,
+					const struct vring_used_elem *used,
+					int num);
+
 void virtqueue_disable_cb(struct virtqueue *vq);
 
 int virtqueue_enable_cb(struct virtqueue *vq);
 
+int virtqueue_has_buffer(struct virtqueue *vq);
+
+void *virtqueue_peek_buffer(struct virtqueue *vq, uint16_t n, uint32_t *len);
+
 void virtqueue_kick(struct virtqueue *vq);
 
+void virtqueue_flush_cache(struct virtqueue *vq);
+
+void virtqueue_cache_flush(struct virtqueue *vq, void *addr, size_t len);
+
+void virtqueue_cache_invalidate(struct virtqueue *vq, void *addr, size_t len);
+
 static inline struct virtqueue *virtqueue_allocate(unsigned int num_desc_extra)
 {
 	struct virtqueue *vqs;
@@ -223,6 +391,13 @@ uint32_t virtqueue_get_desc_size(struct virtqueue *vq);
 
 uint32_t virtqueue_get_buffer_length(struct virtqueue *vq, uint16_t idx);
 
+int virtqueue_get_buffer_segments(struct virtqueue *vq, uint16_t idx,
+				  struct virtqueue_buf *segs, int num);
+
+void *virtqueue_detach_unused_buffer(struct virtqueue *vq);
+
+void virtqueue_get_stats(struct virtqueue *vq, struct virtqueue_stats *stats);
+
 #if defined __cplusplus
 }
 #endif
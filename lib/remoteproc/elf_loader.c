@@ -697,6 +697,30 @@ int elf_get_load_state(void *img_info)
 	return *load_state;
 }
 
+unsigned int elf_get_data_flags(void *img_info)
+{
+	const void *phdr;
+	unsigned int p_flags;
+	int *load_state;
+
+	if (!img_info)
+		return RPROC_LOAD_DATA_WRITABLE;
+	load_state = elf_load_state(img_info);
+	/* The index of the next segment is kept in the load state */
+	phdr = elf_get_segment_from_index(img_info,
+					  (*load_state &
+					   ELF_NEXT_SEGMENT_MASK) - 1);
+	if (!phdr)
+		return RPROC_LOAD_DATA_WRITABLE;
+	if (elf_is_64(img_info) == 0)
+		p_flags = ((const Elf32_Phdr *)phdr)->p_flags;
+	else
+		p_flags = ((const Elf64_Phdr *)phdr)->p_flags;
+
+	return ((p_flags & PF_W) ? RPROC_LOAD_DATA_WRITABLE : 0) |
+	       ((p_flags & PF_OPENAMP_LZ4) ? RPROC_LOAD_DATA_LZ4 : 0);
+}
+
 struct loader_ops elf_ops = {
 	.load_header = elf_load_header,
 	.load_data = elf_load,
@@ -704,4 +728,5 @@ struct loader_ops elf_ops = {
 	.release = elf_release,
 	.get_entry = elf_get_entry,
 	.get_load_state = elf_get_load_state,
+	.get_data_flags = elf_get_data_flags,
 };
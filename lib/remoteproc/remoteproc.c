@@ -7,14 +7,21 @@
  */
 
 #include <metal/alloc.h>
+#include <metal/atomic.h>
 #include <metal/log.h>
+#include <metal/time.h>
 #include <metal/utilities.h>
 #include <openamp/elf_loader.h>
 #include <openamp/remoteproc.h>
 #include <openamp/remoteproc_loader.h>
 #include <openamp/remoteproc_virtio.h>
+#include <openamp/rpmsg_virtio.h>
 #include <openamp/rsc_table_parser.h>
 
+#ifdef RPROC_LZ4
+#include "remoteproc_lz4.h"
+#endif
+
 /******************************************************************************
  *  static functions
  *****************************************************************************/
@@ -142,6 +149,415 @@ static int remoteproc_parse_rsc_table(struct remoteproc *rproc,
 	return handle_rsc_table(rproc, rsc_table, rsc_size, io);
 }
 
+/* Target segment collected by a parallel load */
+struct remoteproc_load_seg {
+	metal_phys_addr_t pa;
+	struct metal_io_region *io;
+	struct remoteproc_load_cache *cache;
+	int readonly;
+	size_t offset;		/* offset of the data in the image */
+	size_t copy_len;	/* data still to copy, 0 if copied already */
+	size_t filesz;		/* data size, padded up to memsz */
+	size_t memsz;
+	unsigned char padding;
+	unsigned int first_job;
+};
+
+/* Segments of a parallel load, and their progress shared by the workers */
+struct remoteproc_load_ctx {
+	struct remoteproc *rproc;
+	void *store;
+	struct image_store_ops *store_ops;
+	struct remoteproc_load_seg *segs;
+	unsigned int num_segs;
+	unsigned int max_segs;
+	unsigned int num_jobs;
+	atomic_uint next_job;
+	atomic_int error;
+};
+
+/* Hash of data loaded at pa, 0 standing for unknown data */
+static uint64_t remoteproc_load_hash(const void *data, size_t len,
+				     metal_phys_addr_t pa)
+{
+	const unsigned char *p = data;
+	uint64_t h, w;
+
+	h = ((uint64_t)pa * 0x9e3779b97f4a7c15ULL) ^ len;
+	for (; len >= sizeof(w); len -= sizeof(w), p += sizeof(w)) {
+		memcpy(&w, p, sizeof(w));
+		h = (h ^ w) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+	for (; len; len--, p++)
+		h = (h ^ *p) * 0xff51afd7ed558ccdULL;
+	h ^= h >> 29;
+
+	return h ? h : 1;
+}
+
+/*
+ * Forgets the chunks holding data in [pa, pa + len), or only those also
+ * holding data out of the range with partial
+ */
+static void remoteproc_load_cache_drop(struct remoteproc_load_cache *cache,
+				       metal_phys_addr_t pa, size_t len,
+				       int partial)
+{
+	size_t first, last;
+
+	if (!len)
+		return;
+	first = (size_t)(pa - cache->pa) / cache->chunk_size;
+	last = (size_t)(pa + len - 1 - cache->pa) / cache->chunk_size;
+	if (!partial) {
+		for (; first <= last; first++)
+			cache->hashes[first] = 0;
+		return;
+	}
+	if ((pa - cache->pa) % cache->chunk_size)
+		cache->hashes[first] = 0;
+	if ((pa + len - cache->pa) % cache->chunk_size)
+		cache->hashes[last] = 0;
+}
+
+/*
+ * Gets the load cache of the memory a segment is loaded to, and forgets
+ * the chunks the segment changes without tracking them: the ones it only
+ * partly fills, and all of them if the segment is writable.
+ */
+static struct remoteproc_load_cache *
+remoteproc_load_cache_prepare(struct remoteproc *rproc, metal_phys_addr_t pa,
+			      size_t filesz, size_t memsz, int readonly)
+{
+	struct remoteproc_mem *mem;
+
+	if (memsz < filesz)
+		memsz = filesz;
+	mem = remoteproc_get_mem(rproc, NULL, pa, METAL_BAD_PHYS, NULL, memsz);
+	if (!mem || !mem->cache)
+		return NULL;
+	if (readonly) {
+		remoteproc_load_cache_drop(mem->cache, pa, filesz, 1);
+		remoteproc_load_cache_drop(mem->cache, pa + filesz,
+					   memsz - filesz, 0);
+	} else {
+		remoteproc_load_cache_drop(mem->cache, pa, memsz, 0);
+	}
+
+	return mem->cache;
+}
+
+/*
+ * Copies data of a segment to the target memory. For read-only data, the
+ * chunks the cache tells are in the memory already are skipped, the other
+ * whole chunks are copied from a local copy of their data, and hashed.
+ */
+static int remoteproc_load_copy(void *store,
+				struct image_store_ops *store_ops,
+				struct remoteproc_load_cache *cache,
+				int readonly, size_t offset, size_t len,
+				metal_phys_addr_t pa,
+				struct metal_io_region *io,
+				const void **img_data)
+{
+	size_t piece, index;
+	uint64_t hash;
+	int ret;
+
+	while (len) {
+		piece = len;
+		if (cache && readonly) {
+			piece = cache->chunk_size -
+				(size_t)(pa - cache->pa) % cache->chunk_size;
+			if (piece > len)
+				piece = len;
+		}
+		*img_data = NULL;
+		if (cache && readonly && piece == cache->chunk_size) {
+			ret = store_ops->load(store, offset, piece, img_data,
+					      RPROC_LOAD_ANYADDR, NULL, 1);
+			if (ret < (int)piece)
+				goto error;
+			index = (size_t)(pa - cache->pa) / cache->chunk_size;
+			hash = remoteproc_load_hash(*img_data, piece, pa);
+			if (cache->hashes[index] == hash) {
+				atomic_fetch_add(&cache->skipped, piece);
+				goto next;
+			}
+			cache->hashes[index] = 0;
+			ret = metal_io_block_write(io,
+						   metal_io_phys_to_offset(io,
+									   pa),
+						   *img_data, piece);
+			if (ret != (int)piece)
+				goto error;
+			cache->hashes[index] = hash;
+		} else {
+			ret = store_ops->load(store, offset, piece, img_data,
+					      pa, io, 1);
+			if (ret != (int)piece)
+				goto error;
+		}
+		if (cache)
+			atomic_fetch_add(&cache->copied, piece);
+next:
+		pa += piece;
+		offset += piece;
+		len -= piece;
+	}
+
+	return 0;
+
+error:
+	metal_log(METAL_LOG_ERROR, "load data failed 0x%lx, 0x%lx, 0x%x\r\n",
+		  pa, offset, (unsigned int)piece);
+	return -RPROC_EINVAL;
+}
+
+/*
+ * Decompresses the data of a segment to the target memory, filesz being
+ * set to the size of the decompressed data
+ */
+static int remoteproc_load_decompress(struct remoteproc *rproc, void *store,
+				      struct image_store_ops *store_ops,
+				      size_t offset, size_t len,
+				      metal_phys_addr_t pa,
+				      struct metal_io_region *io,
+				      size_t memsz, size_t *filesz)
+{
+#ifdef RPROC_LZ4
+	unsigned long long start;
+	unsigned long io_offset;
+	int ret;
+
+	io_offset = metal_io_phys_to_offset(io, pa);
+	if (io_offset == METAL_BAD_OFFSET) {
+		metal_log(METAL_LOG_ERROR,
+			  "load failed, no mapping for 0x%lx\r\n", pa);
+		return -RPROC_EINVAL;
+	}
+	start = metal_get_timestamp();
+	ret = remoteproc_lz4_load(store, store_ops, offset, len, io, io_offset,
+				  memsz, filesz);
+	rproc->load_stats.time += metal_get_timestamp() - start;
+	if (ret) {
+		metal_log(METAL_LOG_ERROR,
+			  "load failed, bad compressed data 0x%lx, 0x%x\r\n",
+			  offset, (unsigned int)len);
+		return ret;
+	}
+	rproc->load_stats.compressed += len;
+	rproc->load_stats.decompressed += *filesz;
+
+	return 0;
+#else
+	(void)rproc;
+	(void)store;
+	(void)store_ops;
+	(void)len;
+	(void)pa;
+	(void)io;
+	(void)memsz;
+	(void)filesz;
+	metal_log(METAL_LOG_ERROR,
+		  "load failed, compressed data 0x%lx needs RPROC_LZ4\r\n",
+		  offset);
+	return -RPROC_EINVAL;
+#endif
+}
+
+/*
+ * The copies of a segment are aligned on RPROC_LOAD_CHUNK_SIZE in the
+ * target memory, so that no chunk of a load cache is shared by two of them
+ */
+static unsigned int remoteproc_load_seg_copies(struct remoteproc_load_seg *seg)
+{
+	size_t head = (size_t)(seg->pa % RPROC_LOAD_CHUNK_SIZE);
+
+	if (!seg->copy_len)
+		return 0;
+	return metal_div_round_up(head + seg->copy_len, RPROC_LOAD_CHUNK_SIZE);
+}
+
+static unsigned int remoteproc_load_seg_jobs(struct remoteproc_load_seg *seg)
+{
+	return remoteproc_load_seg_copies(seg) +
+	       metal_div_round_up(seg->memsz - seg->filesz,
+				  RPROC_LOAD_CHUNK_SIZE);
+}
+
+/* Copies or zero-fills one chunk of a segment */
+static int remoteproc_load_do_job(struct remoteproc_load_ctx *ctx,
+				  unsigned int job)
+{
+	struct remoteproc_load_seg *seg = ctx->segs;
+	const void *img_data;
+	unsigned int copies;
+	size_t start, len;
+	int ret;
+
+	while (job >= seg->first_job + remoteproc_load_seg_jobs(seg))
+		seg++;
+	job -= seg->first_job;
+	copies = remoteproc_load_seg_copies(seg);
+
+	if (job < copies) {
+		size_t head = (size_t)(seg->pa % RPROC_LOAD_CHUNK_SIZE);
+
+		start = job ? (size_t)job * RPROC_LOAD_CHUNK_SIZE - head : 0;
+		len = (size_t)(job + 1) * RPROC_LOAD_CHUNK_SIZE - head - start;
+		if (len > seg->copy_len - start)
+			len = seg->copy_len - start;
+		ret = remoteproc_load_copy(ctx->store, ctx->store_ops,
+					   seg->cache, seg->readonly,
+					   seg->offset + start, len,
+					   seg->pa + start, seg->io,
+					   &img_data);
+		if (ret)
+			return ret;
+	} else {
+		start = seg->filesz +
+			(size_t)(job - copies) * RPROC_LOAD_CHUNK_SIZE;
+		len = seg->memsz - start;
+		if (len > RPROC_LOAD_CHUNK_SIZE)
+			len = RPROC_LOAD_CHUNK_SIZE;
+		metal_io_block_set(seg->io,
+				   metal_io_phys_to_offset(seg->io,
+							   seg->pa + start),
+				   seg->padding, len);
+	}
+
+	return 0;
+}
+
+/* Runs the jobs of a parallel load until none is left */
+static void remoteproc_load_work(void *arg)
+{
+	struct remoteproc_load_ctx *ctx = arg;
+	unsigned int job;
+	int ret;
+
+	while (!atomic_load(&ctx->error)) {
+		job = atomic_fetch_add(&ctx->next_job, 1);
+		if (job >= ctx->num_jobs)
+			break;
+		ret = remoteproc_load_do_job(ctx, job);
+		if (ret)
+			atomic_store(&ctx->error, ret);
+	}
+}
+
+/* Loads the collected segments, with the workers of the pool */
+static int remoteproc_load_segments(struct remoteproc_load_ctx *ctx,
+				    struct remoteproc_load_pool *pool)
+{
+	unsigned int i, workers = 0;
+
+	ctx->num_jobs = 0;
+	for (i = 0; i < ctx->num_segs; i++) {
+		ctx->segs[i].first_job = ctx->num_jobs;
+		ctx->num_jobs += remoteproc_load_seg_jobs(&ctx->segs[i]);
+	}
+	atomic_store(&ctx->next_job, 0);
+
+	/* The calling thread takes its share of the jobs */
+	if (pool) {
+		while (workers < pool->num_workers &&
+		       workers + 1 < ctx->num_jobs &&
+		       !pool->run(pool, remoteproc_load_work, ctx))
+			workers++;
+	}
+	remoteproc_load_work(ctx);
+	if (workers)
+		pool->wait(pool);
+
+	ctx->num_segs = 0;
+	return atomic_load(&ctx->error);
+}
+
+/*
+ * Collects a target segment. A segment overlapping a collected one is
+ * only loaded once they are, so that they are loaded in order.
+ */
+static int remoteproc_load_add_seg(struct remoteproc_load_ctx *ctx,
+				   struct remoteproc_load_pool *pool,
+				   metal_phys_addr_t pa,
+				   struct metal_io_region *io,
+				   struct remoteproc_load_cache *cache,
+				   int readonly, int compressed,
+				   size_t offset, size_t filesz, size_t memsz,
+				   unsigned char padding)
+{
+	struct remoteproc_load_seg *seg;
+	unsigned int i;
+	int ret;
+
+	if (!compressed && memsz < filesz)
+		memsz = filesz;
+	for (i = 0; i < ctx->num_segs; i++) {
+		seg = &ctx->segs[i];
+		if (seg->io == io && pa < seg->pa + seg->memsz &&
+		    seg->pa < pa + memsz)
+			break;
+	}
+	if (i < ctx->num_segs) {
+		ret = remoteproc_load_segments(ctx, pool);
+		if (ret)
+			return ret;
+	}
+
+	if (ctx->num_segs == ctx->max_segs) {
+		unsigned int max = ctx->max_segs ? 2 * ctx->max_segs : 8;
+
+		seg = metal_allocate_memory(max * sizeof(*seg));
+		if (!seg)
+			return -RPROC_ENOMEM;
+		if (ctx->segs) {
+			memcpy(seg, ctx->segs, ctx->num_segs * sizeof(*seg));
+			metal_free_memory(ctx->segs);
+		}
+		ctx->segs = seg;
+		ctx->max_segs = max;
+	}
+
+	/*
+	 * Without concurrent load, the data is copied while collecting.
+	 * Compressed data is always decompressed while collecting.
+	 */
+	if (compressed) {
+		ret = remoteproc_load_decompress(ctx->rproc, ctx->store,
+						 ctx->store_ops, offset, filesz,
+						 pa, io, memsz, &filesz);
+		if (ret)
+			return ret;
+	} else if ((ctx->store_ops->features & SUPPORT_CONCURRENT_LOAD) ==
+		   0 && filesz) {
+		const void *img_data;
+
+		ret = remoteproc_load_copy(ctx->store, ctx->store_ops, cache,
+					   readonly, offset, filesz, pa, io,
+					   &img_data);
+		if (ret)
+			return ret;
+	}
+
+	seg = &ctx->segs[ctx->num_segs++];
+	seg->pa = pa;
+	seg->io = io;
+	seg->cache = cache;
+	seg->readonly = readonly;
+	seg->offset = offset;
+	seg->filesz = filesz;
+	seg->copy_len = !compressed &&
+			(ctx->store_ops->features & SUPPORT_CONCURRENT_LOAD) ?
+			filesz : 0;
+	seg->memsz = memsz;
+	seg->padding = padding;
+
+	return 0;
+}
+
 int remoteproc_set_rsc_table(struct remoteproc *rproc,
 			     struct resource_table *rsc_table,
 			     size_t rsc_size)
@@ -253,6 +669,18 @@ int remoteproc_stop(struct remoteproc *rproc)
 	return ret;
 }
 
+/* Forgets the data loaded to the memories of a remote */
+static void remoteproc_invalidate_load_caches(struct remoteproc *rproc)
+{
+	struct metal_list *node;
+	struct remoteproc_mem *mem;
+
+	metal_list_for_each(&rproc->mems, node) {
+		mem = metal_container_of(node, struct remoteproc_mem, node);
+		remoteproc_invalidate_load_cache(mem->cache);
+	}
+}
+
 int remoteproc_shutdown(struct remoteproc *rproc)
 {
 	int ret = -RPROC_ENODEV;
@@ -270,6 +698,8 @@ int remoteproc_shutdown(struct remoteproc *rproc)
 					ret = rproc->ops->shutdown(rproc);
 				if (!ret) {
 					rproc->state = RPROC_OFFLINE;
+					/* The memories may be powered off */
+					remoteproc_invalidate_load_caches(rproc);
 				}
 			}
 		}
@@ -380,9 +810,44 @@ void *remoteproc_mmap(struct remoteproc *rproc,
 	return va;
 }
 
-int remoteproc_load(struct remoteproc *rproc, const char *path,
-		    void *store, struct image_store_ops *store_ops,
-		    void **img_info)
+void *remoteproc_get_trace(struct remoteproc *rproc, unsigned int index,
+			   size_t *len)
+{
+	struct fw_rsc_trace *trace_rsc;
+	metal_phys_addr_t da;
+	size_t offset;
+	void *va = NULL;
+
+	if (!rproc)
+		return NULL;
+	metal_mutex_acquire(&rproc->lock);
+	if (!rproc->rsc_table)
+		goto out;
+	offset = find_rsc(rproc->rsc_table, RSC_TRACE, index);
+	if (!offset)
+		goto out;
+	trace_rsc = (struct fw_rsc_trace *)((char *)rproc->rsc_table + offset);
+	if (trace_rsc->da == FW_RSC_U32_ADDR_ANY || !trace_rsc->len)
+		goto out;
+	da = trace_rsc->da;
+	va = remoteproc_mmap(rproc, NULL, &da, trace_rsc->len, 0, NULL);
+	if (va && len)
+		*len = trace_rsc->len;
+out:
+	metal_mutex_release(&rproc->lock);
+	return va;
+}
+
+/*
+ * Loads the executable. With a parallel load context, the target segments
+ * are collected, and loaded by the workers of the pool once all of them
+ * are known.
+ */
+static int remoteproc_load_image(struct remoteproc *rproc, const char *path,
+				 void *store, struct image_store_ops *store_ops,
+				 struct remoteproc_load_ctx *ctx,
+				 struct remoteproc_load_pool *pool,
+				 void **img_info)
 {
 	int ret;
 	struct loader_ops *loader;
@@ -416,6 +881,7 @@ int remoteproc_load(struct remoteproc *rproc, const char *path,
 		metal_mutex_release(&rproc->lock);
 		return -RPROC_EINVAL;
 	}
+	memset(&rproc->load_stats, 0, sizeof(rproc->load_stats));
 
 	/* Open executable to get ready to parse */
 	metal_log(METAL_LOG_DEBUG, "%s: open executable image\r\n", __func__);
@@ -504,9 +970,12 @@ int remoteproc_load(struct remoteproc *rproc, const char *path,
 	offset = 0;
 	len = 0;
 	while (1) {
+		struct remoteproc_load_cache *cache;
 		unsigned char padding;
 		size_t nmemsize;
 		metal_phys_addr_t pa;
+		unsigned int flags;
+		int readonly, compressed;
 
 		da = RPROC_LOAD_ANYADDR;
 		nlen = 0;
@@ -539,16 +1008,45 @@ int remoteproc_load(struct remoteproc *rproc, const char *path,
 				ret = -RPROC_EINVAL;
 				goto error3;
 			}
-			if (nlen > 0) {
-				ret = store_ops->load(store, noffset, nlen,
-						      &img_data, pa, io, 1);
-				if (ret != (int)nlen) {
-					metal_log(METAL_LOG_ERROR,
-						  "load data failed 0x%lx, 0x%lx, 0x%x\r\n",
-						  pa, noffset, nlen);
-					ret = -RPROC_EINVAL;
+			flags = loader->get_data_flags ?
+				loader->get_data_flags(limg_info) :
+				RPROC_LOAD_DATA_WRITABLE;
+			compressed = (flags & RPROC_LOAD_DATA_LZ4) != 0;
+			/* Only read-only data is skipped by a reload */
+			readonly = (flags & RPROC_LOAD_DATA_WRITABLE) == 0 &&
+				   !compressed;
+			cache = remoteproc_load_cache_prepare(rproc, pa,
+							      compressed ?
+							      0 : nlen,
+							      nmemsize,
+							      readonly);
+			if (ctx) {
+				ret = remoteproc_load_add_seg(ctx, pool, pa, io,
+							      cache, readonly,
+							      compressed,
+							      noffset, nlen,
+							      nmemsize,
+							      padding);
+				if (ret)
+					goto error3;
+				continue;
+			}
+			if (compressed) {
+				ret = remoteproc_load_decompress(rproc, store,
+								 store_ops,
+								 noffset, nlen,
+								 pa, io,
+								 nmemsize,
+								 &nlen);
+				if (ret)
+					goto error3;
+			} else if (nlen > 0) {
+				ret = remoteproc_load_copy(store, store_ops,
+							   cache, readonly,
+							   noffset, nlen, pa,
+							   io, &img_data);
+				if (ret)
 					goto error3;
-				}
 			}
 			if (nmemsize > nlen) {
 				size_t tmpoffset;
@@ -583,6 +1081,15 @@ int remoteproc_load(struct remoteproc *rproc, const char *path,
 		}
 	}
 
+	/* The resource table is updated once the segments are loaded */
+	if (ctx) {
+		metal_log(METAL_LOG_DEBUG, "%s: load %u segments\r\n",
+			  __func__, ctx->num_segs);
+		ret = remoteproc_load_segments(ctx, pool);
+		if (ret)
+			goto error3;
+	}
+
 	if (rsc_size == 0) {
 		ret = loader->locate_rsc_table(limg_info, &rsc_da,
 					       &offset, &rsc_size);
@@ -626,6 +1133,12 @@ int remoteproc_load(struct remoteproc *rproc, const char *path,
 		rsc_table = NULL;
 	}
 
+	if (rproc->load_stats.compressed)
+		metal_log(METAL_LOG_INFO,
+			  "%s: decompressed 0x%lx bytes from 0x%lx in %llu\r\n",
+			  __func__, rproc->load_stats.decompressed,
+			  rproc->load_stats.compressed,
+			  rproc->load_stats.time);
 	metal_log(METAL_LOG_DEBUG, "%s: successfully load firmware\r\n",
 		  __func__);
 	/* get entry point from the firmware */
@@ -651,6 +1164,67 @@ error1:
 	return ret;
 }
 
+int remoteproc_load(struct remoteproc *rproc, const char *path,
+		    void *store, struct image_store_ops *store_ops,
+		    void **img_info)
+{
+	return remoteproc_load_image(rproc, path, store, store_ops, NULL, NULL,
+				     img_info);
+}
+
+int remoteproc_load_parallel(struct remoteproc *rproc, const char *path,
+			     void *store, struct image_store_ops *store_ops,
+			     struct remoteproc_load_pool *pool,
+			     void **img_info)
+{
+	struct remoteproc_load_ctx ctx;
+	int ret;
+
+	if (pool && (!pool->run || !pool->wait))
+		return -RPROC_EINVAL;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.rproc = rproc;
+	ctx.store = store;
+	ctx.store_ops = store_ops;
+	atomic_init(&ctx.next_job, 0);
+	atomic_init(&ctx.error, 0);
+	ret = remoteproc_load_image(rproc, path, store, store_ops, &ctx, pool,
+				    img_info);
+	if (ctx.segs)
+		metal_free_memory(ctx.segs);
+
+	return ret;
+}
+
+int remoteproc_init_load_cache(struct remoteproc_mem *mem,
+			       struct remoteproc_load_cache *cache,
+			       uint64_t *hashes, size_t chunk_size)
+{
+	if (!mem || !cache || !hashes || !chunk_size ||
+	    (chunk_size & (chunk_size - 1)) != 0 ||
+	    chunk_size > RPROC_LOAD_CHUNK_SIZE || mem->pa % chunk_size != 0)
+		return -RPROC_EINVAL;
+
+	cache->pa = mem->pa;
+	cache->chunk_size = chunk_size;
+	cache->num_chunks = metal_div_round_up(mem->size, chunk_size);
+	cache->hashes = hashes;
+	atomic_init(&cache->copied, 0);
+	atomic_init(&cache->skipped, 0);
+	remoteproc_invalidate_load_cache(cache);
+	mem->cache = cache;
+
+	return 0;
+}
+
+void remoteproc_invalidate_load_cache(struct remoteproc_load_cache *cache)
+{
+	if (!cache)
+		return;
+	memset(cache->hashes, 0, cache->num_chunks * sizeof(*cache->hashes));
+}
+
 int remoteproc_load_noblock(struct remoteproc *rproc,
 			    const void *img_data, size_t offset, size_t len,
 			    void **img_info,
@@ -934,7 +1508,16 @@ remoteproc_create_virtio(struct remoteproc *rproc,
 		da = vring_rsc->da;
 		num_descs = vring_rsc->num;
 		align = vring_rsc->align;
-		size = vring_size(num_descs, align);
+		/*
+		 * A rpmsg vdev offering the cache aligned layout reserves room
+		 * for it
+		 */
+		if (vdev_rsc->id == VIRTIO_ID_RPMSG)
+			size = vring_size(num_descs,
+					  rpmsg_virtio_get_vring_align(
+						vdev_rsc->dfeatures, align));
+		else
+			size = vring_size(num_descs, align);
 		va = remoteproc_mmap(rproc, NULL, &da, size, 0, &io);
 		if (!va)
 			goto err1;
@@ -0,0 +1,428 @@
+/*
+ * LZ4 frame decoder of the remoteproc loader
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <metal/io.h>
+#include <metal/log.h>
+#include <openamp/remoteproc.h>
+#include "remoteproc_lz4.h"
+
+/* Frame format, see the LZ4 frame format description */
+#define LZ4_MAGIC			0x184D2204U
+#define LZ4_SKIPPABLE_MAGIC		0x184D2A50U
+#define LZ4_SKIPPABLE_MASK		0xFFFFFFF0U
+#define LZ4_FLG_VERSION_MASK		0xC0
+#define LZ4_FLG_VERSION			0x40
+#define LZ4_FLG_BLOCK_CSUM		0x10
+#define LZ4_FLG_CONTENT_SIZE		0x08
+#define LZ4_FLG_CONTENT_CSUM		0x04
+#define LZ4_FLG_RESERVED		0x02
+#define LZ4_FLG_DICT_ID			0x01
+#define LZ4_BD_MAX_SIZE_SHIFT		4
+#define LZ4_BD_MAX_SIZE_MASK		0x70
+#define LZ4_BLOCK_UNCOMPRESSED		0x80000000U
+#define LZ4_MIN_MATCH			4
+
+/* Size of the local buffers copying the matches and reading the output */
+#ifndef LZ4_COPY_SIZE
+#define LZ4_COPY_SIZE			64
+#endif
+
+/* xxHash32, the checksum of the frames */
+#define XXH_PRIME32_1			0x9E3779B1U
+#define XXH_PRIME32_2			0x85EBCA77U
+#define XXH_PRIME32_3			0xC2B2AE3DU
+#define XXH_PRIME32_4			0x27D4EB2FU
+#define XXH_PRIME32_5			0x165667B1U
+
+struct lz4_xxh32 {
+	uint32_t v[4];
+	uint64_t total;
+	unsigned char buf[16];
+	unsigned int buf_len;
+};
+
+static uint32_t lz4_read32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+	       (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint32_t lz4_rotl32(uint32_t x, unsigned int r)
+{
+	return (x << r) | (x >> (32 - r));
+}
+
+static uint32_t lz4_xxh32_round(uint32_t v, const unsigned char *p)
+{
+	v += lz4_read32(p) * XXH_PRIME32_2;
+	return lz4_rotl32(v, 13) * XXH_PRIME32_1;
+}
+
+static void lz4_xxh32_init(struct lz4_xxh32 *state)
+{
+	memset(state, 0, sizeof(*state));
+	state->v[0] = XXH_PRIME32_1 + XXH_PRIME32_2;
+	state->v[1] = XXH_PRIME32_2;
+	state->v[3] = 0 - XXH_PRIME32_1;
+}
+
+static void lz4_xxh32_update(struct lz4_xxh32 *state, const void *data,
+			     size_t len)
+{
+	const unsigned char *p = data;
+	size_t n;
+
+	state->total += len;
+	if (state->buf_len) {
+		n = sizeof(state->buf) - state->buf_len;
+		if (n > len)
+			n = len;
+		memcpy(state->buf + state->buf_len, p, n);
+		state->buf_len += n;
+		p += n;
+		len -= n;
+		if (state->buf_len < sizeof(state->buf))
+			return;
+		for (n = 0; n < 4; n++)
+			state->v[n] = lz4_xxh32_round(state->v[n],
+						      state->buf + 4 * n);
+		state->buf_len = 0;
+	}
+	for (; len >= sizeof(state->buf); len -= sizeof(state->buf)) {
+		for (n = 0; n < 4; n++, p += 4)
+			state->v[n] = lz4_xxh32_round(state->v[n], p);
+	}
+	memcpy(state->buf, p, len);
+	state->buf_len = len;
+}
+
+static uint32_t lz4_xxh32_digest(struct lz4_xxh32 *state)
+{
+	const unsigned char *p = state->buf;
+	unsigned int len = state->buf_len;
+	uint32_t h;
+
+	if (state->total >= sizeof(state->buf))
+		h = lz4_rotl32(state->v[0], 1) + lz4_rotl32(state->v[1], 7) +
+		    lz4_rotl32(state->v[2], 12) + lz4_rotl32(state->v[3], 18);
+	else
+		h = state->v[2] + XXH_PRIME32_5;
+	h += (uint32_t)state->total;
+	for (; len >= 4; len -= 4, p += 4) {
+		h += lz4_read32(p) * XXH_PRIME32_3;
+		h = lz4_rotl32(h, 17) * XXH_PRIME32_4;
+	}
+	for (; len; len--, p++) {
+		h += *p * XXH_PRIME32_5;
+		h = lz4_rotl32(h, 11) * XXH_PRIME32_1;
+	}
+	h ^= h >> 15;
+	h *= XXH_PRIME32_2;
+	h ^= h >> 13;
+	h *= XXH_PRIME32_3;
+	h ^= h >> 16;
+
+	return h;
+}
+
+static uint32_t lz4_xxh32(const void *data, size_t len)
+{
+	struct lz4_xxh32 state;
+
+	lz4_xxh32_init(&state);
+	lz4_xxh32_update(&state, data, len);
+	return lz4_xxh32_digest(&state);
+}
+
+/* Reads the length extension bytes of a literal or match length */
+static int lz4_read_length(const unsigned char **src,
+			   const unsigned char *end, size_t *len)
+{
+	unsigned char b;
+
+	do {
+		if (*src == end)
+			return -RPROC_EINVAL;
+		b = *(*src)++;
+		*len += b;
+	} while (b == 255);
+
+	return 0;
+}
+
+/*
+ * Copies a match of len bytes from off bytes back in the output to op,
+ * through a local buffer. A match overlapping op repeats its off bytes,
+ * which are replicated in the buffer to be written as many at a time as
+ * it holds.
+ */
+static int lz4_copy_match(struct metal_io_region *io, unsigned long op,
+			  size_t off, size_t len)
+{
+	unsigned char buf[LZ4_COPY_SIZE];
+	size_t n, step = 0;
+
+	if (off < len && off < sizeof(buf)) {
+		if (metal_io_block_read(io, op - off, buf, off) != (int)off)
+			return -RPROC_EINVAL;
+		for (step = off; step + off <= sizeof(buf); step += off)
+			memcpy(buf + step, buf, off);
+	}
+	while (len) {
+		if (step) {
+			/* Chunks of step bytes keep the pattern in phase */
+			n = len < step ? len : step;
+		} else {
+			n = len < sizeof(buf) ? len : sizeof(buf);
+			if (metal_io_block_read(io, op - off, buf, n) !=
+			    (int)n)
+				return -RPROC_EINVAL;
+		}
+		if (metal_io_block_write(io, op, buf, n) != (int)n)
+			return -RPROC_EINVAL;
+		op += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Decompresses a block to base + *pos of the io region, the matches
+ * reaching back to base at most
+ */
+static int lz4_decode_block(const unsigned char *src, size_t len,
+			    struct metal_io_region *io, unsigned long base,
+			    size_t *pos, size_t size)
+{
+	const unsigned char *end = src + len;
+	size_t op = *pos;
+	size_t lit, mlen, off;
+	unsigned int token;
+
+	while (1) {
+		if (src == end)
+			return -RPROC_EINVAL;
+		token = *src++;
+		lit = token >> 4;
+		if (lit == 15 && lz4_read_length(&src, end, &lit))
+			return -RPROC_EINVAL;
+		if (lit > (size_t)(end - src) || lit > size - op)
+			return -RPROC_EINVAL;
+		if (lit && metal_io_block_write(io, base + op, src, lit) !=
+			   (int)lit)
+			return -RPROC_EINVAL;
+		op += lit;
+		src += lit;
+		/* The last sequence only has literals */
+		if (src == end)
+			break;
+
+		if (end - src < 2)
+			return -RPROC_EINVAL;
+		off = (size_t)src[0] | (size_t)src[1] << 8;
+		src += 2;
+		if (!off || off > op)
+			return -RPROC_EINVAL;
+		mlen = token & 15;
+		if (mlen == 15 && lz4_read_length(&src, end, &mlen))
+			return -RPROC_EINVAL;
+		mlen += LZ4_MIN_MATCH;
+		if (mlen > size - op ||
+		    lz4_copy_match(io, base + op, off, mlen))
+			return -RPROC_EINVAL;
+		op += mlen;
+	}
+	*pos = op;
+
+	return 0;
+}
+
+/* Adds len bytes of the output at pos to the content checksum */
+static int lz4_xxh32_update_io(struct lz4_xxh32 *state,
+			       struct metal_io_region *io, unsigned long pos,
+			       size_t len)
+{
+	unsigned char buf[LZ4_COPY_SIZE];
+	size_t n;
+
+	while (len) {
+		n = len < sizeof(buf) ? len : sizeof(buf);
+		if (metal_io_block_read(io, pos, buf, n) != (int)n)
+			return -RPROC_EINVAL;
+		lz4_xxh32_update(state, buf, n);
+		pos += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Gets len bytes of the image in local memory */
+static const unsigned char *lz4_load(void *store,
+				     struct image_store_ops *store_ops,
+				     size_t offset, size_t len)
+{
+	const void *data = NULL;
+	int ret;
+
+	ret = store_ops->load(store, offset, len, &data, RPROC_LOAD_ANYADDR,
+			      NULL, 1);
+	if (ret < (int)len || !data)
+		return NULL;
+	return data;
+}
+
+/* Decompresses the frame at *offset, skips it if it is skippable */
+static int lz4_decode_frame(void *store, struct image_store_ops *store_ops,
+			    size_t *offset, size_t end,
+			    struct metal_io_region *io, unsigned long dst,
+			    size_t size, size_t *pos)
+{
+	const unsigned char *p;
+	struct lz4_xxh32 csum;
+	unsigned int flg;
+	uint64_t content_size = 0;
+	size_t hlen, bmax, blen, bstart, pos_in_frame, start = *pos;
+	uint32_t magic, bsize;
+	int ret;
+
+	if (end - *offset < 4)
+		return -RPROC_EINVAL;
+	p = lz4_load(store, store_ops, *offset, end - *offset < 5 ? 4 : 5);
+	if (!p)
+		return -RPROC_EINVAL;
+	magic = lz4_read32(p);
+	if ((magic & LZ4_SKIPPABLE_MASK) == LZ4_SKIPPABLE_MAGIC) {
+		if (end - *offset < 8)
+			return -RPROC_EINVAL;
+		p = lz4_load(store, store_ops, *offset + 4, 4);
+		if (!p || lz4_read32(p) > end - *offset - 8)
+			return -RPROC_EINVAL;
+		*offset += 8 + lz4_read32(p);
+		return 0;
+	}
+	if (magic != LZ4_MAGIC || end - *offset < 5)
+		return -RPROC_EINVAL;
+
+	/* Frame descriptor: FLG, BD, content size, dictionary ID, HC */
+	flg = p[4];
+	if ((flg & LZ4_FLG_VERSION_MASK) != LZ4_FLG_VERSION ||
+	    (flg & (LZ4_FLG_RESERVED | LZ4_FLG_DICT_ID)) != 0)
+		return -RPROC_EINVAL;
+	hlen = 3 + ((flg & LZ4_FLG_CONTENT_SIZE) ? 8 : 0);
+	*offset += 4;
+	if (end - *offset < hlen)
+		return -RPROC_EINVAL;
+	p = lz4_load(store, store_ops, *offset, hlen);
+	if (!p || ((lz4_xxh32(p, hlen - 1) >> 8) & 0xFF) != p[hlen - 1])
+		return -RPROC_EINVAL;
+	bmax = (p[1] & LZ4_BD_MAX_SIZE_MASK) >> LZ4_BD_MAX_SIZE_SHIFT;
+	if (bmax < 4 || (p[1] & ~LZ4_BD_MAX_SIZE_MASK) != 0)
+		return -RPROC_EINVAL;
+	bmax = (size_t)1 << (8 + 2 * bmax);
+	if (flg & LZ4_FLG_CONTENT_SIZE) {
+		content_size = lz4_read32(p + 2) |
+			       (uint64_t)lz4_read32(p + 6) << 32;
+		if (content_size > size - *pos)
+			return -RPROC_EINVAL;
+	}
+	*offset += hlen;
+
+	lz4_xxh32_init(&csum);
+	while (1) {
+		if (end - *offset < 4)
+			return -RPROC_EINVAL;
+		p = lz4_load(store, store_ops, *offset, 4);
+		if (!p)
+			return -RPROC_EINVAL;
+		bsize = lz4_read32(p);
+		*offset += 4;
+		/* End mark */
+		if (!bsize)
+			break;
+
+		blen = bsize & ~LZ4_BLOCK_UNCOMPRESSED;
+		hlen = blen + ((flg & LZ4_FLG_BLOCK_CSUM) ? 4 : 0);
+		if (blen > bmax || end - *offset < hlen)
+			return -RPROC_EINVAL;
+		p = lz4_load(store, store_ops, *offset, hlen);
+		if (!p)
+			return -RPROC_EINVAL;
+		if ((flg & LZ4_FLG_BLOCK_CSUM) &&
+		    lz4_xxh32(p, blen) != lz4_read32(p + blen)) {
+			metal_log(METAL_LOG_ERROR,
+				  "lz4: block checksum mismatch at 0x%lx\r\n",
+				  *offset);
+			return -RPROC_EINVAL;
+		}
+		bstart = *pos;
+		if (bsize & LZ4_BLOCK_UNCOMPRESSED) {
+			if (blen > size - *pos)
+				return -RPROC_EINVAL;
+			if (blen && metal_io_block_write(io, dst + *pos, p,
+							 blen) != (int)blen)
+				return -RPROC_EINVAL;
+			*pos += blen;
+		} else {
+			/* The matches do not reach out of the frame */
+			pos_in_frame = *pos - start;
+			ret = lz4_decode_block(p, blen, io, dst + start,
+					       &pos_in_frame, size - start);
+			if (ret) {
+				metal_log(METAL_LOG_ERROR,
+					  "lz4: corrupted block at 0x%lx\r\n",
+					  *offset);
+				return ret;
+			}
+			*pos = start + pos_in_frame;
+		}
+		if ((flg & LZ4_FLG_CONTENT_CSUM) &&
+		    lz4_xxh32_update_io(&csum, io, dst + bstart,
+					*pos - bstart))
+			return -RPROC_EINVAL;
+		*offset += hlen;
+	}
+
+	if ((flg & LZ4_FLG_CONTENT_SIZE) && *pos - start != content_size)
+		return -RPROC_EINVAL;
+	if (flg & LZ4_FLG_CONTENT_CSUM) {
+		if (end - *offset < 4)
+			return -RPROC_EINVAL;
+		p = lz4_load(store, store_ops, *offset, 4);
+		if (!p || lz4_read32(p) != lz4_xxh32_digest(&csum)) {
+			metal_log(METAL_LOG_ERROR,
+				  "lz4: content checksum mismatch\r\n");
+			return -RPROC_EINVAL;
+		}
+		*offset += 4;
+	}
+
+	return 0;
+}
+
+int remoteproc_lz4_load(void *store, struct image_store_ops *store_ops,
+			size_t offset, size_t len, struct metal_io_region *io,
+			unsigned long dst, size_t size, size_t *dlen)
+{
+	size_t end = offset + len;
+	int ret;
+
+	if (!store_ops || !io || dst == METAL_BAD_OFFSET || !dlen)
+		return -RPROC_EINVAL;
+	*dlen = 0;
+	/* The frames are concatenated, as well as their data */
+	while (offset < end) {
+		ret = lz4_decode_frame(store, store_ops, &offset, end, io,
+				       dst, size, dlen);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
@@ -0,0 +1,48 @@
+/*
+ * LZ4 frame decoder of the remoteproc loader
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _REMOTEPROC_LZ4_H_
+#define _REMOTEPROC_LZ4_H_
+
+#include <stddef.h>
+#include <metal/io.h>
+#include <openamp/remoteproc_loader.h>
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+/**
+ * remoteproc_lz4_load() - decompress LZ4 frames to the target memory
+ * @store: pointer to user defined image store argument
+ * @store_ops: pointer to image store operations
+ * @offset: offset of the frames in the image
+ * @len: size of the frames
+ * @io: io region of the target memory
+ * @dst: offset of the destination in @io
+ * @size: size of the destination
+ * @dlen: filled with the size of the decompressed data
+ *
+ * The frames are read from the image store block by block, each block
+ * being decompressed straight to @dst: no more than a block of compressed
+ * data, 4 MB at most, is held in local memory. The target memory is only
+ * accessed with the metal_io block functions, the matches of the blocks
+ * being read back from @dst. The header, block and content checksums of
+ * the frames are verified, the content checksum being computed over the
+ * data read back from @dst. Skippable frames are skipped.
+ *
+ * Returns 0 on success, a negative error code if the frames are corrupted,
+ * or do not fit in @size bytes.
+ */
+int remoteproc_lz4_load(void *store, struct image_store_ops *store_ops,
+			size_t offset, size_t len, struct metal_io_region *io,
+			unsigned long dst, size_t size, size_t *dlen);
+
+#if defined __cplusplus
+}
+#endif
+
+#endif /* _REMOTEPROC_LZ4_H_ */
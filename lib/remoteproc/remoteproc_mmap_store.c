@@ -0,0 +1,105 @@
+/*
+ * Memory mapped image store, for Linux hosts
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <metal/io.h>
+#include <metal/log.h>
+#include <openamp/remoteproc_mmap_store.h>
+
+static int remoteproc_mmap_store_open(void *store, const char *path,
+				      const void **img_data)
+{
+	struct remoteproc_mmap_store *mstore = store;
+	struct stat st;
+	void *base;
+	int fd;
+
+	if (!mstore || !path)
+		return -RPROC_EINVAL;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		metal_log(METAL_LOG_ERROR, "%s: failed to open %s\r\n",
+			  __func__, path);
+		return -RPROC_ENODEV;
+	}
+	/* The load callbacks return the sizes as int */
+	if (fstat(fd, &st) || st.st_size <= 0 || st.st_size > INT_MAX) {
+		metal_log(METAL_LOG_ERROR, "%s: invalid size of %s\r\n",
+			  __func__, path);
+		close(fd);
+		return -RPROC_EINVAL;
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	/* The mapping holds its own reference to the file */
+	close(fd);
+	if (base == MAP_FAILED) {
+		metal_log(METAL_LOG_ERROR, "%s: failed to map %s\r\n",
+			  __func__, path);
+		return -RPROC_ENOMEM;
+	}
+	/* The segments are mostly read once, in order */
+	(void)madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+	mstore->base = base;
+	mstore->size = st.st_size;
+	*img_data = base;
+	return (int)mstore->size;
+}
+
+static void remoteproc_mmap_store_close(void *store)
+{
+	struct remoteproc_mmap_store *mstore = store;
+
+	if (!mstore->base)
+		return;
+	munmap((void *)mstore->base, mstore->size);
+	mstore->base = NULL;
+	mstore->size = 0;
+}
+
+static int remoteproc_mmap_store_load(void *store, size_t offset,
+				      size_t size, const void **data,
+				      metal_phys_addr_t pa,
+				      struct metal_io_region *io,
+				      char is_blocking)
+{
+	struct remoteproc_mmap_store *mstore = store;
+	const char *src;
+
+	(void)is_blocking;
+
+	if (!mstore->base || offset > mstore->size)
+		return -RPROC_EINVAL;
+	/* Return what the file holds, the loader checks the size */
+	if (size > mstore->size - offset)
+		size = mstore->size - offset;
+	src = (const char *)mstore->base + offset;
+
+	if (pa == RPROC_LOAD_ANYADDR) {
+		/* Point into the mapping, no copy */
+		if (!data)
+			return -RPROC_EINVAL;
+		*data = src;
+		return (int)size;
+	}
+
+	if (!io)
+		return -RPROC_EINVAL;
+	return metal_io_block_write(io, metal_io_phys_to_offset(io, pa), src,
+				    (int)size);
+}
+
+struct image_store_ops remoteproc_mmap_store_ops = {
+	.open = remoteproc_mmap_store_open,
+	.close = remoteproc_mmap_store_close,
+	.load = remoteproc_mmap_store_load,
+	.features = SUPPORT_SEEK | SUPPORT_CONCURRENT_LOAD,
+};
@@ -214,7 +214,7 @@ rproc_virtio_create_vdev(unsigned int role, unsigned int notifyid,
 	if (!vrings_info)
 		goto err0;
 	memset(rpvdev, 0, sizeof(*rpvdev));
-	memset(vrings_info, 0, sizeof(*vrings_info));
+	memset(vrings_info, 0, sizeof(*vrings_info) * num_vrings);
 	vdev = &rpvdev->vdev;
 
 	for (i = 0; i < num_vrings; i++) {
@@ -223,7 +223,12 @@ rproc_virtio_create_vdev(unsigned int role, unsigned int notifyid,
 		unsigned int num_extra_desc = 0;
 
 		vring_rsc = &vdev_rsc->vring[i];
-		if (role == VIRTIO_DEV_MASTER) {
+		/*
+		 * The slave also keeps track of the buffers it gets from a
+		 * packed ring, as it writes them back in any order.
+		 */
+		if (role == VIRTIO_DEV_MASTER ||
+		    (vdev_rsc->dfeatures & VIRTIO_F_RING_PACKED)) {
 			num_extra_desc = vring_rsc->num;
 		}
 		vq = virtqueue_allocate(num_extra_desc);
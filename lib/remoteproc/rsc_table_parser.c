@@ -148,7 +148,7 @@ int handle_vdev_rsc(struct remoteproc *rproc, void *rsc)
 						  notifyid,
 						  notifyid + 1);
 		if (notifyid != RSC_NOTIFY_ID_ANY)
-			vdev_rsc->notifyid = notifyid;
+			vring_rsc->notifyid = notifyid;
 	}
 
 	return 0;
@@ -157,7 +157,8 @@ int handle_vdev_rsc(struct remoteproc *rproc, void *rsc)
 /**
  * handle_trace_rsc
  *
- * trace resource handler.
+ * trace resource handler. The buffer is found again with
+ * remoteproc_get_trace().
  *
  * @param rproc - pointer to remote remoteproc
  * @param rsc   - pointer to trace resource
@@ -8,6 +8,8 @@
  */
 
 #include <openamp/rpmsg.h>
+#include <openamp/rpmsg_frag.h>
+#include <openamp/rpmsg_credit.h>
 #include <metal/alloc.h>
 
 #include "rpmsg_internal.h"
@@ -118,6 +120,12 @@ int rpmsg_send_offchannel_raw(struct rpmsg_endpoint *ept, uint32_t src,
 	if (!ept || !ept->rdev || !data || dst == RPMSG_ADDR_ANY)
 		return RPMSG_ERR_PARAM;
 
+	/* Name service messages are never fragmented */
+	if (ept->frag && dst != RPMSG_NS_EPT_ADDR)
+		return rpmsg_frag_send(ept, src, dst, data, size, wait);
+	if (ept->credit && dst != RPMSG_NS_EPT_ADDR)
+		return rpmsg_credit_send(ept, src, dst, data, size, wait);
+
 	rdev = ept->rdev;
 
 	if (rdev->ops.send_offchannel_raw)
@@ -127,6 +135,154 @@ int rpmsg_send_offchannel_raw(struct rpmsg_endpoint *ept, uint32_t src,
 	return RPMSG_ERR_PARAM;
 }
 
+int rpmsg_send_batch(struct rpmsg_endpoint *ept, const struct rpmsg_msg *msgs,
+		     int num, int wait)
+{
+	struct rpmsg_device *rdev;
+	int i;
+
+	if (!ept || !ept->rdev || !msgs || num <= 0)
+		return RPMSG_ERR_PARAM;
+
+	for (i = 0; i < num; i++) {
+		if (!msgs[i].data || msgs[i].len < 0 ||
+		    msgs[i].dst == RPMSG_ADDR_ANY)
+			return RPMSG_ERR_PARAM;
+	}
+
+	if (ept->credit)
+		return rpmsg_credit_send_batch(ept, msgs, num, wait);
+
+	rdev = ept->rdev;
+
+	if (rdev->ops.send_offchannel_batch)
+		return rdev->ops.send_offchannel_batch(rdev, ept->addr, msgs,
+						       num, wait);
+
+	return RPMSG_ERR_PARAM;
+}
+
+void rpmsg_hold_rx_buffer(struct rpmsg_endpoint *ept, void *rxbuf)
+{
+	struct rpmsg_device *rdev;
+
+	if (!ept || !ept->rdev || !rxbuf)
+		return;
+
+	if (ept->credit) {
+		rpmsg_credit_hold_rx_buffer(ept, rxbuf);
+		return;
+	}
+
+	rdev = ept->rdev;
+
+	if (rdev->ops.hold_rx_buffer)
+		rdev->ops.hold_rx_buffer(rdev, rxbuf);
+}
+
+void rpmsg_release_rx_buffer(struct rpmsg_endpoint *ept, void *rxbuf)
+{
+	struct rpmsg_device *rdev;
+
+	if (!ept || !ept->rdev || !rxbuf)
+		return;
+
+	if (ept->credit) {
+		rpmsg_credit_release_rx_buffer(ept, rxbuf);
+		return;
+	}
+
+	rdev = ept->rdev;
+
+	if (rdev->ops.release_rx_buffer)
+		rdev->ops.release_rx_buffer(rdev, rxbuf);
+}
+
+void *rpmsg_get_tx_payload_buffer(struct rpmsg_endpoint *ept,
+				  uint32_t *len, int wait)
+{
+	struct rpmsg_device *rdev;
+
+	if (!ept || !ept->rdev || !len)
+		return NULL;
+
+	if (ept->credit)
+		return rpmsg_credit_get_tx_payload_buffer(ept, len, wait);
+
+	rdev = ept->rdev;
+
+	if (rdev->ops.get_tx_payload_buffer)
+		return rdev->ops.get_tx_payload_buffer(rdev, ept->addr, len,
+						       wait);
+
+	return NULL;
+}
+
+int rpmsg_release_tx_buffer(struct rpmsg_endpoint *ept, void *txbuf)
+{
+	struct rpmsg_device *rdev;
+
+	if (!ept || !ept->rdev || !txbuf)
+		return RPMSG_ERR_PARAM;
+
+	if (ept->credit)
+		return rpmsg_credit_release_tx_buffer(ept, txbuf);
+
+	rdev = ept->rdev;
+
+	if (rdev->ops.release_tx_buffer)
+		return rdev->ops.release_tx_buffer(rdev, txbuf);
+
+	return RPMSG_ERR_PARAM;
+}
+
+int rpmsg_send_offchannel_nocopy(struct rpmsg_endpoint *ept, uint32_t src,
+				 uint32_t dst, const void *data, int len)
+{
+	struct rpmsg_device *rdev;
+
+	if (!ept || !ept->rdev || !data || dst == RPMSG_ADDR_ANY)
+		return RPMSG_ERR_PARAM;
+
+	if (ept->credit)
+		return rpmsg_credit_send_nocopy(ept, src, dst, data, len);
+
+	rdev = ept->rdev;
+
+	if (rdev->ops.send_offchannel_nocopy)
+		return rdev->ops.send_offchannel_nocopy(rdev, src, dst,
+							data, len);
+
+	return RPMSG_ERR_PARAM;
+}
+
+int rpmsg_send_nocopy_batch(struct rpmsg_endpoint *ept,
+			    const struct rpmsg_msg *msgs, int num)
+{
+	struct rpmsg_device *rdev;
+	int i;
+
+	if (!ept || !ept->rdev || !msgs || num <= 0)
+		return RPMSG_ERR_PARAM;
+
+	for (i = 0; i < num; i++) {
+		if (!msgs[i].data || msgs[i].len < 0 ||
+		    msgs[i].dst == RPMSG_ADDR_ANY)
+			return RPMSG_ERR_PARAM;
+	}
+
+	if (ept->credit)
+		return rpmsg_credit_send_nocopy_batch(ept, msgs, num);
+
+	rdev = ept->rdev;
+
+	if (rdev->ops.send_offchannel_nocopy_batch)
+		return rdev->ops.send_offchannel_nocopy_batch(rdev, ept->addr,
+							      msgs, num);
+
+	return RPMSG_ERR_PARAM;
+}
+
 int rpmsg_send_ns_message(struct rpmsg_endpoint *ept, unsigned long flags)
 {
 	struct rpmsg_ns_msg ns_msg;
@@ -144,13 +300,82 @@ int rpmsg_send_ns_message(struct rpmsg_endpoint *ept, unsigned long flags)
 		return RPMSG_SUCCESS;
 }
 
+/**
+ * rpmsg_ept_addr_hash
+ *
+ * Gets the bucket of an address in the endpoints address table.
+ *
+ * @param addr - endpoint local address
+ *
+ * return - bucket index
+ */
+static inline unsigned int rpmsg_ept_addr_hash(uint32_t addr)
+{
+	return addr & (RPMSG_EPT_HASH_SIZE - 1);
+}
+
+/**
+ * rpmsg_ept_name_hash
+ *
+ * Gets the bucket of a name in the endpoints name table.
+ *
+ * @param name - endpoint name
+ *
+ * return - bucket index
+ */
+static unsigned int rpmsg_ept_name_hash(const char *name)
+{
+	uint32_t hash = 2166136261U;
+	unsigned int i;
+
+	/* FNV-1a */
+	for (i = 0; i < RPMSG_NAME_SIZE && name[i]; i++) {
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619U;
+	}
+
+	return hash & (RPMSG_EPT_HASH_SIZE - 1);
+}
+
 struct rpmsg_endpoint *rpmsg_get_endpoint(struct rpmsg_device *rdev,
 					  const char *name, uint32_t addr,
 					  uint32_t dest_addr)
 {
-	struct metal_list *node;
+	struct metal_list *bucket, *node;
 	struct rpmsg_endpoint *ept;
 
+	/* try to get by local address only */
+	if (!name && addr != RPMSG_ADDR_ANY) {
+		bucket = &rdev->ept_addr_table[rpmsg_ept_addr_hash(addr)];
+		metal_list_for_each(bucket, node) {
+			ept = metal_container_of(node, struct rpmsg_endpoint,
+						 addr_node);
+			if (ept->addr == addr)
+				return ept;
+		}
+		return NULL;
+	}
+
+	/* name service lookup */
+	if (name && addr == RPMSG_ADDR_ANY) {
+		bucket = &rdev->ept_name_table[rpmsg_ept_name_hash(name)];
+		metal_list_for_each(bucket, node) {
+			ept = metal_container_of(node, struct rpmsg_endpoint,
+						 name_node);
+			if (strncmp(ept->name, name, sizeof(ept->name)))
+				continue;
+			/*
+			 * destination address is known, equal to ept remote
+			 * address, or ept is not associated to remote ept
+			 */
+			if ((dest_addr != RPMSG_ADDR_ANY &&
+			     ept->dest_addr == dest_addr) ||
+			    ept->dest_addr == RPMSG_ADDR_ANY)
+				return ept;
+		}
+		return NULL;
+	}
+
 	metal_list_for_each(&rdev->endpoints, node) {
 		int name_match = 0;
 
@@ -186,15 +411,34 @@ static void rpmsg_unregister_endpoint(struct rpmsg_endpoint *ept)
 		rpmsg_release_address(rdev->bitmap, RPMSG_ADDR_BMP_SIZE,
 				      ept->addr);
 	metal_list_del(&ept->node);
+	metal_list_del(&ept->addr_node);
+	metal_list_del(&ept->name_node);
 	ept->rdev = NULL;
+	rdev->ept_gen++;
 	metal_mutex_release(&rdev->lock);
 }
 
 void rpmsg_register_endpoint(struct rpmsg_device *rdev,
 			     struct rpmsg_endpoint *ept)
 {
+	unsigned int addr_hash = rpmsg_ept_addr_hash(ept->addr);
+	unsigned int name_hash = rpmsg_ept_name_hash(ept->name);
+
 	ept->rdev = rdev;
 	metal_list_add_tail(&rdev->endpoints, &ept->node);
+	metal_list_add_tail(&rdev->ept_addr_table[addr_hash], &ept->addr_node);
+	metal_list_add_tail(&rdev->ept_name_table[name_hash], &ept->name_node);
+}
+
+void rpmsg_init_endpoints(struct rpmsg_device *rdev)
+{
+	unsigned int i;
+
+	metal_list_init(&rdev->endpoints);
+	for (i = 0; i < RPMSG_EPT_HASH_SIZE; i++) {
+		metal_list_init(&rdev->ept_addr_table[i]);
+		metal_list_init(&rdev->ept_name_table[i]);
+	}
 }
 
 int rpmsg_create_ept(struct rpmsg_endpoint *ept, struct rpmsg_device *rdev,
@@ -275,4 +519,58 @@ void rpmsg_destroy_ept(struct rpmsg_endpoint *ept)
 	    ept->addr >= RPMSG_RESERVED_ADDRESSES)
 		(void)rpmsg_send_ns_message(ept, RPMSG_NS_DESTROY);
 	rpmsg_unregister_endpoint(ept);
+	if (ept->frag)
+		rpmsg_frag_disable(ept);
+	if (ept->credit)
+		rpmsg_credit_disable(ept);
+}
+
+int rpmsg_set_ept_priority(struct rpmsg_endpoint *ept, unsigned int priority)
+{
+	struct rpmsg_device *rdev;
+
+	if (!ept || !ept->rdev)
+		return RPMSG_ERR_PARAM;
+
+	rdev = ept->rdev;
+	metal_mutex_acquire(&rdev->lock);
+	ept->priority = priority;
+	metal_mutex_release(&rdev->lock);
+
+	return RPMSG_SUCCESS;
+}
+
+int rpmsg_get_stats(struct rpmsg_device *rdev, struct rpmsg_stats *stats)
+{
+	if (!rdev || !stats)
+		return RPMSG_ERR_PARAM;
+
+	memset(stats, 0, sizeof(*stats));
+	if (rdev->ops.get_stats)
+		rdev->ops.get_stats(rdev, stats);
+
+	return RPMSG_SUCCESS;
+}
+
+int rpmsg_get_tx_buffer_size(struct rpmsg_endpoint *ept)
+{
+	struct rpmsg_device *rdev;
+	int size;
+
+	if (!ept || !ept->rdev)
+		return RPMSG_ERR_PARAM;
+
+	rdev = ept->rdev;
+	if (!rdev->ops.get_tx_buffer_size)
+		return RPMSG_ERR_PARAM;
+
+	size = rdev->ops.get_tx_buffer_size(rdev, ept->addr);
+	/* The credit header is part of the payload of the buffers */
+	if (size > 0 && ept->credit) {
+		size -= sizeof(struct rpmsg_credit_hdr);
+		if (size < 0)
+			size = 0;
+	}
+
+	return size;
 }
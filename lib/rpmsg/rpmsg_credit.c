@@ -0,0 +1,647 @@
+/*
+ * RPMsg credit based flow control
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <string.h>
+#include <metal/utilities.h>
+#include <openamp/rpmsg_credit.h>
+
+#include "rpmsg_internal.h"
+
+/* Ticks between two limit requests of a sender waiting for credits */
+#define RPMSG_CREDIT_SYNC_TICKS		1000
+
+#define RPMSG_CREDIT_LOCATE_HDR(p)	((struct rpmsg_credit_hdr *)(p) - 1)
+
+/**
+ * rpmsg_credit_avail
+ *
+ * Returns the number of credits left. The credit lock must be held.
+ *
+ * @param credit - pointer to the flow control context
+ *
+ * @return - number of messages which can be sent
+ */
+static inline uint16_t rpmsg_credit_avail(struct rpmsg_credit *credit)
+{
+	return (uint16_t)(credit->tx_limit - credit->tx_count);
+}
+
+/**
+ * rpmsg_credit_rx_limit
+ *
+ * Returns the limit to send to the remote: the messages consumed so far
+ * plus the window. The credit lock must be held.
+ *
+ * @param credit - pointer to the flow control context
+ *
+ * @return - limit of the messages accepted from the remote
+ */
+static inline uint16_t rpmsg_credit_rx_limit(struct rpmsg_credit *credit)
+{
+	return (uint16_t)(credit->rx_count + credit->window);
+}
+
+/**
+ * rpmsg_credit_set_limit
+ *
+ * Takes the limit carried by a message of the remote, unless a later one
+ * is already known, the senders waiting for credits being woken up.
+ * The credit lock must be held.
+ *
+ * @param credit - pointer to the flow control context
+ * @param hdr    - pointer to the header of the message
+ */
+static void rpmsg_credit_set_limit(struct rpmsg_credit *credit,
+				   const struct rpmsg_credit_hdr *hdr)
+{
+	if (!credit->synced ||
+	    (int16_t)(hdr->limit - credit->tx_limit) > 0) {
+		credit->tx_limit = hdr->limit;
+		atomic_fetch_add(&credit->event, 1);
+	}
+	credit->synced = true;
+}
+
+/**
+ * rpmsg_credit_peek_cb
+ *
+ * Takes the limit of a message not delivered yet to the endpoint. This
+ * does not change the limit taken once the message is delivered, as the
+ * limits only increase. A message carrying nothing else than the limit
+ * may thus be dropped, unless it asks for the limit of the endpoint.
+ *
+ * @param ept  - pointer to the rpmsg endpoint
+ * @param data - message received
+ * @param len  - length of the message
+ * @param src  - source address of the message
+ * @param priv - private data of the endpoint
+ *
+ * @return - 1 if the message can be dropped, RPMSG_SUCCESS otherwise
+ */
+static int rpmsg_credit_peek_cb(struct rpmsg_endpoint *ept, void *data,
+				size_t len, uint32_t src, void *priv)
+{
+	struct rpmsg_credit *credit = ept->credit;
+	struct rpmsg_credit_hdr *hdr = data;
+
+	(void)src;
+	(void)priv;
+
+	if (len < sizeof(*hdr))
+		return RPMSG_SUCCESS;
+
+	metal_mutex_acquire(&credit->lock);
+	rpmsg_credit_set_limit(credit, hdr);
+	metal_mutex_release(&credit->lock);
+
+	return hdr->flags & (RPMSG_CREDIT_F_DATA | RPMSG_CREDIT_F_SYNC) ?
+	       RPMSG_SUCCESS : 1;
+}
+
+/**
+ * rpmsg_credit_ready
+ *
+ * Tells whether a credit is available to a waiting sender, after taking
+ * the limits of the messages received and not delivered yet: a sender in
+ * the context handling the notifications would otherwise never see the
+ * limit it waits for, the endpoint callbacks being called by this context.
+ *
+ * @param arg - pointer to the rpmsg endpoint
+ *
+ * @return - non-zero if a credit is available
+ */
+static int rpmsg_credit_ready(void *arg)
+{
+	struct rpmsg_endpoint *ept = arg;
+	struct rpmsg_credit *credit = ept->credit;
+	struct rpmsg_device *rdev = ept->rdev;
+	int avail;
+
+	if (rdev->ops.peek_rx)
+		rdev->ops.peek_rx(rdev, ept, rpmsg_credit_peek_cb);
+
+	metal_mutex_acquire(&credit->lock);
+	avail = rpmsg_credit_avail(credit) != 0;
+	metal_mutex_release(&credit->lock);
+
+	return avail;
+}
+
+/**
+ * rpmsg_credit_fill_hdr
+ *
+ * Fills the credit header of a message, which carries the current limit.
+ *
+ * @param credit - pointer to the flow control context
+ * @param hdr    - pointer to the header to fill
+ * @param flags  - RPMSG_CREDIT_F_* flags of the message
+ */
+static void rpmsg_credit_fill_hdr(struct rpmsg_credit *credit,
+				  struct rpmsg_credit_hdr *hdr, uint16_t flags)
+{
+	metal_mutex_acquire(&credit->lock);
+	hdr->limit = rpmsg_credit_rx_limit(credit);
+	hdr->flags = credit->synced ? flags : flags | RPMSG_CREDIT_F_SYNC;
+	credit->rx_limit = hdr->limit;
+	metal_mutex_release(&credit->lock);
+}
+
+/**
+ * rpmsg_credit_send_limit
+ *
+ * Sends the current limit in a message without data. No buffer is waited
+ * for: if none is available, the limit is sent with the next message.
+ *
+ * @param ept   - pointer to the rpmsg endpoint
+ * @param dst   - address of the remote endpoint
+ * @param flags - RPMSG_CREDIT_F_* flags of the message
+ *
+ * @return - RPMSG_SUCCESS on success, negative error value otherwise
+ */
+static int rpmsg_credit_send_limit(struct rpmsg_endpoint *ept, uint32_t dst,
+				   uint16_t flags)
+{
+	struct rpmsg_credit *credit = ept->credit;
+	struct rpmsg_device *rdev = ept->rdev;
+	struct rpmsg_credit_hdr hdr;
+	int status;
+
+	if (dst == RPMSG_ADDR_ANY || !rdev->ops.send_offchannel_raw)
+		return RPMSG_ERR_PARAM;
+
+	metal_mutex_acquire(&credit->lock);
+	hdr.limit = rpmsg_credit_rx_limit(credit);
+	hdr.flags = credit->synced ? flags : flags | RPMSG_CREDIT_F_SYNC;
+	metal_mutex_release(&credit->lock);
+
+	status = rdev->ops.send_offchannel_raw(rdev, ept->addr, dst, &hdr,
+					       sizeof(hdr), false);
+	if (status < 0)
+		return status;
+
+	metal_mutex_acquire(&credit->lock);
+	if ((int16_t)(hdr.limit - credit->rx_limit) > 0)
+		credit->rx_limit = hdr.limit;
+	metal_mutex_release(&credit->lock);
+
+	return RPMSG_SUCCESS;
+}
+
+/**
+ * rpmsg_credit_update
+ *
+ * Sends the limit once half of the window has been consumed since it was
+ * last sent, so that the remote gets the credits back in a few messages.
+ *
+ * @param ept   - pointer to the rpmsg endpoint
+ * @param dst   - address of the remote endpoint
+ * @param force - send the limit even if little has been consumed
+ */
+static void rpmsg_credit_update(struct rpmsg_endpoint *ept, uint32_t dst,
+				bool force)
+{
+	struct rpmsg_credit *credit = ept->credit;
+	uint16_t consumed;
+
+	metal_mutex_acquire(&credit->lock);
+	consumed = (uint16_t)(rpmsg_credit_rx_limit(credit) -
+			      credit->rx_limit);
+	metal_mutex_release(&credit->lock);
+
+	if (force || consumed >= (credit->window + 1) / 2)
+		(void)rpmsg_credit_send_limit(ept, dst, 0);
+}
+
+/**
+ * rpmsg_credit_consume
+ *
+ * Accounts a received message as consumed, giving its credit back.
+ *
+ * @param ept - pointer to the rpmsg endpoint
+ * @param dst - address of the remote endpoint
+ */
+static void rpmsg_credit_consume(struct rpmsg_endpoint *ept, uint32_t dst)
+{
+	struct rpmsg_credit *credit = ept->credit;
+
+	metal_mutex_acquire(&credit->lock);
+	credit->rx_count++;
+	metal_mutex_release(&credit->lock);
+
+	rpmsg_credit_update(ept, dst, false);
+}
+
+/**
+ * rpmsg_credit_take
+ *
+ * Takes the credit of a message to send. Without a limit from the remote
+ * yet, the caller asks for it. Out of credits, the caller waits for the
+ * remote to raise the limit, asking it again from time to time in case
+ * it could not send it. The messages not delivered yet are checked for
+ * the limit before each sleep.
+ *
+ * @param ept  - pointer to the rpmsg endpoint
+ * @param dst  - address of the remote endpoint
+ * @param wait - boolean, wait or not for a credit
+ *
+ * @return - RPMSG_SUCCESS on success, RPMSG_ERR_NO_BUFF if out of credits
+ */
+static int rpmsg_credit_take(struct rpmsg_endpoint *ept, uint32_t dst,
+			     int wait)
+{
+	struct rpmsg_credit *credit = ept->credit;
+	int sync_ticks;
+	int tick_count;
+	int ticks;
+	unsigned int event;
+
+	if (wait)
+		tick_count = RPMSG_TICK_COUNT / RPMSG_TICKS_PER_INTERVAL;
+	else
+		tick_count = 0;
+
+	metal_mutex_acquire(&credit->lock);
+	if (!rpmsg_credit_avail(credit))
+		credit->stalls++;
+	/* Ask for the limit at once if none has been received yet */
+	sync_ticks = credit->synced ? RPMSG_CREDIT_SYNC_TICKS : 0;
+	while (!rpmsg_credit_avail(credit)) {
+		if (!sync_ticks) {
+			metal_mutex_release(&credit->lock);
+			(void)rpmsg_credit_send_limit(ept, dst,
+						      RPMSG_CREDIT_F_SYNC);
+			metal_mutex_acquire(&credit->lock);
+			sync_ticks = RPMSG_CREDIT_SYNC_TICKS;
+			continue;
+		}
+		if (!tick_count) {
+			metal_mutex_release(&credit->lock);
+			return RPMSG_ERR_NO_BUFF;
+		}
+		/* Wake up for the next limit request at the latest */
+		ticks = tick_count < sync_ticks ? tick_count : sync_ticks;
+		event = atomic_load(&credit->event);
+		metal_mutex_release(&credit->lock);
+		ticks = rpmsg_wait_event(&credit->event, event,
+					 rpmsg_credit_ready, ept, ticks);
+		tick_count -= ticks;
+		sync_ticks -= ticks;
+		metal_mutex_acquire(&credit->lock);
+	}
+	credit->tx_count++;
+	metal_mutex_release(&credit->lock);
+
+	return RPMSG_SUCCESS;
+}
+
+/**
+ * rpmsg_credit_give_back
+ *
+ * Gives back the credit of a message which is not sent.
+ *
+ * @param credit - pointer to the flow control context
+ */
+static void rpmsg_credit_give_back(struct rpmsg_credit *credit)
+{
+	metal_mutex_acquire(&credit->lock);
+	credit->tx_count--;
+	metal_mutex_release(&credit->lock);
+}
+
+/**
+ * rpmsg_credit_get_tx_buffer
+ *
+ * Takes a credit and a TX buffer, whose payload begins with the credit
+ * header.
+ *
+ * @param ept  - pointer to the rpmsg endpoint
+ * @param src  - source address
+ * @param dst  - address of the remote endpoint
+ * @param len  - size of the returned buffer, header excluded
+ * @param wait - boolean, wait or not for a credit and a buffer
+ *
+ * @return - pointer to the credit header of the buffer, NULL on failure
+ */
+static struct rpmsg_credit_hdr *
+rpmsg_credit_get_tx_buffer(struct rpmsg_endpoint *ept, uint32_t src,
+			   uint32_t dst, uint32_t *len, int wait)
+{
+	struct rpmsg_device *rdev = ept->rdev;
+	struct rpmsg_credit_hdr *hdr;
+
+	if (!rdev->ops.get_tx_payload_buffer || !rdev->ops.release_tx_buffer)
+		return NULL;
+
+	if (rpmsg_credit_take(ept, dst, wait))
+		return NULL;
+
+	hdr = rdev->ops.get_tx_payload_buffer(rdev, src, len, wait);
+	if (hdr && *len < sizeof(*hdr)) {
+		rdev->ops.release_tx_buffer(rdev, hdr);
+		hdr = NULL;
+	}
+	if (!hdr) {
+		rpmsg_credit_give_back(ept->credit);
+		return NULL;
+	}
+	*len -= sizeof(*hdr);
+
+	return hdr;
+}
+
+/**
+ * rpmsg_credit_rx_cb
+ *
+ * Endpoint callback of the endpoints with flow control. It takes the limit
+ * of the remote, then calls the user callback with the data, if any.
+ *
+ * @param ept  - pointer to the rpmsg endpoint
+ * @param data - message received
+ * @param len  - length of the message
+ * @param src  - source address of the message
+ * @param priv - private data of the endpoint
+ *
+ * @return - return value of the user callback, or RPMSG_SUCCESS
+ */
+static int rpmsg_credit_rx_cb(struct rpmsg_endpoint *ept, void *data,
+			      size_t len, uint32_t src, void *priv)
+{
+	struct rpmsg_credit *credit = ept->credit;
+	struct rpmsg_credit_hdr *hdr = data;
+	int status = RPMSG_SUCCESS;
+
+	if (len < sizeof(*hdr))
+		return RPMSG_SUCCESS;
+
+	metal_mutex_acquire(&credit->lock);
+	rpmsg_credit_set_limit(credit, hdr);
+	metal_mutex_release(&credit->lock);
+
+	if (hdr->flags & RPMSG_CREDIT_F_DATA) {
+		credit->held = false;
+		status = credit->cb(ept, hdr + 1, len - sizeof(*hdr), src,
+				    priv);
+		/* A held message gives its credit back once released */
+		if (!credit->held) {
+			metal_mutex_acquire(&credit->lock);
+			credit->rx_count++;
+			metal_mutex_release(&credit->lock);
+		}
+	}
+	rpmsg_credit_update(ept, src, hdr->flags & RPMSG_CREDIT_F_SYNC);
+
+	return status;
+}
+
+int rpmsg_credit_enable(struct rpmsg_endpoint *ept,
+			struct rpmsg_credit *credit, uint32_t window)
+{
+	if (!ept || !ept->rdev || !ept->cb || !credit || ept->credit ||
+	    ept->frag || !window || window > RPMSG_CREDIT_MAX_WINDOW)
+		return RPMSG_ERR_PARAM;
+
+	credit->cb = ept->cb;
+	credit->window = window;
+	credit->tx_count = 0;
+	credit->tx_limit = 0;
+	credit->rx_count = 0;
+	credit->rx_limit = 0;
+	credit->synced = false;
+	credit->held = false;
+	credit->stalls = 0;
+	metal_mutex_init(&credit->lock);
+	atomic_init(&credit->event, 0);
+
+	/*
+	 * Nothing is sent yet, the remote may not have enabled its flow
+	 * control: the limits are exchanged with the first message sent.
+	 */
+	ept->credit = credit;
+	ept->cb = rpmsg_credit_rx_cb;
+
+	return RPMSG_SUCCESS;
+}
+
+void rpmsg_credit_disable(struct rpmsg_endpoint *ept)
+{
+	struct rpmsg_credit *credit;
+
+	if (!ept || !ept->credit)
+		return;
+
+	credit = ept->credit;
+	ept->cb = credit->cb;
+	ept->credit = NULL;
+	metal_mutex_deinit(&credit->lock);
+}
+
+int rpmsg_credit_get_tx_credits(struct rpmsg_endpoint *ept)
+{
+	struct rpmsg_credit *credit;
+	int avail;
+
+	if (!ept || !ept->credit)
+		return RPMSG_ERR_PARAM;
+
+	credit = ept->credit;
+	metal_mutex_acquire(&credit->lock);
+	avail = rpmsg_credit_avail(credit);
+	metal_mutex_release(&credit->lock);
+
+	return avail;
+}
+
+int rpmsg_credit_send(struct rpmsg_endpoint *ept, uint32_t src, uint32_t dst,
+		      const void *data, int len, int wait)
+{
+	struct rpmsg_device *rdev = ept->rdev;
+	struct rpmsg_credit_hdr *hdr;
+	uint32_t buf_len;
+	int status;
+
+	if (!rdev->ops.send_offchannel_nocopy || len < 0)
+		return RPMSG_ERR_PARAM;
+
+	hdr = rpmsg_credit_get_tx_buffer(ept, src, dst, &buf_len, wait);
+	if (!hdr)
+		return RPMSG_ERR_NO_BUFF;
+	if ((uint32_t)len > buf_len) {
+		rdev->ops.release_tx_buffer(rdev, hdr);
+		rpmsg_credit_give_back(ept->credit);
+		return RPMSG_ERR_BUFF_SIZE;
+	}
+
+	rpmsg_credit_fill_hdr(ept->credit, hdr, RPMSG_CREDIT_F_DATA);
+	memcpy(hdr + 1, data, len);
+	status = rdev->ops.send_offchannel_nocopy(rdev, src, dst, hdr,
+						  sizeof(*hdr) + len);
+
+	return status < 0 ? status : len;
+}
+
+int rpmsg_credit_send_batch(struct rpmsg_endpoint *ept,
+			    const struct rpmsg_msg *msgs, int num, int wait)
+{
+	struct rpmsg_msg batch[RPMSG_CREDIT_BATCH_SIZE];
+	struct rpmsg_device *rdev = ept->rdev;
+	struct rpmsg_credit_hdr *hdr;
+	uint32_t buf_len;
+	int err = RPMSG_ERR_NO_BUFF;
+	int sent = 0;
+	int n;
+
+	if (!rdev->ops.send_offchannel_nocopy_batch)
+		return RPMSG_ERR_PARAM;
+
+	while (sent < num) {
+		for (n = 0; n < RPMSG_CREDIT_BATCH_SIZE && sent + n < num;
+		     n++) {
+			const struct rpmsg_msg *msg = &msgs[sent + n];
+
+			/*
+			 * The credits and buffers of a batch are only given
+			 * back once it is sent, so only the first one is
+			 * waited for.
+			 */
+			hdr = rpmsg_credit_get_tx_buffer(ept, ept->addr,
+							 msg->dst, &buf_len,
+							 n ? false : wait);
+			if (!hdr)
+				break;
+			if ((uint32_t)msg->len > buf_len) {
+				rdev->ops.release_tx_buffer(rdev, hdr);
+				rpmsg_credit_give_back(ept->credit);
+				err = RPMSG_ERR_BUFF_SIZE;
+				break;
+			}
+
+			rpmsg_credit_fill_hdr(ept->credit, hdr,
+					      RPMSG_CREDIT_F_DATA);
+			memcpy(hdr + 1, msg->data, msg->len);
+			batch[n].dst = msg->dst;
+			batch[n].data = hdr;
+			batch[n].len = sizeof(*hdr) + msg->len;
+		}
+		if (!n)
+			break;
+		(void)rdev->ops.send_offchannel_nocopy_batch(rdev, ept->addr,
+							     batch, n);
+		sent += n;
+		if (err == RPMSG_ERR_BUFF_SIZE)
+			break;
+	}
+
+	return sent ? sent : err;
+}
+
+void *rpmsg_credit_get_tx_payload_buffer(struct rpmsg_endpoint *ept,
+					 uint32_t *len, int wait)
+{
+	struct rpmsg_credit_hdr *hdr;
+
+	hdr = rpmsg_credit_get_tx_buffer(ept, ept->addr, ept->dest_addr, len,
+					 wait);
+
+	return hdr ? hdr + 1 : NULL;
+}
+
+int rpmsg_credit_release_tx_buffer(struct rpmsg_endpoint *ept, void *txbuf)
+{
+	struct rpmsg_device *rdev = ept->rdev;
+	int status;
+
+	if (!rdev->ops.release_tx_buffer)
+		return RPMSG_ERR_PARAM;
+
+	status = rdev->ops.release_tx_buffer(rdev,
+					     RPMSG_CREDIT_LOCATE_HDR(txbuf));
+	if (!status)
+		rpmsg_credit_give_back(ept->credit);
+
+	return status;
+}
+
+int rpmsg_credit_send_nocopy(struct rpmsg_endpoint *ept, uint32_t src,
+			     uint32_t dst, const void *data, int len)
+{
+	struct rpmsg_device *rdev = ept->rdev;
+	struct rpmsg_credit_hdr *hdr = RPMSG_CREDIT_LOCATE_HDR(data);
+	int status;
+
+	if (!rdev->ops.send_offchannel_nocopy || len < 0)
+		return RPMSG_ERR_PARAM;
+
+	rpmsg_credit_fill_hdr(ept->credit, hdr, RPMSG_CREDIT_F_DATA);
+	status = rdev->ops.send_offchannel_nocopy(rdev, src, dst, hdr,
+						  sizeof(*hdr) + len);
+
+	return status < 0 ? status : len;
+}
+
+int rpmsg_credit_send_nocopy_batch(struct rpmsg_endpoint *ept,
+				   const struct rpmsg_msg *msgs, int num)
+{
+	struct rpmsg_msg batch[RPMSG_CREDIT_BATCH_SIZE];
+	struct rpmsg_device *rdev = ept->rdev;
+	struct rpmsg_credit_hdr *hdr;
+	int sent = 0;
+	int status;
+	int n;
+
+	if (!rdev->ops.send_offchannel_nocopy_batch)
+		return RPMSG_ERR_PARAM;
+
+	while (sent < num) {
+		for (n = 0; n < RPMSG_CREDIT_BATCH_SIZE && sent + n < num;
+		     n++) {
+			const struct rpmsg_msg *msg = &msgs[sent + n];
+
+			hdr = RPMSG_CREDIT_LOCATE_HDR(msg->data);
+			rpmsg_credit_fill_hdr(ept->credit, hdr,
+					      RPMSG_CREDIT_F_DATA);
+			batch[n].dst = msg->dst;
+			batch[n].data = hdr;
+			batch[n].len = sizeof(*hdr) + msg->len;
+		}
+		status = rdev->ops.send_offchannel_nocopy_batch(rdev,
+								ept->addr,
+								batch, n);
+		if (status < 0)
+			return sent ? sent : status;
+		sent += n;
+	}
+
+	return sent;
+}
+
+void rpmsg_credit_hold_rx_buffer(struct rpmsg_endpoint *ept, void *rxbuf)
+{
+	struct rpmsg_device *rdev = ept->rdev;
+
+	if (!rdev->ops.hold_rx_buffer)
+		return;
+
+	ept->credit->held = true;
+	rdev->ops.hold_rx_buffer(rdev, RPMSG_CREDIT_LOCATE_HDR(rxbuf));
+}
+
+void rpmsg_credit_release_rx_buffer(struct rpmsg_endpoint *ept, void *rxbuf)
+{
+	struct rpmsg_device *rdev = ept->rdev;
+	struct rpmsg_credit_hdr *hdr = RPMSG_CREDIT_LOCATE_HDR(rxbuf);
+	uint32_t src;
+
+	if (!rdev->ops.release_rx_buffer)
+		return;
+
+	/*
+	 * The credit goes back to the sender of the message, the endpoint
+	 * may not be bound to it
+	 */
+	src = RPMSG_LOCATE_HDR(hdr)->src;
+	rdev->ops.release_rx_buffer(rdev, hdr);
+	rpmsg_credit_consume(ept, src);
+}
@@ -0,0 +1,221 @@
+/*
+ * RPMsg large message fragmentation
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <string.h>
+#include <metal/alloc.h>
+#include <metal/utilities.h>
+#include <openamp/rpmsg_frag.h>
+
+#include "rpmsg_internal.h"
+
+/**
+ * rpmsg_frag_reset
+ *
+ * Forgets the message being reassembled, freeing its buffer if it was
+ * allocated.
+ *
+ * @param frag - pointer to the fragmentation context
+ */
+static void rpmsg_frag_reset(struct rpmsg_frag *frag)
+{
+	if (frag->msg && frag->msg != frag->buf)
+		metal_free_memory(frag->msg);
+	frag->msg = NULL;
+	frag->msg_len = 0;
+	frag->offset = 0;
+}
+
+/**
+ * rpmsg_frag_drop
+ *
+ * Drops the message being reassembled, if any.
+ *
+ * @param frag - pointer to the fragmentation context
+ */
+static void rpmsg_frag_drop(struct rpmsg_frag *frag)
+{
+	if (frag->msg_len) {
+		frag->dropped++;
+		rpmsg_frag_reset(frag);
+	}
+}
+
+/**
+ * rpmsg_frag_rx_cb
+ *
+ * Endpoint callback of the fragmenting endpoints. It copies the fragments
+ * into the reassembly buffer and calls the user callback once the whole
+ * message is received.
+ *
+ * @param ept  - pointer to the rpmsg endpoint
+ * @param data - fragment received
+ * @param len  - length of the fragment
+ * @param src  - source address of the fragment
+ * @param priv - private data of the endpoint
+ *
+ * @return - return value of the user callback, or RPMSG_SUCCESS
+ */
+static int rpmsg_frag_rx_cb(struct rpmsg_endpoint *ept, void *data,
+			    size_t len, uint32_t src, void *priv)
+{
+	struct rpmsg_frag *frag = ept->frag;
+	struct rpmsg_frag_hdr *hdr = data;
+	size_t chunk;
+	int status;
+
+	if (len < sizeof(*hdr)) {
+		frag->dropped++;
+		return RPMSG_SUCCESS;
+	}
+	chunk = len - sizeof(*hdr);
+
+	if (!hdr->offset) {
+		/* First fragment, the previous message will not complete */
+		rpmsg_frag_drop(frag);
+		if (chunk == hdr->msg_len)
+			return frag->cb(ept, hdr + 1, chunk, src, priv);
+
+		if (chunk > hdr->msg_len || hdr->msg_len > frag->size) {
+			frag->dropped++;
+			return RPMSG_SUCCESS;
+		}
+		if (frag->buf)
+			frag->msg = frag->buf;
+		else
+			frag->msg = metal_allocate_memory(hdr->msg_len);
+		if (!frag->msg) {
+			frag->dropped++;
+			return RPMSG_SUCCESS;
+		}
+		frag->msg_len = hdr->msg_len;
+		frag->src = src;
+	} else if (!frag->msg_len || src != frag->src ||
+		   hdr->msg_len != frag->msg_len ||
+		   hdr->offset != frag->offset) {
+		/* A fragment is missing, wait for the next message */
+		rpmsg_frag_drop(frag);
+		return RPMSG_SUCCESS;
+	} else if (chunk > frag->msg_len - frag->offset) {
+		rpmsg_frag_drop(frag);
+		return RPMSG_SUCCESS;
+	}
+
+	memcpy(frag->msg + frag->offset, hdr + 1, chunk);
+	frag->offset += chunk;
+	if (frag->offset < frag->msg_len)
+		return RPMSG_SUCCESS;
+
+	status = frag->cb(ept, frag->msg, frag->msg_len, src, priv);
+	rpmsg_frag_reset(frag);
+
+	return status;
+}
+
+int rpmsg_frag_enable(struct rpmsg_endpoint *ept, struct rpmsg_frag *frag,
+		      void *buf, size_t size)
+{
+	if (!ept || !ept->rdev || !ept->cb || !frag || ept->frag ||
+	    ept->credit)
+		return RPMSG_ERR_PARAM;
+	if (size > UINT32_MAX)
+		size = UINT32_MAX;
+
+	frag->cb = ept->cb;
+	frag->buf = buf;
+	frag->size = size;
+	frag->msg = NULL;
+	frag->msg_len = 0;
+	frag->offset = 0;
+	frag->src = RPMSG_ADDR_ANY;
+	frag->dropped = 0;
+	metal_mutex_init(&frag->tx_lock);
+
+	ept->frag = frag;
+	ept->cb = rpmsg_frag_rx_cb;
+
+	return RPMSG_SUCCESS;
+}
+
+void rpmsg_frag_disable(struct rpmsg_endpoint *ept)
+{
+	struct rpmsg_frag *frag;
+
+	if (!ept || !ept->frag)
+		return;
+
+	frag = ept->frag;
+	ept->cb = frag->cb;
+	ept->frag = NULL;
+	rpmsg_frag_reset(frag);
+	metal_mutex_deinit(&frag->tx_lock);
+}
+
+int rpmsg_frag_send(struct rpmsg_endpoint *ept, uint32_t src, uint32_t dst,
+		    const void *data, int len, int wait)
+{
+	struct rpmsg_msg msgs[RPMSG_FRAG_BATCH_SIZE];
+	struct rpmsg_device *rdev;
+	struct rpmsg_frag_hdr *hdr;
+	uint32_t buf_len, chunk;
+	int offset = 0;
+	int status = len;
+	int num;
+
+	if (!ept || !ept->rdev || !ept->frag || !data || len < 0 ||
+	    dst == RPMSG_ADDR_ANY)
+		return RPMSG_ERR_PARAM;
+
+	rdev = ept->rdev;
+	if (!rdev->ops.get_tx_payload_buffer ||
+	    !rdev->ops.release_tx_buffer ||
+	    !rdev->ops.send_offchannel_nocopy_batch)
+		return RPMSG_ERR_PARAM;
+
+	metal_mutex_acquire(&ept->frag->tx_lock);
+	do {
+		for (num = 0; num < RPMSG_FRAG_BATCH_SIZE; num++) {
+			if (num && offset == len)
+				break;
+			/*
+			 * The buffers of a batch are only given back by the
+			 * remote once sent, so only the first one is waited
+			 * for. A message is completed once started.
+			 */
+			hdr = rdev->ops.get_tx_payload_buffer(rdev, src,
+							      &buf_len,
+							      num ? false :
+							      offset ? true :
+							      wait);
+			if (!hdr)
+				break;
+			if (buf_len <= sizeof(*hdr)) {
+				rdev->ops.release_tx_buffer(rdev, hdr);
+				status = RPMSG_ERR_BUFF_SIZE;
+				break;
+			}
+
+			chunk = metal_min((uint32_t)(len - offset),
+					  buf_len - sizeof(*hdr));
+			hdr->msg_len = len;
+			hdr->offset = offset;
+			memcpy(hdr + 1, (const char *)data + offset, chunk);
+			msgs[num].dst = dst;
+			msgs[num].data = hdr;
+			msgs[num].len = sizeof(*hdr) + chunk;
+			offset += chunk;
+		}
+		if (!num) {
+			if (status >= 0)
+				status = RPMSG_ERR_NO_BUFF;
+			break;
+		}
+		(void)rdev->ops.send_offchannel_nocopy_batch(rdev, src, msgs,
+							     num);
+	} while (offset < len && status >= 0);
+	metal_mutex_release(&ept->frag->tx_lock);
+
+	return status;
+}
@@ -9,6 +9,9 @@
 
 #include <stdint.h>
 #include <openamp/rpmsg.h>
+#include <metal/atomic.h>
+#include <metal/cpu.h>
+#include <metal/sleep.h>
 
 #if defined __cplusplus
 extern "C" {
@@ -35,7 +38,91 @@ extern "C" {
 	} while (0)
 #endif
 
+/* Total tick count for 15secs - 1usec tick. */
+#define RPMSG_TICK_COUNT                        15000000
+
+/* Time to wait - In multiple of 1 msecs. */
+#define RPMSG_TICKS_PER_INTERVAL                1000
+
+/*
+ * Number of polls of an event counter before the waiter sleeps: the
+ * events which come within the polls are seen in microseconds.
+ */
+#ifndef RPMSG_WAIT_EVENT_POLLS
+#define RPMSG_WAIT_EVENT_POLLS                  1000
+#endif
+
+/*
+ * First sleep of a waiter once done polling, in usecs: the sleeps double up
+ * to a tick, so that the wake-up latency of a wait is bounded by its length
+ * while the sleeps of a long one are not lengthened by the timer slack.
+ */
+#ifndef RPMSG_WAIT_EVENT_SLEEP_USEC
+#define RPMSG_WAIT_EVENT_SLEEP_USEC             50
+#endif
+
+/**
+ * rpmsg_wait_event - wait for an event counter to move
+ *
+ * Polls @event, then sleeps by steps doubling from
+ * RPMSG_WAIT_EVENT_SLEEP_USEC to a tick, until it differs from @seen,
+ * @ready reports the awaited state, or @ticks ticks have been slept.
+ * libmetal has no timed condition wait, so the waiters of the remote events
+ * wait on counters bumped by the event handlers, checked after each sleep,
+ * and a stalled remote cannot block them for longer than their tick budget.
+ * @ready is checked along with the counter for the waiters which may run
+ * in the context of the event handler, and would otherwise never see the
+ * event, e.g. a sender in an endpoint callback waiting for TX buffers.
+ *
+ * @event: counter of the events
+ * @seen: value of the counter read before the wait, with the lock
+ *        protecting the awaited state held
+ * @ready: checks the awaited state, NULL if only @event is waited for
+ * @arg: argument of @ready
+ * @ticks: maximum number of ticks to sleep
+ *
+ * Returns the number of ticks slept, rounded up, to be charged to the
+ * caller budget.
+ */
+static inline int rpmsg_wait_event(atomic_uint *event, unsigned int seen,
+				   int (*ready)(void *arg), void *arg,
+				   int ticks)
+{
+	int polls = 0, slept = 0, step = RPMSG_WAIT_EVENT_SLEEP_USEC;
+	int budget = ticks * RPMSG_TICKS_PER_INTERVAL;
+
+	while (atomic_load(event) == seen && !(ready && ready(arg))) {
+		if (polls < RPMSG_WAIT_EVENT_POLLS) {
+			polls++;
+			metal_cpu_yield();
+			continue;
+		}
+		if (slept >= budget)
+			break;
+		if (step > budget - slept)
+			step = budget - slept;
+		metal_sleep_usec(step);
+		slept += step;
+		if (step < RPMSG_TICKS_PER_INTERVAL / 2)
+			step *= 2;
+		else
+			step = RPMSG_TICKS_PER_INTERVAL;
+	}
+
+	return (slept + RPMSG_TICKS_PER_INTERVAL - 1) /
+	       RPMSG_TICKS_PER_INTERVAL;
+}
+
+/* Adds to a device counter, with RPMSG_STATS */
+#ifdef RPMSG_STATS
+#define RPMSG_STATS_ADD(_stats, _field, _n)	((_stats)->_field += (_n))
+#else
+#define RPMSG_STATS_ADD(_stats, _field, _n)	do { (void)(_n); } while (0)
+#endif
+
 #define RPMSG_LOCATE_DATA(p) ((unsigned char *)(p) + sizeof(struct rpmsg_hdr))
+#define RPMSG_LOCATE_HDR(p) \
+	((struct rpmsg_hdr *)((unsigned char *)(p) - sizeof(struct rpmsg_hdr)))
 /**
  * enum rpmsg_ns_flags - dynamic name service announcement flags
  *
@@ -112,15 +199,37 @@ static inline void rpmsg_initialize_ept(struct rpmsg_endpoint *ept,
 	ept->dest_addr = dest;
 	ept->cb = cb;
 	ept->ns_unbind_cb = ns_unbind_cb;
+	ept->frag = NULL;
+	ept->priority = 0;
+	ept->credit = NULL;
 }
 
 int rpmsg_send_ns_message(struct rpmsg_endpoint *ept, unsigned long flags);
 
+/*
+ * Functions of the endpoints with flow control, called by their rpmsg_*()
+ * counterparts, see rpmsg_credit.h
+ */
+int rpmsg_credit_send(struct rpmsg_endpoint *ept, uint32_t src, uint32_t dst,
+		      const void *data, int len, int wait);
+int rpmsg_credit_send_batch(struct rpmsg_endpoint *ept,
+			    const struct rpmsg_msg *msgs, int num, int wait);
+void *rpmsg_credit_get_tx_payload_buffer(struct rpmsg_endpoint *ept,
+					 uint32_t *len, int wait);
+int rpmsg_credit_release_tx_buffer(struct rpmsg_endpoint *ept, void *txbuf);
+int rpmsg_credit_send_nocopy(struct rpmsg_endpoint *ept, uint32_t src,
+			     uint32_t dst, const void *data, int len);
+int rpmsg_credit_send_nocopy_batch(struct rpmsg_endpoint *ept,
+				   const struct rpmsg_msg *msgs, int num);
+void rpmsg_credit_hold_rx_buffer(struct rpmsg_endpoint *ept, void *rxbuf);
+void rpmsg_credit_release_rx_buffer(struct rpmsg_endpoint *ept, void *rxbuf);
+
 struct rpmsg_endpoint *rpmsg_get_endpoint(struct rpmsg_device *rvdev,
 					  const char *name, uint32_t addr,
 					  uint32_t dest_addr);
 void rpmsg_register_endpoint(struct rpmsg_device *rdev,
 			     struct rpmsg_endpoint *ept);
+void rpmsg_init_endpoints(struct rpmsg_device *rdev);
 
 static inline struct rpmsg_endpoint *
 rpmsg_get_ept_from_addr(struct rpmsg_device *rdev, uint32_t addr)
@@ -0,0 +1,178 @@
+/*
+ * RPMsg binary trace ring
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include <metal/time.h>
+#include <metal/utilities.h>
+#include <openamp/rpmsg_trace.h>
+
+/* Smallest ring, so that seq - 1 never is the seq of the same entry */
+#define RPMSG_TRACE_MIN_ENTRIES	2
+
+static const char * const rpmsg_trace_names[] = {
+	[RPMSG_TRACE_SEND] = "send",
+	[RPMSG_TRACE_ENQUEUE] = "enqueue",
+	[RPMSG_TRACE_KICK] = "kick",
+	[RPMSG_TRACE_NOTIFY] = "notify",
+	[RPMSG_TRACE_CB_ENTER] = "cb_enter",
+	[RPMSG_TRACE_CB_EXIT] = "cb_exit",
+	[RPMSG_TRACE_BUF_RETURN] = "buf_return",
+	[RPMSG_TRACE_NO_BUFF] = "no_buff",
+};
+
+/**
+ * rpmsg_trace_is_busy
+ *
+ * Tells whether an entry is being written. A writer marks the entry of
+ * sequence number seq with seq - 1, which is never the sequence number of
+ * an entry at the same place.
+ *
+ * @param trace - pointer to the trace ring
+ * @param entry - pointer to the entry
+ * @param seq   - sequence number read from the entry
+ *
+ * @return - true if the entry is being written
+ */
+static inline bool rpmsg_trace_is_busy(struct rpmsg_trace *trace,
+				       struct rpmsg_trace_entry *entry,
+				       uint32_t seq)
+{
+	uint32_t slot = (uint32_t)(entry - trace->entries);
+
+	return ((seq + 1) & (trace->num_entries - 1)) == slot;
+}
+
+struct rpmsg_trace *rpmsg_trace_init(void *mem, size_t size)
+{
+	struct rpmsg_trace *trace = mem;
+	uint32_t num = 1, i;
+
+	if (!mem || size < sizeof(*trace))
+		return NULL;
+	size = (size - sizeof(*trace)) / sizeof(struct rpmsg_trace_entry);
+	if (size < RPMSG_TRACE_MIN_ENTRIES)
+		return NULL;
+	while (num <= size / 2 && num < 0x80000000U)
+		num <<= 1;
+
+	memset(trace, 0, sizeof(*trace));
+	trace->version = RPMSG_TRACE_VERSION;
+	trace->entry_size = sizeof(struct rpmsg_trace_entry);
+	trace->num_entries = num;
+	/* Entry i holds seq i - num: none of them is written */
+	for (i = 0; i < num; i++) {
+		memset(&trace->entries[i], 0, sizeof(trace->entries[i]));
+		atomic_init(&trace->entries[i].seq, i - num);
+	}
+	atomic_init(&trace->head, 0);
+	atomic_thread_fence(memory_order_seq_cst);
+	trace->magic = RPMSG_TRACE_MAGIC;
+
+	return trace;
+}
+
+struct rpmsg_trace *rpmsg_trace_open(void *mem, size_t size)
+{
+	struct rpmsg_trace *trace = mem;
+	uint32_t num;
+
+	if (!mem || size < sizeof(*trace) || trace->magic != RPMSG_TRACE_MAGIC ||
+	    trace->version != RPMSG_TRACE_VERSION ||
+	    trace->entry_size != sizeof(struct rpmsg_trace_entry))
+		return NULL;
+	num = trace->num_entries;
+	if (num < RPMSG_TRACE_MIN_ENTRIES || (num & (num - 1)) ||
+	    num > (size - sizeof(*trace)) / sizeof(struct rpmsg_trace_entry))
+		return NULL;
+
+	return trace;
+}
+
+void rpmsg_trace_record(struct rpmsg_trace *trace, uint16_t event,
+			uint16_t queue, uint32_t arg0, uint32_t arg1,
+			uint32_t arg2, uint32_t arg3)
+{
+	struct rpmsg_trace_entry *entry;
+	uint32_t seq, cur;
+
+	seq = atomic_fetch_add_explicit(&trace->head, 1, memory_order_relaxed);
+	entry = &trace->entries[seq & (trace->num_entries - 1)];
+
+	/*
+	 * Mark the entry busy, so that a reader does not take it as written.
+	 * A writer delayed for a whole lap of the ring finds the entry taken
+	 * by a newer event, or still being written, and drops its event
+	 * rather than mixing it with or overwriting the newer one.
+	 */
+	cur = atomic_load_explicit(&entry->seq, memory_order_relaxed);
+	do {
+		if ((int32_t)(cur - seq) >= 0 ||
+		    rpmsg_trace_is_busy(trace, entry, cur))
+			return;
+	} while (!atomic_compare_exchange_weak_explicit(&entry->seq, &cur,
+							seq - 1,
+							memory_order_relaxed,
+							memory_order_relaxed));
+	atomic_thread_fence(memory_order_release);
+	entry->timestamp = metal_get_timestamp();
+	entry->event = event;
+	entry->queue = queue;
+	entry->args[0] = arg0;
+	entry->args[1] = arg1;
+	entry->args[2] = arg2;
+	entry->args[3] = arg3;
+	atomic_store_explicit(&entry->seq, seq, memory_order_release);
+}
+
+int rpmsg_trace_read(struct rpmsg_trace *trace, uint32_t *seq,
+		     struct rpmsg_trace_entry *entry)
+{
+	uint32_t num = trace->num_entries;
+	struct rpmsg_trace_entry *e;
+	uint32_t head, s = *seq;
+	uint32_t first;
+
+	while (1) {
+		head = atomic_load_explicit(&trace->head, memory_order_acquire);
+		if ((int32_t)(head - s) <= 0)
+			return 0;
+		/* Overwritten, go on with the oldest entry */
+		if (head - s > num)
+			s = head - num;
+
+		e = &trace->entries[s & (num - 1)];
+		first = atomic_load_explicit(&e->seq, memory_order_acquire);
+		/* Reserved, but not written yet */
+		if ((int32_t)(first - s) < 0)
+			return 0;
+		if (first == s) {
+			memcpy(entry, e, sizeof(*entry));
+			atomic_thread_fence(memory_order_acquire);
+			if (atomic_load_explicit(&e->seq,
+						 memory_order_relaxed) == s) {
+				atomic_init(&entry->seq, s);
+				*seq = s + 1;
+				return 1;
+			}
+		}
+		/* Overwritten while reading it, catch up with the writers */
+	}
+}
+
+void rpmsg_trace_attach(struct rpmsg_device *rdev, struct rpmsg_trace *trace)
+{
+	metal_mutex_acquire(&rdev->lock);
+	rdev->trace = trace;
+	metal_mutex_release(&rdev->lock);
+}
+
+const char *rpmsg_trace_event_name(uint16_t event)
+{
+	if (event >= metal_dim(rpmsg_trace_names) || !rpmsg_trace_names[event])
+		return "unknown";
+	return rpmsg_trace_names[event];
+}
@@ -9,62 +9,587 @@
 
 #include <metal/alloc.h>
 #include <metal/sleep.h>
+#include <metal/time.h>
 #include <metal/utilities.h>
+#include <openamp/rpmsg_trace.h>
 #include <openamp/rpmsg_virtio.h>
 #include <openamp/virtqueue.h>
 
 #include "rpmsg_internal.h"
 
+/* Number of vrings of a queue */
 #define RPMSG_NUM_VRINGS                        2
 
-/* Total tick count for 15secs - 1usec tick. */
-#define RPMSG_TICK_COUNT                        15000000
+/*
+ * Flag set in the rpmsg header reserved field of a RX buffer held by the
+ * application. The lower bits keep the buffer index.
+ */
+#define RPMSG_BUF_HELD                          (1U << 31)
+
+/*
+ * Buffer information kept in the rpmsg header reserved field while the
+ * buffer is owned by this side: the buffer index in the low 16 bits, the
+ * index of its queue above.
+ */
+#define RPMSG_BUF_QUEUE_SHIFT                   16
+#define RPMSG_BUF_INFO(qid, idx)                \
+	(((uint32_t)(qid) << RPMSG_BUF_QUEUE_SHIFT) | (uint16_t)(idx))
+#define RPMSG_BUF_INFO_QUEUE(info)              \
+	(((info) & ~RPMSG_BUF_HELD) >> RPMSG_BUF_QUEUE_SHIFT)
+#define RPMSG_BUF_INFO_IDX(info)                ((uint16_t)(info))
+
+/**
+ * struct vbuff_reclaimer_t - TX buffer released without being sent
+ * @node: node in the rpmsg virtio device reclaimer list
+ * @len: length of the buffer
+ * @idx: index of the buffer
+ *
+ * It is stored at the beginning of the released buffer itself.
+ */
+struct vbuff_reclaimer_t {
+	struct metal_list node;
+	uint32_t len;
+	uint16_t idx;
+};
+
+/**
+ * struct rpmsg_virtio_tx_waiter - sender waiting for a TX buffer
+ * @node: node in the queue list of waiters
+ * @priority: priority of the sending endpoint
+ *
+ * It lives on the stack of the waiting sender.
+ */
+struct rpmsg_virtio_tx_waiter {
+	struct metal_list node;
+	unsigned int priority;
+};
+
+/**
+ * struct rpmsg_virtio_tx_slot - TX buffer staged for the TX virtqueue
+ * @buf: pointer to the buffer, header included, 0 while the slot is free
+ * @len: length of the buffer
+ * @idx: index of the buffer
+ *
+ * The sender which claimed the slot fills @len and @idx, then @buf.
+ */
+struct rpmsg_virtio_tx_slot {
+	atomic_uintptr_t buf;
+	uint32_t len;
+	uint16_t idx;
+};
+
+/**
+ * struct rpmsg_virtio_rxbuf - RX buffer drained from the virtqueue
+ * @rp_hdr: pointer to the buffer
+ * @ept: destination endpoint, NULL if unknown
+ * @len: length of the buffer
+ * @idx: index of the buffer
+ * @held: buffer held by the application
+ */
+struct rpmsg_virtio_rxbuf {
+	struct rpmsg_hdr *rp_hdr;
+	struct rpmsg_endpoint *ept;
+	uint32_t len;
+	uint16_t idx;
+	bool held;
+};
 
-/* Time to wait - In multiple of 1 msecs. */
-#define RPMSG_TICKS_PER_INTERVAL                1000
+/* Free list head fields, see struct rpmsg_virtio_shm_pool_hdr */
+#define RPMSG_SHM_POOL_INDEX_MASK	((1U << RPMSG_SHM_POOL_INDEX_BITS) - 1)
+#define RPMSG_SHM_POOL_HEAD_INDEX(head)	((head) & RPMSG_SHM_POOL_INDEX_MASK)
+#define RPMSG_SHM_POOL_HEAD_NEXT(head, index)	\
+	((((head) | RPMSG_SHM_POOL_INDEX_MASK) + 1) | (index))
+
+/* Largest size of the buffers of a pool, limited by the head index */
+#define RPMSG_SHM_POOL_MAX_SIZE	\
+	((size_t)RPMSG_SHM_POOL_INDEX_MASK * RPMSG_SHM_POOL_MIN_BUF_SIZE)
 
 #ifndef VIRTIO_SLAVE_ONLY
+/**
+ * rpmsg_virtio_shm_pool_class
+ *
+ * Gets the size class of a buffer.
+ *
+ * @param size       - requested buffer size
+ * @param class_size - size of the class
+ *
+ * @return - class index, negative value if the size is too big
+ */
+static int rpmsg_virtio_shm_pool_class(size_t size, size_t *class_size)
+{
+	size_t csize = RPMSG_SHM_POOL_MIN_BUF_SIZE;
+	size_t step = RPMSG_SHM_POOL_MIN_BUF_SIZE;
+	int cls;
+
+	for (cls = 0; cls < RPMSG_SHM_POOL_NUM_CLASSES; cls++) {
+		if (size <= csize) {
+			*class_size = csize;
+			return cls;
+		}
+		/* Four classes per power of two from 4 steps */
+		if (csize == 8 * step)
+			step <<= 1;
+		csize += step;
+	}
+
+	return -1;
+}
+
+/**
+ * rpmsg_virtio_shm_pool_pop
+ *
+ * Takes a buffer from the free list of a size class.
+ *
+ * @param shpool - pointer to the shared buffers pool
+ * @param cls    - size class
+ *
+ * @return - buffer pointer, NULL if the free list is empty
+ */
+static void *rpmsg_virtio_shm_pool_pop(struct rpmsg_virtio_shm_pool *shpool,
+				       int cls)
+{
+	atomic_uint *head = &shpool->hdr->free_list[cls];
+	unsigned int old_head, new_head;
+	volatile uint32_t *node;
+
+	old_head = atomic_load(head);
+	do {
+		if (!RPMSG_SHM_POOL_HEAD_INDEX(old_head))
+			return NULL;
+		node = (uint32_t *)((char *)shpool->base +
+				    (size_t)(RPMSG_SHM_POOL_HEAD_INDEX(old_head) -
+					     1) * RPMSG_SHM_POOL_MIN_BUF_SIZE);
+		/*
+		 * The node may be taken meanwhile and the link overwritten,
+		 * the tag change makes the exchange fail in that case.
+		 */
+		new_head = RPMSG_SHM_POOL_HEAD_NEXT(old_head,
+				RPMSG_SHM_POOL_HEAD_INDEX(*node));
+	} while (!atomic_compare_exchange_weak(head, &old_head, new_head));
+
+	return (void *)node;
+}
+
+/**
+ * rpmsg_virtio_shm_pool_push
+ *
+ * Puts a buffer on the free list of a size class.
+ *
+ * @param shpool - pointer to the shared buffers pool
+ * @param cls    - size class
+ * @param buffer - buffer pointer
+ */
+static void rpmsg_virtio_shm_pool_push(struct rpmsg_virtio_shm_pool *shpool,
+				       int cls, void *buffer)
+{
+	atomic_uint *head = &shpool->hdr->free_list[cls];
+	unsigned int old_head, new_head;
+	uint32_t *node = buffer;
+	unsigned int index;
+
+	index = (unsigned int)(((char *)buffer - (char *)shpool->base) /
+			       RPMSG_SHM_POOL_MIN_BUF_SIZE) + 1;
+	old_head = atomic_load(head);
+	do {
+		*node = RPMSG_SHM_POOL_HEAD_INDEX(old_head);
+		new_head = RPMSG_SHM_POOL_HEAD_NEXT(old_head, index);
+	} while (!atomic_compare_exchange_weak(head, &old_head, new_head));
+}
+
+/**
+ * rpmsg_virtio_shm_pool_carve
+ *
+ * Takes a new buffer from the memory never allocated.
+ *
+ * @param shpool - pointer to the shared buffers pool
+ * @param size   - buffer size
+ *
+ * @return - buffer pointer, NULL if the pool is exhausted
+ */
+static void *rpmsg_virtio_shm_pool_carve(struct rpmsg_virtio_shm_pool *shpool,
+					 size_t size)
+{
+	unsigned int avail = atomic_load(&shpool->hdr->avail);
+
+	do {
+		if (avail < size)
+			return NULL;
+	} while (!atomic_compare_exchange_weak(&shpool->hdr->avail, &avail,
+					       avail - size));
+
+	return (char *)shpool->base + shpool->size - avail;
+}
+
 metal_weak void *
 rpmsg_virtio_shm_pool_get_buffer(struct rpmsg_virtio_shm_pool *shpool,
 				 size_t size)
 {
-	void *buffer;
-
-	if (shpool->avail < size)
+	struct rpmsg_virtio_shm_pool_hdr *hdr = shpool->hdr;
+	unsigned int used, peak;
+	void *buffer = NULL;
+	size_t csize;
+	int cls;
+
+	cls = rpmsg_virtio_shm_pool_class(size, &csize);
+	if (cls >= 0) {
+		buffer = rpmsg_virtio_shm_pool_pop(shpool, cls);
+		if (!buffer)
+			buffer = rpmsg_virtio_shm_pool_carve(shpool, csize);
+	}
+	if (!buffer) {
+		atomic_fetch_add(&hdr->failures, 1);
 		return NULL;
-	buffer = (char *)shpool->base + shpool->size - shpool->avail;
-	shpool->avail -= size;
+	}
+
+	atomic_fetch_add(&hdr->allocs, 1);
+	used = atomic_fetch_add(&hdr->used, csize) + csize;
+	peak = atomic_load(&hdr->peak);
+	while (peak < used &&
+	       !atomic_compare_exchange_weak(&hdr->peak, &peak, used))
+		;
 
 	return buffer;
 }
+
+metal_weak void
+rpmsg_virtio_shm_pool_put_buffer(struct rpmsg_virtio_shm_pool *shpool,
+				 void *buffer, size_t size)
+{
+	size_t csize;
+	int cls;
+
+	if (!buffer || (char *)buffer < (char *)shpool->base ||
+	    (char *)buffer >= (char *)shpool->base + shpool->size)
+		return;
+	cls = rpmsg_virtio_shm_pool_class(size, &csize);
+	if (cls < 0)
+		return;
+
+	rpmsg_virtio_shm_pool_push(shpool, cls, buffer);
+	atomic_fetch_add(&shpool->hdr->frees, 1);
+	atomic_fetch_sub(&shpool->hdr->used, csize);
+}
+
+/**
+ * rpmsg_virtio_alloc_buffer
+ *
+ * Allocates a buffer from the shared memory pool of the device. The buffer
+ * starts at the buffer offset of the device in the allocation.
+ *
+ * @param rvdev - pointer to rpmsg device
+ * @param size  - buffer size
+ *
+ * @return - buffer pointer, NULL if the pool is exhausted
+ */
+static void *rpmsg_virtio_alloc_buffer(struct rpmsg_virtio_device *rvdev,
+				       uint32_t size)
+{
+	char *buffer;
+
+	buffer = rpmsg_virtio_shm_pool_get_buffer(rvdev->shpool,
+						  size + rvdev->buf_offset);
+	return buffer ? buffer + rvdev->buf_offset : NULL;
+}
+
+/**
+ * rpmsg_virtio_free_buffer
+ *
+ * Gives back a buffer got with rpmsg_virtio_alloc_buffer to the shared
+ * memory pool.
+ *
+ * @param rvdev  - pointer to rpmsg device
+ * @param buffer - buffer pointer
+ * @param size   - buffer size
+ */
+static void rpmsg_virtio_free_buffer(struct rpmsg_virtio_device *rvdev,
+				     void *buffer, uint32_t size)
+{
+	rpmsg_virtio_shm_pool_put_buffer(rvdev->shpool,
+					 (char *)buffer - rvdev->buf_offset,
+					 size + rvdev->buf_offset);
+}
 #endif /*!VIRTIO_SLAVE_ONLY*/
 
 void rpmsg_virtio_init_shm_pool(struct rpmsg_virtio_shm_pool *shpool,
 				void *shb, size_t size)
 {
+	struct rpmsg_virtio_shm_pool_hdr *hdr = shb;
+	uintptr_t base;
+	size_t hdr_size;
+	int i;
+
 	if (!shpool)
 		return;
-	shpool->base = shb;
+	/* The buffers follow the header, aligned on the smallest buffer */
+	base = ((uintptr_t)(hdr + 1) + RPMSG_SHM_POOL_MIN_BUF_SIZE - 1) &
+	       ~((uintptr_t)RPMSG_SHM_POOL_MIN_BUF_SIZE - 1);
+	hdr_size = base - (uintptr_t)shb;
+	shpool->hdr = hdr;
+	shpool->base = (void *)base;
+	shpool->size = 0;
+	if (!shb || size <= hdr_size)
+		return;
+	size -= hdr_size;
+	if (size > RPMSG_SHM_POOL_MAX_SIZE)
+		size = RPMSG_SHM_POOL_MAX_SIZE;
 	shpool->size = size;
-	shpool->avail = size;
+
+	atomic_store(&hdr->avail, size);
+	for (i = 0; i < RPMSG_SHM_POOL_NUM_CLASSES; i++)
+		atomic_store(&hdr->free_list[i], 0);
+	atomic_store(&hdr->used, 0);
+	atomic_store(&hdr->peak, 0);
+	atomic_store(&hdr->allocs, 0);
+	atomic_store(&hdr->frees, 0);
+	atomic_store(&hdr->failures, 0);
+}
+
+void rpmsg_virtio_shm_pool_get_stats(struct rpmsg_virtio_shm_pool *shpool,
+				     struct rpmsg_virtio_shm_pool_stats *stats)
+{
+	struct rpmsg_virtio_shm_pool_hdr *hdr;
+
+	if (!shpool || !stats)
+		return;
+	memset(stats, 0, sizeof(*stats));
+	if (!shpool->size)
+		return;
+	hdr = shpool->hdr;
+	stats->size = shpool->size;
+	stats->avail = atomic_load(&hdr->avail);
+	stats->used = atomic_load(&hdr->used);
+	stats->peak = atomic_load(&hdr->peak);
+	stats->allocs = atomic_load(&hdr->allocs);
+	stats->frees = atomic_load(&hdr->frees);
+	stats->failures = atomic_load(&hdr->failures);
+}
+
+/**
+ * rpmsg_virtio_vq_lock
+ *
+ * Locks a virtqueue. Each virtqueue has its own lock, so that the TX and
+ * RX paths do not contend. In RPMSG_VIRTIO_SPSC mode, there is a single
+ * producer and a single consumer on each vring, which need no lock: with
+ * RPMSG_DEBUG, the lock is only tried, to catch concurrent accesses.
+ * With RPMSG_STATS, the lock is tried first to count the contention.
+ *
+ * @param lock      - pointer to the virtqueue lock
+ * @param contended - counter of the times the lock was found taken
+ */
+static inline void rpmsg_virtio_vq_lock(metal_mutex_t *lock,
+					unsigned long *contended)
+{
+#ifdef RPMSG_VIRTIO_SPSC
+	(void)contended;
+#ifdef RPMSG_DEBUG
+	RPMSG_ASSERT(metal_mutex_try_acquire(lock),
+		     "concurrent virtqueue access in SPSC mode\r\n");
+#else
+	(void)lock;
+#endif
+#elif defined(RPMSG_STATS)
+	if (!metal_mutex_try_acquire(lock)) {
+		metal_mutex_acquire(lock);
+		(*contended)++;
+	}
+#else
+	(void)contended;
+	metal_mutex_acquire(lock);
+#endif
+}
+
+/**
+ * rpmsg_virtio_vq_unlock
+ *
+ * Unlocks a virtqueue locked with rpmsg_virtio_vq_lock.
+ *
+ * @param lock - pointer to the virtqueue lock
+ */
+static inline void rpmsg_virtio_vq_unlock(metal_mutex_t *lock)
+{
+#if defined(RPMSG_VIRTIO_SPSC) && !defined(RPMSG_DEBUG)
+	(void)lock;
+#else
+	metal_mutex_release(lock);
+#endif
+}
+
+/**
+ * rpmsg_virtio_queue_id
+ *
+ * Returns the index of a queue in its device.
+ *
+ * @param queue - pointer to the queue
+ *
+ * @return - index of the queue
+ */
+static inline unsigned int
+rpmsg_virtio_queue_id(struct rpmsg_virtio_queue *queue)
+{
+	return (unsigned int)(queue - queue->rvdev->queues);
+}
+
+/**
+ * rpmsg_virtio_trace
+ *
+ * Records a transport event of a queue, if a trace ring is attached to the
+ * device.
+ *
+ * @param queue - pointer to the queue
+ * @param event - RPMSG_TRACE_* event
+ * @param arg0  - first argument of the event
+ * @param arg1  - second argument of the event
+ * @param arg2  - third argument of the event
+ * @param arg3  - fourth argument of the event
+ */
+static inline void rpmsg_virtio_trace(struct rpmsg_virtio_queue *queue,
+				      uint16_t event, uint32_t arg0,
+				      uint32_t arg1, uint32_t arg2,
+				      uint32_t arg3)
+{
+	struct rpmsg_trace *trace = queue->rvdev->rdev.trace;
+
+	if (trace)
+		rpmsg_trace_record(trace, event,
+				   rpmsg_virtio_queue_id(queue), arg0, arg1,
+				   arg2, arg3);
+}
+
+/**
+ * rpmsg_virtio_kick
+ *
+ * Kicks a virtqueue of a queue, recording the kick in the trace ring.
+ *
+ * @param queue - pointer to the queue
+ * @param vq    - TX or RX virtqueue of the queue
+ */
+static void rpmsg_virtio_kick(struct rpmsg_virtio_queue *queue,
+			      struct virtqueue *vq)
+{
+	rpmsg_virtio_trace(queue, RPMSG_TRACE_KICK, vq == queue->rvq,
+			   vq->vq_queued_cnt, 0, 0);
+	virtqueue_kick(vq);
+}
+
+/**
+ * rpmsg_virtio_vq_queue
+ *
+ * Returns the queue of a virtqueue, the queue i using the vrings 2 * i and
+ * 2 * i + 1.
+ *
+ * @param vq - pointer to the virtqueue
+ *
+ * @return - pointer to the queue
+ */
+static inline struct rpmsg_virtio_queue *
+rpmsg_virtio_vq_queue(struct virtqueue *vq)
+{
+	struct rpmsg_virtio_device *rvdev = vq->vq_dev->priv;
+
+	return &rvdev->queues[vq->vq_queue_index / RPMSG_NUM_VRINGS];
+}
+
+/**
+ * rpmsg_virtio_buf_queue
+ *
+ * Returns the queue of a buffer owned by this side, from the information
+ * kept in its header.
+ *
+ * @param rvdev  - pointer to rpmsg device
+ * @param rp_hdr - pointer to the buffer header
+ *
+ * @return - pointer to the queue
+ */
+static inline struct rpmsg_virtio_queue *
+rpmsg_virtio_buf_queue(struct rpmsg_virtio_device *rvdev,
+		       struct rpmsg_hdr *rp_hdr)
+{
+	return &rvdev->queues[RPMSG_BUF_INFO_QUEUE(rp_hdr->reserved)];
+}
+
+/* Priority of a sender not looked up yet */
+#define RPMSG_VIRTIO_PRIORITY_UNKNOWN	((unsigned int)-1)
+
+/**
+ * rpmsg_virtio_get_ept_priority
+ *
+ * Returns the priority of an endpoint, 0 if it does not exist anymore.
+ *
+ * @param rvdev - pointer to rpmsg device
+ * @param src   - address of the endpoint
+ *
+ * @return - priority of the endpoint
+ */
+static unsigned int
+rpmsg_virtio_get_ept_priority(struct rpmsg_virtio_device *rvdev, uint32_t src)
+{
+	struct rpmsg_device *rdev = &rvdev->rdev;
+	struct rpmsg_endpoint *ept;
+	unsigned int priority = 0;
+
+	metal_mutex_acquire(&rdev->lock);
+	ept = rpmsg_get_ept_from_addr(rdev, src);
+	if (ept)
+		priority = ept->priority;
+	metal_mutex_release(&rdev->lock);
+
+	return priority;
+}
+
+/**
+ * rpmsg_virtio_get_tx_queue
+ *
+ * Returns the queue on which an endpoint sends its messages: the queue
+ * whose index is the endpoint priority, the priorities beyond the last
+ * queue sharing the last queue. The priority is only looked up with
+ * several queues, it is RPMSG_VIRTIO_PRIORITY_UNKNOWN otherwise.
+ *
+ * @param rvdev    - pointer to rpmsg device
+ * @param src      - address of the endpoint
+ * @param priority - priority of the endpoint
+ *
+ * @return - pointer to the queue
+ */
+static struct rpmsg_virtio_queue *
+rpmsg_virtio_get_tx_queue(struct rpmsg_virtio_device *rvdev, uint32_t src,
+			  unsigned int *priority)
+{
+	unsigned int qid;
+
+	if (rvdev->num_queues == 1) {
+		*priority = RPMSG_VIRTIO_PRIORITY_UNKNOWN;
+		return &rvdev->queues[0];
+	}
+
+	*priority = rpmsg_virtio_get_ept_priority(rvdev, src);
+	qid = metal_min(*priority, rvdev->num_queues - 1);
+
+	return &rvdev->queues[qid];
 }
 
+#ifndef RPMSG_VIRTIO_SPSC
 /**
  * rpmsg_virtio_return_buffer
  *
  * Places the used buffer back on the virtqueue.
  *
- * @param rvdev  - pointer to remote core
+ * @param queue  - pointer to the queue
  * @param buffer - buffer pointer
  * @param len    - buffer length
  * @param idx    - buffer index
  *
  */
-static void rpmsg_virtio_return_buffer(struct rpmsg_virtio_device *rvdev,
+static void rpmsg_virtio_return_buffer(struct rpmsg_virtio_queue *queue,
 				       void *buffer, uint32_t len,
 				       uint16_t idx)
 {
-	unsigned int role = rpmsg_virtio_get_role(rvdev);
+	unsigned int role = rpmsg_virtio_get_role(queue->rvdev);
+
+	/*
+	 * The header has been written on reception: write it back before
+	 * the other side owns the buffer again.
+	 */
+	virtqueue_cache_flush(queue->rvq, buffer, sizeof(struct rpmsg_hdr));
 #ifndef VIRTIO_SLAVE_ONLY
 	if (role == RPMSG_MASTER) {
 		struct virtqueue_buf vqbuf;
@@ -73,127 +598,476 @@ static void rpmsg_virtio_return_buffer(struct rpmsg_virtio_device *rvdev,
 		/* Initialize buffer node */
 		vqbuf.buf = buffer;
 		vqbuf.len = len;
-		virtqueue_add_buffer(rvdev->rvq, &vqbuf, 0, 1, buffer);
+		virtqueue_add_buffer(queue->rvq, &vqbuf, 0, 1, buffer);
 	}
 #endif /*VIRTIO_SLAVE_ONLY*/
 
 #ifndef VIRTIO_MASTER_ONLY
 	if (role == RPMSG_REMOTE) {
 		(void)buffer;
-		virtqueue_add_consumed_buffer(rvdev->rvq, idx, len);
+		virtqueue_add_consumed_buffer(queue->rvq, idx, len);
 	}
 #endif /*VIRTIO_MASTER_ONLY*/
 }
+#endif /* !RPMSG_VIRTIO_SPSC */
 
 /**
- * rpmsg_virtio_enqueue_buffer
+ * rpmsg_virtio_return_buffers
  *
- * Places buffer on the virtqueue for consumption by the other side.
+ * Places several used buffers back on the virtqueue, with a single ring
+ * index update.
  *
- * @param rvdev  - pointer to rpmsg virtio
- * @param buffer - buffer pointer
- * @param len    - buffer length
- * @param idx    - buffer index
+ * @param queue  - pointer to the queue
+ * @param rxbufs - array of buffers to return
+ * @param num    - number of buffers
  *
- * @return - status of function execution
  */
-static int rpmsg_virtio_enqueue_buffer(struct rpmsg_virtio_device *rvdev,
-				       void *buffer, uint32_t len,
-				       uint16_t idx)
+static void rpmsg_virtio_return_buffers(struct rpmsg_virtio_queue *queue,
+					struct rpmsg_virtio_rxbuf *rxbufs,
+					unsigned int num)
 {
-	unsigned int role = rpmsg_virtio_get_role(rvdev);
+	unsigned int role = rpmsg_virtio_get_role(queue->rvdev);
+	unsigned int i;
+
+	if (!num)
+		return;
+
+	rpmsg_virtio_trace(queue, RPMSG_TRACE_BUF_RETURN, num, 0, 0, 0);
+	/* Write back the headers, as rpmsg_virtio_return_buffer() */
+	for (i = 0; i < num; i++)
+		virtqueue_cache_flush(queue->rvq, rxbufs[i].rp_hdr,
+				      sizeof(struct rpmsg_hdr));
+
 #ifndef VIRTIO_SLAVE_ONLY
 	if (role == RPMSG_MASTER) {
-		struct virtqueue_buf vqbuf;
-		(void)idx;
+		struct virtqueue_buf vqbufs[RPMSG_RX_BATCH_SIZE];
 
-		/* Initialize buffer node */
-		vqbuf.buf = buffer;
-		vqbuf.len = len;
-		return virtqueue_add_buffer(rvdev->svq, &vqbuf, 1, 0, buffer);
+		for (i = 0; i < num; i++) {
+			vqbufs[i].buf = rxbufs[i].rp_hdr;
+			vqbufs[i].len = rxbufs[i].len;
+		}
+		virtqueue_add_buffer_batch(queue->rvq, vqbufs, num, 1);
 	}
-#endif /*!VIRTIO_SLAVE_ONLY*/
+#endif /*VIRTIO_SLAVE_ONLY*/
 
 #ifndef VIRTIO_MASTER_ONLY
 	if (role == RPMSG_REMOTE) {
-		(void)buffer;
-		return virtqueue_add_consumed_buffer(rvdev->svq, idx, len);
+		struct vring_used_elem used[RPMSG_RX_BATCH_SIZE];
+
+		for (i = 0; i < num; i++) {
+			used[i].id = rxbufs[i].idx;
+			used[i].len = rxbufs[i].len;
+		}
+		virtqueue_add_consumed_buffer_batch(queue->rvq, used, num);
 	}
-#endif /*!VIRTIO_MASTER_ONLY*/
-	return 0;
+#endif /*VIRTIO_MASTER_ONLY*/
 }
 
 /**
- * rpmsg_virtio_get_tx_buffer
+ * rpmsg_virtio_enqueue_buffer
  *
- * Provides buffer to transmit messages.
+ * Places buffer on the virtqueue for consumption by the other side. The
+ * message, whose header is written, is flushed at the next kick.
  *
- * @param rvdev - pointer to rpmsg device
- * @param len  - length of returned buffer
- * @param idx  - buffer index
+ * @param queue  - pointer to the queue
+ * @param buffer - buffer pointer
+ * @param len    - buffer length
+ * @param idx    - buffer index
  *
- * return - pointer to buffer.
+ * @return - status of function execution
  */
-static void *rpmsg_virtio_get_tx_buffer(struct rpmsg_virtio_device *rvdev,
-					uint32_t *len, uint16_t *idx)
+static int rpmsg_virtio_enqueue_buffer(struct rpmsg_virtio_queue *queue,
+				       void *buffer, uint32_t len,
+				       uint16_t idx)
 {
-	unsigned int role = rpmsg_virtio_get_role(rvdev);
-	void *data = NULL;
+	unsigned int role = rpmsg_virtio_get_role(queue->rvdev);
+	uint32_t payload_len = ((struct rpmsg_hdr *)buffer)->len;
+	int status = 0;
 
+	virtqueue_cache_flush(queue->svq, buffer, sizeof(struct rpmsg_hdr) +
+			      payload_len);
 #ifndef VIRTIO_SLAVE_ONLY
 	if (role == RPMSG_MASTER) {
-		data = virtqueue_get_buffer(rvdev->svq, len, idx);
-		if (!data) {
-			data = rpmsg_virtio_shm_pool_get_buffer(rvdev->shpool,
-							RPMSG_BUFFER_SIZE);
-			*len = RPMSG_BUFFER_SIZE;
-		}
+		struct virtqueue_buf vqbuf;
+		(void)idx;
+
+		/* Initialize buffer node */
+		vqbuf.buf = buffer;
+		vqbuf.len = len;
+		status = virtqueue_add_buffer(queue->svq, &vqbuf, 1, 0,
+					      buffer);
 	}
 #endif /*!VIRTIO_SLAVE_ONLY*/
 
 #ifndef VIRTIO_MASTER_ONLY
-	if (role == RPMSG_REMOTE) {
-		data = virtqueue_get_available_buffer(rvdev->svq, idx, len);
-	}
+	if (role == RPMSG_REMOTE)
+		status = virtqueue_add_consumed_buffer(queue->svq, idx, len);
 #endif /*!VIRTIO_MASTER_ONLY*/
 
-	return data;
+	if (!status) {
+		RPMSG_STATS_ADD(&queue->stats, tx_msgs, 1);
+		RPMSG_STATS_ADD(&queue->stats, tx_bytes, payload_len);
+		/* The master does not track the index of its TX buffers */
+		rpmsg_virtio_trace(queue, RPMSG_TRACE_ENQUEUE,
+				   ((struct rpmsg_hdr *)buffer)->src,
+				   ((struct rpmsg_hdr *)buffer)->dst,
+				   payload_len,
+				   role == RPMSG_REMOTE ? idx : 0);
+	}
+
+	return status;
 }
 
+#ifdef RPMSG_VIRTIO_TX_STAGING
 /**
- * rpmsg_virtio_get_rx_buffer
+ * rpmsg_virtio_tx_drain
  *
- * Retrieves the received buffer from the virtqueue.
+ * Places the staged TX buffers on the TX virtqueue, in their claim order,
+ * up to the first slot claimed but not filled yet, then kicks the remote.
+ * The TX lock must be held.
  *
- * @param rvdev - pointer to rpmsg device
- * @param len  - size of received buffer
- * @param idx  - index of buffer
+ * @param queue - pointer to the queue
+ */
+static void rpmsg_virtio_tx_drain(struct rpmsg_virtio_queue *queue)
+{
+	struct rpmsg_virtio_tx_slot *slot;
+	unsigned int queued = 0;
+	uintptr_t buf;
+	uint32_t len;
+	uint16_t idx;
+	int status;
+
+	while (1) {
+		slot = &queue->tx_slots[queue->tx_published &
+					queue->tx_slot_mask];
+		buf = atomic_load_explicit(&slot->buf, memory_order_acquire);
+		if (!buf)
+			break;
+		len = slot->len;
+		idx = slot->idx;
+		/* The slot is claimed again once the buffer is given back */
+		atomic_store_explicit(&slot->buf, 0, memory_order_relaxed);
+		queue->tx_published++;
+
+		status = rpmsg_virtio_enqueue_buffer(queue, (void *)buf, len,
+						     idx);
+		RPMSG_ASSERT(status == VQUEUE_SUCCESS,
+			     "failed to enqueue buffer\r\n");
+		queued++;
+	}
+	/* Let the other side know that there are jobs to process. */
+	if (queued)
+		rpmsg_virtio_kick(queue, queue->svq);
+}
+#endif /* RPMSG_VIRTIO_TX_STAGING */
+
+/**
+ * rpmsg_virtio_tx_unlock
  *
- * @return - pointer to received buffer
+ * Unlocks the TX virtqueue of a queue. With RPMSG_VIRTIO_TX_STAGING, the
+ * buffers staged by the senders which found the lock taken are placed on
+ * the virtqueue first. A buffer staged while the lock is released is seen
+ * either by its sender, which then takes the lock, or here, which takes
+ * the lock again.
+ *
+ * @param queue - pointer to the queue
+ */
+static void rpmsg_virtio_tx_unlock(struct rpmsg_virtio_queue *queue)
+{
+#ifdef RPMSG_VIRTIO_TX_STAGING
+	do {
+		if (atomic_load(&queue->tx_pending) &&
+		    atomic_exchange(&queue->tx_pending, 0))
+			rpmsg_virtio_tx_drain(queue);
+		metal_mutex_release(&queue->tx_lock);
+		/* Pairs with the fence of rpmsg_virtio_tx_publish */
+		atomic_thread_fence(memory_order_seq_cst);
+	} while (atomic_load(&queue->tx_pending) &&
+		 metal_mutex_try_acquire(&queue->tx_lock));
+#else
+	rpmsg_virtio_vq_unlock(&queue->tx_lock);
+#endif
+}
+
+/**
+ * rpmsg_virtio_tx_stage
+ *
+ * Places a filled TX buffer on the TX virtqueue, the TX lock being held.
+ *
+ * With RPMSG_VIRTIO_TX_STAGING, the TX lock is not held: the buffer is
+ * staged in the next slot, claimed with an atomic increment, and placed on
+ * the virtqueue in the order of its slot by rpmsg_virtio_tx_publish(). A
+ * sender claims a slot per TX buffer it holds, and there are at least as
+ * many slots as TX buffers: a slot is always free when claimed.
+ *
+ * @param queue  - pointer to the queue
+ * @param buffer - buffer pointer, whose header is written
+ * @param len    - buffer length
+ * @param idx    - buffer index
+ */
+static void rpmsg_virtio_tx_stage(struct rpmsg_virtio_queue *queue,
+				  void *buffer, uint32_t len, uint16_t idx)
+{
+#ifdef RPMSG_VIRTIO_TX_STAGING
+	struct rpmsg_virtio_tx_slot *slot;
+
+	slot = &queue->tx_slots[atomic_fetch_add_explicit(&queue->tx_claimed, 1,
+							  memory_order_relaxed) &
+				queue->tx_slot_mask];
+	slot->len = len;
+	slot->idx = idx;
+	atomic_store_explicit(&slot->buf, (uintptr_t)buffer,
+			      memory_order_release);
+#else
+	int status;
+
+	status = rpmsg_virtio_enqueue_buffer(queue, buffer, len, idx);
+	RPMSG_ASSERT(status == VQUEUE_SUCCESS,
+		     "failed to enqueue buffer\r\n");
+#endif
+}
+
+/**
+ * rpmsg_virtio_tx_publish
+ *
+ * Kicks the remote for the TX buffers placed on the TX virtqueue, the TX
+ * lock being held.
  *
+ * With RPMSG_VIRTIO_TX_STAGING, the TX lock is not held: the staged
+ * buffers are placed on the virtqueue before the kick. If the lock is
+ * taken, the sender does not wait for it, and leaves its buffers to the
+ * lock holder, which places them when it unlocks.
+ *
+ * @param queue - pointer to the queue
+ */
+static void rpmsg_virtio_tx_publish(struct rpmsg_virtio_queue *queue)
+{
+#ifdef RPMSG_VIRTIO_TX_STAGING
+	if (!metal_mutex_try_acquire(&queue->tx_lock)) {
+		atomic_store(&queue->tx_pending, 1);
+		/* Pairs with the fence of rpmsg_virtio_tx_unlock */
+		atomic_thread_fence(memory_order_seq_cst);
+		if (!metal_mutex_try_acquire(&queue->tx_lock))
+			return;
+	}
+	rpmsg_virtio_tx_drain(queue);
+	rpmsg_virtio_tx_unlock(queue);
+#else
+	rpmsg_virtio_kick(queue, queue->svq);
+#endif
+}
+
+/**
+ * rpmsg_virtio_get_tx_buffer
+ *
+ * Provides buffer to transmit messages.
+ *
+ * @param queue - pointer to the queue
+ * @param len  - length of returned buffer
+ * @param idx  - buffer index
+ *
+ * return - pointer to buffer.
  */
-static void *rpmsg_virtio_get_rx_buffer(struct rpmsg_virtio_device *rvdev,
+static void *rpmsg_virtio_get_tx_buffer(struct rpmsg_virtio_queue *queue,
 					uint32_t *len, uint16_t *idx)
 {
+	struct rpmsg_virtio_device *rvdev = queue->rvdev;
 	unsigned int role = rpmsg_virtio_get_role(rvdev);
 	void *data = NULL;
 
+	/* Recycle first the buffers released without being sent */
+	if (!metal_list_is_empty(&queue->reclaimer)) {
+		struct vbuff_reclaimer_t *r_desc;
+
+		r_desc = metal_container_of(queue->reclaimer.next,
+					    struct vbuff_reclaimer_t, node);
+		metal_list_del(&r_desc->node);
+		*len = r_desc->len;
+		*idx = r_desc->idx;
+		return r_desc;
+	}
+
+#ifndef VIRTIO_SLAVE_ONLY
+	if (role == RPMSG_MASTER) {
+		data = virtqueue_get_buffer(queue->svq, len, idx);
+		/* Never allocate more buffers than configured */
+		if (!data &&
+		    queue->tx_buf_alloc < rvdev->config.h2r_buf_num) {
+			data = rpmsg_virtio_alloc_buffer(rvdev,
+						rvdev->config.h2r_buf_size);
+			*len = rvdev->config.h2r_buf_size;
+			if (data)
+				queue->tx_buf_alloc++;
+		}
+	}
+#endif /*!VIRTIO_SLAVE_ONLY*/
+
+#ifndef VIRTIO_MASTER_ONLY
+	if (role == RPMSG_REMOTE) {
+		data = virtqueue_get_available_buffer(queue->svq, idx, len);
+	}
+#endif /*!VIRTIO_MASTER_ONLY*/
+
+	return data;
+}
+
+/**
+ * rpmsg_virtio_get_tx_buffer_len
+ *
+ * Returns the length of a TX buffer, as it has to be enqueued on the
+ * virtqueue.
+ *
+ * @param queue - pointer to the queue
+ * @param idx   - buffer index
+ *
+ * @return - buffer length
+ */
+static uint32_t rpmsg_virtio_get_tx_buffer_len(struct rpmsg_virtio_queue *queue,
+					       uint16_t idx)
+{
+	unsigned int role = rpmsg_virtio_get_role(queue->rvdev);
+	uint32_t len = 0;
+
+#ifndef VIRTIO_SLAVE_ONLY
+	if (role == RPMSG_MASTER) {
+		(void)idx;
+		len = queue->rvdev->config.h2r_buf_size;
+	}
+#endif /*!VIRTIO_SLAVE_ONLY*/
+
+#ifndef VIRTIO_MASTER_ONLY
+	if (role == RPMSG_REMOTE) {
+		len = virtqueue_get_buffer_length(queue->svq, idx);
+	}
+#endif /*!VIRTIO_MASTER_ONLY*/
+
+	return len;
+}
+
+/**
+ * rpmsg_virtio_get_rx_buffer
+ *
+ * Retrieves the received buffer from the virtqueue.
+ *
+ * @param queue - pointer to the queue
+ * @param len  - size of received buffer
+ * @param idx  - index of buffer
+ *
+ * @return - pointer to received buffer
+ *
+ */
+static void *rpmsg_virtio_get_rx_buffer(struct rpmsg_virtio_queue *queue,
+					uint32_t *len, uint16_t *idx)
+{
+	unsigned int role = rpmsg_virtio_get_role(queue->rvdev);
+	void *data = NULL;
+
 #ifndef VIRTIO_SLAVE_ONLY
 	if (role == RPMSG_MASTER) {
-		data = virtqueue_get_buffer(rvdev->rvq, len, idx);
+		data = virtqueue_get_buffer(queue->rvq, len, idx);
 	}
 #endif /*!VIRTIO_SLAVE_ONLY*/
 
 #ifndef VIRTIO_MASTER_ONLY
 	if (role == RPMSG_REMOTE) {
 		data =
-		    virtqueue_get_available_buffer(rvdev->rvq, idx, len);
+		    virtqueue_get_available_buffer(queue->rvq, idx, len);
 	}
 #endif /*!VIRTIO_MASTER_ONLY*/
 
 	return data;
 }
 
+/**
+ * rpmsg_virtio_invalidate_rx_buffer
+ *
+ * Discards the cached copy of a received buffer before it is read: the
+ * header first, then the payload whose length it gives.
+ *
+ * @param queue  - pointer to the queue
+ * @param rp_hdr - pointer to the received buffer
+ * @param len    - length of the buffer
+ */
+static void
+rpmsg_virtio_invalidate_rx_buffer(struct rpmsg_virtio_queue *queue,
+				  struct rpmsg_hdr *rp_hdr, uint32_t len)
+{
+	uintptr_t start, end;
+
+	if (!queue->rvdev->vdev->cache_ops || len < sizeof(*rp_hdr))
+		return;
+
+	virtqueue_cache_invalidate(queue->rvq, rp_hdr, sizeof(*rp_hdr));
+	/* Skip the payload part in the cache line of the header */
+	start = ((uintptr_t)(rp_hdr + 1) + VRING_CACHE_LINE_SIZE - 1) &
+		~(uintptr_t)(VRING_CACHE_LINE_SIZE - 1);
+	end = (uintptr_t)(rp_hdr + 1) +
+	      metal_min(rp_hdr->len, len - sizeof(*rp_hdr));
+	if (end > start)
+		virtqueue_cache_invalidate(queue->rvq, (void *)start,
+					   end - start);
+}
+
+/**
+ * rpmsg_virtio_get_rx_buffers
+ *
+ * Drains up to @max received buffers from the virtqueue.
+ *
+ * @param queue  - pointer to the queue
+ * @param rxbufs - array to fill with the received buffers
+ * @param max    - maximum number of buffers to drain
+ *
+ * @return - number of buffers drained
+ */
+static unsigned int
+rpmsg_virtio_get_rx_buffers(struct rpmsg_virtio_queue *queue,
+			    struct rpmsg_virtio_rxbuf *rxbufs,
+			    unsigned int max)
+{
+	unsigned int num;
+
+	for (num = 0; num < max; num++) {
+		rxbufs[num].rp_hdr = rpmsg_virtio_get_rx_buffer(queue,
+							       &rxbufs[num].len,
+							       &rxbufs[num].idx);
+		if (!rxbufs[num].rp_hdr)
+			break;
+		rpmsg_virtio_invalidate_rx_buffer(queue, rxbufs[num].rp_hdr,
+						  rxbufs[num].len);
+		rxbufs[num].held = false;
+	}
+
+	return num;
+}
+
+/**
+ * rpmsg_virtio_get_rx_buffers_armed
+ *
+ * Drains a batch of received buffers or, if the virtqueue is empty, enables
+ * the RX notifications. The buffers received before the notifications are
+ * enabled are drained, the notifications being disabled again.
+ *
+ * @param queue  - pointer to the queue
+ * @param rxbufs - array of RPMSG_RX_BATCH_SIZE received buffers to fill
+ *
+ * @return - number of buffers drained, 0 once the notifications are enabled
+ */
+static unsigned int
+rpmsg_virtio_get_rx_buffers_armed(struct rpmsg_virtio_queue *queue,
+				  struct rpmsg_virtio_rxbuf *rxbufs)
+{
+	unsigned int num;
+
+	while (1) {
+		num = rpmsg_virtio_get_rx_buffers(queue, rxbufs,
+						  RPMSG_RX_BATCH_SIZE);
+		if (num || !virtqueue_enable_cb(queue->rvq))
+			return num;
+		/* A message arrived before the notifications were enabled */
+		virtqueue_disable_cb(queue->rvq);
+	}
+}
+
 #ifndef VIRTIO_MASTER_ONLY
 /**
  * check if the remote is ready to start RPMsg communication
@@ -222,213 +1096,1273 @@ static int rpmsg_virtio_wait_remote_ready(struct rpmsg_virtio_device *rvdev)
  *
  * Returns buffer size available for sending messages.
  *
- * @param rvdev - pointer to rpmsg device
+ * @param queue - pointer to the queue
  *
  * @return - buffer size
  *
  */
-static int _rpmsg_virtio_get_buffer_size(struct rpmsg_virtio_device *rvdev)
+static int _rpmsg_virtio_get_buffer_size(struct rpmsg_virtio_queue *queue)
 {
-	unsigned int role = rpmsg_virtio_get_role(rvdev);
+	unsigned int role = rpmsg_virtio_get_role(queue->rvdev);
 	int length = 0;
 
 #ifndef VIRTIO_SLAVE_ONLY
 	if (role == RPMSG_MASTER) {
 		/*
 		 * If device role is Master then buffers are provided by us,
-		 * so just provide the macro.
+		 * so just provide the configured size.
+		 */
+		length = queue->rvdev->config.h2r_buf_size -
+			 sizeof(struct rpmsg_hdr);
+	}
+#endif /*!VIRTIO_SLAVE_ONLY*/
+
+#ifndef VIRTIO_MASTER_ONLY
+	if (role == RPMSG_REMOTE) {
+		/*
+		 * If other core is Master then buffers are provided by it,
+		 * so get the buffer size from the virtqueue.
 		 */
-		length = RPMSG_BUFFER_SIZE - sizeof(struct rpmsg_hdr);
+		length =
+		    (int)virtqueue_get_desc_size(queue->svq) -
+		    sizeof(struct rpmsg_hdr);
+		if (length < 0) {
+			length = 0;
+		}
+	}
+#endif /*!VIRTIO_MASTER_ONLY*/
+
+	return length;
+}
+
+/**
+ * _rpmsg_virtio_get_rx_buffer_size
+ *
+ * Returns buffer size available for receiving messages.
+ *
+ * @param queue - pointer to the queue
+ *
+ * @return - buffer size
+ *
+ */
+static int _rpmsg_virtio_get_rx_buffer_size(struct rpmsg_virtio_queue *queue)
+{
+	unsigned int role = rpmsg_virtio_get_role(queue->rvdev);
+	int length = 0;
+
+#ifndef VIRTIO_SLAVE_ONLY
+	if (role == RPMSG_MASTER) {
+		/* RX buffers are provided by us too. */
+		length = queue->rvdev->config.r2h_buf_size -
+			 sizeof(struct rpmsg_hdr);
 	}
 #endif /*!VIRTIO_SLAVE_ONLY*/
 
-#ifndef VIRTIO_MASTER_ONLY
-	if (role == RPMSG_REMOTE) {
-		/*
-		 * If other core is Master then buffers are provided by it,
-		 * so get the buffer size from the virtqueue.
-		 */
-		length =
-		    (int)virtqueue_get_desc_size(rvdev->svq) -
-		    sizeof(struct rpmsg_hdr);
-		if (length < 0) {
-			length = 0;
-		}
+#ifndef VIRTIO_MASTER_ONLY
+	if (role == RPMSG_REMOTE) {
+		/* RX buffers are provided by the Master. */
+		length =
+		    (int)virtqueue_get_desc_size(queue->rvq) -
+		    sizeof(struct rpmsg_hdr);
+		if (length < 0) {
+			length = 0;
+		}
+	}
+#endif /*!VIRTIO_MASTER_ONLY*/
+
+	return length;
+}
+
+/**
+ * rpmsg_virtio_get_tx_buffer_size
+ *
+ * Returns buffer size available for the messages of an endpoint, on the
+ * queue of its priority.
+ *
+ * @param rdev - pointer to rpmsg device
+ * @param src  - address of the endpoint
+ *
+ * @return - buffer size
+ */
+static int rpmsg_virtio_get_tx_buffer_size(struct rpmsg_device *rdev,
+					   uint32_t src)
+{
+	struct rpmsg_virtio_device *rvdev;
+	struct rpmsg_virtio_queue *queue;
+	unsigned int priority;
+	int size;
+
+	rvdev = metal_container_of(rdev, struct rpmsg_virtio_device, rdev);
+	queue = rpmsg_virtio_get_tx_queue(rvdev, src, &priority);
+	rpmsg_virtio_vq_lock(&queue->tx_lock,
+			     &queue->stats.tx_lock_contended);
+	size = _rpmsg_virtio_get_buffer_size(queue);
+	rpmsg_virtio_tx_unlock(queue);
+
+	return size;
+}
+
+/**
+ * rpmsg_virtio_tx_ready
+ *
+ * Tells whether TX buffers have been given back, for a sender waiting for
+ * them without the TX lock. The TX virtqueue is only checked if the lock
+ * is free: otherwise another sender is at work, and it is checked again
+ * at the next poll.
+ *
+ * @param arg - pointer to the queue
+ *
+ * @return - non-zero if a TX buffer can be got
+ */
+static int rpmsg_virtio_tx_ready(void *arg)
+{
+	struct rpmsg_virtio_queue *queue = arg;
+	int ready;
+
+#ifndef RPMSG_VIRTIO_SPSC
+	if (!metal_mutex_try_acquire(&queue->tx_lock))
+		return 0;
+#endif
+	ready = !metal_list_is_empty(&queue->reclaimer) ||
+		virtqueue_has_buffer(queue->svq);
+#ifndef RPMSG_VIRTIO_SPSC
+	rpmsg_virtio_tx_unlock(queue);
+#endif
+
+	return ready;
+}
+
+/**
+ * rpmsg_virtio_wait_tx_buffer
+ *
+ * Waits for the remote to give back TX buffers. The TX lock must be held,
+ * it is released while waiting.
+ *
+ * The first waiter polls the TX virtqueue and the reclaimed buffers, then
+ * sleeps between the checks by steps growing to a tick: a buffer returned
+ * within the polls is taken in microseconds rather than after a tick, which
+ * matters to the senders refilling the ring in batches, like
+ * rpmsg_frag_send(). The other waiters wait for the waiters ahead of them to be
+ * served. The ticks slept are charged to @tick_count (see
+ * rpmsg_wait_event()). With RPMSG_TX_WAIT_EVENT, the first waiter also
+ * enables the TX virtqueue callback, so that the remote notifies when it
+ * gives back buffers.
+ *
+ * @param queue      - pointer to the queue
+ * @param tick_count - remaining ticks to wait
+ * @param first      - whether the caller is the first waiter
+ *
+ * @return - 0 if the wait timed out, non-zero otherwise
+ */
+static int rpmsg_virtio_wait_tx_buffer(struct rpmsg_virtio_queue *queue,
+				       int *tick_count, bool first)
+{
+	unsigned int event;
+
+	if (!*tick_count)
+		return 0;
+
+	event = atomic_load(&queue->tx_event);
+#ifdef RPMSG_TX_WAIT_EVENT
+	/*
+	 * Request a notification for returned buffers, unless some have
+	 * been returned meanwhile. The notification cannot be missed as the
+	 * event counter is read before the callback is enabled.
+	 */
+	if (first && virtqueue_enable_cb(queue->svq)) {
+		virtqueue_disable_cb(queue->svq);
+		return 1;
+	}
+#endif
+	rpmsg_virtio_tx_unlock(queue);
+	*tick_count -= rpmsg_wait_event(&queue->tx_event, event,
+					first ? rpmsg_virtio_tx_ready : NULL,
+					queue, *tick_count);
+	rpmsg_virtio_vq_lock(&queue->tx_lock,
+			     &queue->stats.tx_lock_contended);
+#ifdef RPMSG_TX_WAIT_EVENT
+	/* The TX virtqueue is only updated by the senders, not the callback */
+	if (first)
+		virtqueue_disable_cb(queue->svq);
+#endif
+
+	return 1;
+}
+
+/**
+ * rpmsg_virtio_stats_time
+ *
+ * Returns a timestamp to measure the TX buffer waits, with RPMSG_STATS.
+ *
+ * @return - timestamp, 0 without RPMSG_STATS
+ */
+static inline unsigned long long rpmsg_virtio_stats_time(void)
+{
+#ifdef RPMSG_STATS
+	return metal_get_timestamp();
+#else
+	return 0;
+#endif
+}
+
+/**
+ * rpmsg_virtio_stats_tx_wait
+ *
+ * Accounts a wait for a TX buffer, with RPMSG_STATS. The TX lock must be
+ * held.
+ *
+ * @param queue - pointer to the queue
+ * @param start - timestamp of the beginning of the wait
+ * @param data  - buffer got, NULL if none was available in time
+ */
+static inline void rpmsg_virtio_stats_tx_wait(struct rpmsg_virtio_queue *queue,
+					      unsigned long long start,
+					      void *data)
+{
+#ifdef RPMSG_STATS
+	queue->stats.tx_waits++;
+	queue->stats.tx_wait_time += metal_get_timestamp() - start;
+	if (!data)
+		queue->stats.tx_no_buff++;
+#else
+	(void)queue;
+	(void)start;
+	(void)data;
+#endif
+}
+
+/**
+ * rpmsg_virtio_get_tx_buffer_fair
+ *
+ * Provides a TX buffer to a sender, in turn with the senders waiting for
+ * one. The waiting senders are served by endpoint priority, then in their
+ * order of arrival, and a sender does not take a buffer while a sender of
+ * the same or a higher priority is waiting: an endpoint flooding the queue
+ * cannot starve the others. The TX lock must be held, it is released while
+ * waiting.
+ *
+ * @param queue      - pointer to the queue
+ * @param src        - address of the sending endpoint
+ * @param priority   - priority of the sending endpoint, looked up when
+ *                     waiting if RPMSG_VIRTIO_PRIORITY_UNKNOWN
+ * @param len        - length of returned buffer
+ * @param idx        - buffer index
+ * @param tick_count - remaining ticks to wait, 0 not to wait
+ *
+ * @return - pointer to buffer, NULL if none is available in time
+ */
+static void *rpmsg_virtio_get_tx_buffer_fair(struct rpmsg_virtio_queue *queue,
+					     uint32_t src,
+					     unsigned int priority,
+					     uint32_t *len, uint16_t *idx,
+					     int *tick_count)
+{
+	unsigned long long start;
+	void *data;
+#ifndef RPMSG_VIRTIO_SPSC
+	struct rpmsg_virtio_tx_waiter waiter;
+	struct rpmsg_virtio_tx_waiter *ahead;
+	struct metal_list *node;
+	bool first;
+#endif
+
+#ifdef RPMSG_VIRTIO_SPSC
+	/* A single sender, which waits for nobody */
+	(void)src;
+	(void)priority;
+	data = rpmsg_virtio_get_tx_buffer(queue, len, idx);
+	if (!data && !*tick_count)
+		RPMSG_STATS_ADD(&queue->stats, tx_no_buff, 1);
+	if (data || !*tick_count)
+		return data;
+
+	start = rpmsg_virtio_stats_time();
+	while (!data && rpmsg_virtio_wait_tx_buffer(queue, tick_count, true))
+		data = rpmsg_virtio_get_tx_buffer(queue, len, idx);
+	rpmsg_virtio_stats_tx_wait(queue, start, data);
+
+	return data;
+#else
+	if (metal_list_is_empty(&queue->tx_waiters)) {
+		data = rpmsg_virtio_get_tx_buffer(queue, len, idx);
+		if (!data && !*tick_count)
+			RPMSG_STATS_ADD(&queue->stats, tx_no_buff, 1);
+		if (data || !*tick_count)
+			return data;
+	}
+
+	start = rpmsg_virtio_stats_time();
+	if (priority == RPMSG_VIRTIO_PRIORITY_UNKNOWN) {
+		/* The device lock is never taken with a TX lock held */
+		rpmsg_virtio_tx_unlock(queue);
+		priority = rpmsg_virtio_get_ept_priority(queue->rvdev, src);
+		rpmsg_virtio_vq_lock(&queue->tx_lock,
+				     &queue->stats.tx_lock_contended);
+	}
+	waiter.priority = priority;
+
+	/* Line up behind the waiters of the same or a higher priority */
+	metal_list_for_each(&queue->tx_waiters, node) {
+		ahead = metal_container_of(node, struct rpmsg_virtio_tx_waiter,
+					   node);
+		if (ahead->priority > waiter.priority)
+			break;
+	}
+	metal_list_add_before(node, &waiter.node);
+
+	while (1) {
+		data = NULL;
+		first = queue->tx_waiters.next == &waiter.node;
+		if (first)
+			data = rpmsg_virtio_get_tx_buffer(queue, len, idx);
+		if (data || !rpmsg_virtio_wait_tx_buffer(queue, tick_count,
+							 first))
+			break;
+	}
+	metal_list_del(&waiter.node);
+	/* Let the next waiter take its turn */
+	if (!metal_list_is_empty(&queue->tx_waiters))
+		atomic_fetch_add(&queue->tx_event, 1);
+	rpmsg_virtio_stats_tx_wait(queue, start, data);
+
+	return data;
+#endif
+}
+
+/**
+ * rpmsg_virtio_get_tx_payload_buffer
+ *
+ * Provides the payload part of a TX buffer, to be filled in place by the
+ * caller. The buffer index and queue are kept in the buffer header until
+ * the buffer is sent or released.
+ *
+ * @param rdev - pointer to rpmsg device
+ * @param src  - address of the endpoint, which selects the queue
+ * @param len  - size of the returned payload buffer
+ * @param wait - boolean, wait or not for buffer to become available
+ *
+ * @return - pointer to payload buffer, NULL for failure.
+ */
+static void *rpmsg_virtio_get_tx_payload_buffer(struct rpmsg_device *rdev,
+						uint32_t src, uint32_t *len,
+						int wait)
+{
+	struct rpmsg_virtio_device *rvdev;
+	struct rpmsg_virtio_queue *queue;
+	struct rpmsg_hdr *rp_hdr;
+	unsigned int priority;
+	uint16_t idx;
+	int tick_count;
+	int status;
+
+	/* Get the associated remote device for channel. */
+	rvdev = metal_container_of(rdev, struct rpmsg_virtio_device, rdev);
+
+	status = rpmsg_virtio_get_status(rvdev);
+	/* Validate device state */
+	if (!(status & VIRTIO_CONFIG_STATUS_DRIVER_OK))
+		return NULL;
+
+	if (wait)
+		tick_count = RPMSG_TICK_COUNT / RPMSG_TICKS_PER_INTERVAL;
+	else
+		tick_count = 0;
+
+	queue = rpmsg_virtio_get_tx_queue(rvdev, src, &priority);
+	/* Lock the queue to enable exclusive access to its virtqueue */
+	rpmsg_virtio_vq_lock(&queue->tx_lock,
+			     &queue->stats.tx_lock_contended);
+	rp_hdr = rpmsg_virtio_get_tx_buffer_fair(queue, src, priority, len,
+						 &idx, &tick_count);
+	if (!rp_hdr)
+		rpmsg_virtio_trace(queue, RPMSG_TRACE_NO_BUFF, src, 0, 0, 0);
+	rpmsg_virtio_tx_unlock(queue);
+	if (!rp_hdr)
+		return NULL;
+
+	/* Keep the buffer index and queue until the buffer is sent */
+	rp_hdr->reserved = RPMSG_BUF_INFO(rpmsg_virtio_queue_id(queue), idx);
+	rp_hdr->len = 0;
+
+	/* The payload size is the buffer size minus the header */
+	*len -= sizeof(struct rpmsg_hdr);
+
+	return RPMSG_LOCATE_DATA(rp_hdr);
+}
+
+/**
+ * rpmsg_virtio_reclaim_tx_buffer
+ *
+ * Queues an unsent TX buffer on the reclaimer list, to be returned by the
+ * next TX buffer request. The TX lock must be held.
+ *
+ * @param queue  - pointer to the queue
+ * @param buffer - pointer to the buffer, header included
+ * @param len    - length of the buffer
+ * @param idx    - buffer index
+ */
+static void rpmsg_virtio_reclaim_tx_buffer(struct rpmsg_virtio_queue *queue,
+					   void *buffer, uint32_t len,
+					   uint16_t idx)
+{
+	/* The reclaimer descriptor overwrites the released buffer */
+	struct vbuff_reclaimer_t *r_desc = buffer;
+
+	r_desc->idx = idx;
+	r_desc->len = len;
+	metal_list_add_tail(&queue->reclaimer, &r_desc->node);
+}
+
+/**
+ * rpmsg_virtio_release_tx_buffer
+ *
+ * Gives back a TX payload buffer which will not be sent. It is queued on
+ * the reclaimer list of its queue, to be returned by the next TX buffer
+ * request.
+ *
+ * @param rdev  - pointer to rpmsg device
+ * @param txbuf - pointer to payload buffer
+ *
+ * @return - RPMSG_SUCCESS
+ */
+static int rpmsg_virtio_release_tx_buffer(struct rpmsg_device *rdev,
+					  void *txbuf)
+{
+	struct rpmsg_virtio_device *rvdev;
+	struct rpmsg_virtio_queue *queue;
+	struct rpmsg_hdr *rp_hdr = RPMSG_LOCATE_HDR(txbuf);
+	uint16_t idx;
+
+	rvdev = metal_container_of(rdev, struct rpmsg_virtio_device, rdev);
+	queue = rpmsg_virtio_buf_queue(rvdev, rp_hdr);
+
+	rpmsg_virtio_vq_lock(&queue->tx_lock,
+			     &queue->stats.tx_lock_contended);
+
+	idx = RPMSG_BUF_INFO_IDX(rp_hdr->reserved);
+	rpmsg_virtio_reclaim_tx_buffer(queue, (char *)txbuf - sizeof(*rp_hdr),
+				       rpmsg_virtio_get_tx_buffer_len(queue,
+								      idx),
+				       idx);
+
+	rpmsg_virtio_tx_unlock(queue);
+
+	return RPMSG_SUCCESS;
+}
+
+/**
+ * rpmsg_virtio_send_offchannel_nocopy
+ *
+ * Sends a TX payload buffer, filled in place by the caller, to the
+ * remote device, on the queue the buffer was taken from.
+ *
+ * @param rdev - pointer to rpmsg device
+ * @param src  - source address of channel
+ * @param dst  - destination address of channel
+ * @param data - payload buffer got with rpmsg_virtio_get_tx_payload_buffer
+ * @param len  - size of data, at most the payload size of the buffer
+ *
+ * @return - size of data sent or negative value for failure.
+ */
+static int rpmsg_virtio_send_offchannel_nocopy(struct rpmsg_device *rdev,
+					       uint32_t src, uint32_t dst,
+					       const void *data, int len)
+{
+	struct rpmsg_virtio_device *rvdev;
+	struct rpmsg_virtio_queue *queue;
+	struct metal_io_region *io;
+	struct rpmsg_hdr rp_hdr;
+	struct rpmsg_hdr *hdr;
+	uint32_t buff_len;
+	uint16_t idx;
+	int status;
+
+	/* Get the associated remote device for channel. */
+	rvdev = metal_container_of(rdev, struct rpmsg_virtio_device, rdev);
+
+	hdr = RPMSG_LOCATE_HDR(data);
+	/* The reserved field contains the buffer index and queue */
+	queue = rpmsg_virtio_buf_queue(rvdev, hdr);
+	idx = RPMSG_BUF_INFO_IDX(hdr->reserved);
+
+	/* The payload must fit in the buffer it was written to */
+	buff_len = rpmsg_virtio_get_tx_buffer_len(queue, idx);
+	if (len < 0 || len > (int)(buff_len - sizeof(struct rpmsg_hdr)))
+		return RPMSG_ERR_PARAM;
+
+	/* Initialize RPMSG header. */
+	rp_hdr.dst = dst;
+	rp_hdr.src = src;
+	rp_hdr.len = len;
+	rp_hdr.reserved = 0;
+	rp_hdr.flags = 0;
+
+	io = rvdev->shbuf_io;
+	status = metal_io_block_write(io, metal_io_virt_to_offset(io, hdr),
+				      &rp_hdr, sizeof(rp_hdr));
+	RPMSG_ASSERT(status == sizeof(rp_hdr), "failed to write header\r\n");
+
+#ifndef RPMSG_VIRTIO_TX_STAGING
+	rpmsg_virtio_vq_lock(&queue->tx_lock,
+			     &queue->stats.tx_lock_contended);
+#endif
+	/* Enqueue buffer on virtqueue. */
+	rpmsg_virtio_tx_stage(queue, hdr, buff_len, idx);
+	/* Let the other side know that there is a job to process. */
+	rpmsg_virtio_tx_publish(queue);
+#ifndef RPMSG_VIRTIO_TX_STAGING
+	rpmsg_virtio_tx_unlock(queue);
+#endif
+
+	return len;
+}
+
+/**
+ * rpmsg_virtio_send_offchannel_batch
+ *
+ * Sends several rpmsg messages to the remote device. The TX buffers are
+ * taken by batches of RPMSG_TX_BATCH_SIZE under a single lock hold, then
+ * the messages of a batch are copied and enqueued, and the remote is
+ * kicked once. With RPMSG_VIRTIO_TX_STAGING, the messages are copied and
+ * staged without the lock.
+ *
+ * @param rdev - pointer to rpmsg device
+ * @param src  - source address of channel
+ * @param msgs - messages to transmit
+ * @param num  - number of messages
+ * @param wait - boolean, wait or not for buffers to become available
+ *
+ * @return - number of messages sent or negative value for failure.
+ *
+ */
+static int rpmsg_virtio_send_offchannel_batch(struct rpmsg_device *rdev,
+					      uint32_t src,
+					      const struct rpmsg_msg *msgs,
+					      int num, int wait)
+{
+	struct rpmsg_virtio_device *rvdev;
+	struct rpmsg_virtio_queue *queue;
+	struct metal_io_region *io;
+	struct rpmsg_hdr *hdrs[RPMSG_TX_BATCH_SIZE];
+	uint32_t lens[RPMSG_TX_BATCH_SIZE];
+	uint16_t idxs[RPMSG_TX_BATCH_SIZE];
+	const struct rpmsg_msg *msg;
+	struct rpmsg_hdr rp_hdr;
+	unsigned int priority;
+	int avail_size;
+	int tick_count;
+	int status;
+	int sent = 0;
+	int err = RPMSG_ERR_NO_BUFF;
+	int i;
+
+	/* Get the associated remote device for channel. */
+	rvdev = metal_container_of(rdev, struct rpmsg_virtio_device, rdev);
+
+	status = rpmsg_virtio_get_status(rvdev);
+	/* Validate device state */
+	if (!(status & VIRTIO_CONFIG_STATUS_DRIVER_OK))
+		return RPMSG_ERR_DEV_STATE;
+
+	io = rvdev->shbuf_io;
+	rp_hdr.src = src;
+	rp_hdr.reserved = 0;
+	rp_hdr.flags = 0;
+
+	if (wait)
+		tick_count = RPMSG_TICK_COUNT / RPMSG_TICKS_PER_INTERVAL;
+	else
+		tick_count = 0;
+
+	queue = rpmsg_virtio_get_tx_queue(rvdev, src, &priority);
+	/* Lock the queue to enable exclusive access to its virtqueue */
+	rpmsg_virtio_vq_lock(&queue->tx_lock,
+			     &queue->stats.tx_lock_contended);
+	avail_size = _rpmsg_virtio_get_buffer_size(queue);
+	while (1) {
+		int got = 0;
+		int no_wait = 0;
+
+		while (got < RPMSG_TX_BATCH_SIZE && sent + got < num) {
+			msg = &msgs[sent + got];
+			rpmsg_virtio_trace(queue, RPMSG_TRACE_SEND, src,
+					   msg->dst, msg->len, 0);
+			/*
+			 * Fail fast if the buffer size is already known to
+			 * be too small
+			 */
+			if (avail_size && msg->len > avail_size) {
+				err = RPMSG_ERR_BUFF_SIZE;
+				break;
+			}
+			/* The buffers of the batch are sent before waiting */
+			hdrs[got] = rpmsg_virtio_get_tx_buffer_fair(queue, src,
+								    priority,
+								    &lens[got],
+								    &idxs[got],
+								    got ?
+								    &no_wait :
+								    &tick_count);
+			if (!hdrs[got]) {
+				if (!got)
+					rpmsg_virtio_trace(queue,
+							   RPMSG_TRACE_NO_BUFF,
+							   src, 0, 0, 0);
+				break;
+			}
+			if (msg->len >
+			    (int)(lens[got] - sizeof(struct rpmsg_hdr))) {
+				rpmsg_virtio_reclaim_tx_buffer(queue, hdrs[got],
+							       lens[got],
+							       idxs[got]);
+				err = RPMSG_ERR_BUFF_SIZE;
+				break;
+			}
+			got++;
+		}
+#ifdef RPMSG_VIRTIO_TX_STAGING
+		rpmsg_virtio_tx_unlock(queue);
+#endif
+
+		for (i = 0; i < got; i++) {
+			msg = &msgs[sent + i];
+			/* Initialize RPMSG header and copy data. */
+			rp_hdr.dst = msg->dst;
+			rp_hdr.len = msg->len;
+			status = metal_io_block_write(io,
+					metal_io_virt_to_offset(io, hdrs[i]),
+					&rp_hdr, sizeof(rp_hdr));
+			RPMSG_ASSERT(status == sizeof(rp_hdr),
+				     "failed to write header\r\n");
+			status = metal_io_block_write(io,
+					metal_io_virt_to_offset(io,
+						RPMSG_LOCATE_DATA(hdrs[i])),
+					msg->data, msg->len);
+			RPMSG_ASSERT(status == msg->len,
+				     "failed to write buffer\r\n");
+			/* Enqueue buffer on virtqueue. */
+			rpmsg_virtio_tx_stage(queue, hdrs[i], lens[i], idxs[i]);
+		}
+		/* Let the other side know that there are jobs to process. */
+		if (got)
+			rpmsg_virtio_tx_publish(queue);
+
+		sent += got;
+		if (!got || sent == num || err == RPMSG_ERR_BUFF_SIZE)
+			break;
+
+		/* The next batch waits for the remote to return buffers */
+		if (wait)
+			tick_count = RPMSG_TICK_COUNT / RPMSG_TICKS_PER_INTERVAL;
+#ifdef RPMSG_VIRTIO_TX_STAGING
+		rpmsg_virtio_vq_lock(&queue->tx_lock,
+				     &queue->stats.tx_lock_contended);
+#endif
+	}
+#ifndef RPMSG_VIRTIO_TX_STAGING
+	rpmsg_virtio_tx_unlock(queue);
+#endif
+
+	return sent ? sent : err;
+}
+
+/**
+ * This function sends rpmsg "message" to remote device.
+ *
+ * @param rdev    - pointer to rpmsg device
+ * @param src     - source address of channel
+ * @param dst     - destination address of channel
+ * @param data    - data to transmit
+ * @param size    - size of data
+ * @param wait    - boolean, wait or not for buffer to become
+ *                  available
+ *
+ * @return - size of data sent or negative value for failure.
+ *
+ */
+static int rpmsg_virtio_send_offchannel_raw(struct rpmsg_device *rdev,
+					    uint32_t src, uint32_t dst,
+					    const void *data,
+					    int size, int wait)
+{
+	struct rpmsg_msg msg;
+	int status;
+
+	/* A batch of one message takes the queue lock once */
+	msg.dst = dst;
+	msg.data = data;
+	msg.len = size;
+	status = rpmsg_virtio_send_offchannel_batch(rdev, src, &msg, 1, wait);
+
+	return status == 1 ? size : status;
+}
+
+/**
+ * rpmsg_virtio_send_offchannel_nocopy_batch
+ *
+ * Sends several TX payload buffers, filled in place by the caller, to the
+ * remote device. The consecutive buffers of a queue are enqueued under a
+ * single lock hold, or staged with RPMSG_VIRTIO_TX_STAGING, then the remote
+ * is kicked once.
+ *
+ * @param rdev - pointer to rpmsg device
+ * @param src  - source address of channel
+ * @param msgs - messages to transmit, their data being payload buffers
+ *               got with rpmsg_virtio_get_tx_payload_buffer
+ * @param num  - number of messages
+ *
+ * @return - number of messages sent or negative value for failure.
+ */
+static int
+rpmsg_virtio_send_offchannel_nocopy_batch(struct rpmsg_device *rdev,
+					  uint32_t src,
+					  const struct rpmsg_msg *msgs,
+					  int num)
+{
+	struct rpmsg_virtio_device *rvdev;
+	struct rpmsg_virtio_queue *queue = NULL, *next;
+	struct metal_io_region *io;
+	struct rpmsg_hdr rp_hdr;
+	struct rpmsg_hdr *hdr;
+	uint32_t buff_len;
+	uint16_t idx;
+	int status;
+	int i;
+
+	/* Get the associated remote device for channel. */
+	rvdev = metal_container_of(rdev, struct rpmsg_virtio_device, rdev);
+
+	/* The payloads must fit in their buffers, none is sent otherwise */
+	for (i = 0; i < num; i++) {
+		hdr = RPMSG_LOCATE_HDR(msgs[i].data);
+		next = rpmsg_virtio_buf_queue(rvdev, hdr);
+		idx = RPMSG_BUF_INFO_IDX(hdr->reserved);
+		buff_len = rpmsg_virtio_get_tx_buffer_len(next, idx);
+		if (msgs[i].len < 0 ||
+		    msgs[i].len > (int)(buff_len - sizeof(struct rpmsg_hdr)))
+			return RPMSG_ERR_PARAM;
+	}
+
+	io = rvdev->shbuf_io;
+	rp_hdr.src = src;
+	rp_hdr.reserved = 0;
+	rp_hdr.flags = 0;
+
+	for (i = 0; i < num; i++) {
+		hdr = RPMSG_LOCATE_HDR(msgs[i].data);
+		/* The reserved field contains the buffer index and queue */
+		next = rpmsg_virtio_buf_queue(rvdev, hdr);
+		idx = RPMSG_BUF_INFO_IDX(hdr->reserved);
+		if (next != queue) {
+			if (queue) {
+				rpmsg_virtio_tx_publish(queue);
+#ifndef RPMSG_VIRTIO_TX_STAGING
+				rpmsg_virtio_tx_unlock(queue);
+#endif
+			}
+			queue = next;
+#ifndef RPMSG_VIRTIO_TX_STAGING
+			rpmsg_virtio_vq_lock(&queue->tx_lock,
+					     &queue->stats.tx_lock_contended);
+#endif
+		}
+
+		rp_hdr.dst = msgs[i].dst;
+		rp_hdr.len = msgs[i].len;
+		status = metal_io_block_write(io,
+					      metal_io_virt_to_offset(io, hdr),
+					      &rp_hdr, sizeof(rp_hdr));
+		RPMSG_ASSERT(status == sizeof(rp_hdr),
+			     "failed to write header\r\n");
+
+		buff_len = rpmsg_virtio_get_tx_buffer_len(queue, idx);
+		/* Enqueue buffer on virtqueue. */
+		rpmsg_virtio_tx_stage(queue, hdr, buff_len, idx);
+	}
+	/* Let the other side know that there are jobs to process. */
+	if (queue) {
+		rpmsg_virtio_tx_publish(queue);
+#ifndef RPMSG_VIRTIO_TX_STAGING
+		rpmsg_virtio_tx_unlock(queue);
+#endif
+	}
+
+	return num;
+}
+
+/**
+ * rpmsg_virtio_tx_callback
+ *
+ * Tx callback function.
+ *
+ * @param vq - pointer to virtqueue on which Tx is has been
+ *             completed.
+ *
+ */
+static void rpmsg_virtio_tx_callback(struct virtqueue *vq)
+{
+	struct rpmsg_virtio_queue *queue = rpmsg_virtio_vq_queue(vq);
+
+	rpmsg_virtio_trace(queue, RPMSG_TRACE_NOTIFY, 0, 0, 0, 0);
+	/* Wake up the senders waiting for TX buffers */
+	atomic_fetch_add(&queue->tx_event, 1);
+}
+
+/**
+ * rpmsg_virtio_get_rx_epts
+ *
+ * Looks up the destination endpoints of RX buffers, with a single hold of
+ * the device lock.
+ *
+ * @param rdev   - pointer to rpmsg device
+ * @param rxbufs - array of buffers
+ * @param num    - number of buffers
+ *
+ * @return - endpoint generation of the device at the lookup
+ */
+static unsigned int rpmsg_virtio_get_rx_epts(struct rpmsg_device *rdev,
+					     struct rpmsg_virtio_rxbuf *rxbufs,
+					     unsigned int num)
+{
+	unsigned int i, ept_gen;
+
+	/* Get the channel nodes from the remote device channels list */
+	metal_mutex_acquire(&rdev->lock);
+	for (i = 0; i < num; i++)
+		rxbufs[i].ept = rpmsg_get_ept_from_addr(rdev,
+							rxbufs[i].rp_hdr->dst);
+	ept_gen = rdev->ept_gen;
+	metal_mutex_release(&rdev->lock);
+
+	return ept_gen;
+}
+
+/**
+ * rpmsg_virtio_rx_drain
+ *
+ * Delivers the received messages of a queue to the endpoints.
+ *
+ * The received buffers are drained by batches of RPMSG_RX_BATCH_SIZE. The
+ * buffers of a batch are returned with a single ring update, and the peer
+ * is kicked once the virtqueue is empty. The destination endpoints of a
+ * batch are looked up at once, and again if a callback destroys endpoints.
+ *
+ * The RX notifications must be disabled by the caller. With @arm, they are
+ * enabled again once the virtqueue is empty, so that the peer only notifies
+ * when this side waits for messages. With VIRTIO_RING_F_EVENT_IDX, enabling
+ * them also publishes how far the virtqueue has been consumed.
+ *
+ * @param queue - pointer to the queue
+ * @param arm   - whether to enable the RX notifications once done
+ *
+ * @return - number of messages received
+ */
+static unsigned int rpmsg_virtio_rx_drain(struct rpmsg_virtio_queue *queue,
+					  bool arm)
+{
+	struct rpmsg_device *rdev = &queue->rvdev->rdev;
+	struct rpmsg_virtio_rxbuf rxbufs[RPMSG_RX_BATCH_SIZE];
+	struct rpmsg_endpoint *ept;
+	struct rpmsg_hdr *rp_hdr;
+	unsigned int qid = rpmsg_virtio_queue_id(queue);
+	unsigned int num, nret, i, total = 0, ept_gen;
+	unsigned long long bytes;
+	int status;
+
+	rpmsg_virtio_vq_lock(&queue->rx_lock,
+			     &queue->stats.rx_lock_contended);
+
+	/* Process the received data from remote node */
+	if (arm)
+		num = rpmsg_virtio_get_rx_buffers_armed(queue, rxbufs);
+	else
+		num = rpmsg_virtio_get_rx_buffers(queue, rxbufs,
+						  RPMSG_RX_BATCH_SIZE);
+
+	rpmsg_virtio_vq_unlock(&queue->rx_lock);
+
+	while (num) {
+		total += num;
+		bytes = 0;
+
+		ept_gen = rpmsg_virtio_get_rx_epts(rdev, rxbufs, num);
+		for (i = 0; i < num; i++) {
+			/* An endpoint of the batch may have been destroyed */
+			if (rdev->ept_gen != ept_gen)
+				ept_gen = rpmsg_virtio_get_rx_epts(rdev,
+								   &rxbufs[i],
+								   num - i);
+			rp_hdr = rxbufs[i].rp_hdr;
+			ept = rxbufs[i].ept;
+			bytes += rp_hdr->len;
+
+			/* Keep the buffer index in case the buffer is held */
+			rp_hdr->reserved = RPMSG_BUF_INFO(qid, rxbufs[i].idx);
+
+			if (ept) {
+				if (ept->dest_addr == RPMSG_ADDR_ANY) {
+					/*
+					 * First message received from the
+					 * remote side, update channel
+					 * destination address
+					 */
+					ept->dest_addr = rp_hdr->src;
+				}
+				rpmsg_virtio_trace(queue, RPMSG_TRACE_CB_ENTER,
+						   rp_hdr->src, rp_hdr->dst,
+						   rp_hdr->len, rxbufs[i].idx);
+				status = ept->cb(ept, RPMSG_LOCATE_DATA(rp_hdr),
+						 rp_hdr->len, rp_hdr->src,
+						 ept->priv);
+				rpmsg_virtio_trace(queue, RPMSG_TRACE_CB_EXIT,
+						   rp_hdr->src, rp_hdr->dst,
+						   rp_hdr->len, rxbufs[i].idx);
+
+				RPMSG_ASSERT(status >= 0,
+					     "unexpected callback status\r\n");
+			}
+			rxbufs[i].held = !!(rp_hdr->reserved & RPMSG_BUF_HELD);
+		}
+
+		/* Return used buffers, unless held by the application. */
+		for (i = 0, nret = 0; i < num; i++) {
+			if (!rxbufs[i].held)
+				rxbufs[nret++] = rxbufs[i];
+		}
+
+		rpmsg_virtio_vq_lock(&queue->rx_lock,
+				     &queue->stats.rx_lock_contended);
+
+		RPMSG_STATS_ADD(&queue->stats, rx_msgs, num);
+		RPMSG_STATS_ADD(&queue->stats, rx_bytes, bytes);
+		rpmsg_virtio_return_buffers(queue, rxbufs, nret);
+
+		num = rpmsg_virtio_get_rx_buffers(queue, rxbufs,
+						  RPMSG_RX_BATCH_SIZE);
+		if (!num) {
+			/* tell peer we return some rx buffer */
+			rpmsg_virtio_kick(queue, queue->rvq);
+			if (arm)
+				num = rpmsg_virtio_get_rx_buffers_armed(queue,
+									rxbufs);
+		}
+		rpmsg_virtio_vq_unlock(&queue->rx_lock);
+	}
+
+	return total;
+}
+
+/**
+ * rpmsg_virtio_rx_callback
+ *
+ * Rx callback function.
+ *
+ * In the hybrid RX mode, the notification switches the RX virtqueue to
+ * poll mode, the RX notifications being left disabled until
+ * rpmsg_virtio_rx_poll() finds the virtqueue idle.
+ *
+ * @param vq - pointer to virtqueue on which messages is received
+ *
+ */
+static void rpmsg_virtio_rx_callback(struct virtqueue *vq)
+{
+	struct rpmsg_virtio_queue *queue = rpmsg_virtio_vq_queue(vq);
+	bool polling;
+
+	rpmsg_virtio_trace(queue, RPMSG_TRACE_NOTIFY, 1, 0, 0, 0);
+	rpmsg_virtio_vq_lock(&queue->rx_lock,
+			     &queue->stats.rx_lock_contended);
+
+	/* No need to be notified while draining the virtqueue */
+	virtqueue_disable_cb(queue->rvq);
+
+	polling = queue->rx_poll_budget != 0;
+	if (polling && !atomic_load(&queue->rx_polling)) {
+		queue->rx_poll_idle = 0;
+		queue->rx_poll_stats.to_poll++;
+		atomic_store(&queue->rx_polling, 1);
 	}
-#endif /*!VIRTIO_MASTER_ONLY*/
 
-	return length;
+	rpmsg_virtio_vq_unlock(&queue->rx_lock);
+
+	rpmsg_virtio_rx_drain(queue, !polling);
 }
 
+#ifndef RPMSG_VIRTIO_SPSC
 /**
- * This function sends rpmsg "message" to remote device.
- *
- * @param rdev    - pointer to rpmsg device
- * @param src     - source address of channel
- * @param dst     - destination address of channel
- * @param data    - data to transmit
- * @param size    - size of data
- * @param wait    - boolean, wait or not for buffer to become
- *                  available
+ * rpmsg_virtio_peek_rx
  *
- * @return - size of data sent or negative value for failure.
+ * Calls @cb with the messages for an endpoint which are in the RX
+ * virtqueues and not drained yet. This lets the context handling the
+ * notifications, which cannot deliver the messages while in an endpoint
+ * callback, look at the messages received in the meantime. The messages
+ * are left to be delivered, except the ones at the head of a virtqueue
+ * which @cb returns 1 for: their buffers are returned to the remote right
+ * away, so that the messages the caller waits for can still come in.
+ * @cb must not send or release buffers.
  *
+ * @param rdev - pointer to rpmsg device
+ * @param ept  - pointer to the endpoint
+ * @param cb   - function called with each message, as the endpoint
+ *               callback would be
  */
-static int rpmsg_virtio_send_offchannel_raw(struct rpmsg_device *rdev,
-					    uint32_t src, uint32_t dst,
-					    const void *data,
-					    int size, int wait)
+static void rpmsg_virtio_peek_rx(struct rpmsg_device *rdev,
+				 struct rpmsg_endpoint *ept, rpmsg_ept_cb cb)
 {
+	struct rpmsg_virtio_rxbuf rxbufs[RPMSG_RX_BATCH_SIZE];
 	struct rpmsg_virtio_device *rvdev;
-	struct rpmsg_hdr rp_hdr;
-	void *buffer = NULL;
-	uint16_t idx;
-	int tick_count;
-	uint32_t buff_len;
-	int status;
-	struct metal_io_region *io;
+	struct rpmsg_virtio_queue *queue;
+	struct rpmsg_hdr *rp_hdr;
+	unsigned int i, nret;
+	uint32_t len;
+	uint16_t n;
+	bool dropped;
 
-	/* Get the associated remote device for channel. */
 	rvdev = metal_container_of(rdev, struct rpmsg_virtio_device, rdev);
+	for (i = 0; i < rvdev->num_queues; i++) {
+		queue = &rvdev->queues[i];
+		dropped = false;
+		nret = 0;
+		n = 0;
+		/* The buffers cannot be drained meanwhile */
+		rpmsg_virtio_vq_lock(&queue->rx_lock,
+				     &queue->stats.rx_lock_contended);
+		while (n < queue->rvq->vq_nentries) {
+			rp_hdr = virtqueue_peek_buffer(queue->rvq, n, &len);
+			if (!rp_hdr)
+				break;
+			rpmsg_virtio_invalidate_rx_buffer(queue, rp_hdr, len);
+			if (len < sizeof(*rp_hdr) ||
+			    rp_hdr->len > len - sizeof(*rp_hdr) ||
+			    rp_hdr->dst != ept->addr) {
+				n++;
+				continue;
+			}
+			/* Every message is seen, only the head is dropped */
+			if (cb(ept, RPMSG_LOCATE_DATA(rp_hdr), rp_hdr->len,
+			       rp_hdr->src, ept->priv) != 1 || n) {
+				n++;
+				continue;
+			}
 
-	status = rpmsg_virtio_get_status(rvdev);
-	/* Validate device state */
-	if (!(status & VIRTIO_CONFIG_STATUS_DRIVER_OK)) {
-		return RPMSG_ERR_DEV_STATE;
+			/* Drop the message, the next one becomes the head */
+			RPMSG_STATS_ADD(&queue->stats, rx_msgs, 1);
+			RPMSG_STATS_ADD(&queue->stats, rx_bytes, rp_hdr->len);
+			rxbufs[nret].rp_hdr =
+				rpmsg_virtio_get_rx_buffer(queue,
+							   &rxbufs[nret].len,
+							   &rxbufs[nret].idx);
+			dropped = true;
+			if (++nret == RPMSG_RX_BATCH_SIZE) {
+				rpmsg_virtio_return_buffers(queue, rxbufs,
+							    nret);
+				nret = 0;
+			}
+		}
+		rpmsg_virtio_return_buffers(queue, rxbufs, nret);
+		if (dropped)
+			rpmsg_virtio_kick(queue, queue->rvq);
+		rpmsg_virtio_vq_unlock(&queue->rx_lock);
 	}
+}
+#endif
 
-	if (wait)
-		tick_count = RPMSG_TICK_COUNT / RPMSG_TICKS_PER_INTERVAL;
-	else
-		tick_count = 0;
+void rpmsg_virtio_set_rx_poll_budget(struct rpmsg_virtio_device *rvdev,
+				     unsigned int budget)
+{
+	struct rpmsg_virtio_queue *queue;
+	unsigned int i;
+
+	for (i = 0; i < rvdev->num_queues; i++) {
+		queue = &rvdev->queues[i];
+		rpmsg_virtio_vq_lock(&queue->rx_lock,
+				     &queue->stats.rx_lock_contended);
+		queue->rx_poll_budget = budget;
+		rpmsg_virtio_vq_unlock(&queue->rx_lock);
+	}
+}
 
-	while (1) {
-		int avail_size;
+int rpmsg_virtio_rx_poll_queue(struct rpmsg_virtio_device *rvdev,
+			       unsigned int qid)
+{
+	struct rpmsg_virtio_queue *queue;
+	unsigned int num;
 
-		/* Lock the device to enable exclusive access to virtqueues */
-		metal_mutex_acquire(&rdev->lock);
-		avail_size = _rpmsg_virtio_get_buffer_size(rvdev);
-		if (avail_size && size > avail_size) {
-			metal_mutex_release(&rdev->lock);
-			return RPMSG_ERR_BUFF_SIZE;
+	if (qid >= rvdev->num_queues)
+		return RPMSG_ERR_PARAM;
+	queue = &rvdev->queues[qid];
+	if (!atomic_load(&queue->rx_polling))
+		return 0;
+
+	num = rpmsg_virtio_rx_drain(queue, false);
+
+	rpmsg_virtio_vq_lock(&queue->rx_lock,
+			     &queue->stats.rx_lock_contended);
+	queue->rx_poll_stats.polls++;
+	queue->rx_poll_stats.msgs += num;
+	if (num) {
+		queue->rx_poll_idle = 0;
+	} else {
+		queue->rx_poll_stats.empty_polls++;
+		queue->rx_poll_idle++;
+	}
+	/*
+	 * The virtqueue is idle: go back to interrupt mode, unless a message
+	 * arrived before the notifications are enabled.
+	 */
+	if (!num && queue->rx_poll_idle >= queue->rx_poll_budget &&
+	    atomic_load(&queue->rx_polling)) {
+		if (virtqueue_enable_cb(queue->rvq)) {
+			virtqueue_disable_cb(queue->rvq);
+		} else {
+			atomic_store(&queue->rx_polling, 0);
+			queue->rx_poll_stats.to_irq++;
 		}
-
-		buffer = rpmsg_virtio_get_tx_buffer(rvdev, &buff_len, &idx);
-		metal_mutex_release(&rdev->lock);
-		if (buffer || !tick_count)
-			break;
-		if (avail_size != 0)
-			return RPMSG_ERR_BUFF_SIZE;
-		metal_sleep_usec(RPMSG_TICKS_PER_INTERVAL);
-		tick_count--;
 	}
-	if (!buffer)
-		return RPMSG_ERR_NO_BUFF;
+	rpmsg_virtio_vq_unlock(&queue->rx_lock);
 
-	/* Initialize RPMSG header. */
-	rp_hdr.dst = dst;
-	rp_hdr.src = src;
-	rp_hdr.len = size;
-	rp_hdr.reserved = 0;
+	return (int)num;
+}
 
-	/* Copy data to rpmsg buffer. */
-	io = rvdev->shbuf_io;
-	status = metal_io_block_write(io, metal_io_virt_to_offset(io, buffer),
-				      &rp_hdr, sizeof(rp_hdr));
-	RPMSG_ASSERT(status == sizeof(rp_hdr), "failed to write header\r\n");
+int rpmsg_virtio_rx_poll(struct rpmsg_virtio_device *rvdev)
+{
+	unsigned int i;
+	int num = 0;
 
-	status = metal_io_block_write(io,
-				      metal_io_virt_to_offset(io,
-						RPMSG_LOCATE_DATA(buffer)),
-				      data, size);
-	RPMSG_ASSERT(status == size, "failed to write buffer\r\n");
-	metal_mutex_acquire(&rdev->lock);
+	for (i = 0; i < rvdev->num_queues; i++)
+		num += rpmsg_virtio_rx_poll_queue(rvdev, i);
 
-	/* Enqueue buffer on virtqueue. */
-	status = rpmsg_virtio_enqueue_buffer(rvdev, buffer, buff_len, idx);
-	RPMSG_ASSERT(status == VQUEUE_SUCCESS, "failed to enqueue buffer\r\n");
-	/* Let the other side know that there is a job to process. */
-	virtqueue_kick(rvdev->svq);
+	return num;
+}
 
-	metal_mutex_release(&rdev->lock);
+void rpmsg_virtio_get_rx_poll_stats(struct rpmsg_virtio_device *rvdev,
+				    struct rpmsg_virtio_rx_poll_stats *stats)
+{
+	struct rpmsg_virtio_queue *queue;
+	unsigned int i;
 
-	return size;
+	if (!rvdev || !stats)
+		return;
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0; i < rvdev->num_queues; i++) {
+		queue = &rvdev->queues[i];
+		rpmsg_virtio_vq_lock(&queue->rx_lock,
+				     &queue->stats.rx_lock_contended);
+		stats->to_poll += queue->rx_poll_stats.to_poll;
+		stats->to_irq += queue->rx_poll_stats.to_irq;
+		stats->polls += queue->rx_poll_stats.polls;
+		stats->empty_polls += queue->rx_poll_stats.empty_polls;
+		stats->msgs += queue->rx_poll_stats.msgs;
+		rpmsg_virtio_vq_unlock(&queue->rx_lock);
+	}
 }
 
 /**
- * rpmsg_virtio_tx_callback
+ * rpmsg_virtio_get_stats
  *
- * Tx callback function.
- *
- * @param vq - pointer to virtqueue on which Tx is has been
- *             completed.
+ * Sums up the counters of the queues of a device and of their virtqueues.
  *
+ * @param rdev  - pointer to rpmsg device
+ * @param stats - pointer to the structure to fill, zeroed by the caller
  */
-static void rpmsg_virtio_tx_callback(struct virtqueue *vq)
+static void rpmsg_virtio_get_stats(struct rpmsg_device *rdev,
+				   struct rpmsg_stats *stats)
 {
-	(void)vq;
+	struct rpmsg_virtio_device *rvdev;
+	struct rpmsg_virtio_queue *queue;
+	struct virtqueue_stats svq_stats, rvq_stats;
+	unsigned int role, i;
+
+	rvdev = metal_container_of(rdev, struct rpmsg_virtio_device, rdev);
+	role = rpmsg_virtio_get_role(rvdev);
+	for (i = 0; i < rvdev->num_queues; i++) {
+		queue = &rvdev->queues[i];
+
+		rpmsg_virtio_vq_lock(&queue->tx_lock,
+				     &queue->stats.tx_lock_contended);
+		stats->tx_msgs += queue->stats.tx_msgs;
+		stats->tx_bytes += queue->stats.tx_bytes;
+		stats->tx_no_buff += queue->stats.tx_no_buff;
+		stats->tx_waits += queue->stats.tx_waits;
+		stats->tx_wait_time += queue->stats.tx_wait_time;
+		stats->tx_lock_contended += queue->stats.tx_lock_contended;
+		virtqueue_get_stats(queue->svq, &svq_stats);
+		rpmsg_virtio_tx_unlock(queue);
+
+		rpmsg_virtio_vq_lock(&queue->rx_lock,
+				     &queue->stats.rx_lock_contended);
+		stats->rx_msgs += queue->stats.rx_msgs;
+		stats->rx_bytes += queue->stats.rx_bytes;
+		stats->rx_lock_contended += queue->stats.rx_lock_contended;
+		virtqueue_get_stats(queue->rvq, &rvq_stats);
+		rpmsg_virtio_vq_unlock(&queue->rx_lock);
+
+		stats->kicks += svq_stats.kicks + rvq_stats.kicks;
+		stats->notifications += svq_stats.notifications +
+					rvq_stats.notifications;
+		/* The remote does not see when the master consumes messages */
+		if (role == RPMSG_MASTER &&
+		    svq_stats.max_outstanding > stats->tx_ring_max)
+			stats->tx_ring_max = svq_stats.max_outstanding;
+		if (rvq_stats.max_pending > stats->rx_ring_max)
+			stats->rx_ring_max = rvq_stats.max_pending;
+	}
 }
 
+#ifndef RPMSG_VIRTIO_SPSC
 /**
- * rpmsg_virtio_rx_callback
- *
- * Rx callback function.
+ * rpmsg_virtio_hold_rx_buffer
  *
- * @param vq - pointer to virtqueue on which messages is received
+ * Marks a RX buffer as held, so that it is not returned to the virtqueue
+ * when the endpoint callback returns.
  *
+ * @param rdev  - pointer to rpmsg device
+ * @param rxbuf - pointer to RX payload buffer
  */
-static void rpmsg_virtio_rx_callback(struct virtqueue *vq)
+static void rpmsg_virtio_hold_rx_buffer(struct rpmsg_device *rdev,
+					void *rxbuf)
 {
-	struct virtio_device *vdev = vq->vq_dev;
-	struct rpmsg_virtio_device *rvdev = vdev->priv;
-	struct rpmsg_device *rdev = &rvdev->rdev;
-	struct rpmsg_endpoint *ept;
 	struct rpmsg_hdr *rp_hdr;
-	uint32_t len;
-	uint16_t idx;
-	int status;
-
-	metal_mutex_acquire(&rdev->lock);
-
-	/* Process the received data from remote node */
-	rp_hdr = rpmsg_virtio_get_rx_buffer(rvdev, &len, &idx);
-
-	metal_mutex_release(&rdev->lock);
-
-	while (rp_hdr) {
-		/* Get the channel node from the remote device channels list. */
-		metal_mutex_acquire(&rdev->lock);
-		ept = rpmsg_get_ept_from_addr(rdev, rp_hdr->dst);
-		metal_mutex_release(&rdev->lock);
 
-		if (ept) {
-			if (ept->dest_addr == RPMSG_ADDR_ANY) {
-				/*
-				 * First message received from the remote side,
-				 * update channel destination address
-				 */
-				ept->dest_addr = rp_hdr->src;
-			}
-			status = ept->cb(ept, RPMSG_LOCATE_DATA(rp_hdr),
-					 rp_hdr->len, rp_hdr->src, ept->priv);
-
-			RPMSG_ASSERT(status >= 0,
-				     "unexpected callback status\r\n");
-		}
+	(void)rdev;
 
-		metal_mutex_acquire(&rdev->lock);
+	rp_hdr = RPMSG_LOCATE_HDR(rxbuf);
+	rp_hdr->reserved |= RPMSG_BUF_HELD;
+}
 
-		/* Return used buffers. */
-		rpmsg_virtio_return_buffer(rvdev, rp_hdr, len, idx);
+/**
+ * rpmsg_virtio_release_rx_buffer
+ *
+ * Returns a held RX buffer to the virtqueue of its queue.
+ *
+ * @param rdev  - pointer to rpmsg device
+ * @param rxbuf - pointer to RX payload buffer
+ */
+static void rpmsg_virtio_release_rx_buffer(struct rpmsg_device *rdev,
+					   void *rxbuf)
+{
+	struct rpmsg_virtio_device *rvdev;
+	struct rpmsg_virtio_queue *queue;
+	struct rpmsg_hdr *rp_hdr;
+	uint16_t idx;
+	uint32_t len;
 
-		rp_hdr = rpmsg_virtio_get_rx_buffer(rvdev, &len, &idx);
-		if (!rp_hdr) {
-			/* tell peer we return some rx buffer */
-			virtqueue_kick(rvdev->rvq);
-		}
-		metal_mutex_release(&rdev->lock);
-	}
+	rvdev = metal_container_of(rdev, struct rpmsg_virtio_device, rdev);
+	rp_hdr = RPMSG_LOCATE_HDR(rxbuf);
+	/* The reserved field contains the buffer index and queue */
+	queue = rpmsg_virtio_buf_queue(rvdev, rp_hdr);
+	idx = RPMSG_BUF_INFO_IDX(rp_hdr->reserved);
+
+	rpmsg_virtio_vq_lock(&queue->rx_lock,
+			     &queue->stats.rx_lock_contended);
+	len = virtqueue_get_buffer_length(queue->rvq, idx);
+	rpmsg_virtio_trace(queue, RPMSG_TRACE_BUF_RETURN, 1, 1, 0, 0);
+	rpmsg_virtio_return_buffer(queue, rp_hdr, len, idx);
+	/* Tell peer we return some rx buffer */
+	rpmsg_virtio_kick(queue, queue->rvq);
+	rpmsg_virtio_vq_unlock(&queue->rx_lock);
 }
+#endif /* !RPMSG_VIRTIO_SPSC */
 
 /**
  * rpmsg_virtio_ns_callback
@@ -497,17 +2431,243 @@ static int rpmsg_virtio_ns_callback(struct rpmsg_endpoint *ept, void *data,
 	return RPMSG_SUCCESS;
 }
 
+#ifndef VIRTIO_SLAVE_ONLY
+/**
+ * rpmsg_virtio_free_buffers
+ *
+ * Gives back to the shared memory pool the buffers still owned by the
+ * virtqueues and the TX buffers released without being sent, for all the
+ * queues. The RX buffers held by the application have to be released
+ * before.
+ *
+ * @param rvdev - pointer to rpmsg device
+ */
+static void rpmsg_virtio_free_buffers(struct rpmsg_virtio_device *rvdev)
+{
+	struct rpmsg_virtio_queue *queue;
+	struct vbuff_reclaimer_t *r_desc;
+	void *buffer;
+	unsigned int i;
+
+	for (i = 0; i < rvdev->num_queues; i++) {
+		queue = &rvdev->queues[i];
+		while ((buffer = virtqueue_detach_unused_buffer(queue->rvq)))
+			rpmsg_virtio_free_buffer(rvdev, buffer,
+						 rvdev->config.r2h_buf_size);
+
+		while ((buffer = virtqueue_detach_unused_buffer(queue->svq)))
+			rpmsg_virtio_free_buffer(rvdev, buffer,
+						 rvdev->config.h2r_buf_size);
+
+		while (!metal_list_is_empty(&queue->reclaimer)) {
+			r_desc = metal_container_of(queue->reclaimer.next,
+						    struct vbuff_reclaimer_t,
+						    node);
+			metal_list_del(&r_desc->node);
+			rpmsg_virtio_free_buffer(rvdev, r_desc,
+						 rvdev->config.h2r_buf_size);
+		}
+
+		queue->tx_buf_alloc = 0;
+	}
+}
+
+/**
+ * rpmsg_virtio_add_rx_buffers
+ *
+ * Allocates the RX buffers of a queue and makes them available to the
+ * remote.
+ *
+ * @param queue  - pointer to the queue
+ *
+ * @return - status of function execution
+ */
+static int rpmsg_virtio_add_rx_buffers(struct rpmsg_virtio_queue *queue)
+{
+	struct rpmsg_virtio_device *rvdev = queue->rvdev;
+	struct metal_io_region *shm_io = rvdev->shbuf_io;
+	struct virtqueue_buf vqbuf;
+	unsigned int idx;
+	void *buffer;
+	int status;
+
+	vqbuf.len = rvdev->config.r2h_buf_size;
+	for (idx = 0; idx < rvdev->config.r2h_buf_num; idx++) {
+		/* Initialize TX virtqueue buffers for remote device */
+		buffer = rpmsg_virtio_alloc_buffer(rvdev,
+						   rvdev->config.r2h_buf_size);
+
+		if (!buffer)
+			return RPMSG_ERR_NO_BUFF;
+
+		vqbuf.buf = buffer;
+
+		metal_io_block_set(shm_io,
+				   metal_io_virt_to_offset(shm_io, buffer),
+				   0x00, rvdev->config.r2h_buf_size);
+		virtqueue_cache_flush(queue->rvq, buffer,
+				      rvdev->config.r2h_buf_size);
+		status = virtqueue_add_buffer(queue->rvq, &vqbuf, 0, 1, buffer);
+
+		if (status != RPMSG_SUCCESS) {
+			rpmsg_virtio_free_buffer(rvdev, buffer,
+						 rvdev->config.r2h_buf_size);
+			return status;
+		}
+	}
+
+	return RPMSG_SUCCESS;
+}
+#endif /*!VIRTIO_SLAVE_ONLY*/
+
+/**
+ * rpmsg_virtio_init_queue
+ *
+ * Initializes a queue and assigns it its pair of vrings: the master
+ * receives on the first one, the remote on the second one.
+ *
+ * @param rvdev     - pointer to rpmsg device
+ * @param qid       - index of the queue
+ * @param vq_names  - virtqueue names to fill
+ * @param callbacks - virtqueue callbacks to fill
+ */
+static void rpmsg_virtio_init_queue(struct rpmsg_virtio_device *rvdev,
+				    unsigned int qid, const char *vq_names[],
+				    vq_callback callbacks[])
+{
+	struct rpmsg_virtio_queue *queue = &rvdev->queues[qid];
+	struct virtio_device *vdev = rvdev->vdev;
+	unsigned int role = rpmsg_virtio_get_role(rvdev);
+	unsigned int vring = qid * RPMSG_NUM_VRINGS;
+
+	queue->rvdev = rvdev;
+	queue->tx_buf_alloc = 0;
+	metal_mutex_init(&queue->tx_lock);
+	metal_mutex_init(&queue->rx_lock);
+	metal_list_init(&queue->reclaimer);
+	metal_list_init(&queue->tx_waiters);
+	atomic_init(&queue->tx_event, 0);
+	queue->tx_slots = NULL;
+	queue->tx_slot_mask = 0;
+	atomic_init(&queue->tx_claimed, 0);
+	queue->tx_published = 0;
+	atomic_init(&queue->tx_pending, 0);
+	queue->rx_poll_budget = 0;
+	queue->rx_poll_idle = 0;
+	atomic_init(&queue->rx_polling, 0);
+	memset(&queue->rx_poll_stats, 0, sizeof(queue->rx_poll_stats));
+	memset(&queue->stats, 0, sizeof(queue->stats));
+
+#ifndef VIRTIO_SLAVE_ONLY
+	if (role == RPMSG_MASTER) {
+		vq_names[vring] = "rx_vq";
+		vq_names[vring + 1] = "tx_vq";
+		callbacks[vring] = rpmsg_virtio_rx_callback;
+		callbacks[vring + 1] = rpmsg_virtio_tx_callback;
+		queue->rvq = vdev->vrings_info[vring].vq;
+		queue->svq = vdev->vrings_info[vring + 1].vq;
+	}
+#endif /*!VIRTIO_SLAVE_ONLY*/
+
+#ifndef VIRTIO_MASTER_ONLY
+	if (role == RPMSG_REMOTE) {
+		vq_names[vring] = "tx_vq";
+		vq_names[vring + 1] = "rx_vq";
+		callbacks[vring] = rpmsg_virtio_tx_callback;
+		callbacks[vring + 1] = rpmsg_virtio_rx_callback;
+		queue->rvq = vdev->vrings_info[vring + 1].vq;
+		queue->svq = vdev->vrings_info[vring].vq;
+	}
+#endif /*!VIRTIO_MASTER_ONLY*/
+}
+
+#ifdef RPMSG_VIRTIO_TX_STAGING
+/**
+ * rpmsg_virtio_free_tx_slots
+ *
+ * Frees the TX staging slots of the queues of a device.
+ *
+ * @param rvdev - pointer to rpmsg device
+ */
+static void rpmsg_virtio_free_tx_slots(struct rpmsg_virtio_device *rvdev)
+{
+	unsigned int i;
+
+	for (i = 0; i < rvdev->num_queues; i++) {
+		if (rvdev->queues[i].tx_slots)
+			metal_free_memory(rvdev->queues[i].tx_slots);
+		rvdev->queues[i].tx_slots = NULL;
+	}
+}
+
+/**
+ * rpmsg_virtio_alloc_tx_slots
+ *
+ * Allocates the TX staging slots of the queues of a device, once their
+ * virtqueues are created: there is a slot per TX vring entry, rounded up
+ * to a power of two so that the claim numbers can wrap around.
+ *
+ * @param rvdev - pointer to rpmsg device
+ *
+ * @return - status of function execution
+ */
+static int rpmsg_virtio_alloc_tx_slots(struct rpmsg_virtio_device *rvdev)
+{
+	struct rpmsg_virtio_queue *queue;
+	unsigned int num;
+	unsigned int i, j;
+
+	for (i = 0; i < rvdev->num_queues; i++) {
+		queue = &rvdev->queues[i];
+		num = 1;
+		while (num < queue->svq->vq_nentries)
+			num <<= 1;
+		queue->tx_slots = metal_allocate_memory(num *
+							sizeof(*queue->tx_slots));
+		if (!queue->tx_slots) {
+			rpmsg_virtio_free_tx_slots(rvdev);
+			return RPMSG_ERR_NO_MEM;
+		}
+		for (j = 0; j < num; j++)
+			atomic_init(&queue->tx_slots[j].buf, 0);
+		queue->tx_slot_mask = num - 1;
+	}
+
+	return RPMSG_SUCCESS;
+}
+#endif /* RPMSG_VIRTIO_TX_STAGING */
+
 int rpmsg_virtio_get_buffer_size(struct rpmsg_device *rdev)
 {
 	int size;
 	struct rpmsg_virtio_device *rvdev;
+	struct rpmsg_virtio_queue *queue;
 
 	if (!rdev)
 		return RPMSG_ERR_PARAM;
-	metal_mutex_acquire(&rdev->lock);
 	rvdev = (struct rpmsg_virtio_device *)rdev;
-	size = _rpmsg_virtio_get_buffer_size(rvdev);
-	metal_mutex_release(&rdev->lock);
+	queue = &rvdev->queues[0];
+	rpmsg_virtio_vq_lock(&queue->tx_lock,
+			     &queue->stats.tx_lock_contended);
+	size = _rpmsg_virtio_get_buffer_size(queue);
+	rpmsg_virtio_tx_unlock(queue);
+	return size;
+}
+
+int rpmsg_virtio_get_rx_buffer_size(struct rpmsg_device *rdev)
+{
+	int size;
+	struct rpmsg_virtio_device *rvdev;
+	struct rpmsg_virtio_queue *queue;
+
+	if (!rdev)
+		return RPMSG_ERR_PARAM;
+	rvdev = (struct rpmsg_virtio_device *)rdev;
+	queue = &rvdev->queues[0];
+	rpmsg_virtio_vq_lock(&queue->rx_lock,
+			     &queue->stats.rx_lock_contended);
+	size = _rpmsg_virtio_get_rx_buffer_size(queue);
+	rpmsg_virtio_vq_unlock(&queue->rx_lock);
 	return size;
 }
 
@@ -516,10 +2676,28 @@ int rpmsg_init_vdev(struct rpmsg_virtio_device *rvdev,
 		    rpmsg_ns_bind_cb ns_bind_cb,
 		    struct metal_io_region *shm_io,
 		    struct rpmsg_virtio_shm_pool *shpool)
+{
+	const struct rpmsg_virtio_config config = {
+		.h2r_buf_size = RPMSG_BUFFER_SIZE,
+		.r2h_buf_size = RPMSG_BUFFER_SIZE,
+		.h2r_buf_num = 0,
+		.r2h_buf_num = 0,
+	};
+
+	return rpmsg_init_vdev_with_config(rvdev, vdev, ns_bind_cb, shm_io,
+					   shpool, &config);
+}
+
+int rpmsg_init_vdev_with_config(struct rpmsg_virtio_device *rvdev,
+				struct virtio_device *vdev,
+				rpmsg_ns_bind_cb ns_bind_cb,
+				struct metal_io_region *shm_io,
+				struct rpmsg_virtio_shm_pool *shpool,
+				const struct rpmsg_virtio_config *config)
 {
 	struct rpmsg_device *rdev;
-	const char *vq_names[RPMSG_NUM_VRINGS];
-	vq_callback callback[RPMSG_NUM_VRINGS];
+	const char *vq_names[RPMSG_NUM_VRINGS * RPMSG_VIRTIO_MAX_QUEUES];
+	vq_callback callback[RPMSG_NUM_VRINGS * RPMSG_VIRTIO_MAX_QUEUES];
 	int status;
 	unsigned int i, role;
 
@@ -530,6 +2708,24 @@ int rpmsg_init_vdev(struct rpmsg_virtio_device *rvdev,
 	rdev->ns_bind_cb = ns_bind_cb;
 	vdev->priv = rvdev;
 	rdev->ops.send_offchannel_raw = rpmsg_virtio_send_offchannel_raw;
+	rdev->ops.get_tx_payload_buffer = rpmsg_virtio_get_tx_payload_buffer;
+	rdev->ops.send_offchannel_nocopy = rpmsg_virtio_send_offchannel_nocopy;
+	rdev->ops.release_tx_buffer = rpmsg_virtio_release_tx_buffer;
+#ifndef RPMSG_VIRTIO_SPSC
+	/*
+	 * A held buffer would be released from another context than the RX
+	 * one, returning it to the RX virtqueue concurrently
+	 */
+	rdev->ops.hold_rx_buffer = rpmsg_virtio_hold_rx_buffer;
+	rdev->ops.release_rx_buffer = rpmsg_virtio_release_rx_buffer;
+	/* Peeking from another context would race with the RX one too */
+	rdev->ops.peek_rx = rpmsg_virtio_peek_rx;
+#endif
+	rdev->ops.send_offchannel_batch = rpmsg_virtio_send_offchannel_batch;
+	rdev->ops.send_offchannel_nocopy_batch =
+		rpmsg_virtio_send_offchannel_nocopy_batch;
+	rdev->ops.get_stats = rpmsg_virtio_get_stats;
+	rdev->ops.get_tx_buffer_size = rpmsg_virtio_get_tx_buffer_size;
 	role = rpmsg_virtio_get_role(rvdev);
 
 #ifndef VIRTIO_MASTER_ONLY
@@ -539,7 +2735,35 @@ int rpmsg_init_vdev(struct rpmsg_virtio_device *rvdev,
 	}
 #endif /*!VIRTIO_MASTER_ONLY*/
 	vdev->features = rpmsg_virtio_get_features(rvdev);
+	/*
+	 * Both sides write the descriptors of a packed ring in place, in
+	 * cache lines which cache maintenance cannot keep apart: with cache
+	 * operations, the master falls back to the split ring, and the remote
+	 * refuses a packed ring.
+	 */
+	if (vdev->cache_ops && (vdev->features & VIRTIO_F_RING_PACKED)) {
+		if (role != RPMSG_MASTER || !vdev->func->set_features)
+			return RPMSG_ERR_INIT;
+		vdev->func->set_features(vdev, vdev->func->get_features(vdev) &
+					 ~VIRTIO_F_RING_PACKED);
+		vdev->features &= ~VIRTIO_F_RING_PACKED;
+	}
 	rdev->support_ns = !!(vdev->features & (1 << VIRTIO_RPMSG_F_NS));
+	/* Both sides lay out the vrings with the negotiated alignment */
+	for (i = 0; i < vdev->vrings_num; i++)
+		vdev->vrings_info[i].info.align =
+			rpmsg_virtio_get_vring_align(vdev->features,
+				vdev->vrings_info[i].info.align);
+
+	/* One queue per pair of vrings with VIRTIO_RPMSG_F_MQ */
+	rvdev->num_queues = 1;
+	if ((vdev->features & (1 << VIRTIO_RPMSG_F_MQ)) &&
+	    vdev->vrings_num >= 2 * RPMSG_NUM_VRINGS)
+		rvdev->num_queues = metal_min(vdev->vrings_num /
+					      RPMSG_NUM_VRINGS,
+					      RPMSG_VIRTIO_MAX_QUEUES);
+	for (i = 0; i < rvdev->num_queues; i++)
+		rpmsg_virtio_init_queue(rvdev, i, vq_names, callback);
 
 #ifndef VIRTIO_SLAVE_ONLY
 	if (role == RPMSG_MASTER) {
@@ -547,48 +2771,64 @@ int rpmsg_init_vdev(struct rpmsg_virtio_device *rvdev,
 		 * Since device is RPMSG Remote so we need to manage the
 		 * shared buffers. Create shared memory pool to handle buffers.
 		 */
-		if (!shpool)
+		if (!shpool || !config)
+			return RPMSG_ERR_PARAM;
+		/* Place the headers at the end of a cache line */
+		if (vdev->features & (1 << VIRTIO_RPMSG_F_CACHE_ALIGNED))
+			rvdev->buf_offset = VRING_CACHE_LINE_SIZE -
+					    sizeof(struct rpmsg_hdr);
+		else
+			rvdev->buf_offset = 0;
+		/*
+		 * A buffer must hold the message header, and the reclaimer
+		 * descriptor once released.
+		 */
+		if (config->h2r_buf_size <=
+		    rvdev->buf_offset + sizeof(struct rpmsg_hdr) ||
+		    config->h2r_buf_size <
+		    rvdev->buf_offset + sizeof(struct vbuff_reclaimer_t) ||
+		    config->r2h_buf_size <=
+		    rvdev->buf_offset + sizeof(struct rpmsg_hdr))
 			return RPMSG_ERR_PARAM;
 		if (!shpool->size)
 			return RPMSG_ERR_NO_BUFF;
 		rvdev->shpool = shpool;
-
-		vq_names[0] = "rx_vq";
-		vq_names[1] = "tx_vq";
-		callback[0] = rpmsg_virtio_rx_callback;
-		callback[1] = rpmsg_virtio_tx_callback;
-		rvdev->rvq  = vdev->vrings_info[0].vq;
-		rvdev->svq  = vdev->vrings_info[1].vq;
+		rvdev->config = *config;
+		rvdev->config.h2r_buf_size -= rvdev->buf_offset;
+		rvdev->config.r2h_buf_size -= rvdev->buf_offset;
 	}
 #endif /*!VIRTIO_SLAVE_ONLY*/
 
 #ifndef VIRTIO_MASTER_ONLY
 	(void)shpool;
-	if (role == RPMSG_REMOTE) {
-		vq_names[0] = "tx_vq";
-		vq_names[1] = "rx_vq";
-		callback[0] = rpmsg_virtio_tx_callback;
-		callback[1] = rpmsg_virtio_rx_callback;
-		rvdev->rvq  = vdev->vrings_info[1].vq;
-		rvdev->svq  = vdev->vrings_info[0].vq;
-	}
+	(void)config;
 #endif /*!VIRTIO_MASTER_ONLY*/
 	rvdev->shbuf_io = shm_io;
 
 	/* Create virtqueues for remote device */
-	status = rpmsg_virtio_create_virtqueues(rvdev, 0, RPMSG_NUM_VRINGS,
+	status = rpmsg_virtio_create_virtqueues(rvdev, 0,
+						RPMSG_NUM_VRINGS *
+						rvdev->num_queues,
 						vq_names, callback);
 	if (status != RPMSG_SUCCESS)
 		return status;
 
-	/*
-	 * Suppress "tx-complete" interrupts
-	 * since send method use busy loop when buffer pool exhaust
-	 */
-	virtqueue_disable_cb(rvdev->svq);
+	for (i = 0; i < rvdev->num_queues; i++) {
+		/*
+		 * Suppress "tx-complete" interrupts
+		 * since send method use busy loop when buffer pool exhaust
+		 */
+		virtqueue_disable_cb(rvdev->queues[i].svq);
+	}
+
+#ifdef RPMSG_VIRTIO_TX_STAGING
+	status = rpmsg_virtio_alloc_tx_slots(rvdev);
+	if (status != RPMSG_SUCCESS)
+		return status;
+#endif
 
 	/* TODO: can have a virtio function to set the shared memory I/O */
-	for (i = 0; i < RPMSG_NUM_VRINGS; i++) {
+	for (i = 0; i < RPMSG_NUM_VRINGS * rvdev->num_queues; i++) {
 		struct virtqueue *vq;
 
 		vq = vdev->vrings_info[i].vq;
@@ -597,31 +2837,31 @@ int rpmsg_init_vdev(struct rpmsg_virtio_device *rvdev,
 
 #ifndef VIRTIO_SLAVE_ONLY
 	if (role == RPMSG_MASTER) {
-		struct virtqueue_buf vqbuf;
-		unsigned int idx;
-		void *buffer;
-
-		vqbuf.len = RPMSG_BUFFER_SIZE;
-		for (idx = 0; idx < rvdev->rvq->vq_nentries; idx++) {
-			/* Initialize TX virtqueue buffers for remote device */
-			buffer = rpmsg_virtio_shm_pool_get_buffer(shpool,
-							RPMSG_BUFFER_SIZE);
-
-			if (!buffer) {
-				return RPMSG_ERR_NO_BUFF;
-			}
-
-			vqbuf.buf = buffer;
+		struct rpmsg_virtio_queue *queue;
 
-			metal_io_block_set(shm_io,
-					   metal_io_virt_to_offset(shm_io,
-								   buffer),
-					   0x00, RPMSG_BUFFER_SIZE);
-			status =
-				virtqueue_add_buffer(rvdev->rvq, &vqbuf, 0, 1,
-						     buffer);
+		/*
+		 * The number of buffers cannot exceed the vrings size, the
+		 * smallest one if the queues differ.
+		 */
+		for (i = 0; i < rvdev->num_queues; i++) {
+			queue = &rvdev->queues[i];
+			if (!rvdev->config.h2r_buf_num ||
+			    rvdev->config.h2r_buf_num > queue->svq->vq_nentries)
+				rvdev->config.h2r_buf_num =
+					queue->svq->vq_nentries;
+			if (!rvdev->config.r2h_buf_num ||
+			    rvdev->config.r2h_buf_num > queue->rvq->vq_nentries)
+				rvdev->config.r2h_buf_num =
+					queue->rvq->vq_nentries;
+		}
 
+		for (i = 0; i < rvdev->num_queues; i++) {
+			status = rpmsg_virtio_add_rx_buffers(&rvdev->queues[i]);
 			if (status != RPMSG_SUCCESS) {
+				rpmsg_virtio_free_buffers(rvdev);
+#ifdef RPMSG_VIRTIO_TX_STAGING
+				rpmsg_virtio_free_tx_slots(rvdev);
+#endif
 				return status;
 			}
 		}
@@ -629,7 +2869,7 @@ int rpmsg_init_vdev(struct rpmsg_virtio_device *rvdev,
 #endif /*!VIRTIO_SLAVE_ONLY*/
 
 	/* Initialize channels and endpoints list */
-	metal_list_init(&rdev->endpoints);
+	rpmsg_init_endpoints(rdev);
 
 	/*
 	 * Create name service announcement endpoint if device supports name
@@ -643,8 +2883,14 @@ int rpmsg_init_vdev(struct rpmsg_virtio_device *rvdev,
 	}
 
 #ifndef VIRTIO_SLAVE_ONLY
-	if (role == RPMSG_MASTER)
+	if (role == RPMSG_MASTER) {
+		/* The vrings and buffers must be visible to the remote */
+		for (i = 0; i < rvdev->num_queues; i++) {
+			virtqueue_flush_cache(rvdev->queues[i].rvq);
+			virtqueue_flush_cache(rvdev->queues[i].svq);
+		}
 		rpmsg_virtio_set_status(rvdev, VIRTIO_CONFIG_STATUS_DRIVER_OK);
+	}
 #endif /*!VIRTIO_SLAVE_ONLY*/
 
 	return status;
@@ -655,6 +2901,8 @@ void rpmsg_deinit_vdev(struct rpmsg_virtio_device *rvdev)
 	struct metal_list *node;
 	struct rpmsg_device *rdev;
 	struct rpmsg_endpoint *ept;
+	struct rpmsg_virtio_queue *queue;
+	unsigned int i;
 
 	rdev = &rvdev->rdev;
 	while (!metal_list_is_empty(&rdev->endpoints)) {
@@ -663,8 +2911,22 @@ void rpmsg_deinit_vdev(struct rpmsg_virtio_device *rvdev)
 		rpmsg_destroy_ept(ept);
 	}
 
-	rvdev->rvq = 0;
-	rvdev->svq = 0;
+#ifndef VIRTIO_SLAVE_ONLY
+	if (rpmsg_virtio_get_role(rvdev) == RPMSG_MASTER &&
+	    rvdev->queues[0].rvq)
+		rpmsg_virtio_free_buffers(rvdev);
+#endif /*!VIRTIO_SLAVE_ONLY*/
+#ifdef RPMSG_VIRTIO_TX_STAGING
+	rpmsg_virtio_free_tx_slots(rvdev);
+#endif
 
+	for (i = 0; i < rvdev->num_queues; i++) {
+		queue = &rvdev->queues[i];
+		queue->rvq = 0;
+		queue->svq = 0;
+
+		metal_mutex_deinit(&queue->rx_lock);
+		metal_mutex_deinit(&queue->tx_lock);
+	}
 	metal_mutex_deinit(&rdev->lock);
 }
@@ -35,6 +35,7 @@ static const struct virtio_feature_desc virtio_common_feature_desc[] = {
 	{VIRTIO_RING_F_INDIRECT_DESC, "RingIndirect"},
 	{VIRTIO_RING_F_EVENT_IDX, "EventIdx"},
 	{VIRTIO_F_BAD_FEATURE, "BadFeature"},
+	{VIRTIO_F_RING_PACKED, "RingPacked"},
 
 	{0, NULL}
 };
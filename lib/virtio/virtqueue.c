@@ -12,12 +12,22 @@
 #include <metal/log.h>
 #include <metal/alloc.h>
 
+/* Counts an event in the virtqueue counters, with VQUEUE_STATS */
+#ifdef VQUEUE_STATS
+#define VQ_STATS_INC(_vq, _field)	((_vq)->vq_stats._field++)
+#else
+#define VQ_STATS_INC(_vq, _field)	do { } while (0)
+#endif
+
 /* Prototype for internal functions. */
 static void vq_ring_init(struct virtqueue *, void *, int);
 static void vq_ring_update_avail(struct virtqueue *, uint16_t);
 static uint16_t vq_ring_add_buffer(struct virtqueue *, struct vring_desc *,
 				   uint16_t, struct virtqueue_buf *, int, int);
 static int vq_ring_enable_interrupt(struct virtqueue *, uint16_t);
+static uint16_t vq_ring_add_indirect(struct virtqueue *, uint16_t,
+				     struct virtqueue_buf *, int, int);
+static struct vring_desc *vq_ring_first_desc(struct virtqueue *, uint16_t);
 static void vq_ring_free_chain(struct virtqueue *, uint16_t);
 static int vq_ring_must_notify(struct virtqueue *vq);
 static void vq_ring_notify(struct virtqueue *vq);
@@ -27,6 +37,145 @@ static int virtqueue_nused(struct virtqueue *vq);
 #ifndef VIRTIO_MASTER_ONLY
 static int virtqueue_navail(struct virtqueue *vq);
 #endif
+static void vq_packed_ring_init(struct virtqueue *, void *, int);
+static uint16_t vq_packed_add_chain(struct virtqueue *,
+				    struct virtqueue_buf *, int, int, void *,
+				    uint16_t *);
+static void vq_packed_publish(struct virtqueue *, uint16_t, uint16_t);
+static void *vq_packed_get_buffer(struct virtqueue *, uint32_t *,
+				  uint16_t *);
+static void *vq_packed_get_available_buffer(struct virtqueue *, uint16_t *,
+					    uint32_t *);
+static void *vq_packed_peek_buffer(struct virtqueue *, uint16_t, uint32_t *);
+static uint16_t vq_packed_write_used(struct virtqueue *, uint16_t, uint32_t,
+				     uint16_t *);
+static int vq_packed_enable_interrupt(struct virtqueue *);
+static void vq_packed_disable_interrupt(struct virtqueue *);
+static int vq_packed_must_notify(struct virtqueue *);
+static void vq_cache_flush_ranges(struct virtqueue *);
+static void vq_ring_flush_cache(struct virtqueue *);
+static void vq_ring_flush_event(struct virtqueue *, void *, size_t);
+static void vq_ring_invalidate_entries(struct virtqueue *, uint16_t, void *,
+				       size_t, uint16_t);
+static void vq_ring_invalidate_peer(struct virtqueue *, uint16_t, void *,
+				    size_t, uint16_t);
+
+/* Tells whether the virtqueue uses the packed ring layout */
+static inline bool vq_is_packed(struct virtqueue *vq)
+{
+	return !!(vq->vq_dev->features & VIRTIO_F_RING_PACKED);
+}
+
+/* Tells whether a chain of buffers goes in an indirect descriptor table */
+static inline bool vq_ring_use_indirect(struct virtqueue *vq, int needed)
+{
+	return needed > 1 && needed <= vq->vq_indirect_max &&
+	       (vq->vq_dev->features & VIRTIO_RING_F_INDIRECT_DESC);
+}
+
+/* Tells whether a packed ring descriptor is made available by the driver */
+static inline bool vq_packed_desc_is_avail(struct vring_packed_desc *dp,
+					   bool wrap)
+{
+	uint16_t flags = dp->flags;
+
+	return !!(flags & VRING_PACKED_DESC_F_AVAIL) == wrap &&
+	       !!(flags & VRING_PACKED_DESC_F_USED) != wrap;
+}
+
+/* Tells whether a packed ring descriptor is given back by the device */
+static inline bool vq_packed_desc_is_used(struct vring_packed_desc *dp,
+					  bool wrap)
+{
+	uint16_t flags = dp->flags;
+
+	return !!(flags & VRING_PACKED_DESC_F_AVAIL) == wrap &&
+	       !!(flags & VRING_PACKED_DESC_F_USED) == wrap;
+}
+
+/* Rounds an address down to the start of its cache line */
+static inline uintptr_t vq_cache_line_down(uintptr_t addr)
+{
+	return addr & ~(uintptr_t)(VRING_CACHE_LINE_SIZE - 1);
+}
+
+/* Rounds an address up to the start of the next cache line */
+static inline uintptr_t vq_cache_line_up(uintptr_t addr)
+{
+	return vq_cache_line_down(addr + VRING_CACHE_LINE_SIZE - 1);
+}
+
+/*
+ * Returns the used index. With cache operations, it is only invalidated
+ * and read again once the entries up to it are consumed.
+ */
+static inline uint16_t vq_ring_peer_used_idx(struct virtqueue *vq)
+{
+	struct vring_used *used = vq->vq_ring.used;
+
+	if (!vq->vq_dev->cache_ops)
+		return used->idx;
+	if (vq->vq_cache_peer_idx == vq->vq_used_cons_idx) {
+		virtqueue_cache_invalidate(vq, used, sizeof(*used));
+		vq_ring_invalidate_peer(vq, used->idx, used->ring,
+					sizeof(struct vring_used_elem),
+					vq->vq_used_cons_idx);
+	}
+	return vq->vq_cache_peer_idx;
+}
+
+/* Returns the available index, read as vq_ring_peer_used_idx() */
+static inline uint16_t vq_ring_peer_avail_idx(struct virtqueue *vq)
+{
+	struct vring_avail *avail = vq->vq_ring.avail;
+
+	if (!vq->vq_dev->cache_ops)
+		return avail->idx;
+	if (vq->vq_cache_peer_idx == vq->vq_available_idx) {
+		virtqueue_cache_invalidate(vq, avail, sizeof(*avail));
+		vq_ring_invalidate_peer(vq, avail->idx, avail->ring,
+					sizeof(uint16_t),
+					vq->vq_available_idx);
+	}
+	return vq->vq_cache_peer_idx;
+}
+
+/*
+ * Returns the index of the ring written by this side: the available ring
+ * for the driver, the used ring for the device. With cache operations, it
+ * is only written to the ring once the entries are flushed.
+ */
+static inline uint16_t vq_ring_own_idx(struct virtqueue *vq, uint16_t idx)
+{
+	return vq->vq_dev->cache_ops ? vq->vq_cache_ring_idx : idx;
+}
+
+/*
+ * Keeps a new index of the ring written by this side, to be written by the
+ * next flush, if the device has cache operations. Returns false if the
+ * index must be written right away.
+ */
+static inline bool vq_ring_defer_idx(struct virtqueue *vq, uint16_t idx)
+{
+	if (!vq->vq_dev->cache_ops)
+		return false;
+	vq->vq_cache_ring_idx = idx;
+	return true;
+}
+
+/* Invalidates descriptors written by the driver, before the device reads */
+static inline void vq_cache_invalidate_desc(struct virtqueue *vq, void *desc,
+					    size_t len)
+{
+#ifndef VIRTIO_MASTER_ONLY
+	if (vq->vq_dev->role == VIRTIO_DEV_SLAVE)
+		virtqueue_cache_invalidate(vq, desc, len);
+#else
+	(void)vq;
+	(void)desc;
+	(void)len;
+#endif /*VIRTIO_MASTER_ONLY*/
+}
 
 /* Default implementation of P2V based on libmetal */
 static inline void *virtqueue_phys_to_virt(struct virtqueue *vq,
@@ -46,6 +195,60 @@ static inline metal_phys_addr_t virtqueue_virt_to_phys(struct virtqueue *vq,
 	return metal_io_virt_to_phys(io, buf);
 }
 
+/*
+ * Returns the number of buffers not given back to the other side yet, see
+ * struct virtqueue_stats.
+ */
+static inline uint16_t vq_stats_outstanding(struct virtqueue *vq)
+{
+	struct virtqueue_stats *stats = &vq->vq_stats;
+
+#ifndef VIRTIO_SLAVE_ONLY
+	if (vq->vq_dev->role == VIRTIO_DEV_MASTER)
+		return (uint16_t)(stats->added - stats->got);
+#endif /*VIRTIO_SLAVE_ONLY*/
+	return (uint16_t)(stats->got - stats->added);
+}
+
+/* Counts buffers given to the other side */
+static inline void vq_stats_add(struct virtqueue *vq, unsigned int num)
+{
+#ifdef VQUEUE_STATS
+	struct virtqueue_stats *stats = &vq->vq_stats;
+	uint16_t outstanding;
+
+	stats->added += num;
+	outstanding = vq_stats_outstanding(vq);
+	if (outstanding > stats->max_outstanding)
+		stats->max_outstanding = outstanding;
+#else
+	(void)vq;
+	(void)num;
+#endif
+}
+
+/*
+ * Counts a buffer got from the other side, @pending being the number of
+ * buffers which were waiting in the ring, 0 if unknown.
+ */
+static inline void vq_stats_get(struct virtqueue *vq, uint16_t pending)
+{
+#ifdef VQUEUE_STATS
+	struct virtqueue_stats *stats = &vq->vq_stats;
+	uint16_t outstanding;
+
+	stats->got++;
+	if (pending > stats->max_pending)
+		stats->max_pending = pending;
+	outstanding = vq_stats_outstanding(vq);
+	if (outstanding > stats->max_outstanding)
+		stats->max_outstanding = outstanding;
+#else
+	(void)vq;
+	(void)pending;
+#endif
+}
+
 /**
  * virtqueue_create - Creates new VirtIO queue
  *
@@ -68,12 +271,17 @@ int virtqueue_create(struct virtio_device *virt_dev, unsigned short id,
 		     struct virtqueue *vq)
 {
 	int status = VQUEUE_SUCCESS;
+	size_t size;
 
 	VQ_PARAM_CHK(ring == NULL, status, ERROR_VQUEUE_INVLD_PARAM);
 	VQ_PARAM_CHK(ring->num_descs == 0, status, ERROR_VQUEUE_INVLD_PARAM);
 	VQ_PARAM_CHK(ring->num_descs & (ring->num_descs - 1), status,
 		     ERROR_VRING_ALIGN);
 	VQ_PARAM_CHK(vq == NULL, status, ERROR_NO_MEM);
+	/* No cache maintenance of the packed ring, see virtio_set_cache_ops */
+	VQ_PARAM_CHK(virt_dev->cache_ops &&
+		     (virt_dev->features & VIRTIO_F_RING_PACKED), status,
+		     ERROR_VQUEUE_INVLD_PARAM);
 
 	if (status == VQUEUE_SUCCESS) {
 		vq->vq_dev = virt_dev;
@@ -83,9 +291,31 @@ int virtqueue_create(struct virtio_device *virt_dev, unsigned short id,
 		vq->vq_free_cnt = vq->vq_nentries;
 		vq->callback = callback;
 		vq->notify = notify;
+		vq->vq_cache_nranges = 0;
+		vq->vq_cache_ring_idx = 0;
+		vq->vq_cache_peer_idx = 0;
+		memset(&vq->vq_stats, 0, sizeof(vq->vq_stats));
 
 		/* Initialize vring control block in virtqueue. */
-		vq_ring_init(vq, ring->vaddr, ring->align);
+		if (vq_is_packed(vq)) {
+			vq_packed_ring_init(vq, ring->vaddr, ring->align);
+		} else {
+			vq_ring_init(vq, ring->vaddr, ring->align);
+			/*
+			 * The driver has initialized the whole ring, the
+			 * device must not read its stale cached copy.
+			 */
+			size = vring_size(vq->vq_nentries, ring->align);
+#ifndef VIRTIO_SLAVE_ONLY
+			if (virt_dev->role == VIRTIO_DEV_MASTER)
+				virtqueue_cache_flush(vq, ring->vaddr, size);
+#endif /*VIRTIO_SLAVE_ONLY*/
+#ifndef VIRTIO_MASTER_ONLY
+			if (virt_dev->role == VIRTIO_DEV_SLAVE)
+				virtqueue_cache_invalidate(vq, ring->vaddr,
+							   size);
+#endif /*VIRTIO_MASTER_ONLY*/
+		}
 	}
 
 	return status;
@@ -121,7 +351,18 @@ int virtqueue_add_buffer(struct virtqueue *vq, struct virtqueue_buf *buf_list,
 
 	VQUEUE_BUSY(vq);
 
-	if (status == VQUEUE_SUCCESS) {
+	if (status == VQUEUE_SUCCESS && vq_is_packed(vq)) {
+		uint16_t flags;
+
+		if (vq->vq_free_cnt < needed) {
+			VQUEUE_IDLE(vq);
+			return ERROR_VRING_FULL;
+		}
+		head_idx = vq_packed_add_chain(vq, buf_list, readable,
+					       writable, cookie, &flags);
+		vq_packed_publish(vq, head_idx, flags);
+		vq->vq_queued_cnt++;
+	} else if (status == VQUEUE_SUCCESS) {
 		VQASSERT(vq, cookie != NULL, "enqueuing with no cookie");
 
 		head_idx = vq->vq_desc_head_idx;
@@ -132,11 +373,18 @@ int virtqueue_add_buffer(struct virtqueue *vq, struct virtqueue_buf *buf_list,
 			 "cookie already exists for index");
 
 		dxp->cookie = cookie;
-		dxp->ndescs = needed;
 
 		/* Enqueue buffer onto the ring. */
-		idx = vq_ring_add_buffer(vq, vq->vq_ring.desc, head_idx,
-					 buf_list, readable, writable);
+		if (vq_ring_use_indirect(vq, needed)) {
+			idx = vq_ring_add_indirect(vq, head_idx, buf_list,
+						   readable, writable);
+			needed = 1;
+		} else {
+			idx = vq_ring_add_buffer(vq, vq->vq_ring.desc,
+						 head_idx, buf_list, readable,
+						 writable);
+		}
+		dxp->ndescs = needed;
 
 		vq->vq_desc_head_idx = idx;
 		vq->vq_free_cnt -= needed;
@@ -154,11 +402,110 @@ int virtqueue_add_buffer(struct virtqueue *vq, struct virtqueue_buf *buf_list,
 		vq_ring_update_avail(vq, head_idx);
 	}
 
+	if (status == VQUEUE_SUCCESS)
+		vq_stats_add(vq, 1);
+
 	VQUEUE_IDLE(vq);
 
 	return status;
 }
 
+/**
+ * virtqueue_add_buffer_batch() - Enqueues several buffers in vring for
+ *                                consumption by other side, and makes them
+ *                                available with a single avail index update
+ *
+ * @param vq                - Pointer to VirtIO queue control block.
+ * @param buf_list          - Pointer to an array of virtqueue buffers, each
+ *                            of them is enqueued as a one descriptor chain
+ *                            with the buffer address as cookie.
+ * @param num               - Number of buffers
+ * @param writable          - Non zero if the buffers are writable by the
+ *                            other side, zero if they are readable
+ *
+ * @return                  - Function status
+ */
+int virtqueue_add_buffer_batch(struct virtqueue *vq,
+			       struct virtqueue_buf *buf_list,
+			       int num, int writable)
+{
+	struct vq_desc_extra *dxp;
+	uint16_t head_idx, avail_idx, flags = 0;
+	int i;
+
+	if (num <= 0)
+		return VQUEUE_SUCCESS;
+	if (vq->vq_free_cnt < num)
+		return ERROR_VRING_FULL;
+
+	VQUEUE_BUSY(vq);
+
+	if (vq_is_packed(vq)) {
+		/*
+		 * The device consumes the descriptors in order: holding back
+		 * the flags of the first one makes the whole batch available
+		 * at once.
+		 */
+		for (i = 0; i < num; i++) {
+			uint16_t head_flags;
+
+			avail_idx = vq_packed_add_chain(vq, &buf_list[i],
+							!writable, !!writable,
+							buf_list[i].buf,
+							&head_flags);
+			if (!i) {
+				head_idx = avail_idx;
+				flags = head_flags;
+			} else {
+				vq->vq_packed_ring.desc[avail_idx].flags =
+					head_flags;
+			}
+		}
+		vq_packed_publish(vq, head_idx, flags);
+		vq->vq_queued_cnt += num;
+		vq_stats_add(vq, num);
+
+		VQUEUE_IDLE(vq);
+
+		return VQUEUE_SUCCESS;
+	}
+
+	avail_idx = vq_ring_own_idx(vq, vq->vq_ring.avail->idx);
+	for (i = 0; i < num; i++) {
+		head_idx = vq->vq_desc_head_idx;
+		VQ_RING_ASSERT_VALID_IDX(vq, head_idx);
+		dxp = &vq->vq_descx[head_idx];
+
+		VQASSERT(vq, dxp->cookie == NULL,
+			 "cookie already exists for index");
+
+		dxp->cookie = buf_list[i].buf;
+		dxp->ndescs = 1;
+
+		vq->vq_desc_head_idx =
+			vq_ring_add_buffer(vq, vq->vq_ring.desc, head_idx,
+					   &buf_list[i], !writable, !!writable);
+		vq->vq_free_cnt--;
+
+		vq->vq_ring.avail->ring[avail_idx++ & (vq->vq_nentries - 1)] =
+			head_idx;
+	}
+
+	/* Publish all the new entries at once. */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (!vq_ring_defer_idx(vq, avail_idx))
+		vq->vq_ring.avail->idx = avail_idx;
+
+	/* Keep pending count until virtqueue_notify(). */
+	vq->vq_queued_cnt += num;
+	vq_stats_add(vq, num);
+
+	VQUEUE_IDLE(vq);
+
+	return VQUEUE_SUCCESS;
+}
+
 /**
  * virtqueue_get_buffer - Returns used buffers from VirtIO queue
  *
@@ -172,13 +519,20 @@ void *virtqueue_get_buffer(struct virtqueue *vq, uint32_t *len, uint16_t *idx)
 {
 	struct vring_used_elem *uep;
 	void *cookie;
-	uint16_t used_idx, desc_idx;
+	uint16_t used_idx, desc_idx, peer_idx;
 
-	if (!vq || vq->vq_used_cons_idx == vq->vq_ring.used->idx)
+	if (vq && vq_is_packed(vq))
+		return vq_packed_get_buffer(vq, len, idx);
+
+	if (!vq)
+		return NULL;
+	peer_idx = vq_ring_peer_used_idx(vq);
+	if (vq->vq_used_cons_idx == peer_idx)
 		return NULL;
 
 	VQUEUE_BUSY(vq);
 
+	vq_stats_get(vq, peer_idx - vq->vq_used_cons_idx);
 	used_idx = vq->vq_used_cons_idx++ & (vq->vq_nentries - 1);
 	uep = &vq->vq_ring.used->ring[used_idx];
 
@@ -193,8 +547,12 @@ void *virtqueue_get_buffer(struct virtqueue *vq, uint32_t *len, uint16_t *idx)
 	cookie = vq->vq_descx[desc_idx].cookie;
 	vq->vq_descx[desc_idx].cookie = NULL;
 
+	/*
+	 * Report the descriptor index, not the used ring slot: buffers may
+	 * be handed back by the caller in any order.
+	 */
 	if (idx)
-		*idx = used_idx;
+		*idx = desc_idx;
 	VQUEUE_IDLE(vq);
 
 	return cookie;
@@ -202,7 +560,127 @@ void *virtqueue_get_buffer(struct virtqueue *vq, uint32_t *len, uint16_t *idx)
 
 uint32_t virtqueue_get_buffer_length(struct virtqueue *vq, uint16_t idx)
 {
-	return vq->vq_ring.desc[idx].len;
+	struct vring_desc *dp;
+
+	if (vq_is_packed(vq))
+		return vq->vq_descx[idx].len;
+	dp = vq_ring_first_desc(vq, idx);
+	return dp ? dp->len : 0;
+}
+
+/**
+ * virtqueue_get_buffer_segments - Returns the buffers of a descriptor chain
+ *
+ * Walks the chain whose head is the descriptor idx, either directly in the
+ * ring or in its indirect descriptor table. Only the split ring is
+ * supported.
+ *
+ * @param vq            - Pointer to VirtIO queue control block
+ * @param idx           - Index of the head descriptor of the chain
+ * @param segs          - Array to fill with the buffers of the chain
+ * @param num           - Number of entries of the array
+ *
+ * @return              - Number of buffers of the chain, which may be
+ *                        more than num, or an error code
+ */
+int virtqueue_get_buffer_segments(struct virtqueue *vq, uint16_t idx,
+				  struct virtqueue_buf *segs, int num)
+{
+	struct vring_desc *desc, *dp;
+	uint32_t max;
+	int i;
+
+	if (!vq || vq_is_packed(vq) || idx >= vq->vq_nentries)
+		return ERROR_VQUEUE_INVLD_PARAM;
+
+	desc = vq->vq_ring.desc;
+	max = vq->vq_nentries;
+	dp = &desc[idx];
+	vq_cache_invalidate_desc(vq, dp, sizeof(*dp));
+	if (dp->flags & VRING_DESC_F_INDIRECT) {
+		max = dp->len / sizeof(struct vring_desc);
+		desc = virtqueue_phys_to_virt(vq, dp->addr);
+		if (!desc || !max)
+			return ERROR_INVLD_DESC_IDX;
+		dp = desc;
+		vq_cache_invalidate_desc(vq, desc, max * sizeof(*desc));
+	}
+
+	for (i = 0; ; i++) {
+		/* A longer chain has a loop */
+		if ((uint32_t)i >= max)
+			return ERROR_INVLD_DESC_IDX;
+		if (i < num) {
+			segs[i].buf = virtqueue_phys_to_virt(vq, dp->addr);
+			segs[i].len = dp->len;
+		}
+		if (!(dp->flags & VRING_DESC_F_NEXT))
+			break;
+		if (dp->next >= max)
+			return ERROR_INVLD_DESC_IDX;
+		dp = &desc[dp->next];
+		if (desc == vq->vq_ring.desc)
+			vq_cache_invalidate_desc(vq, dp, sizeof(*dp));
+	}
+
+	return i + 1;
+}
+
+/**
+ * virtqueue_detach_unused_buffer - Detaches a buffer still owned by the
+ *                                  VirtIO queue
+ *
+ * Used on teardown, to get back the buffers which have been added to the
+ * queue and not returned by the other side yet.
+ *
+ * @param vq            - Pointer to VirtIO queue control block
+ *
+ * @return              - Pointer to the buffer, NULL if there is none left
+ */
+void *virtqueue_detach_unused_buffer(struct virtqueue *vq)
+{
+	void *cookie;
+	uint16_t idx;
+
+	if (!vq)
+		return NULL;
+
+	VQUEUE_BUSY(vq);
+
+	for (idx = 0; idx < vq->vq_nentries; idx++) {
+		cookie = vq->vq_descx[idx].cookie;
+		if (cookie) {
+			vq->vq_descx[idx].cookie = NULL;
+			if (vq_is_packed(vq)) {
+				vq->vq_free_cnt += vq->vq_descx[idx].ndescs;
+				vq->vq_descx[idx].next = vq->vq_desc_head_idx;
+				vq->vq_desc_head_idx = idx;
+			} else {
+				vq_ring_free_chain(vq, idx);
+			}
+			VQUEUE_IDLE(vq);
+			return cookie;
+		}
+	}
+
+	VQUEUE_IDLE(vq);
+
+	return NULL;
+}
+
+/**
+ * virtqueue_get_stats - Gets the counters of a VirtIO queue
+ *
+ * The counters are only collected with VQUEUE_STATS, they are all zero
+ * otherwise. They are read without lock.
+ *
+ * @param vq            - Pointer to VirtIO queue control block
+ * @param stats         - Pointer to the structure to fill
+ */
+void virtqueue_get_stats(struct virtqueue *vq, struct virtqueue_stats *stats)
+{
+	if (vq && stats)
+		*stats = vq->vq_stats;
 }
 
 /**
@@ -237,21 +715,32 @@ void virtqueue_free(struct virtqueue *vq)
 void *virtqueue_get_available_buffer(struct virtqueue *vq, uint16_t *avail_idx,
 				     uint32_t *len)
 {
-	uint16_t head_idx = 0;
-	void *buffer;
+	struct vring_desc *dp;
+	uint16_t head_idx = 0, peer_idx;
+	void *buffer = NULL;
+
+	if (vq_is_packed(vq))
+		return vq_packed_get_available_buffer(vq, avail_idx, len);
 
 	atomic_thread_fence(memory_order_seq_cst);
-	if (vq->vq_available_idx == vq->vq_ring.avail->idx) {
+	peer_idx = vq_ring_peer_avail_idx(vq);
+	if (vq->vq_available_idx == peer_idx) {
 		return NULL;
 	}
 
 	VQUEUE_BUSY(vq);
 
+	vq_stats_get(vq, peer_idx - vq->vq_available_idx);
 	head_idx = vq->vq_available_idx++ & (vq->vq_nentries - 1);
 	*avail_idx = vq->vq_ring.avail->ring[head_idx];
 
-	buffer = virtqueue_phys_to_virt(vq, vq->vq_ring.desc[*avail_idx].addr);
-	*len = vq->vq_ring.desc[*avail_idx].len;
+	/* A chain in an indirect table starts with the table first entry */
+	dp = vq_ring_first_desc(vq, *avail_idx);
+	*len = 0;
+	if (dp) {
+		buffer = virtqueue_phys_to_virt(vq, dp->addr);
+		*len = dp->len;
+	}
 
 	VQUEUE_IDLE(vq);
 
@@ -273,23 +762,114 @@ int virtqueue_add_consumed_buffer(struct virtqueue *vq, uint16_t head_idx,
 	struct vring_used_elem *used_desc = NULL;
 	uint16_t used_idx;
 
-	if (head_idx > vq->vq_nentries) {
+	if (head_idx >= vq->vq_nentries) {
 		return ERROR_VRING_NO_BUFF;
 	}
 
 	VQUEUE_BUSY(vq);
 
-	used_idx = vq->vq_ring.used->idx & (vq->vq_nentries - 1);
-	used_desc = &vq->vq_ring.used->ring[used_idx];
+	if (vq_is_packed(vq)) {
+		uint16_t flags;
+
+		used_idx = vq_packed_write_used(vq, head_idx, len, &flags);
+		vq_packed_publish(vq, used_idx, flags);
+		vq->vq_queued_cnt++;
+		vq_stats_add(vq, 1);
+		VQUEUE_IDLE(vq);
+		return VQUEUE_SUCCESS;
+	}
+
+	used_idx = vq_ring_own_idx(vq, vq->vq_ring.used->idx);
+	used_desc = &vq->vq_ring.used->ring[used_idx &
+					    (vq->vq_nentries - 1)];
 	used_desc->id = head_idx;
 	used_desc->len = len;
 
 	atomic_thread_fence(memory_order_seq_cst);
 
-	vq->vq_ring.used->idx++;
+	if (!vq_ring_defer_idx(vq, used_idx + 1))
+		vq->vq_ring.used->idx = used_idx + 1;
 
 	/* Keep pending count until virtqueue_notify(). */
 	vq->vq_queued_cnt++;
+	vq_stats_add(vq, 1);
+
+	VQUEUE_IDLE(vq);
+
+	return VQUEUE_SUCCESS;
+}
+
+/**
+ * virtqueue_add_consumed_buffer_batch - Returns several consumed buffers
+ *                                       back to VirtIO queue with a single
+ *                                       used index update
+ *
+ * @param vq                     - Pointer to VirtIO queue control block
+ * @param used                   - Array of used elements, giving for each
+ *                                 buffer the index of the vring desc and the
+ *                                 length of the buffer
+ * @param num                    - Number of buffers
+ *
+ * @return                       - Function status
+ */
+int virtqueue_add_consumed_buffer_batch(struct virtqueue *vq,
+					const struct vring_used_elem *used,
+					int num)
+{
+	struct vring_used_elem *used_desc;
+	uint16_t used_idx, head_idx = 0, flags = 0;
+	int i;
+
+	for (i = 0; i < num; i++) {
+		if (used[i].id >= vq->vq_nentries)
+			return ERROR_VRING_NO_BUFF;
+	}
+
+	VQUEUE_BUSY(vq);
+
+	if (vq_is_packed(vq)) {
+		/* Hold back the first flags, as for the available buffers */
+		for (i = 0; i < num; i++) {
+			uint16_t used_flags;
+
+			used_idx = vq_packed_write_used(vq, used[i].id,
+							used[i].len,
+							&used_flags);
+			if (!i) {
+				head_idx = used_idx;
+				flags = used_flags;
+			} else {
+				vq->vq_packed_ring.desc[used_idx].flags =
+					used_flags;
+			}
+		}
+		if (num)
+			vq_packed_publish(vq, head_idx, flags);
+		vq->vq_queued_cnt += num;
+		vq_stats_add(vq, num);
+
+		VQUEUE_IDLE(vq);
+
+		return VQUEUE_SUCCESS;
+	}
+
+	used_idx = vq_ring_own_idx(vq, vq->vq_ring.used->idx);
+	for (i = 0; i < num; i++) {
+		used_desc = &vq->vq_ring.used->ring[used_idx++ &
+						    (vq->vq_nentries - 1)];
+		used_desc->id = used[i].id;
+		used_desc->len = used[i].len;
+	}
+
+	/* Publish all the consumed entries at once. */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (!vq_ring_defer_idx(vq, used_idx))
+		vq->vq_ring.used->idx = used_idx;
+
+	/* Keep pending count until virtqueue_notify(). */
+	vq->vq_queued_cnt += num;
+	vq_stats_add(vq, num);
 
 	VQUEUE_IDLE(vq);
 
@@ -305,75 +885,326 @@ int virtqueue_add_consumed_buffer(struct virtqueue *vq, uint16_t head_idx,
  */
 int virtqueue_enable_cb(struct virtqueue *vq)
 {
+	if (vq_is_packed(vq))
+		return vq_packed_enable_interrupt(vq);
 	return vq_ring_enable_interrupt(vq, 0);
 }
 
 /**
- * virtqueue_disable_cb - Disables callback generation
+ * virtqueue_has_buffer - Tells whether a buffer can be got from the queue
  *
- * @param vq           - Pointer to VirtIO queue control block
+ * The driver gets the buffers used by the device with
+ * virtqueue_get_buffer(), the device the buffers made available by the
+ * driver with virtqueue_get_available_buffer(). Nothing is consumed, so
+ * that a waiter can poll the queue without its callback.
+ *
+ * @param vq            - Pointer to VirtIO queue control block
  *
+ * @return              - Non-zero if a buffer can be got
  */
-void virtqueue_disable_cb(struct virtqueue *vq)
+int virtqueue_has_buffer(struct virtqueue *vq)
 {
-	VQUEUE_BUSY(vq);
+	struct vring_packed_desc *dp;
 
-	if (vq->vq_dev->features & VIRTIO_RING_F_EVENT_IDX) {
+	if (vq_is_packed(vq)) {
 #ifndef VIRTIO_SLAVE_ONLY
 		if (vq->vq_dev->role == VIRTIO_DEV_MASTER) {
-			vring_used_event(&vq->vq_ring) =
-			    vq->vq_used_cons_idx - vq->vq_nentries - 1;
+			dp = &vq->vq_packed_ring.desc[vq->vq_packed_used_idx];
+			return vq_packed_desc_is_used(dp,
+						      vq->vq_packed_used_wrap);
 		}
 #endif /*VIRTIO_SLAVE_ONLY*/
 #ifndef VIRTIO_MASTER_ONLY
 		if (vq->vq_dev->role == VIRTIO_DEV_SLAVE) {
-			vring_avail_event(&vq->vq_ring) =
-			    vq->vq_available_idx - vq->vq_nentries - 1;
+			dp = &vq->vq_packed_ring.desc[vq->vq_packed_avail_idx];
+			return vq_packed_desc_is_avail(dp,
+						       vq->vq_packed_avail_wrap);
 		}
 #endif /*VIRTIO_MASTER_ONLY*/
-	} else {
+		return 0;
+	}
+
+	atomic_thread_fence(memory_order_seq_cst);
 #ifndef VIRTIO_SLAVE_ONLY
-		if (vq->vq_dev->role == VIRTIO_DEV_MASTER)
-			vq->vq_ring.avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+	if (vq->vq_dev->role == VIRTIO_DEV_MASTER)
+		return vq_ring_peer_used_idx(vq) != vq->vq_used_cons_idx;
 #endif /*VIRTIO_SLAVE_ONLY*/
 #ifndef VIRTIO_MASTER_ONLY
-		if (vq->vq_dev->role == VIRTIO_DEV_SLAVE)
-			vq->vq_ring.used->flags |= VRING_USED_F_NO_NOTIFY;
+	if (vq->vq_dev->role == VIRTIO_DEV_SLAVE)
+		return vq_ring_peer_avail_idx(vq) != vq->vq_available_idx;
 #endif /*VIRTIO_MASTER_ONLY*/
-	}
 
-	VQUEUE_IDLE(vq);
+	return 0;
 }
 
 /**
- * virtqueue_kick - Notifies other side that there is buffer available for it.
+ * virtqueue_peek_buffer - Returns a buffer of the queue without getting it
  *
- * @param vq      - Pointer to VirtIO queue control block
+ * Returns the buffer which the n-th next virtqueue_get_buffer() (driver)
+ * or virtqueue_get_available_buffer() (device) call would return, leaving
+ * the queue as is, so that a context which cannot consume the queue can
+ * still read what it holds. The buffer must not be written.
+ *
+ * @param vq            - Pointer to VirtIO queue control block
+ * @param n             - Number of buffers to skip
+ * @param len           - Length of the buffer
+ *
+ * @return              - Pointer to the buffer, NULL if the queue holds
+ *                        no more than n buffers
  */
-void virtqueue_kick(struct virtqueue *vq)
+void *virtqueue_peek_buffer(struct virtqueue *vq, uint16_t n, uint32_t *len)
 {
-	VQUEUE_BUSY(vq);
+	if (vq_is_packed(vq))
+		return vq_packed_peek_buffer(vq, n, len);
 
-	/* Ensure updated avail->idx is visible to host. */
-	atomic_thread_fence(memory_order_seq_cst);
-
-	if (vq_ring_must_notify(vq))
-		vq_ring_notify(vq);
+#ifndef VIRTIO_SLAVE_ONLY
+	if (vq->vq_dev->role == VIRTIO_DEV_MASTER) {
+		struct vring_used *used = vq->vq_ring.used;
+		uint16_t cons, peer, idx;
+
+		/* The index kept for the consumer is left as is */
+		cons = vq->vq_used_cons_idx;
+		if (vq->vq_dev->cache_ops)
+			virtqueue_cache_invalidate(vq, used, sizeof(*used));
+		peer = used->idx;
+		if ((uint16_t)(peer - cons) <= n)
+			return NULL;
+		if (vq->vq_dev->cache_ops)
+			vq_ring_invalidate_entries(vq, peer, used->ring,
+						   sizeof(struct vring_used_elem),
+						   cons);
+		atomic_thread_fence(memory_order_seq_cst);
+
+		idx = (uint16_t)used->ring[(cons + n) &
+					   (vq->vq_nentries - 1)].id;
+		if (idx >= vq->vq_nentries)
+			return NULL;
+		*len = used->ring[(cons + n) & (vq->vq_nentries - 1)].len;
+		return vq->vq_descx[idx].cookie;
+	}
+#endif /*VIRTIO_SLAVE_ONLY*/
 
-	vq->vq_queued_cnt = 0;
+#ifndef VIRTIO_MASTER_ONLY
+	if (vq->vq_dev->role == VIRTIO_DEV_SLAVE) {
+		struct vring_avail *avail = vq->vq_ring.avail;
+		struct vring_desc *dp;
+		uint16_t cons, peer, idx;
+
+		cons = vq->vq_available_idx;
+		if (vq->vq_dev->cache_ops)
+			virtqueue_cache_invalidate(vq, avail, sizeof(*avail));
+		peer = avail->idx;
+		if ((uint16_t)(peer - cons) <= n)
+			return NULL;
+		if (vq->vq_dev->cache_ops)
+			vq_ring_invalidate_entries(vq, peer, avail->ring,
+						   sizeof(uint16_t), cons);
+		atomic_thread_fence(memory_order_seq_cst);
+
+		idx = avail->ring[(cons + n) & (vq->vq_nentries - 1)];
+		if (idx >= vq->vq_nentries)
+			return NULL;
+		dp = vq_ring_first_desc(vq, idx);
+		if (!dp)
+			return NULL;
+		*len = dp->len;
+		return virtqueue_phys_to_virt(vq, dp->addr);
+	}
+#endif /*VIRTIO_MASTER_ONLY*/
 
-	VQUEUE_IDLE(vq);
+	return NULL;
 }
 
 /**
- * virtqueue_dump Dumps important virtqueue fields , use for debugging purposes
+ * virtqueue_disable_cb - Disables callback generation
+ *
+ * @param vq           - Pointer to VirtIO queue control block
  *
- * @param vq - Pointer to VirtIO queue control block
  */
-void virtqueue_dump(struct virtqueue *vq)
+void virtqueue_disable_cb(struct virtqueue *vq)
 {
-	if (!vq)
-		return;
+	VQUEUE_BUSY(vq);
+
+	if (vq_is_packed(vq)) {
+		vq_packed_disable_interrupt(vq);
+	} else if (vq->vq_dev->features & VIRTIO_RING_F_EVENT_IDX) {
+#ifndef VIRTIO_SLAVE_ONLY
+		if (vq->vq_dev->role == VIRTIO_DEV_MASTER) {
+			vring_used_event(&vq->vq_ring) =
+			    vq->vq_used_cons_idx - vq->vq_nentries - 1;
+			vq_ring_flush_event(vq,
+					    &vring_used_event(&vq->vq_ring),
+					    sizeof(uint16_t));
+		}
+#endif /*VIRTIO_SLAVE_ONLY*/
+#ifndef VIRTIO_MASTER_ONLY
+		if (vq->vq_dev->role == VIRTIO_DEV_SLAVE) {
+			vring_avail_event(&vq->vq_ring) =
+			    vq->vq_available_idx - vq->vq_nentries - 1;
+			vq_ring_flush_event(vq,
+					    &vring_avail_event(&vq->vq_ring),
+					    sizeof(uint16_t));
+		}
+#endif /*VIRTIO_MASTER_ONLY*/
+	} else {
+#ifndef VIRTIO_SLAVE_ONLY
+		if (vq->vq_dev->role == VIRTIO_DEV_MASTER) {
+			vq->vq_ring.avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+			vq_ring_flush_event(vq, &vq->vq_ring.avail->flags,
+					    sizeof(uint16_t));
+		}
+#endif /*VIRTIO_SLAVE_ONLY*/
+#ifndef VIRTIO_MASTER_ONLY
+		if (vq->vq_dev->role == VIRTIO_DEV_SLAVE) {
+			vq->vq_ring.used->flags |= VRING_USED_F_NO_NOTIFY;
+			vq_ring_flush_event(vq, &vq->vq_ring.used->flags,
+					    sizeof(uint16_t));
+		}
+#endif /*VIRTIO_MASTER_ONLY*/
+	}
+
+	VQUEUE_IDLE(vq);
+}
+
+/**
+ * virtqueue_kick - Notifies other side that there is buffer available for it.
+ *
+ * @param vq      - Pointer to VirtIO queue control block
+ */
+void virtqueue_kick(struct virtqueue *vq)
+{
+	VQUEUE_BUSY(vq);
+
+	/* Write back what has been queued since the last kick. */
+	virtqueue_flush_cache(vq);
+
+	/* Ensure updated avail->idx is visible to host. */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (vq_ring_must_notify(vq)) {
+		vq_ring_notify(vq);
+		VQ_STATS_INC(vq, kicks);
+	} else {
+		VQ_STATS_INC(vq, kicks_suppressed);
+	}
+
+	vq->vq_queued_cnt = 0;
+
+	VQUEUE_IDLE(vq);
+}
+
+/**
+ * virtqueue_flush_cache - Writes back the shared memory updates of the
+ *                         VirtIO queue not flushed yet
+ *
+ * Done by virtqueue_kick(). The ranges queued with virtqueue_cache_flush()
+ * are flushed first, then the ring entries and, last, the ring index which
+ * makes them visible to the other side: with cache operations, the index
+ * of a split ring is only written there. Nothing is done if the device has
+ * no cache operations.
+ *
+ * @param vq      - Pointer to VirtIO queue control block
+ */
+void virtqueue_flush_cache(struct virtqueue *vq)
+{
+	if (!vq->vq_dev->cache_ops)
+		return;
+
+	vq_cache_flush_ranges(vq);
+	if (!vq_is_packed(vq))
+		vq_ring_flush_cache(vq);
+}
+
+/**
+ * virtqueue_cache_flush - Queues a memory range to write back before the
+ *                         buffers added to the VirtIO queue are visible to
+ *                         the other side
+ *
+ * The range is rounded to cache lines and merged with the overlapping or
+ * adjacent ranges already queued, to be flushed by the next
+ * virtqueue_kick(). Used for the buffers written by this side.
+ *
+ * @param vq      - Pointer to VirtIO queue control block
+ * @param addr    - Start of the memory range
+ * @param len     - Length of the memory range
+ */
+void virtqueue_cache_flush(struct virtqueue *vq, void *addr, size_t len)
+{
+	struct vq_cache_range *range;
+	uintptr_t start, end;
+	uint16_t i;
+
+	if (!vq->vq_dev->cache_ops || !len)
+		return;
+
+	start = vq_cache_line_down((uintptr_t)addr);
+	end = vq_cache_line_up((uintptr_t)addr + len);
+	for (i = 0; i < vq->vq_cache_nranges; i++) {
+		range = &vq->vq_cache_ranges[i];
+		if (start <= range->end && end >= range->start) {
+			if (start < range->start)
+				range->start = start;
+			if (end > range->end)
+				range->end = end;
+			return;
+		}
+	}
+
+	if (vq->vq_cache_nranges == VQ_CACHE_MAX_RANGES)
+		vq_cache_flush_ranges(vq);
+	range = &vq->vq_cache_ranges[vq->vq_cache_nranges++];
+	range->start = start;
+	range->end = end;
+}
+
+/**
+ * virtqueue_cache_invalidate - Discards the cached copy of a memory range
+ *                              written by the other side
+ *
+ * Done right away, before reading a received buffer. The range is rounded
+ * to cache lines, which must not hold updates of this side.
+ *
+ * @param vq      - Pointer to VirtIO queue control block
+ * @param addr    - Start of the memory range
+ * @param len     - Length of the memory range
+ */
+void virtqueue_cache_invalidate(struct virtqueue *vq, void *addr, size_t len)
+{
+	const struct virtio_cache_ops *ops = vq->vq_dev->cache_ops;
+	uintptr_t start, end;
+
+	if (!ops || !len)
+		return;
+
+	start = vq_cache_line_down((uintptr_t)addr);
+	end = vq_cache_line_up((uintptr_t)addr + len);
+	ops->invalidate(ops->priv, (void *)start, end - start);
+}
+
+/**
+ * virtqueue_dump Dumps important virtqueue fields , use for debugging purposes
+ *
+ * @param vq - Pointer to VirtIO queue control block
+ */
+void virtqueue_dump(struct virtqueue *vq)
+{
+	if (!vq)
+		return;
+
+	if (vq_is_packed(vq)) {
+		metal_log(METAL_LOG_DEBUG,
+			  "VQ: %s - size=%d; free=%d; queued=%d; "
+			  "desc_head_idx=%d; avail_idx=%d; avail_wrap=%d; "
+			  "used_idx=%d; used_wrap=%d; driver.flags=0x%x; "
+			  "device.flags=0x%x\r\n",
+			  vq->vq_name, vq->vq_nentries, vq->vq_free_cnt,
+			  vq->vq_queued_cnt, vq->vq_desc_head_idx,
+			  vq->vq_packed_avail_idx, vq->vq_packed_avail_wrap,
+			  vq->vq_packed_used_idx, vq->vq_packed_used_wrap,
+			  vq->vq_packed_ring.driver->flags,
+			  vq->vq_packed_ring.device->flags);
+		return;
+	}
 
 	metal_log(METAL_LOG_DEBUG,
 		  "VQ: %s - size=%d; free=%d; queued=%d; "
@@ -395,11 +1226,22 @@ void virtqueue_dump(struct virtqueue *vq)
  */
 uint32_t virtqueue_get_desc_size(struct virtqueue *vq)
 {
+	struct vring_desc *dp;
 	uint16_t head_idx = 0;
 	uint16_t avail_idx = 0;
 	uint32_t len = 0;
 
-	if (vq->vq_available_idx == vq->vq_ring.avail->idx) {
+	if (vq_is_packed(vq)) {
+		struct vring_packed_desc *dp;
+
+		dp = &vq->vq_packed_ring.desc[vq->vq_packed_avail_idx];
+		if (!vq_packed_desc_is_avail(dp, vq->vq_packed_avail_wrap))
+			return 0;
+		atomic_thread_fence(memory_order_seq_cst);
+		return dp->len;
+	}
+
+	if (vq->vq_available_idx == vq_ring_peer_avail_idx(vq)) {
 		return 0;
 	}
 
@@ -407,7 +1249,9 @@ uint32_t virtqueue_get_desc_size(struct virtqueue *vq)
 
 	head_idx = vq->vq_available_idx & (vq->vq_nentries - 1);
 	avail_idx = vq->vq_ring.avail->ring[head_idx];
-	len = vq->vq_ring.desc[avail_idx].len;
+	dp = vq_ring_first_desc(vq, avail_idx);
+	if (dp)
+		len = dp->len;
 
 	VQUEUE_IDLE(vq);
 
@@ -444,6 +1288,7 @@ static uint16_t vq_ring_add_buffer(struct virtqueue *vq,
 		dp->addr = virtqueue_virt_to_phys(vq, buf_list[i].buf);
 		dp->len = buf_list[i].len;
 		dp->flags = 0;
+		virtqueue_cache_flush(vq, dp, sizeof(*dp));
 
 		if (i < needed - 1)
 			dp->flags |= VRING_DESC_F_NEXT;
@@ -459,6 +1304,61 @@ static uint16_t vq_ring_add_buffer(struct virtqueue *vq,
 	return idx;
 }
 
+/**
+ *
+ * vq_ring_add_indirect
+ *
+ * Fills the indirect descriptor table of the head descriptor with the
+ * chain, and makes the head descriptor point to it.
+ *
+ */
+static uint16_t vq_ring_add_indirect(struct virtqueue *vq, uint16_t head_idx,
+				     struct virtqueue_buf *buf_list,
+				     int readable, int writable)
+{
+	struct vring_desc *table, *dp;
+	int i, needed;
+
+	needed = readable + writable;
+	table = &vq->vq_indirect[head_idx * vq->vq_indirect_max];
+	for (i = 0; i < needed; i++)
+		table[i].next = i + 1;
+	vq_ring_add_buffer(vq, table, 0, buf_list, readable, writable);
+
+	dp = &vq->vq_ring.desc[head_idx];
+	dp->addr = virtqueue_virt_to_phys(vq, table);
+	dp->len = needed * sizeof(struct vring_desc);
+	dp->flags = VRING_DESC_F_INDIRECT;
+	virtqueue_cache_flush(vq, dp, sizeof(*dp));
+
+	return dp->next;
+}
+
+/**
+ *
+ * vq_ring_first_desc
+ *
+ * Returns the first descriptor of a chain, which is the first entry of the
+ * indirect table for an indirect descriptor, NULL if the table is invalid.
+ *
+ */
+static struct vring_desc *vq_ring_first_desc(struct virtqueue *vq,
+					     uint16_t idx)
+{
+	struct vring_desc *dp = &vq->vq_ring.desc[idx];
+	struct vring_desc *table;
+
+	vq_cache_invalidate_desc(vq, dp, sizeof(*dp));
+	if (!(dp->flags & VRING_DESC_F_INDIRECT))
+		return dp;
+	if (dp->len < sizeof(struct vring_desc))
+		return NULL;
+	table = virtqueue_phys_to_virt(vq, dp->addr);
+	if (table)
+		vq_cache_invalidate_desc(vq, table, sizeof(*table));
+	return table;
+}
+
 /**
  *
  * vq_ring_free_chain
@@ -542,12 +1442,13 @@ static void vq_ring_update_avail(struct virtqueue *vq, uint16_t desc_idx)
 	 * currently running on another CPU, we can keep it processing the new
 	 * descriptor.
 	 */
-	avail_idx = vq->vq_ring.avail->idx & (vq->vq_nentries - 1);
-	vq->vq_ring.avail->ring[avail_idx] = desc_idx;
+	avail_idx = vq_ring_own_idx(vq, vq->vq_ring.avail->idx);
+	vq->vq_ring.avail->ring[avail_idx & (vq->vq_nentries - 1)] = desc_idx;
 
 	atomic_thread_fence(memory_order_seq_cst);
 
-	vq->vq_ring.avail->idx++;
+	if (!vq_ring_defer_idx(vq, avail_idx + 1))
+		vq->vq_ring.avail->idx = avail_idx + 1;
 
 	/* Keep pending count until virtqueue_notify(). */
 	vq->vq_queued_cnt++;
@@ -566,23 +1467,37 @@ static int vq_ring_enable_interrupt(struct virtqueue *vq, uint16_t ndesc)
 	 */
 	if (vq->vq_dev->features & VIRTIO_RING_F_EVENT_IDX) {
 #ifndef VIRTIO_SLAVE_ONLY
-		if (vq->vq_dev->role == VIRTIO_DEV_MASTER)
+		if (vq->vq_dev->role == VIRTIO_DEV_MASTER) {
 			vring_used_event(&vq->vq_ring) =
 				vq->vq_used_cons_idx + ndesc;
+			vq_ring_flush_event(vq,
+					    &vring_used_event(&vq->vq_ring),
+					    sizeof(uint16_t));
+		}
 #endif /*VIRTIO_SLAVE_ONLY*/
 #ifndef VIRTIO_MASTER_ONLY
-		if (vq->vq_dev->role == VIRTIO_DEV_SLAVE)
+		if (vq->vq_dev->role == VIRTIO_DEV_SLAVE) {
 			vring_avail_event(&vq->vq_ring) =
 				vq->vq_available_idx + ndesc;
+			vq_ring_flush_event(vq,
+					    &vring_avail_event(&vq->vq_ring),
+					    sizeof(uint16_t));
+		}
 #endif /*VIRTIO_MASTER_ONLY*/
 	} else {
 #ifndef VIRTIO_SLAVE_ONLY
-		if (vq->vq_dev->role == VIRTIO_DEV_MASTER)
+		if (vq->vq_dev->role == VIRTIO_DEV_MASTER) {
 			vq->vq_ring.avail->flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+			vq_ring_flush_event(vq, &vq->vq_ring.avail->flags,
+					    sizeof(uint16_t));
+		}
 #endif /*VIRTIO_SLAVE_ONLY*/
 #ifndef VIRTIO_MASTER_ONLY
-		if (vq->vq_dev->role == VIRTIO_DEV_SLAVE)
+		if (vq->vq_dev->role == VIRTIO_DEV_SLAVE) {
 			vq->vq_ring.used->flags &= ~VRING_USED_F_NO_NOTIFY;
+			vq_ring_flush_event(vq, &vq->vq_ring.used->flags,
+					    sizeof(uint16_t));
+		}
 #endif /*VIRTIO_MASTER_ONLY*/
 	}
 
@@ -618,6 +1533,7 @@ static int vq_ring_enable_interrupt(struct virtqueue *vq, uint16_t ndesc)
  */
 void virtqueue_notification(struct virtqueue *vq)
 {
+	VQ_STATS_INC(vq, notifications);
 	atomic_thread_fence(memory_order_seq_cst);
 	if (vq->callback)
 		vq->callback(vq);
@@ -632,11 +1548,17 @@ static int vq_ring_must_notify(struct virtqueue *vq)
 {
 	uint16_t new_idx, prev_idx, event_idx;
 
+	if (vq_is_packed(vq))
+		return vq_packed_must_notify(vq);
+
 	if (vq->vq_dev->features & VIRTIO_RING_F_EVENT_IDX) {
 #ifndef VIRTIO_SLAVE_ONLY
 		if (vq->vq_dev->role == VIRTIO_DEV_MASTER) {
 			new_idx = vq->vq_ring.avail->idx;
 			prev_idx = new_idx - vq->vq_queued_cnt;
+			virtqueue_cache_invalidate(vq,
+					&vring_avail_event(&vq->vq_ring),
+					sizeof(uint16_t));
 			event_idx = vring_avail_event(&vq->vq_ring);
 			return vring_need_event(event_idx, new_idx,
 						prev_idx) != 0;
@@ -646,6 +1568,9 @@ static int vq_ring_must_notify(struct virtqueue *vq)
 		if (vq->vq_dev->role == VIRTIO_DEV_SLAVE) {
 			new_idx = vq->vq_ring.used->idx;
 			prev_idx = new_idx - vq->vq_queued_cnt;
+			virtqueue_cache_invalidate(vq,
+					&vring_used_event(&vq->vq_ring),
+					sizeof(uint16_t));
 			event_idx = vring_used_event(&vq->vq_ring);
 			return vring_need_event(event_idx, new_idx,
 						prev_idx) != 0;
@@ -653,14 +1578,22 @@ static int vq_ring_must_notify(struct virtqueue *vq)
 #endif /*VIRTIO_MASTER_ONLY*/
 	} else {
 #ifndef VIRTIO_SLAVE_ONLY
-		if (vq->vq_dev->role == VIRTIO_DEV_MASTER)
+		if (vq->vq_dev->role == VIRTIO_DEV_MASTER) {
+			virtqueue_cache_invalidate(vq,
+						   &vq->vq_ring.used->flags,
+						   sizeof(uint16_t));
 			return (vq->vq_ring.used->flags &
 				VRING_USED_F_NO_NOTIFY) == 0;
+		}
 #endif /*VIRTIO_SLAVE_ONLY*/
 #ifndef VIRTIO_MASTER_ONLY
-		if (vq->vq_dev->role == VIRTIO_DEV_SLAVE)
+		if (vq->vq_dev->role == VIRTIO_DEV_SLAVE) {
+			virtqueue_cache_invalidate(vq,
+						   &vq->vq_ring.avail->flags,
+						   sizeof(uint16_t));
 			return (vq->vq_ring.avail->flags &
 				VRING_AVAIL_F_NO_INTERRUPT) == 0;
+		}
 #endif /*VIRTIO_MASTER_ONLY*/
 	}
 
@@ -688,7 +1621,7 @@ static int virtqueue_nused(struct virtqueue *vq)
 {
 	uint16_t used_idx, nused;
 
-	used_idx = vq->vq_ring.used->idx;
+	used_idx = vq_ring_peer_used_idx(vq);
 
 	nused = (uint16_t)(used_idx - vq->vq_used_cons_idx);
 	VQASSERT(vq, nused <= vq->vq_nentries, "used more than available");
@@ -707,7 +1640,7 @@ static int virtqueue_navail(struct virtqueue *vq)
 {
 	uint16_t avail_idx, navail;
 
-	avail_idx = vq->vq_ring.avail->idx;
+	avail_idx = vq_ring_peer_avail_idx(vq);
 
 	navail = (uint16_t)(avail_idx - vq->vq_available_idx);
 	VQASSERT(vq, navail <= vq->vq_nentries, "avail more than available");
@@ -715,3 +1648,570 @@ static int virtqueue_navail(struct virtqueue *vq)
 	return navail;
 }
 #endif /*VIRTIO_MASTER_ONLY*/
+
+/**
+ *
+ * vq_cache_flush_ranges
+ *
+ * Flushes the ranges queued with virtqueue_cache_flush().
+ *
+ */
+static void vq_cache_flush_ranges(struct virtqueue *vq)
+{
+	const struct virtio_cache_ops *ops = vq->vq_dev->cache_ops;
+	struct vq_cache_range *range;
+	uint16_t i;
+
+	for (i = 0; i < vq->vq_cache_nranges; i++) {
+		range = &vq->vq_cache_ranges[i];
+		ops->flush(ops->priv, (void *)range->start,
+			   range->end - range->start);
+	}
+	vq->vq_cache_nranges = 0;
+}
+
+/**
+ *
+ * vq_ring_flush_cache
+ *
+ * Flushes the ring entries written since the last flush, then writes the
+ * ring index kept by vq_ring_defer_idx() and flushes its cache line. As
+ * the index is only written once the entries and buffers are flushed, an
+ * early eviction of its cache line cannot make them visible too soon.
+ *
+ */
+static void vq_ring_flush_cache(struct virtqueue *vq)
+{
+	const struct virtio_cache_ops *ops = vq->vq_dev->cache_ops;
+	char *hdr = NULL, *ring = NULL;
+	size_t size = 0;
+	uintptr_t start, end, hdr_end;
+	uint16_t idx = 0, num, first;
+
+	/* The avail and used headers are the flags and the index */
+#ifndef VIRTIO_SLAVE_ONLY
+	if (vq->vq_dev->role == VIRTIO_DEV_MASTER) {
+		hdr = (char *)vq->vq_ring.avail;
+		ring = (char *)vq->vq_ring.avail->ring;
+		size = sizeof(uint16_t);
+		idx = vq->vq_ring.avail->idx;
+	}
+#endif /*VIRTIO_SLAVE_ONLY*/
+#ifndef VIRTIO_MASTER_ONLY
+	if (vq->vq_dev->role == VIRTIO_DEV_SLAVE) {
+		hdr = (char *)vq->vq_ring.used;
+		ring = (char *)vq->vq_ring.used->ring;
+		size = sizeof(struct vring_used_elem);
+		idx = vq->vq_ring.used->idx;
+	}
+#endif /*VIRTIO_MASTER_ONLY*/
+	num = vq->vq_cache_ring_idx - idx;
+	if (!hdr || !num)
+		return;
+	first = idx & (vq->vq_nentries - 1);
+	if (num >= vq->vq_nentries || first + num > vq->vq_nentries) {
+		first = 0;
+		num = vq->vq_nentries;
+	}
+
+	/* The first entries are flushed with the index */
+	hdr_end = vq_cache_line_up((uintptr_t)ring);
+	start = vq_cache_line_down((uintptr_t)(ring + first * size));
+	end = vq_cache_line_up((uintptr_t)(ring + (first + num) * size));
+	if (start < hdr_end)
+		start = hdr_end;
+	if (end > start)
+		ops->flush(ops->priv, (void *)start, end - start);
+
+	atomic_thread_fence(memory_order_seq_cst);
+#ifndef VIRTIO_SLAVE_ONLY
+	if (vq->vq_dev->role == VIRTIO_DEV_MASTER)
+		vq->vq_ring.avail->idx = vq->vq_cache_ring_idx;
+#endif /*VIRTIO_SLAVE_ONLY*/
+#ifndef VIRTIO_MASTER_ONLY
+	if (vq->vq_dev->role == VIRTIO_DEV_SLAVE)
+		vq->vq_ring.used->idx = vq->vq_cache_ring_idx;
+#endif /*VIRTIO_MASTER_ONLY*/
+	start = vq_cache_line_down((uintptr_t)hdr);
+	ops->flush(ops->priv, (void *)start, hdr_end - start);
+}
+
+/**
+ *
+ * vq_ring_flush_event
+ *
+ * Flushes an event suppression field right away. Its cache line may hold
+ * the ring index, which is only updated by vq_ring_flush_cache().
+ *
+ */
+static void vq_ring_flush_event(struct virtqueue *vq, void *addr, size_t len)
+{
+	const struct virtio_cache_ops *ops = vq->vq_dev->cache_ops;
+	uintptr_t start, end;
+
+	if (!ops)
+		return;
+
+	start = vq_cache_line_down((uintptr_t)addr);
+	end = vq_cache_line_up((uintptr_t)addr + len);
+	ops->flush(ops->priv, (void *)start, end - start);
+}
+
+/**
+ *
+ * vq_ring_invalidate_entries
+ *
+ * Invalidates the ring entries given by the index just read from the other
+ * side, from the consumed index.
+ *
+ */
+static void vq_ring_invalidate_entries(struct virtqueue *vq, uint16_t peer,
+				       void *ring, size_t size, uint16_t cons)
+{
+	uint16_t num, first;
+
+	num = peer - cons;
+	if (num) {
+		/* Read the entries after the index */
+		atomic_thread_fence(memory_order_seq_cst);
+		first = cons & (vq->vq_nentries - 1);
+		if (num >= vq->vq_nentries || first + num > vq->vq_nentries) {
+			first = 0;
+			num = vq->vq_nentries;
+		}
+		virtqueue_cache_invalidate(vq, (char *)ring + first * size,
+					   num * size);
+	}
+}
+
+/**
+ *
+ * vq_ring_invalidate_peer
+ *
+ * Invalidates the ring entries given by the index just read from the other
+ * side, from the consumed index, and keeps the index.
+ *
+ */
+static void vq_ring_invalidate_peer(struct virtqueue *vq, uint16_t peer,
+				    void *ring, size_t size, uint16_t cons)
+{
+	vq_ring_invalidate_entries(vq, peer, ring, size, cons);
+	vq->vq_cache_peer_idx = peer;
+}
+
+/**************************************************************************
+ *                          Packed Ring Helpers                           *
+ **************************************************************************/
+
+/*
+ * With the packed ring, the index returned to and given by the virtqueue
+ * users is the buffer ID, as the descriptors are overwritten by the used
+ * ones. Notifications are suppressed with the event flags only,
+ * VIRTIO_RING_F_EVENT_IDX is not used.
+ */
+
+/**
+ *
+ * vq_packed_advance
+ *
+ */
+static inline void vq_packed_advance(struct virtqueue *vq, uint16_t *idx,
+				     bool *wrap, uint16_t num)
+{
+	*idx += num;
+	if (*idx >= vq->vq_nentries) {
+		*idx -= vq->vq_nentries;
+		*wrap = !*wrap;
+	}
+}
+
+/**
+ *
+ * vq_packed_ring_init
+ *
+ */
+static void vq_packed_ring_init(struct virtqueue *vq, void *ring_mem,
+				int alignment)
+{
+	int size;
+
+	size = vq->vq_nentries;
+
+	vring_packed_init(&vq->vq_packed_ring, size, ring_mem, alignment);
+	vq->vq_packed_avail_idx = 0;
+	vq->vq_packed_avail_wrap = true;
+	vq->vq_packed_used_idx = 0;
+	vq->vq_packed_used_wrap = true;
+
+#ifndef VIRTIO_SLAVE_ONLY
+	if (vq->vq_dev->role == VIRTIO_DEV_MASTER) {
+		int i;
+
+		for (i = 0; i < size - 1; i++)
+			vq->vq_descx[i].next = i + 1;
+		vq->vq_descx[i].next = VQ_RING_DESC_CHAIN_END;
+		vq->vq_desc_head_idx = 0;
+	}
+#endif /*VIRTIO_SLAVE_ONLY*/
+}
+
+/**
+ *
+ * vq_packed_add_chain
+ *
+ * Writes a descriptor chain at the next available position, except the
+ * flags of its first descriptor, returned in head_flags. The chain is
+ * made available by vq_packed_publish().
+ *
+ */
+static uint16_t vq_packed_add_chain(struct virtqueue *vq,
+				    struct virtqueue_buf *buf_list,
+				    int readable, int writable, void *cookie,
+				    uint16_t *head_flags)
+{
+	struct vring_packed_desc *dp;
+	struct vq_desc_extra *dxp;
+	uint16_t head_idx, idx, id, flags;
+	int i, needed;
+	bool wrap;
+
+	needed = readable + writable;
+
+	id = vq->vq_desc_head_idx;
+	VQ_RING_ASSERT_VALID_IDX(vq, id);
+	dxp = &vq->vq_descx[id];
+
+	VQASSERT(vq, dxp->cookie == NULL, "cookie already exists for index");
+
+	vq->vq_desc_head_idx = dxp->next;
+	dxp->cookie = cookie;
+	dxp->ndescs = needed;
+	dxp->len = buf_list[0].len;
+
+	head_idx = vq->vq_packed_avail_idx;
+	idx = head_idx;
+	wrap = vq->vq_packed_avail_wrap;
+	for (i = 0; i < needed; i++) {
+		dp = &vq->vq_packed_ring.desc[idx];
+		dp->addr = virtqueue_virt_to_phys(vq, buf_list[i].buf);
+		dp->len = buf_list[i].len;
+		dp->id = id;
+
+		flags = wrap ? VRING_PACKED_DESC_F_AVAIL :
+			       VRING_PACKED_DESC_F_USED;
+		if (i < needed - 1)
+			flags |= VRING_DESC_F_NEXT;
+		/*
+		 * Readable buffers are inserted  into vring before the
+		 * writable buffers.
+		 */
+		if (i >= readable)
+			flags |= VRING_DESC_F_WRITE;
+
+		if (i)
+			dp->flags = flags;
+		else
+			*head_flags = flags;
+
+		vq_packed_advance(vq, &idx, &wrap, 1);
+	}
+
+	vq->vq_packed_avail_idx = idx;
+	vq->vq_packed_avail_wrap = wrap;
+	vq->vq_free_cnt -= needed;
+
+	return head_idx;
+}
+
+/**
+ *
+ * vq_packed_publish
+ *
+ * Writes the flags of a descriptor once the descriptors it precedes are
+ * visible to the other side.
+ *
+ */
+static void vq_packed_publish(struct virtqueue *vq, uint16_t idx,
+			      uint16_t flags)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+
+	vq->vq_packed_ring.desc[idx].flags = flags;
+}
+
+/**
+ *
+ * vq_packed_get_buffer
+ *
+ */
+static void *vq_packed_get_buffer(struct virtqueue *vq, uint32_t *len,
+				  uint16_t *idx)
+{
+	struct vring_packed_desc *dp;
+	struct vq_desc_extra *dxp;
+	void *cookie;
+	uint16_t id;
+
+	dp = &vq->vq_packed_ring.desc[vq->vq_packed_used_idx];
+	if (!vq_packed_desc_is_used(dp, vq->vq_packed_used_wrap))
+		return NULL;
+
+	VQUEUE_BUSY(vq);
+
+	/* Read the descriptor after its flags. */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	id = dp->id;
+	VQ_RING_ASSERT_VALID_IDX(vq, id);
+	dxp = &vq->vq_descx[id];
+	if (len)
+		*len = dp->len;
+
+	vq_packed_advance(vq, &vq->vq_packed_used_idx,
+			  &vq->vq_packed_used_wrap, dxp->ndescs);
+	vq->vq_free_cnt += dxp->ndescs;
+	vq_stats_get(vq, 0);
+
+	cookie = dxp->cookie;
+	dxp->cookie = NULL;
+	dxp->next = vq->vq_desc_head_idx;
+	vq->vq_desc_head_idx = id;
+
+	if (idx)
+		*idx = id;
+	VQUEUE_IDLE(vq);
+
+	return cookie;
+}
+
+/**
+ *
+ * vq_packed_get_available_buffer
+ *
+ */
+static void *vq_packed_get_available_buffer(struct virtqueue *vq,
+					    uint16_t *avail_idx,
+					    uint32_t *len)
+{
+	struct vring_packed_desc *dp;
+	struct vq_desc_extra *dxp;
+	uint16_t idx, id, flags, ndescs = 0;
+	void *buffer;
+	bool wrap;
+
+	idx = vq->vq_packed_avail_idx;
+	wrap = vq->vq_packed_avail_wrap;
+	dp = &vq->vq_packed_ring.desc[idx];
+	if (!vq_packed_desc_is_avail(dp, wrap))
+		return NULL;
+
+	VQUEUE_BUSY(vq);
+
+	/* Read the descriptor after its flags. */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	id = dp->id;
+	if (id >= vq->vq_nentries) {
+		VQUEUE_IDLE(vq);
+		return NULL;
+	}
+
+	buffer = virtqueue_phys_to_virt(vq, dp->addr);
+	*len = dp->len;
+
+	/* Skip the rest of the chain, the used buffer covers it too. */
+	do {
+		flags = vq->vq_packed_ring.desc[idx].flags;
+		vq_packed_advance(vq, &idx, &wrap, 1);
+		ndescs++;
+	} while ((flags & VRING_DESC_F_NEXT) && ndescs < vq->vq_nentries);
+
+	vq->vq_packed_avail_idx = idx;
+	vq->vq_packed_avail_wrap = wrap;
+
+	dxp = &vq->vq_descx[id];
+	dxp->ndescs = ndescs;
+	dxp->len = *len;
+	*avail_idx = id;
+	vq_stats_get(vq, 0);
+
+	VQUEUE_IDLE(vq);
+
+	return buffer;
+}
+
+/**
+ *
+ * vq_packed_peek_buffer
+ *
+ * Walks the used (driver) or available (device) descriptors from the next
+ * one to get, without moving the positions of the queue.
+ *
+ */
+static void *vq_packed_peek_buffer(struct virtqueue *vq, uint16_t n,
+				   uint32_t *len)
+{
+	struct vring_packed_desc *dp;
+	uint16_t idx;
+	bool wrap;
+
+#ifndef VIRTIO_SLAVE_ONLY
+	if (vq->vq_dev->role == VIRTIO_DEV_MASTER) {
+		uint16_t id, ndescs;
+
+		idx = vq->vq_packed_used_idx;
+		wrap = vq->vq_packed_used_wrap;
+		while (1) {
+			dp = &vq->vq_packed_ring.desc[idx];
+			if (!vq_packed_desc_is_used(dp, wrap))
+				return NULL;
+			/* Read the descriptor after its flags. */
+			atomic_thread_fence(memory_order_seq_cst);
+			id = dp->id;
+			if (id >= vq->vq_nentries)
+				return NULL;
+			if (!n--)
+				break;
+			/* A used descriptor covers the whole chain */
+			ndescs = vq->vq_descx[id].ndescs;
+			if (!ndescs)
+				return NULL;
+			vq_packed_advance(vq, &idx, &wrap, ndescs);
+		}
+		*len = dp->len;
+		return vq->vq_descx[id].cookie;
+	}
+#endif /*VIRTIO_SLAVE_ONLY*/
+
+#ifndef VIRTIO_MASTER_ONLY
+	if (vq->vq_dev->role == VIRTIO_DEV_SLAVE) {
+		uint16_t flags, ndescs;
+
+		idx = vq->vq_packed_avail_idx;
+		wrap = vq->vq_packed_avail_wrap;
+		while (1) {
+			dp = &vq->vq_packed_ring.desc[idx];
+			if (!vq_packed_desc_is_avail(dp, wrap))
+				return NULL;
+			/* Read the descriptor after its flags. */
+			atomic_thread_fence(memory_order_seq_cst);
+			if (!n--)
+				break;
+			ndescs = 0;
+			do {
+				flags = vq->vq_packed_ring.desc[idx].flags;
+				vq_packed_advance(vq, &idx, &wrap, 1);
+				ndescs++;
+			} while ((flags & VRING_DESC_F_NEXT) &&
+				 ndescs < vq->vq_nentries);
+		}
+		if (dp->id >= vq->vq_nentries)
+			return NULL;
+		*len = dp->len;
+		return virtqueue_phys_to_virt(vq, dp->addr);
+	}
+#endif /*VIRTIO_MASTER_ONLY*/
+
+	return NULL;
+}
+
+/**
+ *
+ * vq_packed_write_used
+ *
+ * Writes a used descriptor at the next used position, except its flags,
+ * returned in flags. The descriptor is made used by vq_packed_publish().
+ *
+ */
+static uint16_t vq_packed_write_used(struct virtqueue *vq, uint16_t id,
+				     uint32_t len, uint16_t *flags)
+{
+	struct vring_packed_desc *dp;
+	uint16_t used_idx;
+
+	used_idx = vq->vq_packed_used_idx;
+	dp = &vq->vq_packed_ring.desc[used_idx];
+	dp->id = id;
+	dp->len = len;
+
+	*flags = vq->vq_packed_used_wrap ?
+		 VRING_PACKED_DESC_F_AVAIL | VRING_PACKED_DESC_F_USED : 0;
+
+	vq_packed_advance(vq, &vq->vq_packed_used_idx,
+			  &vq->vq_packed_used_wrap, vq->vq_descx[id].ndescs);
+
+	return used_idx;
+}
+
+/**
+ *
+ * vq_packed_enable_interrupt
+ *
+ */
+static int vq_packed_enable_interrupt(struct virtqueue *vq)
+{
+	struct vring_packed_desc *dp;
+
+#ifndef VIRTIO_SLAVE_ONLY
+	if (vq->vq_dev->role == VIRTIO_DEV_MASTER) {
+		vq->vq_packed_ring.driver->flags =
+			VRING_PACKED_EVENT_FLAG_ENABLE;
+		atomic_thread_fence(memory_order_seq_cst);
+
+		dp = &vq->vq_packed_ring.desc[vq->vq_packed_used_idx];
+		return vq_packed_desc_is_used(dp, vq->vq_packed_used_wrap);
+	}
+#endif /*VIRTIO_SLAVE_ONLY*/
+#ifndef VIRTIO_MASTER_ONLY
+	if (vq->vq_dev->role == VIRTIO_DEV_SLAVE) {
+		vq->vq_packed_ring.device->flags =
+			VRING_PACKED_EVENT_FLAG_ENABLE;
+		atomic_thread_fence(memory_order_seq_cst);
+
+		dp = &vq->vq_packed_ring.desc[vq->vq_packed_avail_idx];
+		return vq_packed_desc_is_avail(dp, vq->vq_packed_avail_wrap);
+	}
+#endif /*VIRTIO_MASTER_ONLY*/
+
+	return 0;
+}
+
+/**
+ *
+ * vq_packed_disable_interrupt
+ *
+ */
+static void vq_packed_disable_interrupt(struct virtqueue *vq)
+{
+#ifndef VIRTIO_SLAVE_ONLY
+	if (vq->vq_dev->role == VIRTIO_DEV_MASTER)
+		vq->vq_packed_ring.driver->flags =
+			VRING_PACKED_EVENT_FLAG_DISABLE;
+#endif /*VIRTIO_SLAVE_ONLY*/
+#ifndef VIRTIO_MASTER_ONLY
+	if (vq->vq_dev->role == VIRTIO_DEV_SLAVE)
+		vq->vq_packed_ring.device->flags =
+			VRING_PACKED_EVENT_FLAG_DISABLE;
+#endif /*VIRTIO_MASTER_ONLY*/
+}
+
+/**
+ *
+ * vq_packed_must_notify
+ *
+ */
+static int vq_packed_must_notify(struct virtqueue *vq)
+{
+#ifndef VIRTIO_SLAVE_ONLY
+	if (vq->vq_dev->role == VIRTIO_DEV_MASTER)
+		return vq->vq_packed_ring.device->flags !=
+		       VRING_PACKED_EVENT_FLAG_DISABLE;
+#endif /*VIRTIO_SLAVE_ONLY*/
+#ifndef VIRTIO_MASTER_ONLY
+	if (vq->vq_dev->role == VIRTIO_DEV_SLAVE)
+		return vq->vq_packed_ring.driver->flags !=
+		       VRING_PACKED_EVENT_FLAG_DISABLE;
+#endif /*VIRTIO_MASTER_ONLY*/
+
+	return 0;
+}
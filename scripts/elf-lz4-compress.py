@@ -0,0 +1,162 @@
+#!/usr/bin/env python3
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Compresses the loadable segments of an ELF executable into LZ4 frames,
+# for the remoteproc loader built with RPROC_LZ4 (WITH_RPROC_LZ4=ON).
+#
+# A compressed segment is flagged PF_OPENAMP_LZ4, its p_filesz is the size
+# of the frame, its p_memsz is unchanged. The resource table section is
+# kept uncompressed, the other sections inside compressed segments become
+# SHT_NOBITS. The frames are made with the lz4 command line tool.
+#
+# Usage: elf-lz4-compress.py [-B4|-B5|-B6|-B7] [--min-size N] in.elf out.elf
+
+import argparse
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+
+PT_LOAD = 1
+SHT_NOBITS = 8
+PF_OPENAMP_LZ4 = 0x00100000
+RSC_TABLE = b".resource_table"
+
+
+class Elf:
+    def __init__(self, data):
+        if data[:4] != b"\x7fELF":
+            sys.exit("not an ELF file")
+        self.is64 = data[4] == 2
+        self.end = "<" if data[5] == 1 else ">"
+        if self.is64:
+            self.ehdr_fmt = self.end + "16sHHIQQQIHHHHHH"
+            self.phdr_fmt = self.end + "IIQQQQQQ"
+            self.shdr_fmt = self.end + "IIQQQQIIQQ"
+        else:
+            self.ehdr_fmt = self.end + "16sHHIIIIIHHHHHH"
+            self.phdr_fmt = self.end + "IIIIIIII"
+            self.shdr_fmt = self.end + "IIIIIIIIII"
+        self.ehdr = list(struct.unpack_from(self.ehdr_fmt, data, 0))
+        phoff, shoff = self.ehdr[5], self.ehdr[6]
+        phentsize, phnum = self.ehdr[9], self.ehdr[10]
+        shentsize, shnum = self.ehdr[11], self.ehdr[12]
+        self.phdrs = [self.phdr(data, phoff + i * phentsize)
+                      for i in range(phnum)]
+        self.shdrs = [list(struct.unpack_from(self.shdr_fmt, data,
+                                              shoff + i * shentsize))
+                      for i in range(shnum)]
+
+    def phdr(self, data, off):
+        p = list(struct.unpack_from(self.phdr_fmt, data, off))
+        # Same field order for both classes: type, flags, offset, vaddr,
+        # paddr, filesz, memsz, align
+        if self.is64:
+            return p
+        return [p[0], p[6], p[1], p[2], p[3], p[4], p[5], p[7]]
+
+    def pack_phdr(self, p):
+        if self.is64:
+            return struct.pack(self.phdr_fmt, *p)
+        return struct.pack(self.phdr_fmt, p[0], p[2], p[3], p[4], p[5],
+                           p[6], p[1], p[7])
+
+
+def lz4(data, block):
+    with tempfile.TemporaryDirectory() as tmp:
+        src = os.path.join(tmp, "seg")
+        with open(src, "wb") as f:
+            f.write(data)
+        subprocess.run(["lz4", "-q", "-f", "-12", block, "-BD",
+                        "--content-size", src, src + ".lz4"], check=True)
+        with open(src + ".lz4", "rb") as f:
+            return f.read()
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("-B", dest="block", default="6",
+                        choices=["4", "5", "6", "7"],
+                        help="LZ4 block size: 64KB, 256KB, 1MB or 4MB")
+    parser.add_argument("--min-size", type=int, default=4096,
+                        help="smallest segment to compress")
+    parser.add_argument("input")
+    parser.add_argument("output")
+    args = parser.parse_args()
+
+    with open(args.input, "rb") as f:
+        data = f.read()
+    elf = Elf(data)
+    # The names are resolved before the sections, shstrtab included, are
+    # moved
+    names = []
+    if elf.shdrs:
+        strtab = elf.shdrs[elf.ehdr[13]][4]
+        names = [data[strtab + sh[0]:data.index(b"\0", strtab + sh[0])]
+                 for sh in elf.shdrs]
+
+    def align(out, n):
+        out.extend(b"\0" * (-len(out) % max(n, 1)))
+
+    # Headers, then the segments, the sections out of the segments, and
+    # the section headers
+    out = bytearray(data[:elf.ehdr[5] + elf.ehdr[10] * elf.ehdr[9]])
+    moved = []
+    for p in sorted(elf.phdrs, key=lambda p: p[2]):
+        if p[0] != PT_LOAD or p[5] == 0:
+            continue
+        seg = data[p[2]:p[2] + p[5]]
+        packed = lz4(seg, "-B" + args.block) if p[5] >= args.min_size \
+            else seg
+        align(out, 8)
+        if packed is not seg and len(packed) < len(seg):
+            moved.append((p[2], p[5], len(out), True))
+            print("segment 0x%x: %u -> %u bytes" % (p[3], p[5],
+                                                     len(packed)))
+            p[1] |= PF_OPENAMP_LZ4
+            p[5] = len(packed)
+            out.extend(packed)
+        else:
+            moved.append((p[2], p[5], len(out), False))
+            out.extend(seg)
+        p[2] = moved[-1][2]
+
+    # Other segments inside the loadable ones, such as notes
+    for p in elf.phdrs:
+        seg = [m for m in moved if m[0] <= p[2] < m[0] + m[1]]
+        if (p[0] != PT_LOAD or p[5] == 0) and seg:
+            p[2] = seg[0][2] + (0 if seg[0][3] else p[2] - seg[0][0])
+
+    for sh, sh_name in zip(elf.shdrs, names):
+        if sh[1] == SHT_NOBITS or sh[5] == 0:
+            continue
+        seg = [m for m in moved if m[0] <= sh[4] < m[0] + m[1]]
+        if seg and not seg[0][3]:
+            sh[4] = seg[0][2] + sh[4] - seg[0][0]
+        elif seg and sh_name != RSC_TABLE:
+            sh[1] = SHT_NOBITS
+            sh[4] = seg[0][2]
+        else:
+            align(out, sh[8])
+            src = sh[4]
+            sh[4] = len(out)
+            out.extend(data[src:src + sh[5]])
+
+    align(out, 8)
+    elf.ehdr[6] = len(out)
+    for sh in elf.shdrs:
+        out.extend(struct.pack(elf.shdr_fmt, *sh))
+    struct.pack_into(elf.ehdr_fmt, out, 0, *elf.ehdr)
+    for i, p in enumerate(elf.phdrs):
+        out[elf.ehdr[5] + i * elf.ehdr[9]:
+            elf.ehdr[5] + (i + 1) * elf.ehdr[9]] = elf.pack_phdr(p)
+
+    with open(args.output, "wb") as f:
+        f.write(out)
+    print("%s: %u -> %u bytes" % (args.output, len(data), len(out)))
+
+
+if __name__ == "__main__":
+    main()